@@ -0,0 +1,241 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Cache of the results of the matcher. An asset that doesn't move scans
+ * the same levels over and over (see output/test_outputs/output.txt),
+ * and each of those scans would search the whole map again for the
+ * same points. The levels are quantized to quantum dB, so that a router
+ * a dB off still hits, and the quantized scan is the key of a small
+ * hash table of the last results : a scan seen lately costs one hash
+ * and one compare.
+ *
+ * The entries are chained by bucket, and kept in the order they were
+ * last used : the least recently used one makes room for a new result.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* FNV-1a, 64 bits */
+#define IW_CACHE_FNV_BASIS	0xcbf29ce484222325ULL
+#define IW_CACHE_FNV_PRIME	0x100000001b3ULL
+
+/***************************** HELPERS *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Quantize a scan into key, return its hash
+ */
+static uint64_t
+iw_cache_key(const struct iw_cache *	cache,
+	     const int8_t *		query,
+	     int			num_routers,
+	     int8_t *			key)
+{
+  uint64_t	hash = IW_CACHE_FNV_BASIS;
+  int		r;
+
+  for(r = 0; r < num_routers; r++)
+    {
+      /* Unheard (0) is a class of its own, levels are negative */
+      key[r] = (query[r] == 0) ? 0
+	: (int8_t) (-1 - (-1 - query[r]) / cache->quantum);
+      hash = (hash ^ (uint8_t) key[r]) * IW_CACHE_FNV_PRIME;
+    }
+  return(hash);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Take an entry out of the order of use
+ */
+static void
+iw_cache_unlink(struct iw_cache *	cache,
+		int			e)
+{
+  struct iw_centry *	entry = &cache->entries[e];
+
+  if(entry->newer >= 0)
+    cache->entries[entry->newer].older = entry->older;
+  else
+    cache->newest = entry->older;
+  if(entry->older >= 0)
+    cache->entries[entry->older].newer = entry->newer;
+  else
+    cache->oldest = entry->newer;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Put an entry first in the order of use
+ */
+static void
+iw_cache_touch(struct iw_cache *	cache,
+	       int			e)
+{
+  struct iw_centry *	entry = &cache->entries[e];
+
+  entry->newer = -1;
+  entry->older = cache->newest;
+  if(cache->newest >= 0)
+    cache->entries[cache->newest].newer = e;
+  cache->newest = e;
+  if(cache->oldest < 0)
+    cache->oldest = e;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Take an entry out of the chain of its bucket
+ */
+static void
+iw_cache_unchain(struct iw_cache *	cache,
+		 int			e)
+{
+  int *	link = &cache->buckets[cache->entries[e].hash
+			       & (cache->num_buckets - 1)];
+
+  while(*link != e)
+    link = &cache->entries[*link].chain;
+  *link = cache->entries[e].chain;
+}
+
+/******************************* API *******************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Create an empty cache of num_entries results, levels quantized to
+ * quantum dB (1 : identical scans only)
+ */
+int
+iw_cache_init(struct iw_cache *	cache,
+	      int		num_entries,
+	      int		quantum)
+{
+  memset(cache, 0, sizeof(*cache));
+  if(num_entries < 1)
+    num_entries = 1;
+  cache->num_entries = num_entries;
+  cache->quantum = (quantum < 1) ? 1 : quantum;
+  /* Two buckets per entry at least, the chains stay short */
+  cache->num_buckets = 1;
+  while(cache->num_buckets < 2 * num_entries)
+    cache->num_buckets *= 2;
+  cache->entries = malloc(num_entries * sizeof(struct iw_centry));
+  cache->keys = malloc((size_t) num_entries * MAX_ROUTERS);
+  cache->buckets = malloc(cache->num_buckets * sizeof(int));
+  if((cache->entries == NULL) || (cache->keys == NULL)
+     || (cache->buckets == NULL))
+    {
+      iw_cache_free(cache);
+      errno = ENOMEM;
+      return(-1);
+    }
+  iw_cache_clear(cache);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Forget every result (the map changed), the counters stay
+ */
+void
+iw_cache_clear(struct iw_cache *	cache)
+{
+  int	b;
+
+  cache->used = 0;
+  cache->newest = -1;
+  cache->oldest = -1;
+  for(b = 0; b < cache->num_buckets; b++)
+    cache->buckets[b] = -1;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Look a scan up : on a hit, knn gets the result it had, and the entry
+ * is the most recently used.
+ * Return 1 on a hit, 0 on a miss.
+ */
+int
+iw_cache_lookup(struct iw_cache *	cache,
+		const int8_t *		query,
+		int			num_routers,
+		struct iw_knn *		knn)
+{
+  int8_t	key[MAX_ROUTERS];
+  uint64_t	hash = iw_cache_key(cache, query, num_routers, key);
+  int		e;
+
+  for(e = cache->buckets[hash & (cache->num_buckets - 1)]; e >= 0;
+      e = cache->entries[e].chain)
+    {
+      struct iw_centry *	entry = &cache->entries[e];
+
+      if((entry->hash == hash) && (entry->num_routers == num_routers)
+	 && (entry->knn.k == knn->k)
+	 && !memcmp(cache->keys + (size_t) e * MAX_ROUTERS, key, num_routers))
+	{
+	  *knn = entry->knn;
+	  iw_cache_unlink(cache, e);
+	  iw_cache_touch(cache, e);
+	  cache->hits++;
+	  return(1);
+	}
+    }
+  cache->misses++;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Keep the result of a scan, in place of the least recently used one
+ * once the cache is full
+ */
+void
+iw_cache_store(struct iw_cache *	cache,
+	       const int8_t *		query,
+	       int			num_routers,
+	       const struct iw_knn *	knn)
+{
+  int8_t *		key;
+  struct iw_centry *	entry;
+  uint64_t		hash;
+  int			e;
+
+  if(cache->used < cache->num_entries)
+    e = cache->used++;
+  else
+    {
+      e = cache->oldest;
+      iw_cache_unlink(cache, e);
+      iw_cache_unchain(cache, e);
+    }
+  entry = &cache->entries[e];
+  key = cache->keys + (size_t) e * MAX_ROUTERS;
+  hash = iw_cache_key(cache, query, num_routers, key);
+  entry->hash = hash;
+  entry->num_routers = num_routers;
+  entry->knn = *knn;
+  entry->chain = cache->buckets[hash & (cache->num_buckets - 1)];
+  cache->buckets[hash & (cache->num_buckets - 1)] = e;
+  iw_cache_touch(cache, e);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release a cache
+ */
+void
+iw_cache_free(struct iw_cache *	cache)
+{
+  free(cache->entries);
+  free(cache->keys);
+  free(cache->buckets);
+  memset(cache, 0, sizeof(*cache));
+}
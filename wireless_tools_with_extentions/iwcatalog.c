@@ -0,0 +1,474 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Catalogue of radio maps : each map (shard) covers one zone of a floor
+ * of a building, and the catalogue arranges them in a building / floor /
+ * zone tree. A query walks down the tree, keeping at each level the few
+ * nodes whose routers best match the routers heard, so that only the
+ * maps of the zones we may be in are searched, however many buildings
+ * the catalogue holds.
+ *
+ * A catalogue is a text file, one shard per line :
+ *	building/floor/zone	mapfile
+ * Empty lines and lines starting with '#' are ignored, relative map
+ * names are relative to the directory of the catalogue.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+#include <limits.h>		/* PATH_MAX */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Longest line of a catalogue */
+#define IWCAT_LINE_MAX		(IWCAT_NAME_LEN + PATH_MAX + 16)
+
+/************************ CATALOGUE LOADING ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Find the child of a node with the given name, create it if needed.
+ * Return its index, or -1.
+ */
+static int
+iw_catalog_child(struct iw_catalog *	cat,
+		 int			parent,
+		 const char *		name)
+{
+  struct iw_cat_node *	node;
+  int			n;
+
+  for(n = cat->nodes[parent].child; n >= 0; n = cat->nodes[n].sibling)
+    if(!strcmp(cat->nodes[n].name, name))
+      return(n);
+
+  if(cat->num_nodes == cat->max_nodes)
+    {
+      int	max_nodes = 2 * cat->max_nodes;
+
+      node = realloc(cat->nodes, max_nodes * sizeof(*node));
+      if(node == NULL)
+	return(-1);
+      cat->nodes = node;
+      cat->max_nodes = max_nodes;
+    }
+
+  n = cat->num_nodes++;
+  node = &cat->nodes[n];
+  memset(node, 0, sizeof(*node));
+  strncpy(node->name, name, IWCAT_NAME_LEN - 1);
+  node->parent = parent;
+  node->shard = -1;
+  /* Keep the children in catalogue order */
+  node->child = -1;
+  node->sibling = -1;
+  if(cat->nodes[parent].child < 0)
+    cat->nodes[parent].child = n;
+  else
+    {
+      int	last = cat->nodes[parent].child;
+
+      while(cat->nodes[last].sibling >= 0)
+	last = cat->nodes[last].sibling;
+      cat->nodes[last].sibling = n;
+    }
+  return(n);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Load one shard of the catalogue, and hang it in the tree
+ */
+static int
+iw_catalog_add(struct iw_catalog *	cat,
+	       const char *		name,
+	       const char *		path)
+{
+  struct iw_shard *	shard;
+  char			part[IWCAT_NAME_LEN];
+  const char *		p;
+  int			node = 0;
+  int			s;
+  int			c;
+
+  if(cat->num_shards == cat->max_shards)
+    {
+      int	max_shards = cat->max_shards ? 2 * cat->max_shards : 8;
+
+      shard = realloc(cat->shards, max_shards * sizeof(*shard));
+      if(shard == NULL)
+	return(-1);
+      cat->shards = shard;
+      cat->max_shards = max_shards;
+    }
+  s = cat->num_shards;
+  shard = &cat->shards[s];
+  memset(shard, 0, sizeof(*shard));
+  strncpy(shard->name, name, IWCAT_NAME_LEN - 1);
+
+  if(iw_map_open(path, &shard->map) < 0)
+    return(-1);
+  if(shard->map.hdr->num_routers > MAX_ROUTERS)
+    {
+      iw_map_close(&shard->map);
+      errno = E2BIG;
+      return(-1);
+    }
+  iw_fpstore_from_map(&shard->fps, &shard->map);
+  if(iw_fpsparse_from_map(&shard->sp, &shard->map) < 0)
+    {
+      iw_map_close(&shard->map);
+      return(-1);
+    }
+  /* From now on, iw_catalog_free() cleans up */
+  cat->num_shards++;
+
+  /* Routers get a global column, in the order we meet them */
+  for(c = 0; c < shard->sp.num_routers; c++)
+    {
+      const unsigned char *	bssid = shard->map.routers[c].bssid;
+      int			g = iw_registry_find(&cat->reg, bssid);
+
+      if(g < 0)
+	{
+	  if(cat->num_routers >= MAX_ROUTERS)
+	    {
+	      errno = E2BIG;
+	      return(-1);
+	    }
+	  g = cat->num_routers++;
+	  cat->routers[g] = shard->map.routers[c];
+	  if(iw_registry_add(&cat->reg, bssid, g) < 0)
+	    return(-1);
+	}
+      shard->global[c] = g;
+    }
+
+  /* Walk down building/floor/zone, creating the nodes as we go */
+  for(p = name; *p != '\0'; )
+    {
+      size_t	len = strcspn(p, "/");
+
+      if(len >= IWCAT_NAME_LEN)
+	len = IWCAT_NAME_LEN - 1;
+      memcpy(part, p, len);
+      part[len] = '\0';
+      p += strcspn(p, "/");
+      if(*p == '/')
+	p++;
+      if(len == 0)
+	continue;
+      if(cat->nodes[node].shard >= 0)
+	{
+	  /* Under a zone that has a map : it would never be searched */
+	  errno = EINVAL;
+	  return(-1);
+	}
+      node = iw_catalog_child(cat, node, part);
+      if(node < 0)
+	return(-1);
+    }
+  if((node == 0) || (cat->nodes[node].shard >= 0)
+     || (cat->nodes[node].child >= 0))
+    {
+      /* Unnamed, or the same zone twice, or a zone holding zones */
+      errno = EINVAL;
+      return(-1);
+    }
+  cat->nodes[node].shard = s;
+
+  /* Each node knows the routers heard anywhere below it */
+  for(; node >= 0; node = cat->nodes[node].parent)
+    for(c = 0; c < shard->sp.num_routers; c++)
+      cat->nodes[node].bssids[shard->global[c] / 64]
+	|= 1ULL << (shard->global[c] % 64);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Compute the centroid of each node : the mean level of each router
+ * over all the points below the node that hear it
+ */
+static int
+iw_catalog_centroids(struct iw_catalog *	cat)
+{
+  long *	sum;
+  int *		count;
+  uint32_t	k;
+  int		n;
+  int		s;
+  int		c;
+
+  sum = calloc((size_t) cat->num_nodes * MAX_ROUTERS, sizeof(long));
+  count = calloc((size_t) cat->num_nodes * MAX_ROUTERS, sizeof(int));
+  if((sum == NULL) || (count == NULL))
+    {
+      free(sum);
+      free(count);
+      errno = ENOMEM;
+      return(-1);
+    }
+
+  for(n = 0; n < cat->num_nodes; n++)
+    {
+      const struct iw_shard *	shard;
+      int			a;
+
+      s = cat->nodes[n].shard;
+      if(s < 0)
+	continue;
+      shard = &cat->shards[s];
+      /* Every cell counts for the zone and all the levels above it */
+      for(k = 0; k < shard->sp.nnz; k++)
+	{
+	  int	g = shard->global[shard->sp.cols[k]];
+
+	  for(a = n; a >= 0; a = cat->nodes[a].parent)
+	    {
+	      sum[(size_t) a * MAX_ROUTERS + g] += shard->sp.vals[k];
+	      count[(size_t) a * MAX_ROUTERS + g]++;
+	    }
+	}
+    }
+
+  for(n = 0; n < cat->num_nodes; n++)
+    for(c = 0; c < cat->num_routers; c++)
+      {
+	size_t	i = (size_t) n * MAX_ROUTERS + c;
+
+	cat->nodes[n].centroid[c] = count[i] ? sum[i] / count[i] : 0;
+      }
+  free(sum);
+  free(count);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Load a catalogue, and map all of its shards
+ */
+int
+iw_catalog_load(struct iw_catalog *	cat,
+		const char *		path)
+{
+  char		line[IWCAT_LINE_MAX];
+  char		name[IWCAT_NAME_LEN];
+  char		map[PATH_MAX];
+  char		full[PATH_MAX];
+  const char *	slash;
+  int		dirlen;
+  int		lineno = 0;
+  FILE *	file;
+  int		err;
+
+  memset(cat, 0, sizeof(*cat));
+  file = fopen(path, "r");
+  if(file == NULL)
+    return(-1);
+
+  cat->max_nodes = 16;
+  cat->nodes = calloc(cat->max_nodes, sizeof(struct iw_cat_node));
+  if((cat->nodes == NULL) || (iw_registry_init(&cat->reg, MAX_ROUTERS) < 0))
+    goto fail;
+  /* The root of the tree, the whole site */
+  cat->num_nodes = 1;
+  cat->nodes[0].parent = -1;
+  cat->nodes[0].child = -1;
+  cat->nodes[0].sibling = -1;
+  cat->nodes[0].shard = -1;
+
+  slash = strrchr(path, '/');
+  dirlen = slash ? slash - path + 1 : 0;
+  while(fgets(line, sizeof(line), file) != NULL)
+    {
+      lineno++;
+      if(sscanf(line, "%63s %4095s", name, map) != 2)
+	{
+	  if((sscanf(line, "%63s", name) == 1) && (name[0] != '#'))
+	    {
+	      fprintf(stderr, "Catalogue %s:%d : no map\n", path, lineno);
+	      errno = EINVAL;
+	      goto fail;
+	    }
+	  continue;
+	}
+      if(name[0] == '#')
+	continue;
+      if(snprintf(full, sizeof(full), "%.*s%s", (map[0] == '/') ? 0 : dirlen,
+		  path, map) >= (int) sizeof(full))
+	errno = ENAMETOOLONG;
+      else if(iw_catalog_add(cat, name, full) == 0)
+	continue;
+      err = errno;
+      fprintf(stderr, "Catalogue %s:%d : can't load %s (%s)\n",
+	      path, lineno, full, strerror(err));
+      errno = err;
+      goto fail;
+    }
+  fclose(file);
+  if(cat->num_shards == 0)
+    {
+      iw_catalog_free(cat);
+      errno = EINVAL;
+      return(-1);
+    }
+  if(iw_catalog_centroids(cat) < 0)
+    {
+      err = errno;
+      iw_catalog_free(cat);
+      errno = err;
+      return(-1);
+    }
+  return(0);
+
+ fail:
+  err = errno;
+  fclose(file);
+  iw_catalog_free(cat);
+  errno = err;
+  return(-1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Unmap all the shards of a catalogue
+ */
+void
+iw_catalog_free(struct iw_catalog *	cat)
+{
+  int	s;
+
+  for(s = 0; s < cat->num_shards; s++)
+    {
+      iw_fpsparse_free(&cat->shards[s].sp);
+      iw_fpstore_free(&cat->shards[s].fps);
+      iw_map_close(&cat->shards[s].map);
+    }
+  free(cat->shards);
+  free(cat->nodes);
+  iw_registry_free(&cat->reg);
+  memset(cat, 0, sizeof(*cat));
+}
+
+/************************* SHARD SELECTION *************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * How well a node matches the sample : the number of heard routers it
+ * knows about, then how close their levels are to its mean levels.
+ */
+static void
+iw_catalog_score(const struct iw_catalog *	cat,
+		 int				n,
+		 const uint64_t *		heard,
+		 const int8_t *			sample,
+		 int *				overlap,
+		 int *				diff)
+{
+  const struct iw_cat_node *	node = &cat->nodes[n];
+  int				w;
+  int				c;
+
+  *overlap = 0;
+  for(w = 0; w < IWCAT_WORDS; w++)
+    *overlap += __builtin_popcountll(node->bssids[w] & heard[w]);
+
+  *diff = 0;
+  for(c = 0; c < cat->num_routers; c++)
+    if((sample[c] != 0) && (node->centroid[c] != 0))
+      *diff += (sample[c] - node->centroid[c]) * (sample[c] - node->centroid[c]);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Pick the shards to search for a sample (one level per router of the
+ * catalogue, 0 if not heard). Walk down the tree keeping the probe best
+ * nodes at each step.
+ * Return the number of shards written to shards (at most probe).
+ */
+int
+iw_catalog_select(const struct iw_catalog *	cat,
+		  const int8_t *		sample,
+		  int				probe,
+		  int *				shards)
+{
+  uint64_t	heard[IWCAT_WORDS];
+  int		frontier[IWCAT_PROBE_MAX];
+  int		cand[IWCAT_PROBE_MAX];
+  int		cand_overlap[IWCAT_PROBE_MAX];
+  int		cand_diff[IWCAT_PROBE_MAX];
+  int		num_frontier = 1;
+  int		inner = 1;
+  int		f;
+  int		c;
+
+  if(probe > IWCAT_PROBE_MAX)
+    probe = IWCAT_PROBE_MAX;
+  if(probe < 1)
+    probe = 1;
+
+  memset(heard, 0, sizeof(heard));
+  for(c = 0; c < cat->num_routers; c++)
+    if(sample[c] != 0)
+      heard[c / 64] |= 1ULL << (c % 64);
+
+  frontier[0] = 0;
+  while(inner)
+    {
+      int	num_cand = 0;
+
+      inner = 0;
+      for(f = 0; f < num_frontier; f++)
+	{
+	  int	n = frontier[f];
+	  int	child = cat->nodes[n].child;
+
+	  /* Zones stay in the running as they are */
+	  if(child < 0)
+	    child = n;
+	  else
+	    inner = 1;
+	  for(; child >= 0;
+	      child = (child == n) ? -1 : cat->nodes[child].sibling)
+	    {
+	      int	overlap;
+	      int	diff;
+	      int	i;
+
+	      iw_catalog_score(cat, child, heard, sample, &overlap, &diff);
+	      /* Insertion in the (short) sorted list of the best nodes */
+	      for(i = num_cand; i > 0; i--)
+		{
+		  if((cand_overlap[i - 1] > overlap)
+		     || ((cand_overlap[i - 1] == overlap)
+			 && (cand_diff[i - 1] <= diff)))
+		    break;
+		  if(i < probe)
+		    {
+		      cand[i] = cand[i - 1];
+		      cand_overlap[i] = cand_overlap[i - 1];
+		      cand_diff[i] = cand_diff[i - 1];
+		    }
+		}
+	      if(i < probe)
+		{
+		  cand[i] = child;
+		  cand_overlap[i] = overlap;
+		  cand_diff[i] = diff;
+		  if(num_cand < probe)
+		    num_cand++;
+		}
+	    }
+	}
+      memcpy(frontier, cand, num_cand * sizeof(int));
+      num_frontier = num_cand;
+    }
+
+  for(f = 0; f < num_frontier; f++)
+    shards[f] = cat->nodes[frontier[f]].shard;
+  return(num_frontier);
+}
@@ -0,0 +1,419 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Clusters of the fingerprints of a radio map, by k-means, computed
+ * when the map is loaded : a coarse to fine search that needs nothing
+ * but the fingerprints, no positions nor zones. A query is measured
+ * against the centroids first, then only against the members of the
+ * few nearest clusters. It is approximate : a neighbour in a cluster
+ * that was not searched is missed (see iwlocbench -a for the recall).
+ *
+ * The centroids are rounded to dBm, and they are blocked fingerprints
+ * of their own, as are the members, cluster after cluster : both are
+ * measured by the distance kernels, the training too.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+
+/***************************** BUILDING *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Put a point (or padding, point -1) in the next slot of the members
+ */
+static int
+iw_cluster_slot(struct iw_cluster *	cl,
+		int			point,
+		const int8_t *		row)
+{
+  static const int8_t	none[MAX_ROUTERS];
+  int			slot = cl->members.num_points;
+
+  if((slot % 64) == 0)
+    {
+      int *	perm = realloc(cl->perm, (slot + 64) * sizeof(int));
+
+      if(perm == NULL)
+	{
+	  errno = ENOMEM;
+	  return(-1);
+	}
+      cl->perm = perm;
+    }
+  if(iw_fpblock_add(&cl->members, (point < 0) ? none : row) < 0)
+    return(-1);
+  cl->perm[slot] = point;
+  return(slot);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Lay the centroids (rows of width num_routers) out for the kernels
+ */
+static int
+iw_cluster_centroids(struct iw_cluster *	cl,
+		     const int8_t *		rows)
+{
+  int	c;
+
+  /* Same number of rows each time, the blocks are overwritten */
+  cl->centroids.num_points = 0;
+  for(c = 0; c < cl->num_clusters; c++)
+    if(iw_fpblock_add(&cl->centroids, rows + (size_t) c * cl->num_routers) < 0)
+      return(-1);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Nearest centroid to a fingerprint. dist has room for the blocks of
+ * the centroids.
+ */
+static int
+iw_cluster_nearest(const struct iw_cluster *	cl,
+		   const int8_t *		row,
+		   int32_t *			dist)
+{
+  int32_t	qpairs[IWMAP_QPAIRS];
+  int		best = 0;
+  int		c;
+
+  iw_fpblock_query(&cl->centroids, row, qpairs);
+  iw_fpblock_dist_blocks(&cl->centroids, qpairs, 0,
+			 (cl->num_clusters + IWMAP_BLOCK - 1) / IWMAP_BLOCK,
+			 dist);
+  for(c = 1; c < cl->num_clusters; c++)
+    if(dist[c] < dist[best])
+      best = c;
+  return(best);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Learn the centroids by k-means over a sample of the points (rows of
+ * width num_routers), into rows
+ */
+static int
+iw_cluster_kmeans(struct iw_cluster *	cl,
+		  const int8_t *	sample,
+		  int			num_sample,
+		  int8_t *		rows)
+{
+  int		k = cl->num_clusters;
+  int		dim = cl->num_routers;
+  int64_t *	sums;
+  int *		counts;
+  int *		assign;
+  int32_t *	dist;
+  unsigned int	seed = 1;
+  int		ret = 0;
+  int		round;
+  int		i;
+  int		c;
+  int		d;
+
+  sums = malloc((size_t) k * dim * sizeof(int64_t));
+  counts = malloc(k * sizeof(int));
+  assign = malloc(num_sample * sizeof(int));
+  dist = malloc((k + IWMAP_BLOCK) * sizeof(int32_t));
+  if((sums == NULL) || (counts == NULL) || (assign == NULL) || (dist == NULL))
+    {
+      free(sums);
+      free(counts);
+      free(assign);
+      free(dist);
+      errno = ENOMEM;
+      return(-1);
+    }
+
+  /* Start from points spread over the sample */
+  for(c = 0; c < k; c++)
+    memcpy(rows + (size_t) c * dim,
+	   sample + (size_t) (c * (num_sample / k)) * dim, dim);
+  for(i = 0; i < num_sample; i++)
+    assign[i] = -1;
+
+  for(round = 0; round < IW_CLUSTER_ROUNDS; round++)
+    {
+      int	moved = 0;
+
+      if(iw_cluster_centroids(cl, rows) < 0)
+	{
+	  ret = -1;
+	  break;
+	}
+      memset(sums, 0, (size_t) k * dim * sizeof(int64_t));
+      memset(counts, 0, k * sizeof(int));
+      for(i = 0; i < num_sample; i++)
+	{
+	  const int8_t *	row = sample + (size_t) i * dim;
+
+	  c = iw_cluster_nearest(cl, row, dist);
+	  if(c != assign[i])
+	    {
+	      assign[i] = c;
+	      moved++;
+	    }
+	  counts[c]++;
+	  for(d = 0; d < dim; d++)
+	    sums[(size_t) c * dim + d] += row[d];
+	}
+      if(moved == 0)
+	break;
+
+      for(c = 0; c < k; c++)
+	{
+	  int8_t *	cent = rows + (size_t) c * dim;
+
+	  if(counts[c] == 0)
+	    {
+	      /* Lost its points, give it another one at random */
+	      seed = seed * 1103515245 + 12345;
+	      memcpy(cent, sample + (size_t) ((seed >> 8) % num_sample) * dim,
+		     dim);
+	      continue;
+	    }
+	  for(d = 0; d < dim; d++)
+	    cent[d] = lround((double) sums[(size_t) c * dim + d] / counts[c]);
+	}
+    }
+
+  free(sums);
+  free(counts);
+  free(assign);
+  free(dist);
+  return(ret);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Cluster the points of a (dense) store, num_clusters of them (0 : the
+ * square root of the number of points, the two stages then measure
+ * about as many)
+ */
+int
+iw_cluster_build(struct iw_cluster *		cl,
+		 const struct iw_fpstore *	fps,
+		 int				num_clusters)
+{
+  int8_t *	sample = NULL;
+  int8_t *	rows = NULL;
+  int32_t *	dist = NULL;
+  int *		owner = NULL;
+  int *		counts = NULL;
+  int *		slots = NULL;
+  int		num_sample;
+  int		dim = fps->num_routers;
+  int		err;
+  int		i;
+  int		c;
+
+  memset(cl, 0, sizeof(*cl));
+  cl->num_routers = dim;
+  cl->probe = IW_CLUSTER_PROBE_DEFAULT;
+  iw_fpblock_init(&cl->centroids, dim);
+  iw_fpblock_init(&cl->members, dim);
+  if(fps->num_points == 0)
+    return(0);
+
+  if(num_clusters <= 0)
+    num_clusters = lround(sqrt((double) fps->num_points));
+  if(num_clusters > fps->num_points)
+    num_clusters = fps->num_points;
+  if(num_clusters < 1)
+    num_clusters = 1;
+  cl->num_clusters = num_clusters;
+
+  num_sample = (fps->num_points < IW_CLUSTER_TRAIN_MAX)
+    ? fps->num_points : IW_CLUSTER_TRAIN_MAX;
+  sample = malloc((size_t) num_sample * dim + 1);
+  rows = malloc((size_t) num_clusters * dim + 1);
+  dist = malloc((num_clusters + IWMAP_BLOCK) * sizeof(int32_t));
+  owner = malloc(fps->num_points * sizeof(int));
+  cl->start = malloc((num_clusters + 1) * sizeof(int));
+  counts = calloc(num_clusters + 1, sizeof(int));
+  if((sample == NULL) || (rows == NULL) || (dist == NULL) || (owner == NULL)
+     || (cl->start == NULL) || (counts == NULL))
+    {
+      errno = ENOMEM;
+      goto fail;
+    }
+
+  /* Learn the centroids on a sample spread over the map */
+  for(i = 0; i < num_sample; i++)
+    memcpy(sample + (size_t) i * dim,
+	   iw_fpstore_row(fps, (int) ((int64_t) i * fps->num_points
+				      / num_sample)), dim);
+  if((iw_cluster_kmeans(cl, sample, num_sample, rows) < 0)
+     || (iw_cluster_centroids(cl, rows) < 0))
+    goto fail;
+
+  /* Every point to its nearest centroid */
+  for(i = 0; i < fps->num_points; i++)
+    {
+      owner[i] = iw_cluster_nearest(cl, iw_fpstore_row(fps, i), dist);
+      counts[owner[i]]++;
+    }
+
+  /* Members cluster after cluster, each from a block of its own */
+  for(c = 0, i = 0; c < num_clusters; c++)
+    {
+      cl->start[c] = i;
+      i += (counts[c] + IWMAP_BLOCK - 1) / IWMAP_BLOCK * IWMAP_BLOCK;
+      counts[c] = cl->start[c];
+    }
+  cl->start[num_clusters] = i;
+  slots = malloc((i + 1) * sizeof(int));
+  if(slots == NULL)
+    {
+      errno = ENOMEM;
+      goto fail;
+    }
+  for(c = 0; c < cl->start[num_clusters]; c++)
+    slots[c] = -1;
+  for(i = 0; i < fps->num_points; i++)
+    slots[counts[owner[i]]++] = i;
+  for(i = 0; i < cl->start[num_clusters]; i++)
+    if(iw_cluster_slot(cl, slots[i], (slots[i] < 0) ? NULL
+		       : iw_fpstore_row(fps, slots[i])) < 0)
+      goto fail;
+
+  cl->num_points = fps->num_points;
+  cl->tail = cl->members.num_points;
+  free(sample);
+  free(rows);
+  free(dist);
+  free(owner);
+  free(counts);
+  free(slots);
+  return(0);
+
+ fail:
+  err = errno;
+  free(sample);
+  free(rows);
+  free(dist);
+  free(owner);
+  free(counts);
+  free(slots);
+  iw_cluster_free(cl);
+  errno = err;
+  return(-1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Add a point after the build, it goes to the tail
+ */
+int
+iw_cluster_add(struct iw_cluster *	cl,
+	       const int8_t *		row)
+{
+  if(iw_cluster_slot(cl, cl->num_points, row) < 0)
+    return(-1);
+  return(cl->num_points++);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release the clusters
+ */
+void
+iw_cluster_free(struct iw_cluster *	cl)
+{
+  iw_fpblock_free(&cl->centroids);
+  iw_fpblock_free(&cl->members);
+  free(cl->start);
+  free(cl->perm);
+  memset(cl, 0, sizeof(*cl));
+}
+
+/***************************** SEARCH *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Offer the points of some slots of the members (first a multiple of
+ * IWMAP_BLOCK)
+ */
+static int
+iw_cluster_scan(const struct iw_cluster *	cl,
+		const int32_t *			qpairs,
+		int				first,
+		int				last,
+		struct iw_knn *			knn)
+{
+  int32_t	dist[IWMAP_BLOCK];
+  int		visited = 0;
+  int		slot;
+  int		i;
+
+  for(slot = first; slot < last; slot += IWMAP_BLOCK)
+    {
+      iw_fpblock_dist_blocks(&cl->members, qpairs, slot / IWMAP_BLOCK, 1,
+			     dist);
+      for(i = 0; (i < IWMAP_BLOCK) && (slot + i < last); i++)
+	{
+	  int	point = cl->perm[slot + i];
+
+	  if(point < 0)
+	    continue;
+	  visited++;
+	  if((knn->count < knn->k) || (dist[i] <= knn->nb[0].dist))
+	    iw_knn_push(knn, point, dist[i]);
+	}
+    }
+  return(visited);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * k nearest points to the query among the members of the cl->probe
+ * clusters with the nearest centroids, and the tail, sorted (see
+ * iw_knn_sort()). visited (if not NULL) gets the number of points
+ * measured, the centroids not counted.
+ * Return the number found.
+ */
+int
+iw_cluster_knn(const struct iw_cluster *	cl,
+	       const int8_t *			query,
+	       struct iw_knn *			knn,
+	       int *				visited)
+{
+  int32_t	qpairs[IWMAP_QPAIRS];
+  int32_t	dist[IWMAP_BLOCK];
+  struct iw_knn	near;
+  int		count = 0;
+  int		b;
+  int		i;
+
+  knn->count = 0;
+  iw_fpblock_query(&cl->members, query, qpairs);
+
+  /* The nearest centroids, by the kernels too */
+  iw_knn_init(&near, cl->probe);
+  for(b = 0; b * IWMAP_BLOCK < cl->num_clusters; b++)
+    {
+      iw_fpblock_dist_blocks(&cl->centroids, qpairs, b, 1, dist);
+      for(i = 0; (i < IWMAP_BLOCK) && (b * IWMAP_BLOCK + i < cl->num_clusters);
+	  i++)
+	if((near.count < near.k) || (dist[i] <= near.nb[0].dist))
+	  iw_knn_push(&near, b * IWMAP_BLOCK + i, dist[i]);
+    }
+
+  for(i = 0; i < near.count; i++)
+    {
+      int	c = near.nb[i].point;
+
+      count += iw_cluster_scan(cl, qpairs, cl->start[c], cl->start[c + 1],
+			       knn);
+    }
+  count += iw_cluster_scan(cl, qpairs, cl->tail, cl->members.num_points, knn);
+  iw_knn_sort(knn);
+  if(visited != NULL)
+    *visited = count;
+  return(knn->count);
+}
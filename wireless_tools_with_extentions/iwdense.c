@@ -0,0 +1,428 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * iwdense : densify a surveyed radio map. A log-distance path loss
+ * model is fitted for each router over the surveyed points, and the
+ * map is filled with virtual points on a regular grid, predicted from
+ * the models. The surveyed points must have positions (iwmapc -c) and
+ * the routers too (iwmapc -r), at least two different ones : no map is
+ * written otherwise.
+ *
+ * The grid is cut in tiles, shared by a pool of threads.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+#include <getopt.h>
+#include <limits.h>		/* INT_MAX */
+#include <pthread.h>
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Side of a tile of the grid, in points */
+#define IWDENSE_TILE		32
+#define IWDENSE_STEP_DEFAULT	0.1
+#define IWDENSE_MAX_THREADS	64
+
+/****************************** TYPES ******************************/
+
+/*
+ * The grid to fill, shared by all the workers
+ */
+struct dense_job
+{
+  const struct iw_pathloss *	models;
+  const double *		range2;		/* Square of the range of each router */
+  const double *		rx;		/* Position of each router */
+  const double *		ry;
+  struct iw_fpstore *		fps;		/* Rows already allocated */
+  int				first;		/* Row of the first grid point */
+  double			floor;		/* Weaker is not heard, dBm */
+  double			x0;		/* Corner of the grid */
+  double			y0;
+  double			step;
+  int				nx;		/* Grid points per row / column */
+  int				ny;
+  int				tiles_x;	/* Tiles per row */
+  int				num_tiles;
+  int				next;		/* Next tile to hand out */
+};
+
+/************************** GRID FILLING ***************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Predict the fingerprint of one grid point
+ */
+static void
+dense_point(const struct dense_job *	job,
+	    double			x,
+	    double			y,
+	    int8_t *			row)
+{
+  int	r;
+
+  for(r = 0; r < job->fps->num_routers; r++)
+    {
+      const struct iw_pathloss *	model = &job->models[r];
+      double				dx = x - job->rx[r];
+      double				dy = y - job->ry[r];
+      double				d2 = dx * dx + dy * dy;
+      double				level;
+      int				dbm;
+
+      /* Out of range (or never heard), no need for the log */
+      if(d2 > job->range2[r])
+	continue;
+      level = iw_pathloss_level(model, d2);
+      if(level < job->floor)
+	continue;
+      /* Round to the nearest dBm, 0 means not heard */
+      dbm = (level > -1.5) ? -1 : (int) (level - 0.5);
+      row[r] = iw_dbm_sat(dbm);
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Worker : fill tiles until there are none left
+ */
+static void *
+dense_worker(void *	arg)
+{
+  struct dense_job *	job = arg;
+  struct iw_fpstore *	fps = job->fps;
+  int			tile;
+
+  while((tile = __sync_fetch_and_add(&job->next, 1)) < job->num_tiles)
+    {
+      int	tx = (tile % job->tiles_x) * IWDENSE_TILE;
+      int	ty = (tile / job->tiles_x) * IWDENSE_TILE;
+      int	ix;
+      int	iy;
+
+      for(iy = ty; (iy < ty + IWDENSE_TILE) && (iy < job->ny); iy++)
+	for(ix = tx; (ix < tx + IWDENSE_TILE) && (ix < job->nx); ix++)
+	  {
+	    int		point = job->first + iy * job->nx + ix;
+	    double	x = job->x0 + ix * job->step;
+	    double	y = job->y0 + iy * job->step;
+
+	    /* Rows were cleared by the store, each point is ours alone */
+	    dense_point(job, x, y, fps->rss + (size_t) point * fps->stride);
+	    fps->x[point] = x;
+	    fps->y[point] = y;
+	    snprintf(fps->labels + (size_t) point * IWMAP_LABEL_LEN,
+		     IWMAP_LABEL_LEN, "%.2f,%.2f", x, y);
+	  }
+    }
+  return(NULL);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Fill the grid with num_threads threads (the caller being one of them)
+ */
+static int
+dense_fill(struct dense_job *	job,
+	   int			num_threads)
+{
+  pthread_t	threads[IWDENSE_MAX_THREADS];
+  int		started;
+  int		err = 0;
+
+  job->tiles_x = (job->nx + IWDENSE_TILE - 1) / IWDENSE_TILE;
+  job->num_tiles = job->tiles_x * ((job->ny + IWDENSE_TILE - 1) / IWDENSE_TILE);
+  job->next = 0;
+
+  for(started = 0; started < num_threads - 1; started++)
+    {
+      err = pthread_create(&threads[started], NULL, dense_worker, job);
+      if(err != 0)
+	break;
+    }
+  /* Whatever could be started, the tiles all get done */
+  dense_worker(job);
+  while(started-- > 0)
+    pthread_join(threads[started], NULL);
+  if(err != 0)
+    fprintf(stderr, "iwdense: using fewer threads : %s\n", strerror(err));
+  return(0);
+}
+
+/************************** DENSIFICATION **************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Check that the routers of a map have positions : a map compiled
+ * without them (or from a router list without them) has them all at the
+ * same place, and the models fitted on the distances to it mean nothing.
+ */
+static int
+densify_check_routers(const struct iwmap *	map)
+{
+  int	i;
+
+  for(i = 1; i < (int) map->hdr->num_routers; i++)
+    if((map->routers[i].x != map->routers[0].x)
+       || (map->routers[i].y != map->routers[0].y))
+      return(0);
+  errno = EINVAL;
+  return(-1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Densify one map
+ */
+static int
+densify_map(const char *	in_path,
+	    const char *	out_path,
+	    double		step,
+	    double		margin,
+	    int			min_level,
+	    int			num_threads,
+	    int			sparse)
+{
+  struct iwmap		map;
+  struct iwmap		out;
+  struct iw_fpstore	survey;
+  struct iw_fpstore	fps;
+  struct iw_fpsparse	sp;
+  struct iw_pathloss	models[MAX_ROUTERS];
+  double		range2[MAX_ROUTERS];
+  double		rx[MAX_ROUTERS];
+  double		ry[MAX_ROUTERS];
+  struct dense_job	job;
+  int8_t		row[MAX_ROUTERS];
+  double		xmin;
+  double		xmax;
+  double		ymin;
+  double		ymax;
+  char			buf[20];
+  uint32_t		flags;
+  uint32_t		k;
+  int			np;
+  int			ret = -1;
+  int			i;
+
+  if(iw_map_open(in_path, &map) < 0)
+    {
+      fprintf(stderr, "iwdense: can't load %s : %s\n", in_path, strerror(errno));
+      return(-1);
+    }
+  np = map.hdr->num_points;
+  if(!(map.hdr->flags & IWMAP_F_COORDS) || (np == 0))
+    {
+      fprintf(stderr, "iwdense: %s has no point positions, "
+	      "compile it with iwmapc -c\n", in_path);
+      iw_map_close(&map);
+      return(-1);
+    }
+  if(densify_check_routers(&map) < 0)
+    {
+      fprintf(stderr, "iwdense: the routers of %s have no positions (all at "
+	      "%d,%d), compile it with iwmapc -r and their positions\n",
+	      in_path, (map.hdr->num_routers > 0) ? map.routers[0].x : 0,
+	      (map.hdr->num_routers > 0) ? map.routers[0].y : 0);
+      iw_map_close(&map);
+      return(-1);
+    }
+  iw_fpstore_from_map(&survey, &map);
+  memset(&fps, 0, sizeof(fps));
+  if(iw_fpsparse_from_map(&sp, &map) < 0)
+    {
+      fprintf(stderr, "iwdense: corrupted map %s\n", in_path);
+      iw_map_close(&map);
+      return(-1);
+    }
+
+  /* The models */
+  if(iw_pathloss_fit(&sp, survey.x, survey.y, map.routers, models) < 0)
+    goto fail;
+  for(i = 0; i < sp.num_routers; i++)
+    {
+      /* Where the model falls below the floor, d^2 = 10^((p0 - floor) / 5n),
+       * with some slack for rounding */
+      rx[i] = map.routers[i].x;
+      ry[i] = map.routers[i].y;
+      range2[i] = -1;
+      if(models[i].points > 0)
+	range2[i] = pow(10.0, (models[i].p0 - min_level) / (5.0 * models[i].n))
+		    * 1.0001;
+      iw_ether_ntop((const struct ether_addr *) map.routers[i].bssid, buf);
+      if(models[i].points == 0)
+	printf("    Router %02d : %s  never heard\n", i, buf);
+      else
+	printf("    Router %02d : %s  %6.1f dBm at 1, exponent %.2f (%d points)\n",
+	       i, buf, models[i].p0, models[i].n, models[i].points);
+    }
+
+  /* The grid covers the survey */
+  xmin = xmax = survey.x[0];
+  ymin = ymax = survey.y[0];
+  for(i = 1; i < np; i++)
+    {
+      xmin = fmin(xmin, survey.x[i]);
+      xmax = fmax(xmax, survey.x[i]);
+      ymin = fmin(ymin, survey.y[i]);
+      ymax = fmax(ymax, survey.y[i]);
+    }
+  memset(&job, 0, sizeof(job));
+  job.models = models;
+  job.range2 = range2;
+  job.rx = rx;
+  job.ry = ry;
+  job.fps = &fps;
+  job.first = np;
+  job.floor = min_level;
+  job.x0 = xmin - margin;
+  job.y0 = ymin - margin;
+  job.step = step;
+  if(((xmax - xmin + 2 * margin) / step >= INT_MAX / 2)
+     || ((ymax - ymin + 2 * margin) / step >= INT_MAX / 2))
+    goto too_big;
+  job.nx = (int) floor((xmax - xmin + 2 * margin) / step + 1e-9) + 1;
+  job.ny = (int) floor((ymax - ymin + 2 * margin) / step + 1e-9) + 1;
+  if(job.nx > (INT_MAX - np) / job.ny)
+    goto too_big;
+
+  /* The surveyed points go first, the grid points fill the rest */
+  if((iw_fpstore_init(&fps, sp.num_routers) < 0)
+     || (iw_fpstore_reserve(&fps, np + job.nx * job.ny) < 0))
+    goto fail;
+  for(i = 0; i < np; i++)
+    {
+      memset(row, 0, sizeof(row));
+      for(k = sp.rowptr[i]; k < sp.rowptr[i + 1]; k++)
+	row[sp.cols[k]] = sp.vals[k];
+      iw_fpstore_add(&fps, row, survey.x[i], survey.y[i],
+		     iw_fpstore_label(&survey, i));
+    }
+  fps.num_points = np + job.nx * job.ny;
+  dense_fill(&job, num_threads);
+
+  flags = IWMAP_F_COORDS | (sparse ? IWMAP_F_SPARSE : 0);
+  if(iw_map_build(&out, &fps, map.routers, flags) < 0)
+    goto fail;
+  if(iw_map_save(&out, out_path) < 0)
+    fprintf(stderr, "iwdense: can't write %s : %s\n",
+	    out_path, strerror(errno));
+  else
+    {
+      printf("%s : %d surveyed + %d x %d grid points, %d routers", out_path,
+	     np, job.nx, job.ny, out.hdr->num_routers);
+      if(out.hdr->flags & IWMAP_F_SPARSE)
+	printf(", %llu heard cells", (unsigned long long) out.hdr->nnz);
+      printf("\n");
+      ret = 0;
+    }
+  iw_map_close(&out);
+  goto out;
+
+ too_big:
+  errno = E2BIG;
+ fail:
+  fprintf(stderr, "iwdense: can't densify %s : %s\n", in_path, strerror(errno));
+ out:
+  iw_fpstore_free(&fps);
+  iw_fpsparse_free(&sp);
+  iw_map_close(&map);
+  return(ret);
+}
+
+/******************************* MAIN ********************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Display help
+ */
+static void
+iw_usage(int	status)
+{
+  fputs("Usage: iwdense [-s] [-g step] [-m margin] [-f floor] [-t threads]"
+	" surveymap densemap\n",
+	status ? stderr : stdout);
+  exit(status);
+}
+
+static const struct option long_opts[] = {
+  { "floor", required_argument, NULL, 'f' },
+  { "grid", required_argument, NULL, 'g' },
+  { "help", no_argument, NULL, 'h' },
+  { "margin", required_argument, NULL, 'm' },
+  { "sparse", no_argument, NULL, 's' },
+  { "threads", required_argument, NULL, 't' },
+  { NULL, 0, NULL, 0 }
+};
+
+/*------------------------------------------------------------------*/
+/*
+ * The main !
+ */
+int
+main(int	argc,
+     char **	argv)
+{
+  double	step = IWDENSE_STEP_DEFAULT;
+  double	margin = 0;
+  int		min_level = IWMAP_FLOOR_DEFAULT;
+  int		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int		sparse = 0;
+  int		opt;
+
+  /* Check command line arguments */
+  while((opt = getopt_long(argc, argv, "f:g:hm:st:", long_opts, NULL)) > 0)
+    {
+      switch(opt)
+	{
+	case 'f':
+	  /* Predicted levels below this are not heard */
+	  min_level = atoi(optarg);
+	  break;
+
+	case 'g':
+	  /* Spacing of the grid, in map units */
+	  step = atof(optarg);
+	  if(!(step > 0))
+	    iw_usage(1);
+	  break;
+
+	case 'h':
+	  iw_usage(0);
+	  break;
+
+	case 'm':
+	  /* Extend the grid beyond the surveyed points */
+	  margin = atof(optarg);
+	  if(!(margin >= 0))
+	    iw_usage(1);
+	  break;
+
+	case 's':
+	  /* Keep only the heard cells */
+	  sparse = 1;
+	  break;
+
+	case 't':
+	  num_threads = atoi(optarg);
+	  break;
+
+	default:
+	  iw_usage(1);
+	  break;
+	}
+    }
+  if(num_threads < 1)
+    num_threads = 1;
+  if(num_threads > IWDENSE_MAX_THREADS)
+    num_threads = IWDENSE_MAX_THREADS;
+
+  if(optind + 2 != argc)
+    iw_usage(1);
+  return(densify_map(argv[optind], argv[optind + 1], step, margin, min_level,
+		     num_threads, sparse) < 0);
+}
@@ -0,0 +1,224 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Gaussian likelihood matcher : a point is not one level per router but
+ * the normal law of the samples it was learnt from (mean and spread,
+ * see IWMAP_F_STATS), and the best points are those under which the
+ * query is the most likely. A router that moves a lot at a point costs
+ * less there for the same difference than a steady one.
+ *
+ * The cost of a cell, the negative log likelihood, only depends on the
+ * difference to the mean and on the spread. Spreads are rounded to
+ * IW_GAUSS_CLASSES classes, and the costs of every difference of every
+ * class are worked out once, in tables that stay in L1 : a cell is the
+ * offset of its entry for a query at 0 dBm in them, and a point costs a
+ * lookup and an add per router. No log nor exp per query.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Routers between two checks of the cost against the worst neighbour */
+#define IW_GAUSS_CHUNK		16
+
+/**************************** SUBROUTINES ****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Spread class of a cell, from its spread in IWMAP_SIGMA_UNIT
+ * (0 : unknown)
+ */
+static int
+iw_gauss_class(int	sigma)
+{
+  double	s = sigma ? sigma * IWMAP_SIGMA_UNIT : IW_GAUSS_SIGMA_DEFAULT;
+  int		c;
+
+  if(s <= IW_GAUSS_SIGMA_MIN)
+    return(0);
+  c = lrint(IW_GAUSS_STEPS * log2(s / IW_GAUSS_SIGMA_MIN));
+  return((c < IW_GAUSS_CLASSES) ? c : IW_GAUSS_CLASSES - 1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Tables of the costs : for each spread class, the cost of each
+ * difference to the mean, from -IW_GAUSS_HALF to IW_GAUSS_HALF dB.
+ * The log of the spread is counted from IW_GAUSS_SIGMA_MIN, so that
+ * all the costs are positive, and the same for every point.
+ */
+static void
+iw_gauss_tables(struct iw_gauss *	gauss)
+{
+  int	c;
+  int	d;
+
+  for(c = 0; c < IW_GAUSS_CLASSES; c++)
+    {
+      double	sigma = IW_GAUSS_SIGMA_MIN * exp2((double) c / IW_GAUSS_STEPS);
+      double	norm = log(sigma / IW_GAUSS_SIGMA_MIN);
+
+      for(d = -IW_GAUSS_HALF; d <= IW_GAUSS_HALF; d++)
+	{
+	  double	z = fmin(abs(d) / sigma, IW_GAUSS_CUTOFF);
+
+	  gauss->table[c * IW_GAUSS_SPAN + IW_GAUSS_HALF + d] =
+	    lrint(IW_GAUSS_SCALE * (0.5 * z * z + norm));
+	}
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Make room for the cells of at least num_points points
+ */
+static int
+iw_gauss_reserve(struct iw_gauss *	gauss,
+		 int			num_points)
+{
+  uint16_t *	cells;
+  int		max_points = gauss->max_points ? gauss->max_points : 64;
+
+  if(num_points <= gauss->max_points)
+    return(0);
+  while(max_points < num_points)
+    max_points *= 2;
+  cells = realloc(gauss->cells, (size_t) max_points
+		  * (gauss->num_routers ? gauss->num_routers : 1)
+		  * sizeof(uint16_t));
+  if(cells == NULL)
+    {
+      errno = ENOMEM;
+      return(-1);
+    }
+  gauss->cells = cells;
+  gauss->max_points = max_points;
+  return(0);
+}
+
+/***************************** LIKELIHOOD *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Build the likelihood of the fingerprints of a (dense) store, with
+ * the stats of its cells where it has them. Unheard routers are at
+ * floor dBm.
+ * Return 0, or -1.
+ */
+int
+iw_gauss_build(struct iw_gauss *		gauss,
+	       const struct iw_fpstore *	fps,
+	       int				floor)
+{
+  int	i;
+
+  memset(gauss, 0, sizeof(*gauss));
+  if(fps->rss == NULL)
+    {
+      errno = ENOTSUP;
+      return(-1);
+    }
+  gauss->num_routers = fps->num_routers;
+  gauss->floor = floor;
+  iw_gauss_tables(gauss);
+  if(iw_gauss_reserve(gauss, fps->num_points) < 0)
+    return(-1);
+  for(i = 0; i < fps->num_points; i++)
+    iw_gauss_add(gauss, iw_fpstore_row(fps, i), iw_fpstore_stats(fps, i));
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Add a point, with the stats of its cells or NULL (the level of the
+ * fingerprint, and the default spread).
+ * Return the index of the point, or -1.
+ */
+int
+iw_gauss_add(struct iw_gauss *		gauss,
+	     const int8_t *		row,
+	     const struct iwmap_stat *	stats)
+{
+  uint16_t *	cells;
+  int		r;
+
+  if(iw_gauss_reserve(gauss, gauss->num_points + 1) < 0)
+    return(-1);
+  cells = gauss->cells + (size_t) gauss->num_points * gauss->num_routers;
+  for(r = 0; r < gauss->num_routers; r++)
+    {
+      int	mean = row[r];
+      int	sigma = 0;
+
+      if((stats != NULL) && (stats[r].mean != 0))
+	{
+	  mean = stats[r].mean;
+	  sigma = stats[r].sigma;
+	}
+      if(mean == 0)
+	mean = gauss->floor;
+      /* Plus the level of the query is its entry */
+      cells[r] = (iw_gauss_class(sigma) * IW_GAUSS_SPAN + IW_GAUSS_HALF
+		  - mean);
+    }
+  return(gauss->num_points++);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * k most likely points of the query, sorted (see iw_knn_sort()), with
+ * their costs as distances. A point is given up once it costs more
+ * than the worst of the k (costs only grow).
+ * Return the number found.
+ */
+int
+iw_gauss_knn(const struct iw_gauss *	gauss,
+	     const int8_t *		query,
+	     struct iw_knn *		knn)
+{
+  const uint16_t *	table = gauss->table;
+  int			levels[MAX_ROUTERS];
+  int			n = gauss->num_routers;
+  int			i;
+  int			r;
+
+  for(r = 0; r < n; r++)
+    levels[r] = query[r] ? query[r] : gauss->floor;
+
+  knn->count = 0;
+  for(i = 0; i < gauss->num_points; i++)
+    {
+      const uint16_t *	cells = gauss->cells + (size_t) i * n;
+      int32_t		bound = (knn->count < knn->k) ? INT32_MAX
+						      : knn->nb[0].dist;
+      int32_t		cost = 0;
+
+      for(r = 0; r < n; r++)
+	{
+	  cost += table[cells[r] + levels[r]];
+	  if(((r + 1) % IW_GAUSS_CHUNK == 0) && (cost > bound))
+	    break;
+	}
+      if(cost <= bound)
+	iw_knn_push(knn, i, cost);
+    }
+  knn->visited = 0;
+  iw_knn_sort(knn);
+  return(knn->count);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release the likelihood of a map
+ */
+void
+iw_gauss_free(struct iw_gauss *	gauss)
+{
+  free(gauss->cells);
+  memset(gauss, 0, sizeof(*gauss));
+}
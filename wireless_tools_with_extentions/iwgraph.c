@@ -0,0 +1,457 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Neighbourhood graph of the points of a radio map, for tracking : the
+ * scans of a tracker come from about where the last fix was, so there
+ * is no need to search the whole map, only around that fix. Each point
+ * is linked to the points nearest to it, on the floor for the maps with
+ * positions (see iwmapc -c), or else by fingerprint.
+ *
+ * A search starts at the last fix and walks the graph outward, best
+ * first, and stops once no point left to explore is nearer than the
+ * worst of the IW_GRAPH_EF best seen : it measures a few degrees of
+ * points, whatever the size of the map. It is a local search, the
+ * caller checks the best it found and falls back to the search of the
+ * whole map when that one is not good enough (the tracker was moved,
+ * or lost).
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Points per cell of the grid the links by position are found with */
+#define IW_GRAPH_CELL_POINTS	2
+
+/****************************** TYPES ******************************/
+
+/*
+ * A point nearest to the one being linked, so far
+ */
+struct iw_graph_link
+{
+  int		point;
+  double	d2;
+};
+
+/**************************** SUBROUTINES ****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Offer a point to the links of another, kept sorted, nearest first.
+ * Points at the same place only take half of the links, so that a heap
+ * of samples taken at one spot doesn't make an island of the graph.
+ */
+static void
+iw_graph_offer(struct iw_graph_link *	links,
+	       int *			count,
+	       int *			same,
+	       int			degree,
+	       int			point,
+	       double			d2)
+{
+  int	i;
+
+  if((*count == degree) && (d2 >= links[degree - 1].d2))
+    return;
+  if(d2 == 0)
+    {
+      if(2 * *same >= degree)
+	return;
+      (*same)++;
+    }
+  i = (*count < degree) ? (*count)++ : degree - 1;
+  for(; (i > 0) && (links[i - 1].d2 > d2); i--)
+    links[i] = links[i - 1];
+  links[i].point = point;
+  links[i].d2 = d2;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Link each point to the degree points nearest to it on the floor. The
+ * points are sorted into a grid of about IW_GRAPH_CELL_POINTS points per
+ * cell, and the cells are visited by rings around the point, until the
+ * next ring is further than the furthest link.
+ */
+static int
+iw_graph_by_position(struct iw_graph *		graph,
+		     const struct iw_fpstore *	fps)
+{
+  struct iw_graph_link	links[IW_GRAPH_DEGREE_MAX];
+  int			n = graph->num_points;
+  int			side = (int) ceil(sqrt((double) n / IW_GRAPH_CELL_POINTS));
+  double		minx = fps->x[0];
+  double		maxx = fps->x[0];
+  double		miny = fps->y[0];
+  double		maxy = fps->y[0];
+  double		cw;
+  double		ch;
+  int *			start;
+  int *			order;
+  int *			cell;
+  int			i;
+  int			c;
+
+  if(side < 1)
+    side = 1;
+  for(i = 1; i < n; i++)
+    {
+      minx = fmin(minx, fps->x[i]);
+      maxx = fmax(maxx, fps->x[i]);
+      miny = fmin(miny, fps->y[i]);
+      maxy = fmax(maxy, fps->y[i]);
+    }
+  cw = (maxx > minx) ? (maxx - minx) / side : 1.0;
+  ch = (maxy > miny) ? (maxy - miny) / side : 1.0;
+
+  start = calloc((size_t) side * side + 1, sizeof(int));
+  order = malloc(n * sizeof(int));
+  cell = malloc(n * sizeof(int));
+  if((start == NULL) || (order == NULL) || (cell == NULL))
+    {
+      free(start);
+      free(order);
+      free(cell);
+      errno = ENOMEM;
+      return(-1);
+    }
+
+  /* Counting sort of the points by cell */
+  for(i = 0; i < n; i++)
+    {
+      int	cx = (int) ((fps->x[i] - minx) / cw);
+      int	cy = (int) ((fps->y[i] - miny) / ch);
+
+      cx = (cx < side) ? cx : side - 1;
+      cy = (cy < side) ? cy : side - 1;
+      cell[i] = cy * side + cx;
+      start[cell[i] + 1]++;
+    }
+  for(c = 0; c < side * side; c++)
+    start[c + 1] += start[c];
+  for(i = 0; i < n; i++)
+    order[start[cell[i]]++] = i;
+  for(c = side * side; c > 0; c--)
+    start[c] = start[c - 1];
+  start[0] = 0;
+
+  for(i = 0; i < n; i++)
+    {
+      int	cx = cell[i] % side;
+      int	cy = cell[i] / side;
+      int	count = 0;
+      int	same = 0;
+      int	ring;
+      int	l;
+
+      for(ring = 0; ring <= side; ring++)
+	{
+	  double	reach = (ring - 1) * fmin(cw, ch);
+	  int		x;
+	  int		y;
+
+	  /* Everything past the last ring is at least that far */
+	  if((count == graph->degree) && (ring > 0)
+	     && (reach * reach >= links[count - 1].d2))
+	    break;
+	  for(y = cy - ring; y <= cy + ring; y++)
+	    {
+	      if((y < 0) || (y >= side))
+		continue;
+	      for(x = cx - ring; x <= cx + ring; x++)
+		{
+		  int	j;
+
+		  if((x < 0) || (x >= side))
+		    continue;
+		  /* Inside of the ring, already seen */
+		  if((abs(x - cx) < ring) && (abs(y - cy) < ring))
+		    continue;
+		  c = y * side + x;
+		  for(j = start[c]; j < start[c + 1]; j++)
+		    {
+		      int	p = order[j];
+		      double	dx = fps->x[p] - fps->x[i];
+		      double	dy = fps->y[p] - fps->y[i];
+
+		      if(p != i)
+			iw_graph_offer(links, &count, &same, graph->degree,
+				       p, dx * dx + dy * dy);
+		    }
+		}
+	    }
+	}
+      for(l = 0; l < graph->degree; l++)
+	graph->links[(size_t) i * graph->degree + l] =
+	  (l < count) ? links[l].point : -1;
+    }
+
+  free(start);
+  free(order);
+  free(cell);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Link each point to the degree points nearest to it by fingerprint, a
+ * search of the whole map per point (O(N^2), once, at load time : the
+ * maps with positions should be preferred for the big ones)
+ */
+static int
+iw_graph_by_fingerprint(struct iw_graph *		graph,
+			const struct iw_fpstore *	fps)
+{
+  struct iw_graph_link	links[IW_GRAPH_DEGREE_MAX];
+  struct iw_fpblock	fpb;
+  struct iw_knn		knn;
+  int			i;
+
+  if(iw_fpblock_from_store(&fpb, fps) < 0)
+    return(-1);
+  /* Room for the points at the same place, and for the point itself */
+  iw_knn_init(&knn, (2 * graph->degree + 1 < IW_KNN_MAX)
+	      ? 2 * graph->degree + 1 : IW_KNN_MAX);
+  for(i = 0; i < graph->num_points; i++)
+    {
+      int	count = 0;
+      int	same = 0;
+      int	j;
+
+      iw_fpblock_knn(&fpb, iw_fpstore_row(fps, i), &knn);
+      for(j = 0; j < knn.count; j++)
+	if(knn.nb[j].point != i)
+	  iw_graph_offer(links, &count, &same, graph->degree,
+			 knn.nb[j].point, knn.nb[j].dist);
+      for(j = 0; j < graph->degree; j++)
+	graph->links[(size_t) i * graph->degree + j] =
+	  (j < count) ? links[j].point : -1;
+    }
+  iw_fpblock_free(&fpb);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Push a point on the frontier, a heap of the points to explore, the
+ * nearest on top
+ */
+static void
+iw_graph_frontier_push(struct iw_graph *	graph,
+		       int			point,
+		       int32_t			dist)
+{
+  struct iw_neighbour *	heap = graph->frontier;
+  int			i;
+
+  for(i = graph->frontier_len++; i > 0; i = (i - 1) / 2)
+    {
+      if(heap[(i - 1) / 2].dist <= dist)
+	break;
+      heap[i] = heap[(i - 1) / 2];
+    }
+  heap[i].point = point;
+  heap[i].dist = dist;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Pop the nearest point of the frontier
+ */
+static struct iw_neighbour
+iw_graph_frontier_pop(struct iw_graph *	graph)
+{
+  struct iw_neighbour *	heap = graph->frontier;
+  struct iw_neighbour	top = heap[0];
+  struct iw_neighbour	last = heap[--graph->frontier_len];
+  int			n = graph->frontier_len;
+  int			i = 0;
+  int			c;
+
+  while((c = 2 * i + 1) < n)
+    {
+      if((c + 1 < n) && (heap[c + 1].dist < heap[c].dist))
+	c++;
+      if(last.dist <= heap[c].dist)
+	break;
+      heap[i] = heap[c];
+      i = c;
+    }
+  heap[i] = last;
+  return(top);
+}
+
+/****************************** GRAPH ******************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Link the points of a (dense) store to their degree nearest, on the
+ * floor if by_position (the store has the positions), else by
+ * fingerprint.
+ * Return 0, or -1.
+ */
+int
+iw_graph_build(struct iw_graph *		graph,
+	       const struct iw_fpstore *	fps,
+	       int				degree,
+	       int				by_position)
+{
+  int	ret;
+
+  memset(graph, 0, sizeof(*graph));
+  if(fps->rss == NULL)
+    {
+      errno = ENOTSUP;
+      return(-1);
+    }
+  if((degree < 1) || (degree > IW_GRAPH_DEGREE_MAX))
+    {
+      errno = EINVAL;
+      return(-1);
+    }
+  graph->num_points = fps->num_points;
+  graph->degree = degree;
+  if(graph->num_points == 0)
+    return(0);
+  graph->links = malloc((size_t) graph->num_points * degree * sizeof(int));
+  graph->seen = calloc(graph->num_points, sizeof(uint32_t));
+  graph->frontier = malloc(graph->num_points * sizeof(struct iw_neighbour));
+  if((graph->links == NULL) || (graph->seen == NULL)
+     || (graph->frontier == NULL))
+    {
+      iw_graph_free(graph);
+      errno = ENOMEM;
+      return(-1);
+    }
+  if(by_position && (fps->x != NULL) && (fps->y != NULL))
+    ret = iw_graph_by_position(graph, fps);
+  else
+    ret = iw_graph_by_fingerprint(graph, fps);
+  if(ret < 0)
+    {
+      ret = errno;
+      iw_graph_free(graph);
+      errno = ret;
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * k nearest points to a query, searched from the point seed outward,
+ * sorted (see iw_knn_sort()), with the distances of
+ * iw_fpblock_knn_masked(). The points of fps added after the build (the
+ * tail) are all measured. The search keeps its marks in the graph, one
+ * search at a time. The number of points measured goes in visited.
+ * Return the number found, 0 if the query heard none of the routers or
+ * seed is not in the graph.
+ */
+int
+iw_graph_knn(struct iw_graph *		graph,
+	     const struct iw_fpstore *	fps,
+	     const int8_t *		query,
+	     int			penalty,
+	     int			seed,
+	     struct iw_knn *		knn,
+	     int *			visited)
+{
+  struct iw_knn	best;
+  int		n = fps->num_routers;
+  int		heard = 0;
+  int		measured = 1;
+  int32_t	dist;
+  int		i;
+  int		r;
+
+  knn->count = 0;
+  knn->visited = 0;
+  *visited = 0;
+  if(penalty < 0)
+    penalty = 0;
+  if(penalty > IW_KNN_PENALTY_MAX)
+    penalty = IW_KNN_PENALTY_MAX;
+  for(r = 0; r < n; r++)
+    heard += (query[r] != 0);
+  if((heard == 0) || (seed < 0) || (seed >= graph->num_points))
+    return(0);
+
+  /* A new mark for this search, clear them all once in 2^32 */
+  if(++graph->search == 0)
+    {
+      memset(graph->seen, 0, graph->num_points * sizeof(uint32_t));
+      graph->search = 1;
+    }
+  iw_knn_init(&best, (knn->k > IW_GRAPH_EF) ? knn->k : IW_GRAPH_EF);
+  graph->frontier_len = 0;
+
+  graph->seen[seed] = graph->search;
+  dist = iw_dist_masked(iw_fpstore_row(fps, seed), query, n, penalty);
+  iw_knn_push(&best, seed, dist);
+  iw_graph_frontier_push(graph, seed, dist);
+  while(graph->frontier_len > 0)
+    {
+      struct iw_neighbour	nb = iw_graph_frontier_pop(graph);
+      const int *		links = graph->links + (size_t) nb.point * graph->degree;
+      int			l;
+
+      /* Nothing left to explore can make it */
+      if((best.count == best.k) && (nb.dist > best.nb[0].dist))
+	break;
+      for(l = 0; (l < graph->degree) && (links[l] >= 0); l++)
+	{
+	  int	p = links[l];
+
+	  if(graph->seen[p] == graph->search)
+	    continue;
+	  graph->seen[p] = graph->search;
+	  dist = iw_dist_masked(iw_fpstore_row(fps, p), query, n, penalty);
+	  measured++;
+	  if((best.count < best.k) || (dist <= best.nb[0].dist))
+	    {
+	      iw_knn_push(&best, p, dist);
+	      iw_graph_frontier_push(graph, p, dist);
+	    }
+	}
+    }
+
+  /* The tail, by brute force */
+  for(i = graph->num_points; i < fps->num_points; i++)
+    {
+      dist = iw_dist_masked(iw_fpstore_row(fps, i), query, n, penalty);
+      if((best.count < best.k) || (dist <= best.nb[0].dist))
+	iw_knn_push(&best, i, dist);
+      measured++;
+    }
+
+  iw_knn_sort(&best);
+  knn->count = (best.count < knn->k) ? best.count : knn->k;
+  for(i = 0; i < knn->count; i++)
+    {
+      knn->nb[i] = best.nb[i];
+      /* Scaled to all the routers, as the search of the whole map */
+      if(heard < n)
+	knn->nb[i].dist = iw_dist_scale(best.nb[i].dist, n, heard);
+    }
+  knn->visited = (double) measured / fps->num_points;
+  *visited = measured;
+  return(knn->count);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release a graph
+ */
+void
+iw_graph_free(struct iw_graph *	graph)
+{
+  free(graph->links);
+  free(graph->seen);
+  free(graph->frontier);
+  memset(graph, 0, sizeof(*graph));
+}
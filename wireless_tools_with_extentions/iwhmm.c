@@ -0,0 +1,506 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Hidden Markov tracker : the states are the points of the map, and
+ * between two scans the tracker stays where it is or goes to one of
+ * the points within a walk of it on the floor (or, for the maps without
+ * positions, linked to it in the neighbourhood graph, see iwgraph.c).
+ * A fix can then only jump across the floor if the scans keep saying
+ * so, where the fixes of the scans taken one by one go anywhere the
+ * diff is the least.
+ *
+ * The transitions are a sparse matrix, one row per state (CSR), and the
+ * forward filter only follows the states still likely (the beam) : an
+ * update costs the transitions out of those, and the diffs of the
+ * states they reach, not N x N. The whole map is only measured when
+ * the tracker is lost : at the start, and when none of the states of
+ * the beam is within the threshold of the scan.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+
+/**************************** SUBROUTINES ****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Compare two states, for the sort of the rows
+ */
+static int
+iw_hmm_cmp(const void *	a,
+	   const void *	b)
+{
+  return(*(const int *) a - *(const int *) b);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Room for the rows and the probabilities of n states (the transitions
+ * are the caller's)
+ */
+static int
+iw_hmm_alloc(struct iw_hmm *	hmm,
+	     int		n)
+{
+  hmm->num_states = n;
+  hmm->rowptr = calloc(n + 1, sizeof(int));
+  hmm->alpha = malloc(n * sizeof(float));
+  hmm->next = malloc(n * sizeof(float));
+  hmm->dist = malloc(n * sizeof(float));
+  hmm->active = malloc(n * sizeof(int));
+  hmm->next_active = malloc(n * sizeof(int));
+  hmm->seen = calloc(n, sizeof(uint32_t));
+  if((hmm->rowptr == NULL) || (hmm->alpha == NULL) || (hmm->next == NULL) || (hmm->dist == NULL)
+     || (hmm->active == NULL) || (hmm->next_active == NULL)
+     || (hmm->seen == NULL))
+    {
+      iw_hmm_free(hmm);
+      errno = ENOMEM;
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Probabilities of the transitions, once the rows are filled : a state
+ * keeps IW_HMM_STAY of its probability, the rest goes evenly to the
+ * others of its row
+ */
+static void
+iw_hmm_probs(struct iw_hmm *	hmm)
+{
+  int	i;
+  int	j;
+
+  for(i = 0; i < hmm->num_states; i++)
+    {
+      int	len = hmm->rowptr[i + 1] - hmm->rowptr[i];
+
+      for(j = hmm->rowptr[i]; j < hmm->rowptr[i + 1]; j++)
+	hmm->probs[j] = ((len == 1) ? 1.0f
+			 : (hmm->cols[j] == i) ? IW_HMM_STAY
+			 : (1.0f - IW_HMM_STAY) / (len - 1));
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Every state as likely, to be measured (lost)
+ */
+static void
+iw_hmm_spread(struct iw_hmm *	hmm)
+{
+  int	i;
+
+  for(i = 0; i < hmm->num_states; i++)
+    {
+      hmm->seen[i] = hmm->scan;
+      hmm->next[i] = 1.0f / hmm->num_states;
+      hmm->next_active[i] = i;
+    }
+  hmm->num_next = hmm->num_states;
+}
+
+/****************************** TRACKER ******************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Tracker over the points of a (dense) store with positions : from a
+ * point, the tracker may go to any point within reach map units (the
+ * most it walks between two scans). The points are sorted into a grid
+ * of cells of at least reach, so that those within reach of a point are
+ * in the 9 cells around it, and are gathered in two passes, one to
+ * count them, one to fill the rows.
+ * Return 0, or -1.
+ */
+int
+iw_hmm_build(struct iw_hmm *		hmm,
+	     const struct iw_fpstore *	fps,
+	     double			reach)
+{
+  int		n = fps->num_points;
+  double	minx;
+  double	maxx;
+  double	miny;
+  double	maxy;
+  double	cell;
+  int		cols;
+  int		rows;
+  int *		start;
+  int *		order;
+  int *		where;
+  int		pass;
+  int		i;
+  int		c;
+
+  memset(hmm, 0, sizeof(*hmm));
+  if((fps->rss == NULL) || (fps->x == NULL) || (fps->y == NULL))
+    {
+      errno = ENOTSUP;
+      return(-1);
+    }
+  if((n == 0) || !(reach > 0))
+    {
+      errno = EINVAL;
+      return(-1);
+    }
+  minx = maxx = fps->x[0];
+  miny = maxy = fps->y[0];
+  for(i = 1; i < n; i++)
+    {
+      minx = fmin(minx, fps->x[i]);
+      maxx = fmax(maxx, fps->x[i]);
+      miny = fmin(miny, fps->y[i]);
+      maxy = fmax(maxy, fps->y[i]);
+    }
+  /* No more cells than points, on a big floor */
+  cell = fmax(reach, sqrt((maxx - minx) * (maxy - miny) / n));
+  cols = (int) ((maxx - minx) / cell) + 1;
+  rows = (int) ((maxy - miny) / cell) + 1;
+
+  start = calloc((size_t) cols * rows + 1, sizeof(int));
+  order = malloc(n * sizeof(int));
+  where = malloc(n * sizeof(int));
+  if((start == NULL) || (order == NULL) || (where == NULL)
+     || (iw_hmm_alloc(hmm, n) < 0))
+    {
+      free(start);
+      free(order);
+      free(where);
+      errno = ENOMEM;
+      return(-1);
+    }
+
+  /* Counting sort of the points by cell */
+  for(i = 0; i < n; i++)
+    {
+      where[i] = ((int) ((fps->y[i] - miny) / cell) * cols
+		  + (int) ((fps->x[i] - minx) / cell));
+      start[where[i] + 1]++;
+    }
+  for(c = 0; c < cols * rows; c++)
+    start[c + 1] += start[c];
+  for(i = 0; i < n; i++)
+    order[start[where[i]]++] = i;
+  for(c = cols * rows; c > 0; c--)
+    start[c] = start[c - 1];
+  start[0] = 0;
+
+  /* Count the rows, then fill them */
+  for(pass = 0; pass < 2; pass++)
+    {
+      hmm->nnz = 0;
+      for(i = 0; i < n; i++)
+	{
+	  int	cx = where[i] % cols;
+	  int	cy = where[i] / cols;
+	  int	x;
+	  int	y;
+
+	  hmm->rowptr[i] = hmm->nnz;
+	  for(y = cy - 1; y <= cy + 1; y++)
+	    for(x = cx - 1; x <= cx + 1; x++)
+	      {
+		int	j;
+
+		if((x < 0) || (x >= cols) || (y < 0) || (y >= rows))
+		  continue;
+		c = y * cols + x;
+		for(j = start[c]; j < start[c + 1]; j++)
+		  {
+		    int		p = order[j];
+		    double	dx = fps->x[p] - fps->x[i];
+		    double	dy = fps->y[p] - fps->y[i];
+
+		    if((p != i) && (dx * dx + dy * dy > reach * reach))
+		      continue;
+		    if(pass)
+		      hmm->cols[hmm->nnz] = p;
+		    hmm->nnz++;
+		  }
+	      }
+	}
+      hmm->rowptr[n] = hmm->nnz;
+      if(pass == 0)
+	{
+	  hmm->cols = malloc((size_t) hmm->nnz * sizeof(int));
+	  hmm->probs = malloc((size_t) hmm->nnz * sizeof(float));
+	  if((hmm->cols == NULL) || (hmm->probs == NULL))
+	    break;
+	}
+    }
+  free(start);
+  free(order);
+  free(where);
+  if((hmm->cols == NULL) || (hmm->probs == NULL))
+    {
+      iw_hmm_free(hmm);
+      errno = ENOMEM;
+      return(-1);
+    }
+  iw_hmm_probs(hmm);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Tracker over the points of a neighbourhood graph, for the maps
+ * without positions (see iwgraph.c) : from a point, the tracker may go
+ * to the points linked to it, either way (the links of the graph are
+ * those of each point to its nearest, they are made both ways here).
+ * Return 0, or -1.
+ */
+int
+iw_hmm_build_graph(struct iw_hmm *		hmm,
+		   const struct iw_graph *	graph)
+{
+  int	n = graph->num_points;
+  int	i;
+  int	l;
+
+  memset(hmm, 0, sizeof(*hmm));
+  if(n == 0)
+    {
+      errno = EINVAL;
+      return(-1);
+    }
+  if(iw_hmm_alloc(hmm, n) < 0)
+    return(-1);
+  /* Each link both ways, and the state itself */
+  hmm->cols = malloc(((size_t) 2 * graph->degree + 1) * n * sizeof(int));
+  hmm->probs = malloc(((size_t) 2 * graph->degree + 1) * n * sizeof(float));
+  if((hmm->cols == NULL) || (hmm->probs == NULL))
+    {
+      iw_hmm_free(hmm);
+      errno = ENOMEM;
+      return(-1);
+    }
+
+  /* Rows as long as the links into and out of each state */
+  for(i = 0; i < n; i++)
+    {
+      const int *	links = graph->links + (size_t) i * graph->degree;
+
+      hmm->rowptr[i + 1]++;
+      for(l = 0; (l < graph->degree) && (links[l] >= 0); l++)
+	{
+	  hmm->rowptr[i + 1]++;
+	  hmm->rowptr[links[l] + 1]++;
+	}
+    }
+  for(i = 0; i < n; i++)
+    hmm->rowptr[i + 1] += hmm->rowptr[i];
+  /* Fill them, the ends of the rows in next_active meanwhile */
+  memcpy(hmm->next_active, hmm->rowptr, n * sizeof(int));
+  for(i = 0; i < n; i++)
+    {
+      const int *	links = graph->links + (size_t) i * graph->degree;
+
+      hmm->cols[hmm->next_active[i]++] = i;
+      for(l = 0; (l < graph->degree) && (links[l] >= 0); l++)
+	{
+	  hmm->cols[hmm->next_active[i]++] = links[l];
+	  hmm->cols[hmm->next_active[links[l]]++] = i;
+	}
+    }
+  /* Without the links made twice */
+  hmm->nnz = 0;
+  for(i = 0; i < n; i++)
+    {
+      int	first = hmm->nnz;
+      int	j;
+
+      qsort(hmm->cols + hmm->rowptr[i], hmm->rowptr[i + 1] - hmm->rowptr[i],
+	    sizeof(int), iw_hmm_cmp);
+      for(j = hmm->rowptr[i]; j < hmm->rowptr[i + 1]; j++)
+	if((hmm->nnz == first) || (hmm->cols[hmm->nnz - 1] != hmm->cols[j]))
+	  hmm->cols[hmm->nnz++] = hmm->cols[j];
+      hmm->rowptr[i] = first;
+    }
+  hmm->rowptr[n] = hmm->nnz;
+  iw_hmm_probs(hmm);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Carry the beam of a tracker over to the one built again for the map
+ * with its learnt points (appended, the states of old are the same in
+ * hmm), so that the tracker isn't lost for it.
+ */
+void
+iw_hmm_resume(struct iw_hmm *		hmm,
+	      const struct iw_hmm *	old)
+{
+  int	i;
+
+  hmm->num_active = 0;
+  for(i = 0; i < old->num_active; i++)
+    {
+      int	s = old->active[i];
+
+      if(s >= hmm->num_states)
+	continue;
+      hmm->alpha[s] = old->alpha[s];
+      hmm->active[hmm->num_active++] = s;
+    }
+  hmm->lost = old->lost;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * One scan : the probability of the states of the beam goes along the
+ * transitions, each state reached is weighted by a normal law of sigma
+ * dB per router on its diff to the scan (iw_fpblock_knn_masked()), and
+ * the states below IW_HMM_BEAM of the best are dropped. If the best
+ * state reached is more than threshold dB per router away from the
+ * scan (RMS), the tracker is lost and every state is measured again.
+ * Return the most likely state, or -1 if the scan heard none of the
+ * routers (nothing changes).
+ */
+int
+iw_hmm_update(struct iw_hmm *			hmm,
+	      const struct iw_fpstore *		fps,
+	      const int8_t *			query,
+	      int				penalty,
+	      double				sigma,
+	      int				threshold)
+{
+  float		scale = (float) (1.0 / (2.0 * sigma * sigma));
+  float		limit = (float) fps->num_routers * threshold * threshold;
+  float		best;
+  float		sum;
+  float		top;
+  float *	swap;
+  int		n = fps->num_routers;
+  int		heard = 0;
+  int		state = -1;
+  int		i;
+  int		r;
+
+  if(penalty < 0)
+    penalty = 0;
+  if(penalty > IW_KNN_PENALTY_MAX)
+    penalty = IW_KNN_PENALTY_MAX;
+  for(r = 0; r < n; r++)
+    heard += (query[r] != 0);
+  if(heard == 0)
+    return(-1);
+
+  /* A new mark for this scan, clear them all once in 2^32 */
+  if(++hmm->scan == 0)
+    {
+      memset(hmm->seen, 0, hmm->num_states * sizeof(uint32_t));
+      hmm->scan = 1;
+    }
+
+  /* Prediction, along the transitions out of the beam */
+  hmm->num_next = 0;
+  for(i = 0; i < hmm->num_active; i++)
+    {
+      int	s = hmm->active[i];
+      float	a = hmm->alpha[s];
+      int	j;
+
+      for(j = hmm->rowptr[s]; j < hmm->rowptr[s + 1]; j++)
+	{
+	  int	t = hmm->cols[j];
+
+	  if(hmm->seen[t] != hmm->scan)
+	    {
+	      hmm->seen[t] = hmm->scan;
+	      hmm->next[t] = 0;
+	      hmm->next_active[hmm->num_next++] = t;
+	    }
+	  hmm->next[t] += a * hmm->probs[j];
+	}
+    }
+  if(hmm->num_next == 0)
+    iw_hmm_spread(hmm);
+
+  /* The diffs of the states reached, scaled to all the routers */
+  for(;;)
+    {
+      best = INFINITY;
+      for(i = 0; i < hmm->num_next; i++)
+	{
+	  int	t = hmm->next_active[i];
+
+	  hmm->dist[t] = ((float) iw_dist_masked(iw_fpstore_row(fps, t), query,
+						 n, penalty) * n / heard);
+	  best = fminf(best, hmm->dist[t]);
+	}
+      if((best <= limit) || (hmm->num_next == hmm->num_states))
+	break;
+      /* Nowhere near, lost */
+      iw_hmm_spread(hmm);
+      hmm->lost++;
+    }
+
+  /* Update, relative to the best state so that one at least is 1 */
+  sum = 0;
+  top = 0;
+  for(i = 0; i < hmm->num_next; i++)
+    {
+      int	t = hmm->next_active[i];
+
+      hmm->next[t] *= expf((best - hmm->dist[t]) * scale);
+      sum += hmm->next[t];
+      if(hmm->next[t] > top)
+	{
+	  top = hmm->next[t];
+	  state = t;
+	}
+    }
+  if(!(sum > 0))
+    {
+      /* Underflow of all of them : the best state alone */
+      for(i = 0; i < hmm->num_next; i++)
+	if(hmm->dist[hmm->next_active[i]] == best)
+	  break;
+      state = hmm->next_active[i];
+      hmm->next[state] = sum = top = 1.0f;
+    }
+
+  /* The beam, in place of the last one */
+  hmm->num_active = 0;
+  for(i = 0; i < hmm->num_next; i++)
+    {
+      int	t = hmm->next_active[i];
+
+      if(hmm->next[t] >= top * IW_HMM_BEAM)
+	{
+	  hmm->next[t] /= sum;
+	  hmm->active[hmm->num_active++] = t;
+	}
+      else
+	hmm->next[t] = 0;
+    }
+  swap = hmm->alpha;
+  hmm->alpha = hmm->next;
+  hmm->next = swap;
+  return(state);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release a tracker
+ */
+void
+iw_hmm_free(struct iw_hmm *	hmm)
+{
+  free(hmm->rowptr);
+  free(hmm->cols);
+  free(hmm->probs);
+  free(hmm->alpha);
+  free(hmm->next);
+  free(hmm->dist);
+  free(hmm->active);
+  free(hmm->next_active);
+  free(hmm->seen);
+  memset(hmm, 0, sizeof(*hmm));
+}
@@ -0,0 +1,422 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Vantage point tree : exact index of the fingerprints of a radio map,
+ * built once when the map is loaded. A search only measures the points
+ * of the subtrees that may hold a neighbour, the others are ruled out
+ * by the triangle inequality.
+ *
+ * Fingerprints are points of a space of up to MAX_ROUTERS dimensions,
+ * but they are taken at positions on a floor, and the levels follow the
+ * distance to the routers : the maps are of low intrinsic dimension,
+ * which is what the tree relies on. Leaves are blocks of the distance
+ * kernels, so the last level is searched with the vector units.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Slack on the bounds of the pruning : the bounds are square roots, in
+ * double, and a neighbour must never be ruled out by a rounding */
+#define IW_VP_EPS		1e-6
+
+/****************************** TYPES ******************************/
+
+/*
+ * A point to index, and its squared distance to the vantage point
+ */
+struct iw_vpitem
+{
+  int		point;
+  int32_t	d2;
+};
+
+/***************************** BUILDING *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Squared distance between two fingerprints
+ */
+static int32_t
+iw_vp_dist2(const int8_t *	a,
+	    const int8_t *	b,
+	    int			num_routers)
+{
+  int32_t	sum = 0;
+  int		r;
+
+  for(r = 0; r < num_routers; r++)
+    sum += (a[r] - b[r]) * (a[r] - b[r]);
+  return(sum);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Get a new node, with room for its vantage fingerprint
+ */
+static int
+iw_vptree_node(struct iw_vptree *	tree)
+{
+  if(tree->num_nodes == tree->max_nodes)
+    {
+      int			max_nodes = tree->max_nodes ? 2 * tree->max_nodes : 64;
+      struct iw_vpnode *	nodes;
+      int8_t *			vrows;
+
+      nodes = realloc(tree->nodes, max_nodes * sizeof(*nodes));
+      if(nodes == NULL)
+	{
+	  errno = ENOMEM;
+	  return(-1);
+	}
+      tree->nodes = nodes;
+      vrows = realloc(tree->vrows, (size_t) max_nodes * tree->num_routers);
+      if((vrows == NULL) && (tree->num_routers > 0))
+	{
+	  errno = ENOMEM;
+	  return(-1);
+	}
+      tree->vrows = vrows;
+      tree->max_nodes = max_nodes;
+    }
+  return(tree->num_nodes++);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Put a point (or padding, point -1) in the next slot of the leaves
+ */
+static int
+iw_vptree_slot(struct iw_vptree *	tree,
+	       int			point,
+	       const int8_t *		row)
+{
+  static const int8_t	none[MAX_ROUTERS];
+  int			slot = tree->leaves.num_points;
+
+  if((slot % 64) == 0)
+    {
+      int *	perm = realloc(tree->perm, (slot + 64) * sizeof(int));
+
+      if(perm == NULL)
+	{
+	  errno = ENOMEM;
+	  return(-1);
+	}
+      tree->perm = perm;
+    }
+  if(iw_fpblock_add(&tree->leaves, (point < 0) ? none : row) < 0)
+    return(-1);
+  tree->perm[slot] = point;
+  return(slot);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Put the k nearest items first (quickselect on the distance)
+ */
+static void
+iw_vp_select(struct iw_vpitem *	items,
+	     int		n,
+	     int		k)
+{
+  int	lo = 0;
+  int	hi = n - 1;
+
+  while(lo < hi)
+    {
+      int32_t		pivot = items[(lo + hi) / 2].d2;
+      int		i = lo;
+      int		j = hi;
+
+      while(i <= j)
+	{
+	  while(items[i].d2 < pivot)
+	    i++;
+	  while(items[j].d2 > pivot)
+	    j--;
+	  if(i <= j)
+	    {
+	      struct iw_vpitem	t = items[i];
+
+	      items[i++] = items[j];
+	      items[j--] = t;
+	    }
+	}
+      if(k <= j)
+	hi = j;
+      else if(k >= i)
+	lo = i;
+      else
+	break;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Build the subtree of n items. Return its node, or -1.
+ */
+static int
+iw_vptree_split(struct iw_vptree *		tree,
+		const struct iw_fpstore *	fps,
+		struct iw_vpitem *		items,
+		int				n,
+		unsigned int *			seed)
+{
+  struct iw_vpnode *	node;
+  const int8_t *	vrow;
+  struct iw_vpitem	t;
+  int			index;
+  int			inner;
+  int			child[2];
+  int			c;
+  int			i;
+
+  index = iw_vptree_node(tree);
+  if(index < 0)
+    return(-1);
+
+  if(n <= IWMAP_BLOCK)
+    {
+      /* Leaf, one block of its own */
+      node = &tree->nodes[index];
+      node->point = -1;
+      node->child[0] = tree->leaves.num_points / IWMAP_BLOCK;
+      node->child[1] = n;
+      for(i = 0; i < IWMAP_BLOCK; i++)
+	if(iw_vptree_slot(tree, (i < n) ? items[i].point : -1,
+			  (i < n) ? iw_fpstore_row(fps, items[i].point) : NULL)
+	   < 0)
+	  return(-1);
+      return(index);
+    }
+
+  /* Any point will do as the vantage point */
+  *seed = *seed * 1103515245 + 12345;
+  c = (*seed >> 8) % n;
+  t = items[0];
+  items[0] = items[c];
+  items[c] = t;
+  vrow = iw_fpstore_row(fps, items[0].point);
+  memcpy(tree->vrows + (size_t) index * tree->num_routers, vrow,
+	 tree->num_routers);
+  for(i = 1; i < n; i++)
+    items[i].d2 = iw_vp_dist2(vrow, iw_fpstore_row(fps, items[i].point),
+			      tree->num_routers);
+
+  /* The nearer half, and the rest */
+  inner = (n - 1) / 2;
+  iw_vp_select(items + 1, n - 1, inner);
+  node = &tree->nodes[index];
+  node->point = items[0].point;
+  for(c = 0; c < 2; c++)
+    {
+      int	first = c ? 1 + inner : 1;
+      int	last = c ? n : 1 + inner;
+      int32_t	lo = INT32_MAX;
+      int32_t	hi = 0;
+
+      for(i = first; i < last; i++)
+	{
+	  if(items[i].d2 < lo)
+	    lo = items[i].d2;
+	  if(items[i].d2 > hi)
+	    hi = items[i].d2;
+	}
+      node->lo[c] = sqrt((double) lo);
+      node->hi[c] = sqrt((double) hi);
+    }
+
+  /* The nodes may move while the children are built */
+  child[0] = iw_vptree_split(tree, fps, items + 1, inner, seed);
+  if(child[0] < 0)
+    return(-1);
+  child[1] = iw_vptree_split(tree, fps, items + 1 + inner, n - 1 - inner, seed);
+  if(child[1] < 0)
+    return(-1);
+  tree->nodes[index].child[0] = child[0];
+  tree->nodes[index].child[1] = child[1];
+  return(index);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Build the tree of the points of a (dense) store
+ */
+int
+iw_vptree_build(struct iw_vptree *		tree,
+		const struct iw_fpstore *	fps)
+{
+  struct iw_vpitem *	items;
+  unsigned int		seed = 1;
+  int			err;
+  int			i;
+
+  memset(tree, 0, sizeof(*tree));
+  tree->num_routers = fps->num_routers;
+  iw_fpblock_init(&tree->leaves, fps->num_routers);
+  if(fps->num_points == 0)
+    return(0);
+
+  items = malloc(fps->num_points * sizeof(*items));
+  if(items == NULL)
+    {
+      errno = ENOMEM;
+      return(-1);
+    }
+  for(i = 0; i < fps->num_points; i++)
+    items[i].point = i;
+  err = iw_vptree_split(tree, fps, items, fps->num_points, &seed);
+  free(items);
+  if(err < 0)
+    {
+      err = errno;
+      iw_vptree_free(tree);
+      errno = err;
+      return(-1);
+    }
+  tree->num_points = fps->num_points;
+  tree->tail = tree->leaves.num_points;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Add a point after the build, it goes to the tail
+ */
+int
+iw_vptree_add(struct iw_vptree *	tree,
+	      const int8_t *		row)
+{
+  if(iw_vptree_slot(tree, tree->num_points, row) < 0)
+    return(-1);
+  return(tree->num_points++);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release a tree
+ */
+void
+iw_vptree_free(struct iw_vptree *	tree)
+{
+  free(tree->nodes);
+  free(tree->vrows);
+  free(tree->perm);
+  iw_fpblock_free(&tree->leaves);
+  memset(tree, 0, sizeof(*tree));
+}
+
+/***************************** SEARCH *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Offer the points of some slots of the leaves
+ */
+static int
+iw_vptree_scan(const struct iw_vptree *	tree,
+	       const int32_t *		qpairs,
+	       int			first,
+	       int			last,
+	       struct iw_knn *		knn)
+{
+  int32_t	dist[IWMAP_BLOCK];
+  int		visited = 0;
+  int		b;
+  int		i;
+
+  for(b = first / IWMAP_BLOCK; b * IWMAP_BLOCK < last; b++)
+    {
+      iw_fpblock_dist_blocks(&tree->leaves, qpairs, b, 1, dist);
+      for(i = 0; i < IWMAP_BLOCK; i++)
+	{
+	  int	slot = b * IWMAP_BLOCK + i;
+	  int	point;
+
+	  if((slot < first) || (slot >= last))
+	    continue;
+	  point = tree->perm[slot];
+	  if(point < 0)
+	    continue;
+	  visited++;
+	  if((knn->count < knn->k) || (dist[i] <= knn->nb[0].dist))
+	    iw_knn_push(knn, point, dist[i]);
+	}
+    }
+  return(visited);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Search a subtree, the nearer child first
+ */
+static int
+iw_vptree_search(const struct iw_vptree *	tree,
+		 int				index,
+		 const int8_t *			query,
+		 const int32_t *		qpairs,
+		 struct iw_knn *		knn)
+{
+  const struct iw_vpnode *	node = &tree->nodes[index];
+  int32_t			d2;
+  double			dq;
+  int				visited = 1;
+  int				first;
+  int				j;
+
+  if(node->point < 0)
+    return(iw_vptree_scan(tree, qpairs, node->child[0] * IWMAP_BLOCK,
+			  node->child[0] * IWMAP_BLOCK + node->child[1], knn));
+
+  d2 = iw_vp_dist2(query, tree->vrows + (size_t) index * tree->num_routers,
+		   tree->num_routers);
+  iw_knn_push(knn, node->point, d2);
+  dq = sqrt((double) d2);
+
+  first = (dq - node->hi[0] > node->lo[1] - dq);
+  for(j = 0; j < 2; j++)
+    {
+      int	c = first ^ j;
+      double	bound = fmax(node->lo[c] - dq, dq - node->hi[c]);
+
+      /* Can't beat the worst neighbour (ties too, they can win) */
+      if((knn->count == knn->k)
+	 && (bound > sqrt((double) knn->nb[0].dist) + IW_VP_EPS))
+	continue;
+      visited += iw_vptree_search(tree, node->child[c], query, qpairs, knn);
+    }
+  return(visited);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * k nearest points to the query, sorted (see iw_knn_sort()), exactly
+ * those of a brute force search. visited (if not NULL) gets the number
+ * of points measured.
+ * Return the number found.
+ */
+int
+iw_vptree_knn(const struct iw_vptree *	tree,
+	      const int8_t *		query,
+	      struct iw_knn *		knn,
+	      int *			visited)
+{
+  int32_t	qpairs[IWMAP_QPAIRS];
+  int		count = 0;
+
+  knn->count = 0;
+  iw_fpblock_query(&tree->leaves, query, qpairs);
+  if(tree->num_nodes > 0)
+    count = iw_vptree_search(tree, 0, query, qpairs, knn);
+  count += iw_vptree_scan(tree, qpairs, tree->tail, tree->leaves.num_points,
+			  knn);
+  iw_knn_sort(knn);
+  if(visited != NULL)
+    *visited = count;
+  return(knn->count);
+}
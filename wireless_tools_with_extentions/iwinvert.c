@@ -0,0 +1,267 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Inverted index of the strongest routers of the points of a radio map.
+ * The few routers a scan hears the loudest are a very selective key :
+ * only the points where those routers are among the loudest too can be
+ * the one the scan was taken at. Each point is posted under its
+ * IW_INV_DEPTH strongest routers, by rank bucket (the strongest, then
+ * the next two, then the next three), and a query looks up its own
+ * IW_INV_KEYS strongest routers in their bucket and the buckets next to
+ * it, as levels swap places between scans.
+ *
+ * Points get a vote per key they share, those with enough votes are the
+ * candidates, measured exactly. It is approximate : the point of the
+ * scan may not have enough votes (see iwlocbench -a for the recall
+ * against the size of the candidates).
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Posting list of a router in a rank bucket */
+#define IW_INV_LIST(inv, r, b)	((r) * IW_INV_BUCKETS + (b))
+
+/**************************** VARIABLES *****************************/
+
+/* Bucket of each rank, the strongest router alone */
+static const int	iw_inv_bucket[IW_INV_DEPTH] = { 0, 1, 1, 2, 2, 2 };
+
+/***************************** BUILDING *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * The strongest routers heard in a fingerprint, the loudest first (ties
+ * by router). Return how many, up to max.
+ */
+static int
+iw_inv_strongest(const int8_t *	row,
+		 int		num_routers,
+		 int		max,
+		 int *		top)
+{
+  int	n = 0;
+  int	r;
+  int	i;
+
+  for(r = 0; r < num_routers; r++)
+    {
+      if(row[r] == 0)
+	continue;
+      /* Insertion into the few kept so far */
+      for(i = n; (i > 0) && (row[top[i - 1]] < row[r]); i--)
+	if(i < max)
+	  top[i] = top[i - 1];
+      if(i < max)
+	{
+	  top[i] = r;
+	  if(n < max)
+	    n++;
+	}
+    }
+  return(n);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Index the points of a (dense) store
+ */
+int
+iw_inv_build(struct iw_invert *		inv,
+	     const struct iw_fpstore *	fps)
+{
+  int	num_lists = fps->num_routers * IW_INV_BUCKETS;
+  int	top[IW_INV_DEPTH];
+  int	pass;
+  int	i;
+  int	j;
+
+  memset(inv, 0, sizeof(*inv));
+  inv->num_points = fps->num_points;
+  inv->num_routers = fps->num_routers;
+  inv->votes = IW_INV_VOTES_DEFAULT;
+  inv->heads = calloc(num_lists + 1, sizeof(int));
+  inv->postings = malloc(((size_t) fps->num_points * IW_INV_DEPTH + 1)
+			 * sizeof(int));
+  inv->seen = calloc(fps->num_points + 1, sizeof(uint32_t));
+  inv->count = malloc(fps->num_points + 1);
+  inv->cands = malloc((fps->num_points + 1) * sizeof(int));
+  if((inv->heads == NULL) || (inv->postings == NULL) || (inv->seen == NULL)
+     || (inv->count == NULL) || (inv->cands == NULL))
+    {
+      iw_inv_free(inv);
+      errno = ENOMEM;
+      return(-1);
+    }
+
+  /* Count the postings of each list, then fill them in */
+  for(pass = 0; pass < 2; pass++)
+    {
+      for(i = 0; i < fps->num_points; i++)
+	{
+	  int	n = iw_inv_strongest(iw_fpstore_row(fps, i), fps->num_routers,
+				     IW_INV_DEPTH, top);
+
+	  for(j = 0; j < n; j++)
+	    {
+	      int	list = IW_INV_LIST(inv, top[j], iw_inv_bucket[j]);
+
+	      if(pass == 0)
+		inv->heads[list + 1]++;
+	      else
+		inv->postings[inv->heads[list]++] = i;
+	    }
+	}
+      if(pass == 0)
+	for(j = 0; j < num_lists; j++)
+	  inv->heads[j + 1] += inv->heads[j];
+      else
+	{
+	  /* Each head went to the end of its list, the next one's start */
+	  for(j = num_lists; j > 0; j--)
+	    inv->heads[j] = inv->heads[j - 1];
+	  inv->heads[0] = 0;
+	}
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release the index
+ */
+void
+iw_inv_free(struct iw_invert *	inv)
+{
+  free(inv->heads);
+  free(inv->postings);
+  free(inv->seen);
+  free(inv->count);
+  free(inv->cands);
+  memset(inv, 0, sizeof(*inv));
+}
+
+/***************************** SEARCH *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * k nearest points to the query among the candidates, those sharing at
+ * least inv->votes of its keys (fewer if that leaves less than k), and
+ * the points of the store added after the build. The diffs are those of
+ * iw_fpblock_knn_masked(). candidates (if not NULL) gets the number of
+ * points measured.
+ * Return the number found, 0 if the keys match no point.
+ */
+int
+iw_inv_knn(struct iw_invert *		inv,
+	   const struct iw_fpstore *	fps,
+	   const int8_t *		query,
+	   int				penalty,
+	   struct iw_knn *		knn,
+	   int *			candidates)
+{
+  int		top[IW_INV_KEYS];
+  int		n = fps->num_routers;
+  int		num_cands = 0;
+  int		measured = 0;
+  int		heard = 0;
+  int		keys;
+  int		votes;
+  int		i;
+  int		j;
+  int		r;
+
+  knn->count = 0;
+  if(candidates != NULL)
+    *candidates = 0;
+  for(r = 0; r < n; r++)
+    heard += (query[r] != 0);
+  keys = iw_inv_strongest(query, inv->num_routers, IW_INV_KEYS, top);
+  if(keys == 0)
+    return(0);
+
+  /* A new mark for this search, clear them all once in 2^32 */
+  if(++inv->search == 0)
+    {
+      memset(inv->seen, 0, inv->num_points * sizeof(uint32_t));
+      inv->search = 1;
+    }
+
+  /* A vote per key, from its bucket and the ones next to it */
+  for(j = 0; j < keys; j++)
+    {
+      int	b = iw_inv_bucket[j];
+      int	lo = (b > 0) ? b - 1 : 0;
+      int	hi = (b < IW_INV_BUCKETS - 1) ? b + 1 : b;
+
+      for(b = lo; b <= hi; b++)
+	{
+	  int	list = IW_INV_LIST(inv, top[j], b);
+
+	  for(i = inv->heads[list]; i < inv->heads[list + 1]; i++)
+	    {
+	      int	p = inv->postings[i];
+
+	      if(inv->seen[p] != inv->search)
+		{
+		  inv->seen[p] = inv->search;
+		  inv->count[p] = 0;
+		  inv->cands[num_cands++] = p;
+		}
+	      inv->count[p]++;
+	    }
+	}
+    }
+
+  /* As many votes as asked, unless too few points have them */
+  votes = (inv->votes < keys) ? inv->votes : keys;
+  for(; votes >= 1; votes--)
+    {
+      int	kept = 0;
+
+      for(i = 0; i < num_cands; i++)
+	kept += (inv->count[inv->cands[i]] >= votes);
+      if(kept >= knn->k)
+	break;
+    }
+  if(votes < 1)
+    votes = 1;
+
+  for(i = 0; i < num_cands; i++)
+    {
+      int	p = inv->cands[i];
+      int32_t	dist;
+
+      if(inv->count[p] < votes)
+	continue;
+      dist = iw_dist_masked(iw_fpstore_row(fps, p), query, n, penalty);
+      measured++;
+      if((knn->count < knn->k) || (dist <= knn->nb[0].dist))
+	iw_knn_push(knn, p, dist);
+    }
+
+  /* The tail, by brute force */
+  for(i = inv->num_points; i < fps->num_points; i++)
+    {
+      int32_t	dist = iw_dist_masked(iw_fpstore_row(fps, i), query, n,
+				      penalty);
+
+      measured++;
+      if((knn->count < knn->k) || (dist <= knn->nb[0].dist))
+	iw_knn_push(knn, i, dist);
+    }
+
+  iw_knn_sort(knn);
+  /* Scaled to all the routers, as the search of the whole map */
+  if((heard > 0) && (heard < n))
+    for(i = 0; i < knn->count; i++)
+      knn->nb[i].dist = iw_dist_scale(knn->nb[i].dist, n, heard);
+  if(candidates != NULL)
+    *candidates = measured;
+  return(knn->count);
+}
@@ -0,0 +1,444 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Journal of learnt points : "iwlist learn" appends each new point to
+ * the journal of the binary map, a running "iwlist track" picks them up
+ * as they come, and once the journal is big enough it is merged into
+ * the map (compaction).
+ *
+ * Writers and the compaction hold an exclusive flock() on the journal.
+ * The compaction unlinks the journal once merged, so that a reader
+ * only has to drain the old file to its end and move to the new one.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+#include <limits.h>		/* PATH_MAX */
+#include <sys/file.h>		/* flock */
+#include <sys/stat.h>		/* fstat */
+
+/************************* JOURNAL FILES *************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Name of the journal of a map
+ */
+int
+iw_journal_path(const char *	map_path,
+		char *		buf,
+		int		buflen)
+{
+  if(snprintf(buf, buflen, "%s%s", map_path, IWMAP_JOURNAL_SUFFIX) >= buflen)
+    {
+      errno = ENAMETOOLONG;
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append one point to a journal, creating it if needed, with the stats
+ * of its cells if stats is not NULL (one per cell).
+ * The record goes in with a single write, under the journal lock.
+ */
+int
+iw_journal_append(const char *			path,
+		  const struct iwmap_jrec *	rec,
+		  const struct iwmap_jcell *	cells,
+		  const struct iwmap_stat *	stats)
+{
+  char		buf[sizeof(struct iwmap_jrec)
+		    + MAX_ROUTERS * (sizeof(struct iwmap_jcell)
+				     + sizeof(struct iwmap_stat))];
+  size_t	len = sizeof(*rec) + rec->num_cells * sizeof(*cells);
+  struct stat	st;
+  int		fd;
+  int		err;
+
+  if(rec->num_cells > MAX_ROUTERS)
+    {
+      errno = E2BIG;
+      return(-1);
+    }
+  memcpy(buf, rec, sizeof(*rec));
+  ((struct iwmap_jrec *) buf)->magic = IWMAP_JREC_MAGIC;
+  ((struct iwmap_jrec *) buf)->flags = (stats != NULL) ? IWMAP_JREC_F_STATS : 0;
+  memcpy(buf + sizeof(*rec), cells, rec->num_cells * sizeof(*cells));
+  if(stats != NULL)
+    {
+      memcpy(buf + len, stats, rec->num_cells * sizeof(*stats));
+      len += rec->num_cells * sizeof(*stats);
+    }
+
+  while(1)
+    {
+      fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+      if(fd < 0)
+	return(-1);
+      if((flock(fd, LOCK_EX) < 0) || (fstat(fd, &st) < 0))
+	goto fail;
+      if(st.st_nlink > 0)
+	break;
+      /* Compacted while we were waiting for the lock, start again */
+      close(fd);
+    }
+
+  if((write(fd, buf, len) != (ssize_t) len) || (fdatasync(fd) < 0))
+    goto fail;
+  /* Closing releases the lock */
+  close(fd);
+  return(0);
+
+ fail:
+  err = errno;
+  close(fd);
+  errno = err;
+  return(-1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Start reading a journal, which doesn't need to exist yet
+ */
+int
+iw_journal_open(struct iw_journal *	journal,
+		const char *		path)
+{
+  journal->path = strdup(path);
+  journal->fd = -1;
+  journal->pos = 0;
+  if(journal->path == NULL)
+    return(-1);
+  journal->fd = open(path, O_RDONLY);
+  if((journal->fd < 0) && (errno != ENOENT))
+    {
+      free(journal->path);
+      journal->path = NULL;
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Read the next complete record of a journal, and the stats of its
+ * cells into stats if it has them (IWMAP_JREC_F_STATS in rec->flags)
+ * and stats is not NULL.
+ * Return 1 if there is one, 0 if there is nothing new (a record being
+ * written is left for later) and -1 on error.
+ */
+int
+iw_journal_next(struct iw_journal *	journal,
+		struct iwmap_jrec *	rec,
+		struct iwmap_jcell *	cells,
+		struct iwmap_stat *	stats)
+{
+  struct stat	st;
+  ssize_t	len;
+  size_t	clen;
+  size_t	slen;
+  int		gone;
+
+  while(1)
+    {
+      if(journal->fd < 0)
+	{
+	  journal->fd = open(journal->path, O_RDONLY);
+	  if(journal->fd < 0)
+	    return((errno == ENOENT) ? 0 : -1);
+	  journal->pos = 0;
+	}
+
+      /* Once unlinked by the compaction, the file can't change any more,
+       * so check that before reading */
+      if(fstat(journal->fd, &st) < 0)
+	return(-1);
+      gone = (st.st_nlink == 0);
+
+      len = pread(journal->fd, rec, sizeof(*rec), journal->pos);
+      if(len < 0)
+	return(-1);
+      if(len == sizeof(*rec))
+	{
+	  if((rec->magic != IWMAP_JREC_MAGIC) || (rec->num_cells > MAX_ROUTERS))
+	    {
+	      errno = EINVAL;
+	      return(-1);
+	    }
+	  clen = rec->num_cells * sizeof(*cells);
+	  slen = (rec->flags & IWMAP_JREC_F_STATS) ?
+	    rec->num_cells * sizeof(struct iwmap_stat) : 0;
+	  len = pread(journal->fd, cells, clen, journal->pos + sizeof(*rec));
+	  if(len < 0)
+	    return(-1);
+	  /* The stats come last, the record is complete once they are in
+	   * (skipped if the caller has no use for them) */
+	  if(((size_t) len == clen) && (slen > 0))
+	    {
+	      if(stats != NULL)
+		len = pread(journal->fd, stats, slen,
+			    journal->pos + sizeof(*rec) + clen);
+	      else
+		len = st.st_size - (journal->pos + sizeof(*rec) + clen);
+	      if(len < 0)
+		return(-1);
+	      len = ((size_t) len >= slen) ? (ssize_t) clen : 0;
+	    }
+	  if((size_t) len == clen)
+	    {
+	      journal->pos += sizeof(*rec) + clen + slen;
+	      rec->label[IWMAP_LABEL_LEN - 1] = '\0';
+	      return(1);
+	    }
+	}
+
+      if(!gone)
+	return(0);
+      /* Drained (a torn record can only come from a crashed writer),
+       * move to the journal started after the compaction */
+      close(journal->fd);
+      journal->fd = -1;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Stop reading a journal
+ */
+void
+iw_journal_close(struct iw_journal *	journal)
+{
+  if(journal->fd >= 0)
+    close(journal->fd);
+  free(journal->path);
+  journal->path = NULL;
+  journal->fd = -1;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Turn a record into a row of the given routers (0 for the unheard
+ * ones), and its stats into stats_row (0 if it has none). Routers not
+ * seen before are appended to routers (if not NULL) and to the registry.
+ * Return the number of routers added.
+ */
+int
+iw_journal_row(struct iw_bssid_registry *	reg,
+	       struct iwmap_router *		routers,
+	       int *				num_routers,
+	       int				max_routers,
+	       const struct iwmap_jrec *	rec,
+	       const struct iwmap_jcell *	cells,
+	       const struct iwmap_stat *	stats,
+	       int8_t *				row,
+	       struct iwmap_stat *		stats_row)
+{
+  int	added = 0;
+  int	col;
+  int	i;
+
+  /* Only the records learnt with their spreads have stats */
+  if(!(rec->flags & IWMAP_JREC_F_STATS))
+    stats = NULL;
+  memset(row, 0, max_routers * sizeof(int8_t));
+  if(stats_row != NULL)
+    memset(stats_row, 0, max_routers * sizeof(struct iwmap_stat));
+  for(i = 0; i < rec->num_cells; i++)
+    {
+      col = iw_registry_find(reg, cells[i].bssid);
+      if(col < 0)
+	{
+	  if(*num_routers >= max_routers)
+	    {
+	      errno = E2BIG;
+	      return(-1);
+	    }
+	  col = (*num_routers)++;
+	  if(routers != NULL)
+	    {
+	      memset(&routers[col], 0, sizeof(routers[col]));
+	      memcpy(routers[col].bssid, cells[i].bssid, ETH_ALEN);
+	    }
+	  if(iw_registry_add(reg, cells[i].bssid, col) < 0)
+	    return(-1);
+	  added++;
+	}
+      row[col] = cells[i].level;
+      if((stats != NULL) && (stats_row != NULL))
+	stats_row[col] = stats[i];
+    }
+  return(added);
+}
+
+/*************************** COMPACTION ***************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Get a dense store of a map we can add points to
+ */
+static int
+iw_map_dense_store(const struct iwmap *		map,
+		   struct iw_fpstore *		fps)
+{
+  struct iw_fpstore	borrowed;
+  struct iw_fpsparse	sp;
+  int8_t		row[MAX_ROUTERS];
+  uint32_t		k;
+  int			err;
+  int			i;
+
+  /* Dense maps are copied on the first addition */
+  iw_fpstore_from_map(fps, map);
+  if(!fps->sparse)
+    return(0);
+
+  borrowed = *fps;
+  if(iw_fpsparse_from_map(&sp, map) < 0)
+    return(-1);
+  if((iw_fpstore_init(fps, borrowed.num_routers) < 0)
+     || (iw_fpstore_reserve(fps, borrowed.num_points) < 0))
+    {
+      err = errno;
+      iw_fpsparse_free(&sp);
+      errno = err;
+      return(-1);
+    }
+  for(i = 0; i < borrowed.num_points; i++)
+    {
+      memset(row, 0, sizeof(row));
+      for(k = sp.rowptr[i]; k < sp.rowptr[i + 1]; k++)
+	row[sp.cols[k]] = sp.vals[k];
+      iw_fpstore_add(fps, row, borrowed.x[i], borrowed.y[i],
+		     iw_fpstore_label(&borrowed, i));
+    }
+  iw_fpsparse_free(&sp);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Merge the journal of a map into the map, and remove the journal.
+ * The map is created if it doesn't exist yet. The map is replaced
+ * atomically, trackers keep using the version they have mapped.
+ * Return the number of points merged.
+ */
+int
+iw_map_compact(const char *	map_path)
+{
+  char				path[PATH_MAX];
+  struct iwmap			map;
+  struct iwmap			out;
+  struct iw_fpstore		fps;
+  struct iw_bssid_registry	reg;
+  struct iw_journal		journal;
+  struct iwmap_router		routers[MAX_ROUTERS];
+  struct iwmap_jrec		rec;
+  struct iwmap_jcell		cells[MAX_ROUTERS];
+  struct iwmap_stat		stats[MAX_ROUTERS];
+  int8_t			row[MAX_ROUTERS];
+  struct iwmap_stat		stats_row[MAX_ROUTERS];
+  struct stat			st;
+  uint32_t			flags = 0;
+  int				num_routers = 0;
+  int				have_map = 0;
+  int				merged = 0;
+  int				ret = -1;
+  int				err;
+  int				r;
+  int				i;
+
+  if(iw_journal_path(map_path, path, sizeof(path)) < 0)
+    return(-1);
+  journal.path = path;
+  journal.pos = 0;
+  journal.fd = open(path, O_RDWR);
+  if(journal.fd < 0)
+    return((errno == ENOENT) ? 0 : -1);
+  memset(&fps, 0, sizeof(fps));
+  memset(&reg, 0, sizeof(reg));
+  /* Keep the learners out. Another compaction may have beaten us. */
+  if((flock(journal.fd, LOCK_EX) < 0) || (fstat(journal.fd, &st) < 0))
+    goto out;
+  if(st.st_nlink == 0)
+    {
+      ret = 0;
+      goto out;
+    }
+
+  if(iw_registry_init(&reg, MAX_ROUTERS) < 0)
+    goto out;
+  if(iw_map_open(map_path, &map) == 0)
+    {
+      have_map = 1;
+      flags = map.hdr->flags;
+      num_routers = map.hdr->num_routers;
+      if(num_routers > MAX_ROUTERS)
+	{
+	  errno = E2BIG;
+	  goto out;
+	}
+      memcpy(routers, map.routers, num_routers * sizeof(routers[0]));
+      for(i = 0; i < num_routers; i++)
+	if(iw_registry_add(&reg, routers[i].bssid, i) < 0)
+	  goto out;
+      if(iw_map_dense_store(&map, &fps) < 0)
+	goto out;
+    }
+  else if((errno != ENOENT) || (iw_fpstore_init(&fps, 0) < 0))
+    goto out;
+  else
+    /* A new map : its points are those of the journal, which are all
+     * learnt at their position */
+    flags = IWMAP_F_COORDS;
+
+  while((r = iw_journal_next(&journal, &rec, cells, stats)) > 0)
+    {
+      if((iw_journal_row(&reg, routers, &num_routers, MAX_ROUTERS,
+			 &rec, cells, stats, row, stats_row) < 0)
+	 || ((num_routers != fps.num_routers)
+	     && (iw_fpstore_set_routers(&fps, num_routers) < 0))
+	 || (iw_fpstore_add(&fps, row, rec.x, rec.y, rec.label) < 0))
+	goto out;
+      if(rec.flags & IWMAP_JREC_F_STATS)
+	{
+	  if(iw_fpstore_set_stats(&fps, fps.num_points - 1, stats_row) < 0)
+	    goto out;
+	  flags |= IWMAP_F_STATS;
+	}
+      merged++;
+    }
+  if(r < 0)
+    goto out;
+  if(journal.pos < st.st_size)
+    fprintf(stderr, "Radio map journal : dropping a torn record in %s\n",
+	    path);
+
+  if(merged > 0)
+    {
+      if(iw_map_build(&out, &fps, routers, flags) < 0)
+	goto out;
+      r = iw_map_save(&out, map_path);
+      iw_map_close(&out);
+      if(r < 0)
+	goto out;
+    }
+  /* Merged, the next learner starts a new journal */
+  if(unlink(path) < 0)
+    goto out;
+  ret = merged;
+
+ out:
+  err = errno;
+  iw_fpstore_free(&fps);
+  if(have_map)
+    iw_map_close(&map);
+  iw_registry_free(&reg);
+  /* Closing releases the lock */
+  close(journal.fd);
+  errno = err;
+  return(ret);
+}
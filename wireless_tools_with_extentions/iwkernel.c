@@ -0,0 +1,2121 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Distance kernels : squared euclidean distance between a sample and
+ * every point of a radio map, over the blocked fingerprints (struct
+ * iw_fpblock). The kernel is picked at run time among the instruction
+ * sets of the CPU : AVX-512, AVX2, SSE2, or plain C.
+ *
+ * All kernels compute the same sums of integers, exactly, so the result
+ * never depends on the CPU. Levels are int8_t dBm, differences fit in
+ * int16_t, and a pair of squares in int32_t : the sum over MAX_ROUTERS
+ * routers is at most 255 * 255 * 512, no overflow.
+ *
+ * Most sites have a few routers, the same number on every map : the
+ * kNN kernels come unrolled for 4, 8, 16, 32 and 64 routers too, each
+ * SIMD kernel has a table of those, and the search takes the one of the
+ * width of its map. The others get the loop on the pairs.
+ *
+ * The same goes for the scan of the product codes (iwpq.c) : 4 bit codes
+ * index tables of 16 uint8_t, which fit in a vector register, so one
+ * byte shuffle looks up a code for 16 points at once. Sums are uint16_t,
+ * the tables are scaled for that. SSE2 has no byte shuffle (it came with
+ * SSSE3), its entry scans in plain C.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IWK_X86
+#include <immintrin.h>
+#endif
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Blocks per call of the kernel in iw_fpblock_nearest(), the distances
+ * of a chunk stay in L1 while we look for the best one */
+#define IWK_CHUNK		64
+
+/* Bytes of one pair of routers of a block */
+#define IWK_PAIR_LEN		(2 * IWMAP_BLOCK)
+
+/* Router pairs between two looks at the partial distances of a block,
+ * when the search may give it up */
+#define IWK_STEP		2
+
+/* Widths (routers) of the maps that get kernels of their own, unrolled
+ * for their number of pairs : 4, 8, 16, 32 and 64, the common ones.
+ * The pairs of the kernels of the other widths are only known at run
+ * time. */
+#define IWK_WIDTHS		5
+#define IWK_WIDTH_MIN		4
+
+/* Unroll the loop on the pairs when their number is a constant (the
+ * kernels of the widths), and only then : gcc does not unroll at -Os */
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 8))
+#define IWK_UNROLL		_Pragma("GCC unroll 32")
+#else
+#define IWK_UNROLL
+#endif
+
+/* Kernel of one block of a given width, and its kernel of any number
+ * of pairs, both around the same body */
+#define IWK_PART_WIDTH(isa, tgt, width)					\
+__attribute__((target(tgt)))						\
+static int								\
+iw_part_##isa##_##width(const int8_t *	cells,				\
+			int		pairs,				\
+			const int32_t *	qpairs,				\
+			int32_t		bound,				\
+			int32_t *	dist)				\
+{									\
+  (void) pairs;								\
+  return(iw_part_##isa##_body(cells, (width) / 2, qpairs, bound, dist));	\
+}
+#define IWK_PART_KERNELS(isa, tgt)					\
+__attribute__((target(tgt)))						\
+static int								\
+iw_part_##isa(const int8_t *	cells,					\
+	      int		pairs,					\
+	      const int32_t *	qpairs,					\
+	      int32_t		bound,					\
+	      int32_t *		dist)					\
+{									\
+  return(iw_part_##isa##_body(cells, pairs, qpairs, bound, dist));	\
+}									\
+IWK_PART_WIDTH(isa, tgt, 4)						\
+IWK_PART_WIDTH(isa, tgt, 8)						\
+IWK_PART_WIDTH(isa, tgt, 16)						\
+IWK_PART_WIDTH(isa, tgt, 32)						\
+IWK_PART_WIDTH(isa, tgt, 64)						\
+static const iw_part_fn	iw_part_##isa##_widths[IWK_WIDTHS] = {		\
+  iw_part_##isa##_4, iw_part_##isa##_8, iw_part_##isa##_16,		\
+  iw_part_##isa##_32, iw_part_##isa##_64				\
+};
+
+/* Queries per call of the batch kernels : each cell loaded is used by
+ * all of them, and their accumulators still fit in the registers */
+#define IWK_QTILE		4
+
+/* Budget of the blocks of map a batch goes through before the next
+ * blocks, so they stay in L2 for every tile of queries */
+#define IWK_BATCH_BYTES		(128 * 1024)
+
+/****************************** TYPES ******************************/
+
+/*
+ * Distances of num_blocks blocks : dist gets IWMAP_BLOCK values per
+ * block, qpairs holds the two query levels of each pair as int16_t.
+ */
+typedef void (*iw_dist_fn)(const int8_t *	cells,
+			   int			pairs,
+			   int			num_blocks,
+			   const int32_t *	qpairs,
+			   int32_t *		dist);
+
+/*
+ * Distances of one block, given up once all its points are over bound :
+ * the routers come by decreasing variance (see iw_fpblock_from_store()),
+ * so the partial sums of the far points soon get there. Every IWK_STEP
+ * pairs it checks, and returns the pairs measured, dist then only holds
+ * partial sums (all over bound).
+ */
+typedef int (*iw_part_fn)(const int8_t *	cells,
+			  int			pairs,
+			  const int32_t *	qpairs,
+			  int32_t		bound,
+			  int32_t *		dist);
+
+/*
+ * The same for a scan that missed some routers. mpairs holds two values
+ * per pair of qpairs : the mask of the heard routers (0xFFFF each), and
+ * the penalty of the missed ones, in dB. A missed router costs the
+ * square of the penalty to the points that hear it, nothing to the
+ * others, instead of the difference.
+ */
+typedef int (*iw_mask_fn)(const int8_t *	cells,
+			  int			pairs,
+			  const int32_t *	qpairs,
+			  const int32_t *	mpairs,
+			  int32_t		bound,
+			  int32_t *		dist);
+
+/*
+ * Distances of num_blocks blocks to IWK_QTILE queries at once, from the
+ * dot products : |a|^2 + |b|^2 - 2 a.b, with norms the |a|^2 of the
+ * points and qnorms the |b|^2 of the queries. qpairs holds the packed
+ * queries one after the other (pairs values each), dist gets the
+ * distances of each query one after the other too (num_blocks *
+ * IWMAP_BLOCK values each).
+ */
+typedef void (*iw_batch_fn)(const int8_t *	cells,
+			    int			pairs,
+			    int			num_blocks,
+			    const int32_t *	qpairs,
+			    const int32_t *	norms,
+			    const int32_t *	qnorms,
+			    int32_t *		dist);
+
+/*
+ * Sums of the product codes of num_blocks blocks : sums gets IWPQ_BLOCK
+ * values per block, and masks one bit per point of each block with a
+ * sum below limit + 1. tables holds 16 entries per sub-quantizer.
+ */
+typedef void (*iw_scan_fn)(const uint8_t *	codes,
+			   int			num_sub,
+			   int			num_blocks,
+			   const uint8_t *	tables,
+			   uint16_t		limit,
+			   uint16_t *		sums,
+			   uint32_t *		masks);
+
+struct iw_kernel
+{
+  const char *	name;
+  int		(*supported)(void);	/* NULL : always */
+  iw_dist_fn	dist;
+  iw_part_fn	part;
+  const iw_part_fn *	widths;	/* part of each of IWK_WIDTHS, or NULL */
+  iw_mask_fn	mask;
+  iw_scan_fn	scan;
+  iw_batch_fn	batch;
+};
+
+/***************************** KERNELS *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Plain C, the reference
+ */
+static void
+iw_dist_scalar(const int8_t *	cells,
+	       int		pairs,
+	       int		num_blocks,
+	       const int32_t *	qpairs,
+	       int32_t *	dist)
+{
+  int	b;
+  int	p;
+  int	i;
+
+  for(b = 0; b < num_blocks; b++)
+    {
+      int32_t *	acc = dist + b * IWMAP_BLOCK;
+
+      memset(acc, 0, IWMAP_BLOCK * sizeof(int32_t));
+      for(p = 0; p < pairs; p++)
+	{
+	  int	q0 = (int16_t) (qpairs[p] & 0xFFFF);
+	  int	q1 = (int16_t) (qpairs[p] >> 16);
+
+	  for(i = 0; i < IWMAP_BLOCK; i++)
+	    {
+	      int	d0 = cells[2 * i] - q0;
+	      int	d1 = cells[2 * i + 1] - q1;
+
+	      acc[i] += d0 * d0 + d1 * d1;
+	    }
+	  cells += IWK_PAIR_LEN;
+	}
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Plain C, one block given up once all its points are over the bound
+ */
+static int
+iw_part_scalar(const int8_t *	cells,
+	       int		pairs,
+	       const int32_t *	qpairs,
+	       int32_t		bound,
+	       int32_t *	dist)
+{
+  int	p;
+  int	i;
+
+  memset(dist, 0, IWMAP_BLOCK * sizeof(int32_t));
+  for(p = 0; p < pairs; p++)
+    {
+      int	q0 = (int16_t) (qpairs[p] & 0xFFFF);
+      int	q1 = (int16_t) (qpairs[p] >> 16);
+      int32_t	low = INT32_MAX;
+
+      for(i = 0; i < IWMAP_BLOCK; i++)
+	{
+	  int	d0 = cells[2 * i] - q0;
+	  int	d1 = cells[2 * i + 1] - q1;
+
+	  dist[i] += d0 * d0 + d1 * d1;
+	  if(dist[i] < low)
+	    low = dist[i];
+	}
+      cells += IWK_PAIR_LEN;
+      if(((p + 1) % IWK_STEP == 0) && (low > bound))
+	return(p + 1);
+    }
+  return(pairs);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Plain C, one block of a partial scan given up as iw_part_scalar()
+ */
+static int
+iw_mask_scalar(const int8_t *	cells,
+	       int		pairs,
+	       const int32_t *	qpairs,
+	       const int32_t *	mpairs,
+	       int32_t		bound,
+	       int32_t *	dist)
+{
+  int	p;
+  int	i;
+  int	j;
+
+  memset(dist, 0, IWMAP_BLOCK * sizeof(int32_t));
+  for(p = 0; p < pairs; p++)
+    {
+      int32_t	low = INT32_MAX;
+
+      for(i = 0; i < IWMAP_BLOCK; i++)
+	{
+	  for(j = 0; j < 2; j++)
+	    {
+	      int	c = cells[2 * i + j];
+	      int	q = (int16_t) (qpairs[p] >> (16 * j));
+	      int	heard = (int16_t) (mpairs[2 * p] >> (16 * j));
+	      int	pen = (int16_t) (mpairs[2 * p + 1] >> (16 * j));
+	      int	d = heard ? c - q : (c ? pen : 0);
+
+	      dist[i] += d * d;
+	    }
+	  if(dist[i] < low)
+	    low = dist[i];
+	}
+      cells += IWK_PAIR_LEN;
+      if(((p + 1) % IWK_STEP == 0) && (low > bound))
+	return(p + 1);
+    }
+  return(pairs);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Plain C scan of the product codes : 16 bytes per sub-quantizer and
+ * block, byte i holds the code of point i (low nibble) and i + 16
+ */
+static void
+iw_scan_scalar(const uint8_t *	codes,
+	       int		num_sub,
+	       int		num_blocks,
+	       const uint8_t *	tables,
+	       uint16_t		limit,
+	       uint16_t *	sums,
+	       uint32_t *	masks)
+{
+  int	b;
+  int	s;
+  int	i;
+
+  for(b = 0; b < num_blocks; b++)
+    {
+      uint32_t	mask = 0;
+
+      memset(sums, 0, IWPQ_BLOCK * sizeof(uint16_t));
+      for(s = 0; s < num_sub; s++)
+	{
+	  const uint8_t *	table = tables + 16 * s;
+
+	  for(i = 0; i < 16; i++)
+	    {
+	      sums[i] += table[codes[i] & 0x0F];
+	      sums[i + 16] += table[codes[i] >> 4];
+	    }
+	  codes += 16;
+	}
+      for(i = 0; i < IWPQ_BLOCK; i++)
+	if(sums[i] <= limit)
+	  mask |= 1U << i;
+      masks[b] = mask;
+      sums += IWPQ_BLOCK;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Plain C batch : IWK_QTILE queries at once, by the dot products
+ */
+static void
+iw_batch_scalar(const int8_t *	cells,
+		int		pairs,
+		int		num_blocks,
+		const int32_t *	qpairs,
+		const int32_t *	norms,
+		const int32_t *	qnorms,
+		int32_t *	dist)
+{
+  int	stride = num_blocks * IWMAP_BLOCK;
+  int	b;
+  int	p;
+  int	q;
+  int	i;
+
+  for(b = 0; b < num_blocks; b++)
+    {
+      int32_t	acc[IWK_QTILE][IWMAP_BLOCK];
+
+      memset(acc, 0, sizeof(acc));
+      for(p = 0; p < pairs; p++)
+	{
+	  for(q = 0; q < IWK_QTILE; q++)
+	    {
+	      int	q0 = (int16_t) (qpairs[q * pairs + p] & 0xFFFF);
+	      int	q1 = (int16_t) (qpairs[q * pairs + p] >> 16);
+
+	      for(i = 0; i < IWMAP_BLOCK; i++)
+		acc[q][i] += cells[2 * i] * q0 + cells[2 * i + 1] * q1;
+	    }
+	  cells += IWK_PAIR_LEN;
+	}
+      for(q = 0; q < IWK_QTILE; q++)
+	for(i = 0; i < IWMAP_BLOCK; i++)
+	  dist[q * stride + i] = norms[i] + qnorms[q] - 2 * acc[q][i];
+      norms += IWMAP_BLOCK;
+      dist += IWMAP_BLOCK;
+    }
+}
+
+#ifdef IWK_X86
+/*------------------------------------------------------------------*/
+/*
+ * SSE2 : 4 points per vector. No sign extension instruction, the sign
+ * bytes come from a compare.
+ */
+__attribute__((target("sse2")))
+static void
+iw_dist_sse2(const int8_t *	cells,
+	     int		pairs,
+	     int		num_blocks,
+	     const int32_t *	qpairs,
+	     int32_t *		dist)
+{
+  const __m128i	zero = _mm_setzero_si128();
+  int		b;
+  int		p;
+
+  for(b = 0; b < num_blocks; b++)
+    {
+      __m128i	acc0 = zero;
+      __m128i	acc1 = zero;
+      __m128i	acc2 = zero;
+      __m128i	acc3 = zero;
+
+      for(p = 0; p < pairs; p++)
+	{
+	  __m128i	q = _mm_set1_epi32(qpairs[p]);
+	  __m128i	lo = _mm_loadu_si128((const __m128i *) cells);
+	  __m128i	hi = _mm_loadu_si128((const __m128i *) (cells + 16));
+	  __m128i	slo = _mm_cmpgt_epi8(zero, lo);
+	  __m128i	shi = _mm_cmpgt_epi8(zero, hi);
+	  __m128i	d;
+
+	  d = _mm_sub_epi16(_mm_unpacklo_epi8(lo, slo), q);
+	  acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(d, d));
+	  d = _mm_sub_epi16(_mm_unpackhi_epi8(lo, slo), q);
+	  acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(d, d));
+	  d = _mm_sub_epi16(_mm_unpacklo_epi8(hi, shi), q);
+	  acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(d, d));
+	  d = _mm_sub_epi16(_mm_unpackhi_epi8(hi, shi), q);
+	  acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(d, d));
+	  cells += IWK_PAIR_LEN;
+	}
+      _mm_storeu_si128((__m128i *) (dist + 0), acc0);
+      _mm_storeu_si128((__m128i *) (dist + 4), acc1);
+      _mm_storeu_si128((__m128i *) (dist + 8), acc2);
+      _mm_storeu_si128((__m128i *) (dist + 12), acc3);
+      dist += IWMAP_BLOCK;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * SSE2, one block given up once all its points are over the bound.
+ * Inlined in the kernel of any number of pairs and in those of the
+ * common widths (see IWK_WIDTHS).
+ */
+__attribute__((target("sse2"), always_inline))
+static inline int
+iw_part_sse2_body(const int8_t *	cells,
+		  int			pairs,
+		  const int32_t *	qpairs,
+		  int32_t		bound,
+		  int32_t *		dist)
+{
+  const __m128i	zero = _mm_setzero_si128();
+  const __m128i	b = _mm_set1_epi32(bound);
+  __m128i	acc0 = zero;
+  __m128i	acc1 = zero;
+  __m128i	acc2 = zero;
+  __m128i	acc3 = zero;
+  int		p;
+
+  IWK_UNROLL
+  for(p = 0; p < pairs; p++)
+    {
+      __m128i	q = _mm_set1_epi32(qpairs[p]);
+      __m128i	lo = _mm_loadu_si128((const __m128i *) cells);
+      __m128i	hi = _mm_loadu_si128((const __m128i *) (cells + 16));
+      __m128i	slo = _mm_cmpgt_epi8(zero, lo);
+      __m128i	shi = _mm_cmpgt_epi8(zero, hi);
+      __m128i	d;
+
+      d = _mm_sub_epi16(_mm_unpacklo_epi8(lo, slo), q);
+      acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(d, d));
+      d = _mm_sub_epi16(_mm_unpackhi_epi8(lo, slo), q);
+      acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(d, d));
+      d = _mm_sub_epi16(_mm_unpacklo_epi8(hi, shi), q);
+      acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(d, d));
+      d = _mm_sub_epi16(_mm_unpackhi_epi8(hi, shi), q);
+      acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(d, d));
+      cells += IWK_PAIR_LEN;
+      if(((p + 1) % IWK_STEP == 0)
+	 && (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(acc0, b),
+							   _mm_cmpgt_epi32(acc1, b)),
+					     _mm_and_si128(_mm_cmpgt_epi32(acc2, b),
+							   _mm_cmpgt_epi32(acc3, b))))
+	     == 0xFFFF))
+	{
+	  p++;
+	  break;
+	}
+    }
+  _mm_storeu_si128((__m128i *) (dist + 0), acc0);
+  _mm_storeu_si128((__m128i *) (dist + 4), acc1);
+  _mm_storeu_si128((__m128i *) (dist + 8), acc2);
+  _mm_storeu_si128((__m128i *) (dist + 12), acc3);
+  return(p);
+}
+
+IWK_PART_KERNELS(sse2, "sse2")
+
+/*------------------------------------------------------------------*/
+/*
+ * SSE2, one block of a partial scan
+ */
+__attribute__((target("sse2")))
+static int
+iw_mask_sse2(const int8_t *	cells,
+	     int		pairs,
+	     const int32_t *	qpairs,
+	     const int32_t *	mpairs,
+	     int32_t		bound,
+	     int32_t *		dist)
+{
+  const __m128i	zero = _mm_setzero_si128();
+  const __m128i	b = _mm_set1_epi32(bound);
+  __m128i	acc[4] = { zero, zero, zero, zero };
+  int		p;
+  int		i;
+
+  for(p = 0; p < pairs; p++)
+    {
+      __m128i	q = _mm_set1_epi32(qpairs[p]);
+      __m128i	m = _mm_set1_epi32(mpairs[2 * p]);
+      __m128i	pen = _mm_set1_epi32(mpairs[2 * p + 1]);
+      __m128i	lo = _mm_loadu_si128((const __m128i *) cells);
+      __m128i	hi = _mm_loadu_si128((const __m128i *) (cells + 16));
+      __m128i	slo = _mm_cmpgt_epi8(zero, lo);
+      __m128i	shi = _mm_cmpgt_epi8(zero, hi);
+      __m128i	c[4];
+      __m128i	over;
+
+      c[0] = _mm_unpacklo_epi8(lo, slo);
+      c[1] = _mm_unpackhi_epi8(lo, slo);
+      c[2] = _mm_unpacklo_epi8(hi, shi);
+      c[3] = _mm_unpackhi_epi8(hi, shi);
+      over = _mm_set1_epi32(-1);
+      for(i = 0; i < 4; i++)
+	{
+	  /* Heard : the difference, missed : the penalty if the point
+	   * hears it */
+	  __m128i	d = _mm_or_si128(_mm_and_si128(_mm_sub_epi16(c[i], q), m),
+					 _mm_andnot_si128(_mm_cmpeq_epi16(c[i], zero),
+							  pen));
+
+	  acc[i] = _mm_add_epi32(acc[i], _mm_madd_epi16(d, d));
+	  over = _mm_and_si128(over, _mm_cmpgt_epi32(acc[i], b));
+	}
+      cells += IWK_PAIR_LEN;
+      if(((p + 1) % IWK_STEP == 0) && (_mm_movemask_epi8(over) == 0xFFFF))
+	{
+	  p++;
+	  break;
+	}
+    }
+  for(i = 0; i < 4; i++)
+    _mm_storeu_si128((__m128i *) (dist + 4 * i), acc[i]);
+  return(p);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * SSE2 batch : half a block at a time, so that the accumulators of the
+ * 4 queries take 8 of the 16 registers
+ */
+__attribute__((target("sse2")))
+static void
+iw_batch_sse2(const int8_t *	cells,
+	      int		pairs,
+	      int		num_blocks,
+	      const int32_t *	qpairs,
+	      const int32_t *	norms,
+	      const int32_t *	qnorms,
+	      int32_t *		dist)
+{
+  const __m128i	zero = _mm_setzero_si128();
+  int		stride = num_blocks * IWMAP_BLOCK;
+  int		b;
+  int		p;
+  int		q;
+
+  /* By half blocks */
+  for(b = 0; b < num_blocks * 2; b++)
+    {
+      const int8_t *	c = cells + (size_t) (b / 2) * pairs * IWK_PAIR_LEN
+			    + (b & 1) * 16;
+      const int32_t *	n = norms + b * 8;
+      int32_t *		d = dist + b * 8;
+      __m128i		a00 = zero, a01 = zero, a10 = zero, a11 = zero;
+      __m128i		a20 = zero, a21 = zero, a30 = zero, a31 = zero;
+      __m128i		n0 = _mm_loadu_si128((const __m128i *) n);
+      __m128i		n1 = _mm_loadu_si128((const __m128i *) (n + 4));
+
+      for(p = 0; p < pairs; p++)
+	{
+	  __m128i	v = _mm_loadu_si128((const __m128i *) c);
+	  __m128i	s = _mm_cmpgt_epi8(zero, v);
+	  __m128i	lo = _mm_unpacklo_epi8(v, s);
+	  __m128i	hi = _mm_unpackhi_epi8(v, s);
+	  __m128i	w;
+
+	  w = _mm_set1_epi32(qpairs[p]);
+	  a00 = _mm_add_epi32(a00, _mm_madd_epi16(lo, w));
+	  a01 = _mm_add_epi32(a01, _mm_madd_epi16(hi, w));
+	  w = _mm_set1_epi32(qpairs[pairs + p]);
+	  a10 = _mm_add_epi32(a10, _mm_madd_epi16(lo, w));
+	  a11 = _mm_add_epi32(a11, _mm_madd_epi16(hi, w));
+	  w = _mm_set1_epi32(qpairs[2 * pairs + p]);
+	  a20 = _mm_add_epi32(a20, _mm_madd_epi16(lo, w));
+	  a21 = _mm_add_epi32(a21, _mm_madd_epi16(hi, w));
+	  w = _mm_set1_epi32(qpairs[3 * pairs + p]);
+	  a30 = _mm_add_epi32(a30, _mm_madd_epi16(lo, w));
+	  a31 = _mm_add_epi32(a31, _mm_madd_epi16(hi, w));
+	  c += IWK_PAIR_LEN;
+	}
+      for(q = 0; q < IWK_QTILE; q++)
+	{
+	  __m128i	qn = _mm_set1_epi32(qnorms[q]);
+	  __m128i	lo = (q == 0) ? a00 : (q == 1) ? a10 : (q == 2) ? a20 : a30;
+	  __m128i	hi = (q == 0) ? a01 : (q == 1) ? a11 : (q == 2) ? a21 : a31;
+
+	  /* |a|^2 + |b|^2 - 2 a.b */
+	  _mm_storeu_si128((__m128i *) (d + q * stride),
+			   _mm_sub_epi32(_mm_add_epi32(n0, qn),
+					 _mm_add_epi32(lo, lo)));
+	  _mm_storeu_si128((__m128i *) (d + q * stride + 4),
+			   _mm_sub_epi32(_mm_add_epi32(n1, qn),
+					 _mm_add_epi32(hi, hi)));
+	}
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * AVX2 : 8 points per vector
+ */
+__attribute__((target("avx2")))
+static void
+iw_dist_avx2(const int8_t *	cells,
+	     int		pairs,
+	     int		num_blocks,
+	     const int32_t *	qpairs,
+	     int32_t *		dist)
+{
+  int		b;
+  int		p;
+
+  for(b = 0; b < num_blocks; b++)
+    {
+      __m256i	acc0 = _mm256_setzero_si256();
+      __m256i	acc1 = _mm256_setzero_si256();
+
+      for(p = 0; p < pairs; p++)
+	{
+	  __m256i	q = _mm256_set1_epi32(qpairs[p]);
+	  __m256i	d;
+
+	  d = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) cells));
+	  d = _mm256_sub_epi16(d, q);
+	  acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(d, d));
+	  d = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (cells + 16)));
+	  d = _mm256_sub_epi16(d, q);
+	  acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(d, d));
+	  cells += IWK_PAIR_LEN;
+	}
+      _mm256_storeu_si256((__m256i *) (dist + 0), acc0);
+      _mm256_storeu_si256((__m256i *) (dist + 8), acc1);
+      dist += IWMAP_BLOCK;
+    }
+  /* Back to SSE without the penalty of dirty upper halves, gcc
+   * doesn't do it for us in a function of another target */
+  _mm256_zeroupper();
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * AVX2, one block given up once all its points are over the bound
+ * (inlined as iw_part_sse2_body())
+ */
+__attribute__((target("avx2"), always_inline))
+static inline int
+iw_part_avx2_body(const int8_t *	cells,
+		  int			pairs,
+		  const int32_t *	qpairs,
+		  int32_t		bound,
+		  int32_t *		dist)
+{
+  const __m256i	b = _mm256_set1_epi32(bound);
+  __m256i	acc0 = _mm256_setzero_si256();
+  __m256i	acc1 = _mm256_setzero_si256();
+  int		p;
+
+  IWK_UNROLL
+  for(p = 0; p < pairs; p++)
+    {
+      __m256i	q = _mm256_set1_epi32(qpairs[p]);
+      __m256i	d;
+
+      d = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) cells));
+      d = _mm256_sub_epi16(d, q);
+      acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(d, d));
+      d = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (cells + 16)));
+      d = _mm256_sub_epi16(d, q);
+      acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(d, d));
+      cells += IWK_PAIR_LEN;
+      if(((p + 1) % IWK_STEP == 0)
+	 && (_mm256_movemask_epi8(_mm256_cmpgt_epi32(_mm256_min_epi32(acc0, acc1), b))
+	     == -1))
+	{
+	  p++;
+	  break;
+	}
+    }
+  _mm256_storeu_si256((__m256i *) (dist + 0), acc0);
+  _mm256_storeu_si256((__m256i *) (dist + 8), acc1);
+  _mm256_zeroupper();
+  return(p);
+}
+
+IWK_PART_KERNELS(avx2, "avx2")
+
+/*------------------------------------------------------------------*/
+/*
+ * AVX2, one block of a partial scan
+ */
+__attribute__((target("avx2")))
+static int
+iw_mask_avx2(const int8_t *	cells,
+	     int		pairs,
+	     const int32_t *	qpairs,
+	     const int32_t *	mpairs,
+	     int32_t		bound,
+	     int32_t *		dist)
+{
+  const __m256i	zero = _mm256_setzero_si256();
+  const __m256i	b = _mm256_set1_epi32(bound);
+  __m256i	acc0 = zero;
+  __m256i	acc1 = zero;
+  int		p;
+
+  for(p = 0; p < pairs; p++)
+    {
+      __m256i	q = _mm256_set1_epi32(qpairs[p]);
+      __m256i	m = _mm256_set1_epi32(mpairs[2 * p]);
+      __m256i	pen = _mm256_set1_epi32(mpairs[2 * p + 1]);
+      __m256i	c;
+      __m256i	d;
+
+      c = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) cells));
+      d = _mm256_or_si256(_mm256_and_si256(_mm256_sub_epi16(c, q), m),
+			  _mm256_andnot_si256(_mm256_cmpeq_epi16(c, zero), pen));
+      acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(d, d));
+      c = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (cells + 16)));
+      d = _mm256_or_si256(_mm256_and_si256(_mm256_sub_epi16(c, q), m),
+			  _mm256_andnot_si256(_mm256_cmpeq_epi16(c, zero), pen));
+      acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(d, d));
+      cells += IWK_PAIR_LEN;
+      if(((p + 1) % IWK_STEP == 0)
+	 && (_mm256_movemask_epi8(_mm256_cmpgt_epi32(_mm256_min_epi32(acc0, acc1), b))
+	     == -1))
+	{
+	  p++;
+	  break;
+	}
+    }
+  _mm256_storeu_si256((__m256i *) (dist + 0), acc0);
+  _mm256_storeu_si256((__m256i *) (dist + 8), acc1);
+  _mm256_zeroupper();
+  return(p);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * AVX2 batch : each pair of a block is widened once for the 4 queries
+ */
+__attribute__((target("avx2")))
+static void
+iw_batch_avx2(const int8_t *	cells,
+	      int		pairs,
+	      int		num_blocks,
+	      const int32_t *	qpairs,
+	      const int32_t *	norms,
+	      const int32_t *	qnorms,
+	      int32_t *		dist)
+{
+  int		stride = num_blocks * IWMAP_BLOCK;
+  int		b;
+  int		p;
+  int		q;
+
+  for(b = 0; b < num_blocks; b++)
+    {
+      __m256i	a00 = _mm256_setzero_si256(), a01 = a00, a10 = a00, a11 = a00;
+      __m256i	a20 = a00, a21 = a00, a30 = a00, a31 = a00;
+      __m256i	n0 = _mm256_loadu_si256((const __m256i *) norms);
+      __m256i	n1 = _mm256_loadu_si256((const __m256i *) (norms + 8));
+
+      for(p = 0; p < pairs; p++)
+	{
+	  __m256i	lo = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) cells));
+	  __m256i	hi = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (cells + 16)));
+	  __m256i	v;
+
+	  v = _mm256_set1_epi32(qpairs[p]);
+	  a00 = _mm256_add_epi32(a00, _mm256_madd_epi16(lo, v));
+	  a01 = _mm256_add_epi32(a01, _mm256_madd_epi16(hi, v));
+	  v = _mm256_set1_epi32(qpairs[pairs + p]);
+	  a10 = _mm256_add_epi32(a10, _mm256_madd_epi16(lo, v));
+	  a11 = _mm256_add_epi32(a11, _mm256_madd_epi16(hi, v));
+	  v = _mm256_set1_epi32(qpairs[2 * pairs + p]);
+	  a20 = _mm256_add_epi32(a20, _mm256_madd_epi16(lo, v));
+	  a21 = _mm256_add_epi32(a21, _mm256_madd_epi16(hi, v));
+	  v = _mm256_set1_epi32(qpairs[3 * pairs + p]);
+	  a30 = _mm256_add_epi32(a30, _mm256_madd_epi16(lo, v));
+	  a31 = _mm256_add_epi32(a31, _mm256_madd_epi16(hi, v));
+	  cells += IWK_PAIR_LEN;
+	}
+      for(q = 0; q < IWK_QTILE; q++)
+	{
+	  __m256i	qn = _mm256_set1_epi32(qnorms[q]);
+	  __m256i	lo = (q == 0) ? a00 : (q == 1) ? a10 : (q == 2) ? a20 : a30;
+	  __m256i	hi = (q == 0) ? a01 : (q == 1) ? a11 : (q == 2) ? a21 : a31;
+
+	  /* |a|^2 + |b|^2 - 2 a.b */
+	  _mm256_storeu_si256((__m256i *) (dist + q * stride),
+			      _mm256_sub_epi32(_mm256_add_epi32(n0, qn),
+					       _mm256_add_epi32(lo, lo)));
+	  _mm256_storeu_si256((__m256i *) (dist + q * stride + 8),
+			      _mm256_sub_epi32(_mm256_add_epi32(n1, qn),
+					       _mm256_add_epi32(hi, hi)));
+	}
+      norms += IWMAP_BLOCK;
+      dist += IWMAP_BLOCK;
+    }
+  _mm256_zeroupper();
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * AVX-512 (BW for the 16 bit operations) : a whole block per vector
+ */
+__attribute__((target("avx512f,avx512bw")))
+static void
+iw_dist_avx512(const int8_t *	cells,
+	       int		pairs,
+	       int		num_blocks,
+	       const int32_t *	qpairs,
+	       int32_t *	dist)
+{
+  int		b;
+  int		p;
+
+  for(b = 0; b < num_blocks; b++)
+    {
+      __m512i	acc = _mm512_setzero_si512();
+
+      for(p = 0; p < pairs; p++)
+	{
+	  __m512i	d;
+
+	  d = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *) cells));
+	  d = _mm512_sub_epi16(d, _mm512_set1_epi32(qpairs[p]));
+	  acc = _mm512_add_epi32(acc, _mm512_madd_epi16(d, d));
+	  cells += IWK_PAIR_LEN;
+	}
+      _mm512_storeu_si512((void *) dist, acc);
+      dist += IWMAP_BLOCK;
+    }
+  _mm256_zeroupper();
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * AVX-512, one block given up once all its points are over the bound
+ * (inlined as iw_part_sse2_body())
+ */
+__attribute__((target("avx512f,avx512bw"), always_inline))
+static inline int
+iw_part_avx512_body(const int8_t *	cells,
+		    int			pairs,
+		    const int32_t *	qpairs,
+		    int32_t		bound,
+		    int32_t *		dist)
+{
+  const __m512i	b = _mm512_set1_epi32(bound);
+  __m512i	acc = _mm512_setzero_si512();
+  int		p;
+
+  IWK_UNROLL
+  for(p = 0; p < pairs; p++)
+    {
+      __m512i	d;
+
+      d = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *) cells));
+      d = _mm512_sub_epi16(d, _mm512_set1_epi32(qpairs[p]));
+      acc = _mm512_add_epi32(acc, _mm512_madd_epi16(d, d));
+      cells += IWK_PAIR_LEN;
+      if(((p + 1) % IWK_STEP == 0)
+	 && (_mm512_cmpgt_epi32_mask(acc, b) == 0xFFFF))
+	{
+	  p++;
+	  break;
+	}
+    }
+  _mm512_storeu_si512((void *) dist, acc);
+  _mm256_zeroupper();
+  return(p);
+}
+
+IWK_PART_KERNELS(avx512, "avx512f,avx512bw")
+
+/*------------------------------------------------------------------*/
+/*
+ * AVX-512, one block of a partial scan : the mask of the heard routers
+ * is a mask register
+ */
+__attribute__((target("avx512f,avx512bw")))
+static int
+iw_mask_avx512(const int8_t *	cells,
+	       int		pairs,
+	       const int32_t *	qpairs,
+	       const int32_t *	mpairs,
+	       int32_t		bound,
+	       int32_t *	dist)
+{
+  const __m512i	zero = _mm512_setzero_si512();
+  const __m512i	b = _mm512_set1_epi32(bound);
+  __m512i	acc = zero;
+  int		p;
+
+  for(p = 0; p < pairs; p++)
+    {
+      __m512i	c;
+      __m512i	d;
+      __mmask32	heard;
+
+      heard = _mm512_test_epi16_mask(_mm512_set1_epi32(mpairs[2 * p]),
+				     _mm512_set1_epi32(-1));
+      c = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *) cells));
+      /* Missed : the penalty where the point hears it */
+      d = _mm512_maskz_mov_epi16(_mm512_test_epi16_mask(c, c),
+				 _mm512_set1_epi32(mpairs[2 * p + 1]));
+      d = _mm512_mask_sub_epi16(d, heard, c, _mm512_set1_epi32(qpairs[p]));
+      acc = _mm512_add_epi32(acc, _mm512_madd_epi16(d, d));
+      cells += IWK_PAIR_LEN;
+      if(((p + 1) % IWK_STEP == 0)
+	 && (_mm512_cmpgt_epi32_mask(acc, b) == 0xFFFF))
+	{
+	  p++;
+	  break;
+	}
+    }
+  _mm512_storeu_si512((void *) dist, acc);
+  _mm256_zeroupper();
+  return(p);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * AVX-512 batch : a whole block per vector, one accumulator per query
+ */
+__attribute__((target("avx512f,avx512bw")))
+static void
+iw_batch_avx512(const int8_t *	cells,
+		int		pairs,
+		int		num_blocks,
+		const int32_t *	qpairs,
+		const int32_t *	norms,
+		const int32_t *	qnorms,
+		int32_t *	dist)
+{
+  int		stride = num_blocks * IWMAP_BLOCK;
+  int		b;
+  int		p;
+  int		q;
+
+  for(b = 0; b < num_blocks; b++)
+    {
+      __m512i	a0 = _mm512_setzero_si512(), a1 = a0, a2 = a0, a3 = a0;
+      __m512i	n = _mm512_loadu_si512((const void *) norms);
+
+      for(p = 0; p < pairs; p++)
+	{
+	  __m512i	v = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *) cells));
+
+	  a0 = _mm512_add_epi32(a0, _mm512_madd_epi16(v, _mm512_set1_epi32(qpairs[p])));
+	  a1 = _mm512_add_epi32(a1, _mm512_madd_epi16(v, _mm512_set1_epi32(qpairs[pairs + p])));
+	  a2 = _mm512_add_epi32(a2, _mm512_madd_epi16(v, _mm512_set1_epi32(qpairs[2 * pairs + p])));
+	  a3 = _mm512_add_epi32(a3, _mm512_madd_epi16(v, _mm512_set1_epi32(qpairs[3 * pairs + p])));
+	  cells += IWK_PAIR_LEN;
+	}
+      for(q = 0; q < IWK_QTILE; q++)
+	{
+	  __m512i	a = (q == 0) ? a0 : (q == 1) ? a1 : (q == 2) ? a2 : a3;
+
+	  _mm512_storeu_si512((void *) (dist + q * stride),
+			      _mm512_sub_epi32(_mm512_add_epi32(n, _mm512_set1_epi32(qnorms[q])),
+					       _mm512_add_epi32(a, a)));
+	}
+      norms += IWMAP_BLOCK;
+      dist += IWMAP_BLOCK;
+    }
+  _mm256_zeroupper();
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Store the sums of a block of codes (4 vectors of 8), and return the
+ * mask of those up to the limit. No unsigned compare, but a <= b is
+ * min(a, b) == a.
+ */
+__attribute__((target("sse4.1"), always_inline))
+static inline uint32_t
+iw_scan_store(__m128i		s0,
+	      __m128i		s1,
+	      __m128i		s2,
+	      __m128i		s3,
+	      __m128i		limit,
+	      uint16_t *	sums)
+{
+  __m128i	m0 = _mm_cmpeq_epi16(_mm_min_epu16(s0, limit), s0);
+  __m128i	m1 = _mm_cmpeq_epi16(_mm_min_epu16(s1, limit), s1);
+  __m128i	m2 = _mm_cmpeq_epi16(_mm_min_epu16(s2, limit), s2);
+  __m128i	m3 = _mm_cmpeq_epi16(_mm_min_epu16(s3, limit), s3);
+
+  _mm_storeu_si128((__m128i *) (sums + 0), s0);
+  _mm_storeu_si128((__m128i *) (sums + 8), s1);
+  _mm_storeu_si128((__m128i *) (sums + 16), s2);
+  _mm_storeu_si128((__m128i *) (sums + 24), s3);
+  return((uint32_t) _mm_movemask_epi8(_mm_packs_epi16(m0, m1))
+	 | ((uint32_t) _mm_movemask_epi8(_mm_packs_epi16(m2, m3)) << 16));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * AVX2 scan : two sub-quantizers per vector, one per lane (the byte
+ * shuffle works by lanes), the lanes are added at the end
+ */
+__attribute__((target("avx2")))
+static void
+iw_scan_avx2(const uint8_t *	codes,
+	     int		num_sub,
+	     int		num_blocks,
+	     const uint8_t *	tables,
+	     uint16_t		limit,
+	     uint16_t *		sums,
+	     uint32_t *		masks)
+{
+  const __m256i	nibble = _mm256_set1_epi8(0x0F);
+  const __m256i	zero = _mm256_setzero_si256();
+  const __m128i	lim = _mm_set1_epi16(limit);
+  int		b;
+  int		s;
+
+  for(b = 0; b < num_blocks; b++)
+    {
+      __m256i	acc0 = zero;
+      __m256i	acc1 = zero;
+      __m256i	acc2 = zero;
+      __m256i	acc3 = zero;
+
+      for(s = 0; s < num_sub; s += 2)
+	{
+	  __m256i	t = _mm256_loadu_si256((const __m256i *) (tables + 16 * s));
+	  __m256i	c = _mm256_loadu_si256((const __m256i *) codes);
+	  __m256i	lo = _mm256_shuffle_epi8(t, _mm256_and_si256(c, nibble));
+	  __m256i	hi = _mm256_shuffle_epi8(t, _mm256_and_si256(_mm256_srli_epi16(c, 4), nibble));
+
+	  acc0 = _mm256_add_epi16(acc0, _mm256_unpacklo_epi8(lo, zero));
+	  acc1 = _mm256_add_epi16(acc1, _mm256_unpackhi_epi8(lo, zero));
+	  acc2 = _mm256_add_epi16(acc2, _mm256_unpacklo_epi8(hi, zero));
+	  acc3 = _mm256_add_epi16(acc3, _mm256_unpackhi_epi8(hi, zero));
+	  codes += 32;
+	}
+      masks[b] = iw_scan_store(_mm_add_epi16(_mm256_castsi256_si128(acc0),
+					     _mm256_extracti128_si256(acc0, 1)),
+			       _mm_add_epi16(_mm256_castsi256_si128(acc1),
+					     _mm256_extracti128_si256(acc1, 1)),
+			       _mm_add_epi16(_mm256_castsi256_si128(acc2),
+					     _mm256_extracti128_si256(acc2, 1)),
+			       _mm_add_epi16(_mm256_castsi256_si128(acc3),
+					     _mm256_extracti128_si256(acc3, 1)),
+			       lim, sums);
+      sums += IWPQ_BLOCK;
+    }
+  _mm256_zeroupper();
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Sum of the four lanes of a vector of uint16_t
+ */
+__attribute__((target("avx512f,avx512bw"), always_inline))
+static inline __m128i
+iw_lanes_avx512(__m512i	acc)
+{
+  return(_mm_add_epi16(_mm_add_epi16(_mm512_extracti32x4_epi32(acc, 0),
+				     _mm512_extracti32x4_epi32(acc, 1)),
+		       _mm_add_epi16(_mm512_extracti32x4_epi32(acc, 2),
+				     _mm512_extracti32x4_epi32(acc, 3))));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * AVX-512 scan : four sub-quantizers per vector
+ */
+__attribute__((target("avx512f,avx512bw")))
+static void
+iw_scan_avx512(const uint8_t *	codes,
+	       int		num_sub,
+	       int		num_blocks,
+	       const uint8_t *	tables,
+	       uint16_t		limit,
+	       uint16_t *	sums,
+	       uint32_t *	masks)
+{
+  const __m512i	nibble = _mm512_set1_epi8(0x0F);
+  const __m512i	zero = _mm512_setzero_si512();
+  const __m128i	lim = _mm_set1_epi16(limit);
+  int		b;
+  int		s;
+
+  for(b = 0; b < num_blocks; b++)
+    {
+      __m512i	acc0 = zero;
+      __m512i	acc1 = zero;
+      __m512i	acc2 = zero;
+      __m512i	acc3 = zero;
+
+      for(s = 0; s < num_sub; s += 4)
+	{
+	  __m512i	t = _mm512_loadu_si512((const void *) (tables + 16 * s));
+	  __m512i	c = _mm512_loadu_si512((const void *) codes);
+	  __m512i	lo = _mm512_shuffle_epi8(t, _mm512_and_si512(c, nibble));
+	  __m512i	hi = _mm512_shuffle_epi8(t, _mm512_and_si512(_mm512_srli_epi16(c, 4), nibble));
+
+	  acc0 = _mm512_add_epi16(acc0, _mm512_unpacklo_epi8(lo, zero));
+	  acc1 = _mm512_add_epi16(acc1, _mm512_unpackhi_epi8(lo, zero));
+	  acc2 = _mm512_add_epi16(acc2, _mm512_unpacklo_epi8(hi, zero));
+	  acc3 = _mm512_add_epi16(acc3, _mm512_unpackhi_epi8(hi, zero));
+	  codes += 64;
+	}
+      masks[b] = iw_scan_store(iw_lanes_avx512(acc0), iw_lanes_avx512(acc1),
+			       iw_lanes_avx512(acc2), iw_lanes_avx512(acc3),
+			       lim, sums);
+      sums += IWPQ_BLOCK;
+    }
+  _mm256_zeroupper();
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * CPU support. __builtin_cpu_supports() also checks that the OS saves
+ * the vector registers.
+ */
+static int
+iw_cpu_sse2(void)
+{
+  __builtin_cpu_init();
+  return(__builtin_cpu_supports("sse2"));
+}
+
+static int
+iw_cpu_avx2(void)
+{
+  __builtin_cpu_init();
+  return(__builtin_cpu_supports("avx2"));
+}
+
+static int
+iw_cpu_avx512(void)
+{
+  __builtin_cpu_init();
+  return(__builtin_cpu_supports("avx512f")
+	 && __builtin_cpu_supports("avx512bw"));
+}
+#endif	/* IWK_X86 */
+
+/**************************** VARIABLES ****************************/
+
+/* By order of preference */
+static const struct iw_kernel	iw_kernels[] = {
+#ifdef IWK_X86
+  { "avx512", iw_cpu_avx512, iw_dist_avx512, iw_part_avx512,
+    iw_part_avx512_widths, iw_mask_avx512, iw_scan_avx512, iw_batch_avx512 },
+  { "avx2", iw_cpu_avx2, iw_dist_avx2, iw_part_avx2, iw_part_avx2_widths,
+    iw_mask_avx2, iw_scan_avx2, iw_batch_avx2 },
+  { "sse2", iw_cpu_sse2, iw_dist_sse2, iw_part_sse2, iw_part_sse2_widths,
+    iw_mask_sse2, iw_scan_scalar, iw_batch_sse2 },
+#endif
+  { "scalar", NULL, iw_dist_scalar, iw_part_scalar, NULL, iw_mask_scalar,
+    iw_scan_scalar, iw_batch_scalar },
+};
+
+/* Kernel in use, NULL until the first search */
+static const struct iw_kernel *	iw_kernel_cur;
+/* Use the kernels of the widths, when the map has one of them */
+static int			iw_kernel_use_widths = 1;
+
+/************************ KERNEL SELECTION ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Pick the kernel by name, or the best the CPU can run if name is NULL.
+ * Mostly to check and measure the kernels against each other.
+ */
+int
+iw_kernel_select(const char *	name)
+{
+  unsigned int	i;
+
+  for(i = 0; i < sizeof(iw_kernels) / sizeof(iw_kernels[0]); i++)
+    {
+      const struct iw_kernel *	k = &iw_kernels[i];
+
+      if((name != NULL) && strcmp(name, k->name))
+	continue;
+      if((k->supported != NULL) && !k->supported())
+	{
+	  if(name == NULL)
+	    continue;
+	  errno = ENOTSUP;
+	  return(-1);
+	}
+      iw_kernel_cur = k;
+      return(0);
+    }
+  errno = ENOENT;
+  return(-1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Use the kernels unrolled for the common widths (1, the default), or
+ * always the one of any width (0). Those give the same distances, this
+ * is to measure them.
+ * Return the previous setting.
+ */
+int
+iw_kernel_widths(int	enable)
+{
+  int	old = iw_kernel_use_widths;
+
+  iw_kernel_use_widths = enable;
+  return(old);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Kernel of a block of the given number of pairs : the one of its width
+ * if it has one, 4 to 64 routers by powers of two, or the one of any
+ * width
+ */
+static iw_part_fn
+iw_kernel_part(int	pairs)
+{
+  const struct iw_kernel *	k = iw_kernel_cur;
+
+  if((k->widths != NULL) && iw_kernel_use_widths
+     && (pairs >= IWK_WIDTH_MIN / 2) && ((pairs & (pairs - 1)) == 0)
+     && (__builtin_ctz(pairs) - 1 < IWK_WIDTHS))
+    return(k->widths[__builtin_ctz(pairs) - 1]);
+  return(k->part);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Name of the kernel in use
+ */
+const char *
+iw_kernel_name(void)
+{
+  if(iw_kernel_cur == NULL)
+    iw_kernel_select(NULL);
+  return(iw_kernel_cur->name);
+}
+
+/************************ BLOCKED FINGERPRINTS ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Make room for num_points points, new cells are 0
+ */
+static int
+iw_fpblock_reserve(struct iw_fpblock *	fpb,
+		   int			num_points)
+{
+  size_t	block_len = (size_t) fpb->pairs * IWK_PAIR_LEN;
+  size_t	norms_len = IWMAP_BLOCK * sizeof(int32_t);
+  int		blocks = (num_points + IWMAP_BLOCK - 1) / IWMAP_BLOCK;
+  int		max_blocks = fpb->max_blocks ? fpb->max_blocks : 4;
+  void *	cells;
+  void *	norms;
+
+  if(blocks <= fpb->max_blocks)
+    return(0);
+  while(max_blocks < blocks)
+    max_blocks *= 2;
+  if(posix_memalign(&cells, IWMAP_ALIGN,
+		    IWMAP_ROUNDUP(max_blocks * block_len, IWMAP_ALIGN)) != 0)
+    {
+      errno = ENOMEM;
+      return(-1);
+    }
+  if(posix_memalign(&norms, IWMAP_ALIGN,
+		    IWMAP_ROUNDUP(max_blocks * norms_len, IWMAP_ALIGN)) != 0)
+    {
+      free(cells);
+      errno = ENOMEM;
+      return(-1);
+    }
+  memset(cells, 0, max_blocks * block_len);
+  memset(norms, 0, max_blocks * norms_len);
+  if(fpb->cells != NULL)
+    {
+      memcpy(cells, fpb->cells, fpb->max_blocks * block_len);
+      memcpy(norms, fpb->norms, fpb->max_blocks * norms_len);
+    }
+  free(fpb->cells);
+  free(fpb->norms);
+  fpb->cells = cells;
+  fpb->norms = norms;
+  fpb->max_blocks = max_blocks;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Create empty blocked fingerprints for the given number of routers
+ */
+void
+iw_fpblock_init(struct iw_fpblock *	fpb,
+		int			num_routers)
+{
+  memset(fpb, 0, sizeof(*fpb));
+  fpb->num_routers = num_routers;
+  fpb->pairs = (num_routers + 1) / 2;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Order of the variances of the routers, the largest first
+ */
+struct iw_fpvar
+{
+  double	var;
+  int		router;
+};
+
+static int
+iw_fpvar_cmp(const void *	a,
+	     const void *	b)
+{
+  const struct iw_fpvar *	va = a;
+  const struct iw_fpvar *	vb = b;
+
+  if(va->var != vb->var)
+    return((va->var < vb->var) ? 1 : -1);
+  return(va->router - vb->router);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Lay the routers out by decreasing variance over the points of the
+ * store : the routers which tell points apart the most come first, and
+ * the partial distances of a search grow the fastest (see iw_part_fn).
+ * The blocks must still be empty.
+ */
+static int
+iw_fpblock_order(struct iw_fpblock *		fpb,
+		 const struct iw_fpstore *	fps)
+{
+  struct iw_fpvar *	vars;
+  int			r;
+
+  if(fps->num_points == 0)
+    return(0);
+  vars = malloc(fpb->num_routers * sizeof(*vars));
+  fpb->order = malloc(fpb->num_routers * sizeof(int));
+  if((vars == NULL) || (fpb->order == NULL))
+    {
+      free(vars);
+      free(fpb->order);
+      fpb->order = NULL;
+      errno = ENOMEM;
+      return(-1);
+    }
+  for(r = 0; r < fpb->num_routers; r++)
+    {
+      vars[r].var = iw_fpstore_var(fps, r);
+      vars[r].router = r;
+    }
+  qsort(vars, fpb->num_routers, sizeof(*vars), iw_fpvar_cmp);
+  for(r = 0; r < fpb->num_routers; r++)
+    fpb->order[r] = vars[r].router;
+  free(vars);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Build the blocked form of a (dense) store
+ */
+int
+iw_fpblock_from_store(struct iw_fpblock *		fpb,
+		      const struct iw_fpstore *		fps)
+{
+  int	i;
+
+  iw_fpblock_init(fpb, fps->num_routers);
+  if((iw_fpblock_order(fpb, fps) < 0)
+     || (iw_fpblock_reserve(fpb, fps->num_points) < 0))
+    {
+      iw_fpblock_free(fpb);
+      return(-1);
+    }
+  for(i = 0; i < fps->num_points; i++)
+    iw_fpblock_add(fpb, iw_fpstore_row(fps, i));
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append a point, row has one value per router
+ */
+int
+iw_fpblock_add(struct iw_fpblock *	fpb,
+	       const int8_t *		row)
+{
+  int8_t *	dst;
+  int32_t	norm = 0;
+  int		slot = fpb->num_points % IWMAP_BLOCK;
+  int		r;
+
+  if(iw_fpblock_reserve(fpb, fpb->num_points + 1) < 0)
+    return(-1);
+  dst = fpb->cells + (size_t) (fpb->num_points / IWMAP_BLOCK) * fpb->pairs
+    * IWK_PAIR_LEN + 2 * slot;
+  for(r = 0; r < fpb->num_routers; r++)
+    {
+      int8_t	level = row[fpb->order ? fpb->order[r] : r];
+
+      dst[(r / 2) * IWK_PAIR_LEN + (r & 1)] = level;
+      norm += level * level;
+    }
+  fpb->norms[fpb->num_points] = norm;
+  return(fpb->num_points++);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release blocked fingerprints
+ */
+void
+iw_fpblock_free(struct iw_fpblock *	fpb)
+{
+  free(fpb->cells);
+  free(fpb->norms);
+  free(fpb->order);
+  memset(fpb, 0, sizeof(*fpb));
+}
+
+/***************************** SEARCH *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Pack the query by pairs of routers, in the order of the blocks, as
+ * the kernels want it (IWMAP_QPAIRS values)
+ */
+void
+iw_fpblock_query(const struct iw_fpblock *	fpb,
+		 const int8_t *			query,
+		 int32_t *			qpairs)
+{
+  const int *	order = fpb->order;
+  int		p;
+
+  if(iw_kernel_cur == NULL)
+    iw_kernel_select(NULL);
+  for(p = 0; p < fpb->pairs; p++)
+    {
+      int	r0 = 2 * p;
+      int	r1 = 2 * p + 1;
+      int	q1 = 0;
+
+      if(r1 < fpb->num_routers)
+	q1 = query[order ? order[r1] : r1];
+      qpairs[p] = (int32_t) (((uint32_t) (uint16_t) q1 << 16)
+			     | (uint16_t) query[order ? order[r0] : r0]);
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Pack the mask of a query that missed some routers (0 in query), next
+ * to iw_fpblock_query() : per pair, the heard routers, then the penalty
+ * of the missed ones (see iw_mask_fn). The padding of the last pair is
+ * heard, at 0 on both sides.
+ * Return the number of routers heard.
+ */
+static int
+iw_fpblock_mask(const struct iw_fpblock *	fpb,
+		const int8_t *			query,
+		int				penalty,
+		int32_t *			mpairs)
+{
+  const int *	order = fpb->order;
+  int		heard = 0;
+  int		p;
+  int		j;
+
+  for(p = 0; p < fpb->pairs; p++)
+    {
+      uint32_t	mask = 0;
+      uint32_t	pen = 0;
+
+      for(j = 0; j < 2; j++)
+	{
+	  int	r = 2 * p + j;
+
+	  if((r >= fpb->num_routers) || (query[order ? order[r] : r] != 0))
+	    {
+	      mask |= 0xFFFFU << (16 * j);
+	      heard += (r < fpb->num_routers);
+	    }
+	  else
+	    pen |= (uint32_t) penalty << (16 * j);
+	}
+      mpairs[2 * p] = (int32_t) mask;
+      mpairs[2 * p + 1] = (int32_t) pen;
+    }
+  return(heard);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Squared distance from a packed query (see iw_fpblock_query()) to the
+ * points of some blocks, IWMAP_BLOCK values per block
+ */
+void
+iw_fpblock_dist_blocks(const struct iw_fpblock *	fpb,
+		       const int32_t *			qpairs,
+		       int				first_block,
+		       int				num_blocks,
+		       int32_t *			dist)
+{
+  iw_kernel_cur->dist(fpb->cells + (size_t) first_block * fpb->pairs
+		      * IWK_PAIR_LEN, fpb->pairs, num_blocks, qpairs, dist);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Squared distance from the query (one level per router) to every point.
+ * dist must have room for the points rounded up to IWMAP_BLOCK.
+ */
+void
+iw_fpblock_dist(const struct iw_fpblock *	fpb,
+		const int8_t *			query,
+		int32_t *			dist)
+{
+  int32_t	qpairs[IWMAP_QPAIRS];
+
+  iw_fpblock_query(fpb, query, qpairs);
+  iw_kernel_cur->dist(fpb->cells, fpb->pairs,
+		      (fpb->num_points + IWMAP_BLOCK - 1) / IWMAP_BLOCK,
+		      qpairs, dist);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Nearest point to the query, the last one of the best if there are ties
+ * (as locate_signal() always did). Return its index, -1 if there are no
+ * points.
+ */
+int
+iw_fpblock_nearest(const struct iw_fpblock *	fpb,
+		   const int8_t *		query,
+		   int32_t *			best_dist)
+{
+  int32_t	qpairs[IWMAP_QPAIRS];
+  int32_t	dist[IWK_CHUNK * IWMAP_BLOCK];
+  size_t	block_len = (size_t) fpb->pairs * IWK_PAIR_LEN;
+  int32_t	best = INT32_MAX;
+  int		best_point = -1;
+  int		first;
+  int		i;
+
+  iw_fpblock_query(fpb, query, qpairs);
+  for(first = 0; first < fpb->num_points; first += IWK_CHUNK * IWMAP_BLOCK)
+    {
+      int	n = fpb->num_points - first;
+
+      if(n > IWK_CHUNK * IWMAP_BLOCK)
+	n = IWK_CHUNK * IWMAP_BLOCK;
+      iw_kernel_cur->dist(fpb->cells + (first / IWMAP_BLOCK) * block_len,
+			  fpb->pairs, (n + IWMAP_BLOCK - 1) / IWMAP_BLOCK,
+			  qpairs, dist);
+      for(i = 0; i < n; i++)
+	if(dist[i] <= best)
+	  {
+	    best = dist[i];
+	    best_point = first + i;
+	  }
+    }
+  if(best_dist != NULL)
+    *best_dist = best;
+  return(best_point);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Offer the points from start (a multiple of IWMAP_BLOCK) to end to the
+ * k nearest of a packed query, masked by mpairs if not NULL (see
+ * iw_fpblock_mask()). Once there are k, a block is given up as soon as
+ * all its points are further than the worst of them (ties may still
+ * win, see iw_knn_push()).
+ * Return the router pairs measured, over all the blocks.
+ */
+static int64_t
+iw_fpblock_knn_range(const struct iw_fpblock *	fpb,
+		     const int32_t *		qpairs,
+		     const int32_t *		mpairs,
+		     int			start,
+		     int			end,
+		     struct iw_knn *		knn)
+{
+  int32_t	dist[IWMAP_BLOCK];
+  size_t	block_len = (size_t) fpb->pairs * IWK_PAIR_LEN;
+  iw_part_fn	part = iw_kernel_part(fpb->pairs);
+  int64_t	measured = 0;
+  int		first;
+  int		i;
+
+  for(first = start; first < end; first += IWMAP_BLOCK)
+    {
+      int	n = end - first;
+      int32_t	bound = (knn->count < knn->k) ? INT32_MAX : knn->nb[0].dist;
+
+      if(n > IWMAP_BLOCK)
+	n = IWMAP_BLOCK;
+      if(mpairs == NULL)
+	measured += part(fpb->cells + (first / IWMAP_BLOCK) * block_len,
+			 fpb->pairs, qpairs, bound, dist);
+      else
+	measured += iw_kernel_cur->mask(fpb->cells + (first / IWMAP_BLOCK)
+					* block_len, fpb->pairs, qpairs,
+					mpairs, bound, dist);
+      /* Points come in order, so as far as the worst is better */
+      for(i = 0; i < n; i++)
+	if((knn->count < knn->k) || (dist[i] <= knn->nb[0].dist))
+	  iw_knn_push(knn, first + i, dist[i]);
+    }
+  return(measured);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Share of the cells of the blocks measured by a search
+ */
+static double
+iw_fpblock_visited(const struct iw_fpblock *	fpb,
+		   int64_t			measured)
+{
+  int	blocks = (fpb->num_points + IWMAP_BLOCK - 1) / IWMAP_BLOCK;
+
+  if((blocks == 0) || (fpb->pairs == 0))
+    return(0);
+  return((double) measured / ((double) blocks * fpb->pairs));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Shard of a search on the pool : its share of the blocks, its own
+ * neighbours
+ */
+struct iw_knn_shards
+{
+  const struct iw_fpblock *	fpb;
+  const int32_t *		qpairs;
+  const int32_t *		mpairs;		/* NULL : all heard */
+  struct iw_knn *		knn;		/* One per shard */
+  int64_t			measured[IW_POOL_MAX_THREADS];
+};
+
+static void
+iw_fpblock_knn_shard(void *	arg,
+		     int	shard,
+		     int	num_shards)
+{
+  struct iw_knn_shards *	job = arg;
+  int				blocks;
+  int				start;
+  int				end;
+
+  blocks = (job->fpb->num_points + IWMAP_BLOCK - 1) / IWMAP_BLOCK;
+  start = (int) ((int64_t) blocks * shard / num_shards) * IWMAP_BLOCK;
+  end = (int) ((int64_t) blocks * (shard + 1) / num_shards) * IWMAP_BLOCK;
+  if(end > job->fpb->num_points)
+    end = job->fpb->num_points;
+  job->knn[shard].count = 0;
+  job->measured[shard] = iw_fpblock_knn_range(job->fpb, job->qpairs,
+					      job->mpairs, start, end,
+					      &job->knn[shard]);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * k nearest points to a packed query, by the caller alone if pool is
+ * NULL, else on the threads of the pool. The map is split in as many
+ * shards as threads, each keeps its own k best, and they are merged
+ * once all are done : no lock and nothing shared while searching.
+ * Return the number found.
+ */
+static int
+iw_fpblock_knn_run(const struct iw_fpblock *	fpb,
+		   struct iw_pool *		pool,
+		   const int32_t *		qpairs,
+		   const int32_t *		mpairs,
+		   struct iw_knn *		knn)
+{
+  struct iw_knn		shards[IW_POOL_MAX_THREADS];
+  struct iw_knn_shards	job;
+  int64_t		measured;
+  int			s;
+  int			i;
+
+  knn->count = 0;
+  if((pool == NULL) || (pool->num_threads < 2))
+    measured = iw_fpblock_knn_range(fpb, qpairs, mpairs, 0, fpb->num_points,
+				    knn);
+  else
+    {
+      for(s = 0; s < pool->num_threads; s++)
+	shards[s].k = knn->k;
+      job.fpb = fpb;
+      job.qpairs = qpairs;
+      job.mpairs = mpairs;
+      job.knn = shards;
+      iw_pool_run(pool, iw_fpblock_knn_shard, &job);
+
+      measured = 0;
+      for(s = 0; s < pool->num_threads; s++)
+	{
+	  for(i = 0; i < shards[s].count; i++)
+	    if((knn->count < knn->k)
+	       || (shards[s].nb[i].dist <= knn->nb[0].dist))
+	      iw_knn_push(knn, shards[s].nb[i].point, shards[s].nb[i].dist);
+	  measured += job.measured[s];
+	}
+    }
+  knn->visited = iw_fpblock_visited(fpb, measured);
+  iw_knn_sort(knn);
+  return(knn->count);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * k nearest points to the query, sorted (see iw_knn_sort()), and in
+ * knn->visited the share of the cells it took.
+ * Return the number found.
+ */
+int
+iw_fpblock_knn(const struct iw_fpblock *	fpb,
+	       const int8_t *			query,
+	       struct iw_knn *			knn)
+{
+  int32_t	qpairs[IWMAP_QPAIRS];
+
+  iw_fpblock_query(fpb, query, qpairs);
+  return(iw_fpblock_knn_run(fpb, NULL, qpairs, NULL, knn));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * k nearest points to the query on the threads of a pool, the same as
+ * iw_fpblock_knn() (pool may be NULL).
+ * Return the number found.
+ */
+int
+iw_fpblock_knn_pool(const struct iw_fpblock *	fpb,
+		    struct iw_pool *		pool,
+		    const int8_t *		query,
+		    struct iw_knn *		knn)
+{
+  int32_t	qpairs[IWMAP_QPAIRS];
+
+  iw_fpblock_query(fpb, query, qpairs);
+  return(iw_fpblock_knn_run(fpb, pool, qpairs, NULL, knn));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * k nearest points to a scan that missed some routers (0 in query), on
+ * the pool if not NULL. The routers heard are compared as usual, a
+ * missed one costs penalty dB to the points that hear it, and nothing
+ * to those that don't. The distances are then scaled by the routers of
+ * the map over the routers heard, to stay comparable with those of the
+ * full scans. A scan that heard them all is iw_fpblock_knn_pool().
+ * Return the number found, 0 if the scan heard none of the routers.
+ */
+int
+iw_fpblock_knn_masked(const struct iw_fpblock *	fpb,
+		      struct iw_pool *		pool,
+		      const int8_t *		query,
+		      int			penalty,
+		      struct iw_knn *		knn)
+{
+  int32_t	qpairs[IWMAP_QPAIRS];
+  int32_t	mpairs[2 * IWMAP_QPAIRS];
+  int		heard;
+  int		i;
+
+  if(penalty < 0)
+    penalty = 0;
+  if(penalty > IW_KNN_PENALTY_MAX)
+    penalty = IW_KNN_PENALTY_MAX;
+  iw_fpblock_query(fpb, query, qpairs);
+  heard = iw_fpblock_mask(fpb, query, penalty, mpairs);
+  knn->count = 0;
+  knn->visited = 0;
+  if(heard == 0)
+    return(0);
+  if(heard == fpb->num_routers)
+    return(iw_fpblock_knn_run(fpb, pool, qpairs, NULL, knn));
+
+  iw_fpblock_knn_run(fpb, pool, qpairs, mpairs, knn);
+  /* The same factor for all, the order stays (ties at the top) */
+  for(i = 0; i < knn->count; i++)
+    knn->nb[i].dist = iw_dist_scale(knn->nb[i].dist, fpb->num_routers, heard);
+  return(knn->count);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * k nearest points of many queries at once, the same as iw_fpblock_knn()
+ * for each, for the offline runs over thousands of recorded samples.
+ * Query q is at queries + q * stride, and gets knn[q], whose k was set
+ * by iw_knn_init(). As a matrix product, by tiles : a chunk of the map
+ * that stays in L2 meets every query before the next chunk is loaded,
+ * and each cell meets IWK_QTILE queries in the registers. The sums go
+ * by |a|^2 + |b|^2 - 2 a.b, exactly the distances of the other kernels.
+ * Return 0, or -1 if out of memory.
+ */
+int
+iw_fpblock_knn_batch(const struct iw_fpblock *	fpb,
+		     const int8_t *		queries,
+		     int			num_queries,
+		     size_t			stride,
+		     struct iw_knn *		knn)
+{
+  int32_t	dist[IWK_QTILE * IWK_CHUNK * IWMAP_BLOCK];
+  int32_t *	qpairs;
+  int32_t *	qnorms;
+  size_t	block_len = (size_t) fpb->pairs * IWK_PAIR_LEN;
+  int		num_tiles = (num_queries + IWK_QTILE - 1) / IWK_QTILE;
+  int		chunk = IWK_BATCH_BYTES / (block_len ? block_len : 1);
+  int		first;
+  int		t;
+  int		q;
+  int		r;
+  int		i;
+
+  if(chunk > IWK_CHUNK)
+    chunk = IWK_CHUNK;
+  if(chunk < 1)
+    chunk = 1;
+  /* Packed queries, the last tile padded with empty ones */
+  qpairs = calloc((size_t) num_tiles * IWK_QTILE * (fpb->pairs + 1),
+		  sizeof(int32_t));
+  if(qpairs == NULL)
+    {
+      errno = ENOMEM;
+      return(-1);
+    }
+  qnorms = qpairs + (size_t) num_tiles * IWK_QTILE * fpb->pairs;
+  for(q = 0; q < num_queries; q++)
+    {
+      const int8_t *	query = queries + q * stride;
+      int32_t		tmp[IWMAP_QPAIRS];
+
+      iw_fpblock_query(fpb, query, tmp);
+      memcpy(qpairs + (size_t) q * fpb->pairs, tmp,
+	     fpb->pairs * sizeof(int32_t));
+      for(r = 0; r < fpb->num_routers; r++)
+	qnorms[q] += query[r] * query[r];
+      knn[q].count = 0;
+    }
+
+  for(first = 0; first < fpb->num_points; first += chunk * IWMAP_BLOCK)
+    {
+      int	n = fpb->num_points - first;
+      int	blocks;
+
+      if(n > chunk * IWMAP_BLOCK)
+	n = chunk * IWMAP_BLOCK;
+      blocks = (n + IWMAP_BLOCK - 1) / IWMAP_BLOCK;
+      for(t = 0; t < num_tiles; t++)
+	{
+	  iw_kernel_cur->batch(fpb->cells + (first / IWMAP_BLOCK) * block_len,
+			       fpb->pairs, blocks,
+			       qpairs + (size_t) t * IWK_QTILE * fpb->pairs,
+			       fpb->norms + first, qnorms + t * IWK_QTILE,
+			       dist);
+	  for(q = t * IWK_QTILE;
+	      (q < (t + 1) * IWK_QTILE) && (q < num_queries); q++)
+	    {
+	      const int32_t *	d = dist + (q % IWK_QTILE) * blocks * IWMAP_BLOCK;
+	      struct iw_knn *	nn = &knn[q];
+
+	      for(i = 0; i < n; i++)
+		if((nn->count < nn->k) || (d[i] <= nn->nb[0].dist))
+		  iw_knn_push(nn, first + i, d[i]);
+	    }
+	}
+    }
+
+  for(q = 0; q < num_queries; q++)
+    iw_knn_sort(&knn[q]);
+  free(qpairs);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Sums of the product codes of some blocks (see iwpq.c), IWPQ_BLOCK
+ * values per block, and in masks the points of each block with a sum up
+ * to limit. num_sub is a multiple of IWPQ_SUB_ALIGN.
+ */
+void
+iw_kernel_scan(const uint8_t *	codes,
+	       int		num_sub,
+	       int		num_blocks,
+	       const uint8_t *	tables,
+	       uint16_t		limit,
+	       uint16_t *	sums,
+	       uint32_t *	masks)
+{
+  if(iw_kernel_cur == NULL)
+    iw_kernel_select(NULL);
+  iw_kernel_cur->scan(codes, num_sub, num_blocks, tables, limit, sums, masks);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Distance of one fingerprint to a query, as iw_fpblock_knn_masked()
+ * measures it before the scaling : a router the query missed costs
+ * penalty dB to the fingerprint if it hears it. For the searches that
+ * measure a few points here and there (the trackers), not the blocks.
+ */
+int32_t
+iw_dist_masked(const int8_t *	row,
+	       const int8_t *	query,
+	       int		num_routers,
+	       int		penalty)
+{
+  int32_t	dist = 0;
+  int		r;
+
+  for(r = 0; r < num_routers; r++)
+    {
+      int	d = row[r] - query[r];
+
+      if(query[r] == 0)
+	d = row[r] ? penalty : 0;
+      dist += d * d;
+    }
+  return(dist);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Distance of a query that heard heard of the num_routers routers,
+ * scaled to all of them to compare with those of the full scans. With
+ * many routers, few heard and a big penalty it doesn't fit in 32 bits,
+ * so it stops at INT32_MAX (as far as can be).
+ */
+int32_t
+iw_dist_scale(int32_t	dist,
+	      int	num_routers,
+	      int	heard)
+{
+  int64_t	scaled = (int64_t) dist * num_routers / heard;
+
+  return((scaled > INT32_MAX) ? INT32_MAX : (int32_t) scaled);
+}
+
+/************************ NEAREST NEIGHBOURS ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Start a search of the k nearest neighbours
+ */
+void
+iw_knn_init(struct iw_knn *	knn,
+	    int			k)
+{
+  if(k < 1)
+    k = 1;
+  if(k > IW_KNN_MAX)
+    k = IW_KNN_MAX;
+  knn->k = k;
+  knn->count = 0;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Put nb at the top of the heap of the n first neighbours (the worst on
+ * top) and sift it down
+ */
+static void
+iw_knn_sift(struct iw_neighbour *	heap,
+	    int				n,
+	    struct iw_neighbour		nb)
+{
+  int	i;
+  int	c;
+
+  for(i = 0; (c = 2 * i + 1) < n; i = c)
+    {
+      if((c + 1 < n) && iw_knn_worse(&heap[c + 1], &heap[c]))
+	c++;
+      if(!iw_knn_worse(&heap[c], &nb))
+	break;
+      heap[i] = heap[c];
+    }
+  heap[i] = nb;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Offer a point to a kNN search : O(log k) if it makes it, a compare if
+ * it doesn't
+ */
+void
+iw_knn_push(struct iw_knn *	knn,
+	    int			point,
+	    int32_t		dist)
+{
+  struct iw_neighbour *	heap = knn->nb;
+  struct iw_neighbour	nb;
+  int			i;
+
+  nb.point = point;
+  nb.dist = dist;
+  if(knn->count < knn->k)
+    {
+      /* Not full, sift up */
+      for(i = knn->count++; i > 0; i = (i - 1) / 2)
+	{
+	  if(!iw_knn_worse(&nb, &heap[(i - 1) / 2]))
+	    break;
+	  heap[i] = heap[(i - 1) / 2];
+	}
+      heap[i] = nb;
+      return;
+    }
+
+  /* Full, replace the worst */
+  if(iw_knn_worse(&heap[0], &nb))
+    iw_knn_sift(heap, knn->count, nb);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Sort the neighbours found, the nearest first (heap sort in place)
+ */
+void
+iw_knn_sort(struct iw_knn *	knn)
+{
+  struct iw_neighbour *	heap = knn->nb;
+  struct iw_neighbour	nb;
+  int			n;
+
+  for(n = knn->count - 1; n > 0; n--)
+    {
+      /* The worst goes to the end, sift the last one down */
+      nb = heap[n];
+      heap[n] = heap[0];
+      iw_knn_sift(heap, n, nb);
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Position of the sample, from the positions of its neighbours weighted
+ * by the inverse of their diff.
+ * Return -1 if there are no neighbours.
+ */
+int
+iw_knn_position(const struct iw_knn *	knn,
+		const double *		x,
+		const double *		y,
+		double *		px,
+		double *		py)
+{
+  double	sw = 0;
+  double	sx = 0;
+  double	sy = 0;
+  int		i;
+
+  if(knn->count == 0)
+    {
+      errno = ENOENT;
+      return(-1);
+    }
+  for(i = 0; i < knn->count; i++)
+    {
+      double	w = 1.0 / (sqrt((double) knn->nb[i].dist) + IW_KNN_EPS);
+
+      sw += w;
+      sx += w * x[knn->nb[i].point];
+      sy += w * y[knn->nb[i].point];
+    }
+  *px = sx / sw;
+  *py = sy / sw;
+  return(0);
+}
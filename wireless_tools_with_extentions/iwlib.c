@@ -141,6 +141,18 @@ const struct iw_modul_descr	iw_modul_list[] = {
 /* Disable runtime version warning in iw_get_range_info() */
 int	iw_ignore_version = 0;
 
+/* Julz's extensions : location tracking state shared with iwlist */
+FILE *				fp[MAX_ROUTERS];
+struct router			router_address_map[MAX_ROUTERS];
+int				no_routers;
+int				valid_quality_event;
+struct timeval			curTimeUnit;
+int				num_aps;
+int				cur_router;
+int				num_timeUnits;
+char				test_num[4];
+struct location_tracking	window;
+
 /************************ SOCKET SUBROUTINES *************************/
 
 /*------------------------------------------------------------------*/
@@ -1426,7 +1438,7 @@ iw_print_stats(char *		buffer,
 										qual->updated & IW_QUAL_LEVEL_UPDATED ? '=' : ':',
 										rcpilevel);
 					///window update
-					window.sliding_window[window.curPos].signal_strength [num_aps -1] = rcpilevel;
+					window.sliding_window[window.curPos].signal_strength[cur_router] = iw_dbm_sat((int) rcpilevel);
 					//window.sliding_window[window.curPos].router[num_aps] =  rcpilevel;
 				}
 				
@@ -1470,7 +1482,7 @@ iw_print_stats(char *		buffer,
 											dblevel);
 											
 						///window update
-						window.sliding_window[window.curPos].signal_strength[num_aps -1] = dblevel;
+						window.sliding_window[window.curPos].signal_strength[cur_router] = iw_dbm_sat(dblevel);
 					}
 					
 					/* Deal with noise level in dBm (absolute power measurement) */
@@ -1505,7 +1517,7 @@ iw_print_stats(char *		buffer,
 											qual->level, range->max_qual.level);
 						
 						///window update
-						window.sliding_window[window.curPos].signal_strength[num_aps -1] = qual->level;
+						window.sliding_window[window.curPos].signal_strength[cur_router] = iw_dbm_sat(qual->level);
 					}
 					
 					/* Deal with noise level as relative value (0 -> max) */
@@ -1532,7 +1544,7 @@ iw_print_stats(char *		buffer,
 			fprintf(fp[num_aps -1], "Quality:,%d,  Signal level:,%d,  Noise level:,%d,",
 								qual->qual, qual->level, qual->noise);
 			///window update
-			window.sliding_window[window.curPos].signal_strength[num_aps -1] = qual->level;
+			window.sliding_window[window.curPos].signal_strength[cur_router] = iw_dbm_sat(qual->level);
 		}
 	}
 
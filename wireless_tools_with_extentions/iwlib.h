@@ -30,6 +30,7 @@
 #include <netdb.h>		/* gethostbyname, getnetbyname */
 #include <net/ethernet.h>	/* struct ether_addr */
 #include <sys/time.h>		/* struct timeval */
+#include <stdint.h>		/* int8_t (signal levels) */
 #include <unistd.h>
 
 /* This is our header selection. Try to hide the mess and the misery :-(
@@ -605,10 +606,12 @@ iw_ether_cmp(const struct ether_addr* eth1, const struct ether_addr* eth2)
 }
 /* Julz's extensions :D */
 ///file io
-#define MAX_ROUTERS 50
+#define MAX_ROUTERS 512 ///large sites hear a few hundred APs
 #define WINDOW_SIZE 100
-#define MAX_COORDINATES 1000
-FILE *fp [MAX_ROUTERS];
+///signal levels are kept as int8_t dBm: real readings lie in -110..0
+#define IW_DBM_MIN -128
+#define IW_DBM_MAX 127
+extern FILE *fp [MAX_ROUTERS];
 
 struct router	{
 	char mac [150] ;
@@ -616,27 +619,29 @@ struct router	{
 	int xCo, yCo;
 	
 	struct iw_quality current_signal;
-} router_address_map[MAX_ROUTERS];
+};
+extern struct router router_address_map[MAX_ROUTERS];
 ///
 
-int no_routers;///the number of routers that will be used in the experiment
-int valid_quality_event;
-double distance (double Pr, double Pt, double Gt, double Gr, double delta);
+extern int no_routers;///the number of routers that will be used in the experiment
+extern int valid_quality_event;
+double distance (double Pr, double P0, double n);///inverse of the path loss model
 
-struct timeval curTimeUnit;
+extern struct timeval curTimeUnit;
 
 ///location_time_stats: a struct to contain the signal levels at 1 point in time
 struct location_time_stats {
 	struct timeval time; ///time of sampling
 	struct iw_quality router[MAX_ROUTERS]; ///router signal levels at point in time
 	struct iw_event data [MAX_ROUTERS];
-	int signal_strength [MAX_ROUTERS];
+	int8_t signal_strength [MAX_ROUTERS]; ///dBm, saturated by iw_dbm_sat
 	union iwreq_data record;
 	};
 
-int num_aps;
-int num_timeUnits;
-char test_num [4];
+extern int num_aps;
+extern int cur_router;///column (router_address_map index) of the router being scanned
+extern int num_timeUnits;
+extern char test_num [4];
 
 ///struct to hold all signal readings, limiting the number by the "window size"
 struct location_tracking	{
@@ -644,22 +649,25 @@ struct location_tracking	{
 	int curPos;
 };
 ///the object that will hold signal tracking data
-struct location_tracking window;
-
+extern struct location_tracking window;
 
-///the number of coordinates read in from the map of environ
-int coor_count; 
-///the signals to coordinate map
-struct sig_coor_map_item	{
-	int signal_strength [MAX_ROUTERS];
-	double x,y;
-	char label [40];
-};
-struct sig_coor_map_item sig_coor_map [MAX_COORDINATES];
+///the signals to coordinate map is the fingerprint store, see iwmap.h
 
 
-///the localising function
-struct sig_coor_map_item * locate_signal (struct location_time_stats input_signals);
+/*------------------------------------------------------------------*/
+/*
+ * Convert a signal level to the int8_t dBm of the fingerprints,
+ * saturating out of range values rather than wrapping them
+ */
+static inline int8_t
+iw_dbm_sat(int	level)
+{
+  if(level < IW_DBM_MIN)
+    return(IW_DBM_MIN);
+  if(level > IW_DBM_MAX)
+    return(IW_DBM_MAX);
+  return((int8_t) level);
+}
 
 /*end of Julz's extensions*/
 #ifdef __cplusplus
@@ -12,7 +12,11 @@
  */
 
 #include "iwlib.h"		/* Header */
+#include "iwmap.h"		/* Radio maps */
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <getopt.h>
 
 /****************************** TYPES ******************************/
 
@@ -444,6 +448,524 @@ iw_print_gen_ie(unsigned char *	buffer,
  * do the complete job...
  */
 
+///the radio map used by track, mmap'ed from the compiled map file
+static struct iwmap radio_map;
+///the fingerprints of the radio map (learn_map: the point being learnt)
+static struct iw_fpstore fingerprints;
+///the routers kept, when the map was reduced to those that tell its points apart
+static struct iw_select router_selection;
+static int use_select = 0;
+///the heard cells only, for sparse maps (large sites)
+static struct iw_fpsparse sparse_fingerprints;
+///the same fingerprints by blocks of points, for the vector kernels (dense maps)
+static struct iw_fpblock block_fingerprints;
+///and their vantage point tree, for the dense maps too big for brute force
+static struct iw_vptree vptree_fingerprints;
+static int use_vptree = 0;
+///or their clusters, searching the members of the nearest few only (approximate)
+static struct iw_cluster cluster_fingerprints;
+static int use_cluster = 0;
+///the points by their strongest routers, only those sharing the sample's are measured
+static struct iw_invert invert_fingerprints;
+static int use_invert = 0;
+///or the threads sharing their brute force search, when there are cores for it
+static struct iw_pool search_pool;
+///or, for the maps learnt with the spread of each level, their likelihood
+static struct iw_gauss gauss_fingerprints;
+static int use_gauss = 0;
+///and their product codes, for the approximate search (iwmapc -q)
+static struct iw_pq pq_fingerprints;
+static int use_pq = 0;
+///the neighbourhood graph of the points, tracking searches around the last fix first
+static struct iw_graph graph_fingerprints;
+static int use_graph = 0;
+///the particle filter following the tracker across the floor (maps with positions)
+static struct iw_pf track_filter;
+static int use_filter = 0;
+///or the hidden Markov tracker, whose fixes only walk from point to point
+static struct iw_hmm track_hmm;
+static int use_hmm = 0;
+static double hmm_reach = 0;
+///the last results of the matcher, a device that doesn't move scans the same levels
+static struct iw_cache result_cache;
+static int use_cache = 0;
+///the points learnt while tracking, see learn_map
+static struct iw_journal journal;
+///the maps of a whole site, by building/floor/zone
+static struct iw_catalog catalog;
+///the routers of router_address_map, hashed by BSSID for the scan events
+static struct iw_bssid_registry router_registry;
+
+/*
+ * Julz:
+ * index the routers of router_address_map by BSSID, so that the scan
+ * event handlers find the column of a cell without comparing strings
+ */
+static int index_routers (void)
+{
+	unsigned char bssid [ETH_ALEN];
+	int c = 0;
+	
+	if (iw_registry_init(&router_registry, no_routers) < 0)
+		return -1;
+	for (c = 0 ; c < no_routers ; c++)	{
+		if (iw_ether_aton(router_address_map[c].mac, (struct ether_addr *) bssid) != ETH_ALEN)	{
+			fprintf(stderr, "Bad router address %s\n", router_address_map[c].mac);
+			continue;
+		}
+		if (iw_registry_add(&router_registry, bssid, c) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Julz:
+ * journal a learnt point next to the binary map, where running trackers
+ * pick it up, and merge the journal into the map once it gets big.
+ * The point goes in at (x, y), its position on the floor, with the mean
+ * and variance of each router, as in the text map
+ */
+static int journal_point (const char * map_path, const char * label, double x, double y, const int8_t * fingerprint, const double * mean, const double * variance)
+{
+	struct iwmap_jrec rec;
+	struct iwmap_jcell cells [MAX_ROUTERS];
+	struct iwmap_stat stats [MAX_ROUTERS];
+	char journal_path [PATH_MAX];
+	struct stat st;
+	int l = 0;
+	
+	memset(&rec, 0, sizeof(rec));
+	strncpy(rec.label, label, IWMAP_LABEL_LEN - 1);
+	rec.x = x;
+	rec.y = y;
+	///only the heard routers go in, by BSSID
+	for (l = 0 ; l < no_routers ; l++)	{
+		if (fingerprint[l] == 0)
+			continue;
+		if (iw_ether_aton(router_address_map[l].mac, (struct ether_addr *) cells[rec.num_cells].bssid) != ETH_ALEN)
+			continue;
+		cells[rec.num_cells].level = fingerprint[l];
+		cells[rec.num_cells].reserved = 0;
+		iw_stat_set(&stats[rec.num_cells], mean[l], variance[l]);
+		rec.num_cells++;
+	}
+	if (iw_journal_path(map_path, journal_path, sizeof(journal_path)) < 0
+	    || iw_journal_append(journal_path, &rec, cells, stats) < 0)
+		return -1;
+	
+	if (stat(journal_path, &st) == 0 && st.st_size >= IWMAP_JOURNAL_COMPACT)	{
+		int merged = iw_map_compact(map_path);
+		if (merged < 0)
+			return -1;
+		printf("merged %d learnt points into %s\n", merged, map_path);
+	}
+	return 0;
+}
+
+/*
+ * Julz:
+ * the Markov tracker of the map: its points within hmm_reach of each
+ * other, or linked by fingerprint for the maps without positions
+ */
+static int build_hmm (struct iw_hmm * hmm)
+{
+	struct iw_graph links;
+	int r = 0;
+	
+	if (radio_map.hdr->flags & IWMAP_F_COORDS)
+		return iw_hmm_build(hmm, &fingerprints, hmm_reach);
+	if (iw_graph_build(&links, &fingerprints, IW_HMM_DEGREE, 0) < 0)
+		return -1;
+	r = iw_hmm_build_graph(hmm, &links);
+	iw_graph_free(&links);
+	return r;
+}
+
+/*
+ * Julz:
+ * what a learnt point does to each search structure of track, see
+ * learn_hooks. The point was added to fingerprints (the last one), row is
+ * its fingerprint and stats its spreads (NULL without), grown is set if it
+ * brought new routers. -1 if the structure can't follow, it is dropped
+ */
+static int learn_pq (const int8_t * row, const struct iwmap_stat * stats, int grown)
+{
+	/* Avoid "Unused parameter" warning */
+	stats = stats;
+	
+	///the codebooks only know the routers they were trained on
+	if (grown)	{
+		printf("new routers, the product codes are out of date: exact search\n");
+		iw_pq_free(&pq_fingerprints);
+		use_pq = 0;
+		return 0;
+	}
+	return iw_pq_add(&pq_fingerprints, row);
+}
+
+static int learn_gauss (const int8_t * row, const struct iwmap_stat * stats, int grown)
+{
+	///learnt points come with their spreads, the old journals
+	///without: those get the default one
+	if (grown)	{
+		iw_gauss_free(&gauss_fingerprints);
+		return iw_gauss_build(&gauss_fingerprints, &fingerprints, IWMAP_FLOOR_DEFAULT);
+	}
+	return iw_gauss_add(&gauss_fingerprints, row, stats);
+}
+
+static int learn_graph (const int8_t * row, const struct iwmap_stat * stats, int grown)
+{
+	/* Avoid "Unused parameter" warning */
+	row = row; stats = stats;
+	
+	///learnt points are the tail of the graph, measured by every
+	///search: link them once the tail is a quarter of it, or at once if
+	///the links by fingerprint don't know the new routers
+	int by_position = radio_map.hdr->flags & IWMAP_F_COORDS;
+	if (!grown && 4 * (fingerprints.num_points - graph_fingerprints.num_points) <= graph_fingerprints.num_points)
+		return 0;
+	iw_graph_free(&graph_fingerprints);
+	return iw_graph_build(&graph_fingerprints, &fingerprints, IW_GRAPH_DEGREE, by_position);
+}
+
+static int learn_invert (const int8_t * row, const struct iwmap_stat * stats, int grown)
+{
+	/* Avoid "Unused parameter" warning */
+	row = row; stats = stats;
+	
+	///learnt points are measured by every search until they are posted
+	int votes = invert_fingerprints.votes;
+	if (!grown && 4 * (fingerprints.num_points - invert_fingerprints.num_points) <= invert_fingerprints.num_points)
+		return 0;
+	iw_inv_free(&invert_fingerprints);
+	if (iw_inv_build(&invert_fingerprints, &fingerprints) < 0)
+		return -1;
+	invert_fingerprints.votes = votes;
+	return 0;
+}
+
+static int learn_cluster (const int8_t * row, const struct iwmap_stat * stats, int grown)
+{
+	/* Avoid "Unused parameter" warning */
+	stats = stats;
+	
+	///the same for the clusters: the tail is measured by every search
+	int tail = cluster_fingerprints.members.num_points - cluster_fingerprints.tail;
+	int probe = cluster_fingerprints.probe;
+	if (!grown && 4 * tail <= cluster_fingerprints.tail)
+		return iw_cluster_add(&cluster_fingerprints, row);
+	iw_cluster_free(&cluster_fingerprints);
+	if (iw_cluster_build(&cluster_fingerprints, &fingerprints, 0) < 0)
+		return -1;
+	cluster_fingerprints.probe = probe;
+	return 0;
+}
+
+static int learn_vptree (const int8_t * row, const struct iwmap_stat * stats, int grown)
+{
+	/* Avoid "Unused parameter" warning */
+	stats = stats;
+	
+	///learnt points go to the tail of the tree, which is searched
+	///by brute force: build it again once the tail is a quarter of it
+	int tail = vptree_fingerprints.leaves.num_points - vptree_fingerprints.tail;
+	if (!grown && 4 * tail <= vptree_fingerprints.tail)
+		return iw_vptree_add(&vptree_fingerprints, row);
+	iw_vptree_free(&vptree_fingerprints);
+	return iw_vptree_build(&vptree_fingerprints, &fingerprints);
+}
+
+static int learn_filter (const int8_t * row, const struct iwmap_stat * stats, int grown)
+{
+	/* Avoid "Unused parameter" warning */
+	row = row; stats = stats; grown = grown;
+	
+	///the particles only land on the points of the grid, which has no
+	///tail: lay it out again at once, the cloud stays where it is
+	return iw_pf_remap(&track_filter, &fingerprints);
+}
+
+static int learn_hmm (const int8_t * row, const struct iwmap_stat * stats, int grown)
+{
+	/* Avoid "Unused parameter" warning */
+	row = row; stats = stats; grown = grown;
+	
+	///the transitions reach no learnt point: build them again at once,
+	///the beam goes on from where it was
+	struct iw_hmm hmm;
+	if (build_hmm(&hmm) < 0)
+		return -1;
+	iw_hmm_resume(&hmm, &track_hmm);
+	iw_hmm_free(&track_hmm);
+	track_hmm = hmm;
+	return 0;
+}
+
+static int learn_cache (const int8_t * row, const struct iwmap_stat * stats, int grown)
+{
+	/* Avoid "Unused parameter" warning */
+	row = row; stats = stats; grown = grown;
+	
+	///the new point may be nearer than the results kept
+	iw_cache_clear(&result_cache);
+	return 0;
+}
+
+static void drop_pq (void)	{ iw_pq_free(&pq_fingerprints); }
+static void drop_gauss (void)	{ iw_gauss_free(&gauss_fingerprints); }
+static void drop_graph (void)	{ iw_graph_free(&graph_fingerprints); }
+static void drop_invert (void)	{ iw_inv_free(&invert_fingerprints); }
+static void drop_cluster (void)	{ iw_cluster_free(&cluster_fingerprints); }
+static void drop_vptree (void)	{ iw_vptree_free(&vptree_fingerprints); }
+static void drop_filter (void)	{ iw_pf_free(&track_filter); }
+static void drop_hmm (void)	{ iw_hmm_free(&track_hmm); }
+static void drop_cache (void)	{ iw_cache_free(&result_cache); }
+
+/*
+ * Julz:
+ * the search structures that follow the learnt points, each with the flag
+ * track turns it on with. A new structure of track goes here too
+ */
+typedef struct learn_entry {
+  const char *		name;		/* For the messages */
+  int *			in_use;		/* Set by track */
+  int			(* learn) (const int8_t * row, const struct iwmap_stat * stats, int grown);
+  void			(* drop) (void);	/* Release it */
+} learn_hook;
+
+static const struct learn_entry learn_hooks[] = {
+	{ "product codes",	&use_pq,	learn_pq,	drop_pq },
+	{ "likelihood search",	&use_gauss,	learn_gauss,	drop_gauss },
+	{ "local search",	&use_graph,	learn_graph,	drop_graph },
+	{ "router index",	&use_invert,	learn_invert,	drop_invert },
+	{ "clusters",		&use_cluster,	learn_cluster,	drop_cluster },
+	{ "vantage point tree",	&use_vptree,	learn_vptree,	drop_vptree },
+	{ "particle filter",	&use_filter,	learn_filter,	drop_filter },
+	{ "Markov tracker",	&use_hmm,	learn_hmm,	drop_hmm },
+	{ "result cache",	&use_cache,	learn_cache,	drop_cache },
+	{ NULL, NULL, NULL, NULL },
+};
+
+/*
+ * Julz:
+ * pick up the points learnt since the map was loaded, from its journal,
+ * without reloading anything: new routers get a new column. The
+ * fingerprints take the point, then each structure in use (learn_hooks);
+ * one that can't follow is dropped, the others go on
+ */
+static void poll_journal (int sparse)
+{
+	struct iwmap_jrec rec;
+	struct iwmap_jcell cells [MAX_ROUTERS];
+	struct iwmap_stat stats [MAX_ROUTERS];
+	struct iwmap_router new_routers [MAX_ROUTERS];
+	int8_t row [MAX_ROUTERS];
+	struct iwmap_stat stats_row [MAX_ROUTERS];
+	int r = 0;
+	
+	if (journal.path == NULL)
+		return;
+	while ((r = iw_journal_next(&journal, &rec, cells, stats)) > 0)	{
+		int old_routers = no_routers;
+		///points learnt with their spreads bring the stats of their cells
+		const struct iwmap_stat * point_stats = (rec.flags & IWMAP_JREC_F_STATS) ? stats_row : NULL;
+		if (iw_journal_row(&router_registry, new_routers, &no_routers, MAX_ROUTERS, &rec, cells, stats, row, stats_row) < 0)	{
+			r = -1;
+			break;
+		}
+		int c = 0;
+		for (c = old_routers ; c < no_routers ; c++)	{
+			iw_ether_ntop((const struct ether_addr *) new_routers[c].bssid, router_address_map[c].mac);
+			router_address_map[c].essid[0] = '\0';
+			router_address_map[c].xCo = 0;
+			router_address_map[c].yCo = 0;
+		}
+		///a reduced map keeps its routers, new ones too: the point is projected
+		///on them and nothing has to be laid out again (its spreads aren't)
+		if (use_select)	{
+			iw_select_row(&router_selection, row, row);
+			old_routers = no_routers;
+			point_stats = NULL;
+		}
+		if (no_routers != old_routers && iw_fpstore_set_routers(&fingerprints, no_routers) < 0)	{
+			r = -1;
+			break;
+		}
+		sparse_fingerprints.num_routers = no_routers;
+		if (iw_fpstore_add(&fingerprints, row, rec.x, rec.y, rec.label) < 0
+		    || (sparse && iw_fpsparse_add(&sparse_fingerprints, row) < 0)
+		    || (!sparse && point_stats != NULL
+			&& iw_fpstore_set_stats(&fingerprints, fingerprints.num_points - 1, point_stats) < 0))	{
+			r = -1;
+			break;
+		}
+		if (!sparse)	{
+			///new routers change the blocks, lay them out again
+			if (no_routers != old_routers)	{
+				iw_fpblock_free(&block_fingerprints);
+				r = iw_fpblock_from_store(&block_fingerprints, &fingerprints);
+			}
+			else
+				r = iw_fpblock_add(&block_fingerprints, row);
+			if (r < 0)
+				break;
+		}
+		int h = 0;
+		for (h = 0 ; learn_hooks[h].name != NULL ; h++)	{
+			const learn_hook * hook = &learn_hooks[h];
+			if (!*hook->in_use || hook->learn(row, point_stats, no_routers != old_routers) == 0)
+				continue;
+			fprintf(stderr, "Can't add %s to the %s, dropping it : %s\n", rec.label, hook->name, strerror(errno));
+			hook->drop();
+			*hook->in_use = 0;
+		}
+		printf("picked up learnt point %s (%d points)\n", rec.label, fingerprints.num_points);
+	}
+	if (r < 0)
+		fprintf(stderr, "Can't pick up the learnt points : %s\n", strerror(errno));
+}
+
+/*
+ * Julz:
+ * locate in a catalogue: the catalogue picks the zones whose routers match
+ * the sample, and each of their maps is searched with locate_signal_sparse.
+ * The diffs are over all the routers of the catalogue (a router the zone
+ * doesn't know counts as unheard), so the zones can be compared. The
+ * neighbours all come from the best zone.
+ */
+static int locate_in_catalogue (const int8_t * sample, int probe, int * shard_out, struct iw_knn * knn)
+{
+	int8_t zone_sample [MAX_ROUTERS];
+	struct iw_knn zone_knn;
+	int shards [IWCAT_PROBE_MAX];
+	int num_shards = iw_catalog_select(&catalog, sample, probe, shards);
+	int best_location = -1;
+	int best_diff = 0;
+	int s = 0;
+	knn->count = 0;
+	for (s = 0 ; s < num_shards ; s++)	{
+		const struct iw_shard * shard = &catalog.shards[shards[s]];
+		///the sample in the columns of the zone, and what the heard routers
+		///it doesn't know about cost
+		int outside = 0;
+		int c = 0;
+		for (c = 0 ; c < catalog.num_routers ; c++)	{
+			int level = sample[c];
+			if (level != 0)
+				outside += (level - shard->sp.floor)*(level - shard->sp.floor);
+		}
+		for (c = 0 ; c < shard->sp.num_routers ; c++)	{
+			int level = sample[shard->global[c]];
+			zone_sample[c] = level;
+			if (level != 0)
+				outside -= (level - shard->sp.floor)*(level - shard->sp.floor);
+		}
+		iw_knn_init(&zone_knn, knn->k);
+		int location = locate_signal_sparse(&shard->sp, zone_sample, &zone_knn);
+		if (location < 0)
+			continue;
+		int diff = zone_knn.nb[0].dist + outside;
+		printf("zone %s: %s (diff %d)\n", shard->name, iw_fpstore_label(&shard->fps, location), diff);
+		if (best_location < 0 || diff < best_diff)	{
+			best_location = location;
+			best_diff = diff;
+			*shard_out = shards[s];
+			///the neighbours, with the same diffs as the zones
+			int n = 0;
+			for (n = 0 ; n < zone_knn.count ; n++)
+				zone_knn.nb[n].dist += outside;
+			*knn = zone_knn;
+		}
+	}
+	return best_location;
+}
+
+/*
+ * Julz:
+ * with more than one neighbour (kNN), the position of the sample worked out
+ * from the positions of the neighbours, and the neighbours themselves
+ */
+static void print_position (const struct iw_fpstore * fps, int coords, const struct iw_knn * knn)
+{
+	if (knn->k < 2)
+		return;
+	if (coords)	{
+		double x = 0, y = 0;
+		if (iw_knn_position(knn, fps->x, fps->y, &x, &y) == 0)
+			printf("position: (%.2f, %.2f) from %d neighbours\n", x, y, knn->count);
+	}
+	int n = 0;
+	for (n = 0 ; n < knn->count ; n++)
+		printf("  neighbour %s (diff %d)\n", iw_fpstore_label(fps, knn->nb[n].point), knn->nb[n].dist);
+}
+
+/*
+ * Julz:
+ * the searches of a dense map timed by choose_search, as iw_pool_probe
+ * calls them
+ */
+static int probe_blocks (void * pool, const int8_t * query, struct iw_knn * knn)
+{
+	return iw_fpblock_knn_pool(&block_fingerprints, pool, query, knn);
+}
+
+static int probe_vptree (void * arg, const int8_t * query, struct iw_knn * knn)
+{
+	int visited = 0;
+	arg = arg;
+	return iw_vptree_knn(&vptree_fingerprints, query, knn, &visited);
+}
+
+/*
+ * Julz:
+ * search a dense map by brute force on this thread, on the threads of the
+ * pool, or through the vantage point tree: whichever is the fastest here,
+ * with this map. Which one wins depends on the cores, their caches and the
+ * width of the map (see iwlocbench -t and -x), so they are timed on a few
+ * points of the map rather than guessed. The tree is only tried from
+ * IW_VPTREE_MIN_POINTS, it never wins below
+ */
+static void choose_search (int threads, int k)
+{
+	double brute = iw_pool_probe(&fingerprints, k, probe_blocks, NULL);
+	double pool = -1;
+	double tree = -1;
+	if (threads != 1 && iw_pool_init(&search_pool, threads) > 1)
+		pool = iw_pool_probe(&fingerprints, k, probe_blocks, &search_pool);
+	else
+		iw_pool_free(&search_pool);
+	if (fingerprints.num_points >= IW_VPTREE_MIN_POINTS)	{
+		if (iw_vptree_build(&vptree_fingerprints, &fingerprints) < 0)
+			fprintf(stderr, "Can't index the map, brute force : %s\n", strerror(errno));
+		else
+			tree = iw_pool_probe(&fingerprints, k, probe_vptree, NULL);
+	}
+	printf("brute force %.1f us", brute * 1e6);
+	if (pool >= 0)
+		printf(", on %d threads %.1f us", search_pool.num_threads, pool * 1e6);
+	if (tree >= 0)
+		printf(", vantage point tree %.1f us", tree * 1e6);
+	printf(" per query\n");
+	
+	///the pool is only kept if it beats the others, and so is the tree
+	if (pool >= 0 && (pool >= brute || (tree >= 0 && pool >= tree)))	{
+		iw_pool_free(&search_pool);
+		pool = -1;
+	}
+	if (tree >= 0 && (tree >= brute || pool >= 0))	{
+		iw_vptree_free(&vptree_fingerprints);
+		tree = -1;
+	}
+	if (pool >= 0)
+		printf("searching on %d threads\n", search_pool.num_threads);
+	else if (tree >= 0)	{
+		use_vptree = 1;
+		printf("indexed %d points in a vantage point tree\n", vptree_fingerprints.num_points);
+	}
+}
+
 /*
  * Julz:
  * Learn map: 
@@ -490,6 +1012,10 @@ void learn_map (int		skfd,
 	}
 	fclose(router_list);///close the file
 	printf("end of router file io\n");
+	if (index_routers() < 0)	{
+		fprintf(stderr, "Can't index the routers : %s\n", strerror(errno));
+		return;
+	}
 	
 	/*
 	///create test coordinates
@@ -532,7 +1058,6 @@ void learn_map (int		skfd,
 		printf(": %d %d\n",curTimeUnit.tv_sec, curTimeUnit.tv_usec);
 		
 		///now compare the data to the coordinate map: where is it?!
-		struct sig_coor_map_item * location;
 		if (num_aps == no_routers)	{
 			/*
 			///send to file the signal strengths of the routers: they ID the coord.
@@ -590,12 +1115,28 @@ void learn_map (int		skfd,
 	}
 	
 	///get the median of the window of results
+	int8_t fingerprint [MAX_ROUTERS];
+	///and the mean and variance of the heard levels, for the likelihood matcher
+	double mean [MAX_ROUTERS];
+	double variance [MAX_ROUTERS];
 	int l = 0;
 	for (l = 0 ; l < no_routers ; l++)
 	{
-		///print the router mac to file
-		fprintf(coord_file,"%s ",router_address_map[l].mac);
+		int heard = 0;
+		double sum = 0, sum2 = 0;
 		int k = 0;
+		for (k = 0 ; k < 10 ; k++)
+		{
+			int level = window.sliding_window[k].signal_strength[l];
+			if (level != 0)	{
+				heard ++;
+				sum += level;
+				sum2 += (double) level * level;
+			}
+		}
+		mean[l] = heard ? sum / heard : 0;
+		variance[l] = heard ? fmax(sum2 / heard - mean[l] * mean[l], 0) : 0;
+		
 		int counts [10][2];
 		///init counts
 		int n = 0;
@@ -649,10 +1190,48 @@ void learn_map (int		skfd,
 			}
 		}
 		//printf("most popular was %d with %d\n",counts[most_popular_value_index][0],counts[most_popular_value_index][1]);
-		fprintf(coord_file,"%d\n",counts[most_popular_value_index][0]);
-		printf("file; %d\n",counts[most_popular_value_index][0]);
+		fingerprint[l] = counts[most_popular_value_index][0];
+	}
+	
+	///where the point is: given after its label, or from the coordinates file
+	double x = 0, y = 0;
+	int have_coords = 0;
+	if (count > 3)	{
+		x = atof(args[2]);
+		y = atof(args[3]);
+		have_coords = 1;
+	}
+	else	{
+		FILE * coords_file = fopen("../input/actual_coordinates.txt", "r");
+		if (coords_file != NULL)	{
+			have_coords = iw_map_find_coords(coords_file, args[1], &x, &y) == 0;
+			fclose(coords_file);
+		}
+	}
+	
+	///store the new point, then send its fingerprint to the file
+	int point = -1;
+	if (iw_fpstore_init(&fingerprints, no_routers) == 0)
+		point = iw_fpstore_add(&fingerprints, fingerprint, x, y, args[1]);
+	if (point < 0)
+		fprintf(stderr, "Can't store the fingerprint : %s\n", strerror(errno));
+	else	{
+		const int8_t * row = iw_fpstore_row(&fingerprints, point);
+		for (l = 0 ; l < fingerprints.num_routers ; l++)	{
+			fprintf(coord_file,"%s %d %.2f %.2f\n",router_address_map[l].mac,row[l],mean[l],variance[l]);
+			printf("file; %d\n",row[l]);
+		}
 		
+		///and to the journal of the binary map, for the trackers: not without
+		///its position, the trackers would put it at the origin
+		char map_filename [PATH_MAX];
+		snprintf(map_filename, sizeof(map_filename), "../input/coordinate_maps/%s.map" , args[0]);
+		if (!have_coords)
+			fprintf(stderr, "No coordinates for %s (give them after the label, or in actual_coordinates.txt), not journalled\n", args[1]);
+		else if (journal_point(map_filename, args[1], x, y, row, mean, variance) < 0)
+			fprintf(stderr, "Can't journal the point : %s\n", strerror(errno));
 	}
+	iw_fpstore_free(&fingerprints);
 	///close all file buffers
 	i = 0;
 	while (fp[i] != NULL)	{
@@ -660,9 +1239,31 @@ void learn_map (int		skfd,
 		fclose(fp[i++]);
 		printf("closed fp %d\n",i);
 	}
+	iw_registry_free(&router_registry);
 	
 }
 
+/*
+ * Julz:
+ * the tuning of track, by name, all of them optional (see track)
+ */
+static const struct option track_opts[] = {
+  { "cache", required_argument, NULL, 'q' },
+  { "candidates", required_argument, NULL, 'c' },
+  { "clusters", required_argument, NULL, 'C' },
+  { "floor", required_argument, NULL, 'f' },
+  { "local", required_argument, NULL, 'l' },
+  { "markov", required_argument, NULL, 'm' },
+  { "neighbours", required_argument, NULL, 'k' },
+  { "particles", required_argument, NULL, 'P' },
+  { "penalty", required_argument, NULL, 'p' },
+  { "routers", required_argument, NULL, 'r' },
+  { "threads", required_argument, NULL, 't' },
+  { "votes", required_argument, NULL, 'v' },
+  { "zones", required_argument, NULL, 'z' },
+  { NULL, 0, NULL, 0 }
+};
+
 /*
 * Julz:
 * track: 
@@ -673,101 +1274,339 @@ void track (int		skfd,
 								 char *	args[],		/* Command line args */
 								 int		count)		/* Args count */
 {
+	///sparse maps (iwmapc -s) only hold the heard routers of each point:
+	///unheard ones count as the floor value, which can be given with -f
+	///(and then also applies to dense maps)
+	int has_floor = 0;
+	int floor = IWMAP_FLOOR_DEFAULT;
+	///the number of zones searched in a catalogue
+	int probe = IWCAT_PROBE_DEFAULT;
+	///the number of neighbours the position is worked out from (kNN)
+	int k = IW_KNN_DEFAULT;
+	///the candidates the approximate search measures (more is slower, but finds more)
+	int rerank = IWPQ_RERANK_DEFAULT;
+	///the threads searching big dense maps (0, the default, is one per core)
+	int threads = 0;
+	///what a router the scan missed costs a point hearing it, in dB (dense maps)
+	int penalty = IW_KNN_PENALTY_DEFAULT;
+	///the worst fix, in dB per router, the search around the last one
+	///may give before the whole map is searched: 0 never searches around,
+	///without -l only the big maps do (dense maps)
+	int has_local = 0;
+	int threshold = IW_GRAPH_THRESHOLD_DEFAULT;
+	///the particles of the filter following the fixes, 0 (the default) for none
+	int particles = 0;
+	///how far the hidden Markov tracker walks between two scans, in map
+	///units (IW_HMM_REACH is a second or so of walking), 0 (the default) for none
+	double reach = 0;
+	///the clusters whose members are searched, the map being clustered
+	///when loaded (dense maps), 0 (the default) for none: the whole map
+	int clusters = 0;
+	///how many of its IW_INV_KEYS strongest routers a point must share with
+	///the sample to be measured (1 any, IW_INV_KEYS all), 0 (the default) for
+	///none (dense maps)
+	int votes = 0;
+	///how many routers the searches keep, those that tell the points apart
+	///the most, or "auto" for the fewest that mostly find the same points as
+	///all of them, 0 (the default) for all (dense maps)
+	int keep_routers = 0;
+	///the dB the levels are rounded to for the cache of the results, 1 for
+	///the same levels only, 0 (the default) for no cache (maps, not catalogues)
+	int quantum = 0;
+	
+	///getopt wants the name of the command first, and reorders what it gets
+	char * argv [count + 2];
+	int opt = 0;
+	argv[0] = "track";
+	memcpy(argv + 1, args, count * sizeof(char *));
+	argv[count + 1] = NULL;
+	///a new scan of the options for each interface
+	optind = 0;
+	while ((opt = getopt_long(count + 1, argv, "C:c:f:k:l:m:P:p:q:r:t:v:z:", track_opts, NULL)) > 0)	{
+		switch (opt)	{
+		case 'C':
+			clusters = atoi(optarg);
+			break;
+		
+		case 'c':
+			rerank = atoi(optarg);
+			break;
+		
+		case 'f':
+			floor = iw_dbm_sat(atoi(optarg));
+			has_floor = 1;
+			break;
+		
+		case 'k':
+			k = atoi(optarg);
+			break;
+		
+		case 'l':
+			threshold = atoi(optarg);
+			has_local = 1;
+			break;
+		
+		case 'm':
+			reach = atof(optarg);
+			break;
+		
+		case 'P':
+			particles = atoi(optarg);
+			break;
+		
+		case 'p':
+			penalty = atoi(optarg);
+			break;
+		
+		case 'q':
+			quantum = atoi(optarg);
+			break;
+		
+		case 'r':
+			keep_routers = strcmp(optarg, "auto") ? atoi(optarg) : -1;
+			break;
+		
+		case 't':
+			threads = atoi(optarg);
+			break;
+		
+		case 'v':
+			votes = atoi(optarg);
+			break;
+		
+		case 'z':
+			probe = atoi(optarg);
+			break;
+		
+		default:
+			fprintf(stderr, "iwlist: bad option to `track' (check 'iwlist --help').\n");
+			return;
+		}
+	}
+	if (count + 1 - optind != 2)	{
+		fprintf(stderr, "iwlist: `track' needs a map and a test number (check 'iwlist --help').\n");
+		return;
+	}
+	const char * map_path = argv[optind];
 	
 	///test output via this pointer
 	FILE * test_output = fopen("../output/test_outputs/output.txt", "a");///open the file for appending
 	if (test_output == NULL) 
 		printf( "Can't open the output test file!\n");	
 	
-	printf("track: %d %s %s %s %s\n",count,ifname,args[0],args[1]);
+	printf("track: %d %s %s %s\n",count,ifname,map_path,argv[optind + 1]);
 	
-	strcpy(test_num , args[1]);
+	strcpy(test_num , argv[optind + 1]);
 	printf("test num is : %s\n",test_num);
 	///outfile heading print:
 	fprintf(test_output, "Tracking:\n" );
-	///get from file the relivant routers 
-	FILE * router_list = fopen("../input/inputrouters.txt", "r");///open the file
-	if (router_list == NULL) 
-		printf( "Can't open input file router list!\n");	
 	
-	///init new router vars
-	char mac [18];
-	int xCo =0, yCo=0;
-	char essid[30];
-	printf("start of input file io\n");
-	///
+	///follow the journal of the map (learn_map), before loading the map:
+	///should a compaction happen in between, we then see its points twice
+	///rather than never
+	char journal_path [PATH_MAX];
+	if (iw_journal_path(map_path, journal_path, sizeof(journal_path)) < 0 || iw_journal_open(&journal, journal_path) < 0)
+		fprintf(stderr, "Can't follow the journal of %s : %s\n", map_path, strerror(errno));
 	
-	fscanf(router_list, "%d", &no_routers);///obtain no routers as 1st param
+	///get the compiled radio map (see iwmapc): it is mmap'ed, not parsed.
+	///a catalogue of maps (building/floor/zone, see iwcatalog.c) will do too
+	int catalogue = 0;
+	if (iw_map_open(map_path, &radio_map) < 0)	{
+		if (errno == EINVAL && iw_catalog_load(&catalog, map_path) == 0)
+			catalogue = 1;
+		else	{
+			fprintf(stderr, "Can't load radio map %s : %s (compile it with iwmapc)\n", map_path, strerror(errno));
+			if (test_output != NULL)
+				fclose(test_output);
+			iw_journal_close(&journal);
+			return;
+		}
+	}
+	///the points learnt go to the journals of the shards, not the catalogue
+	if (catalogue)
+		iw_journal_close(&journal);
+	if (!catalogue && (radio_map.hdr->num_points == 0 || radio_map.hdr->num_routers > MAX_ROUTERS))	{
+		fprintf(stderr, "Radio map %s is empty or has too many routers (%d)\n", map_path, radio_map.hdr->num_routers);
+		iw_map_close(&radio_map);
+		if (test_output != NULL)
+			fclose(test_output);
+		iw_journal_close(&journal);
+		return;
+	}
+	
+	///the router table of the map gives the relevant routers, in the
+	///order of the fingerprint columns (of the catalogue: all the shards)
+	const struct iwmap_router * routers = catalogue ? catalog.routers : radio_map.routers;
+	no_routers = catalogue ? catalog.num_routers : (int) radio_map.hdr->num_routers;
 	printf("no routers %d\n", no_routers);
 	
 	int c =0;
 	for (c = 0 ; c < no_routers ; c++){
 		
-		fscanf(router_list, "%s %d	%d	%s", mac, &xCo, &yCo, essid) ;///capture
-		printf("captured router %d: %s\n", c, essid);
 		///assign router data to the router_address_map item
-		strcpy(router_address_map[c].mac , mac);
-		router_address_map[c].xCo = xCo;
-		router_address_map[c].yCo = yCo;
-		strcpy(router_address_map[c].essid ,essid);
+		iw_ether_ntop((const struct ether_addr *) routers[c].bssid, router_address_map[c].mac);
+		router_address_map[c].xCo = routers[c].x;
+		router_address_map[c].yCo = routers[c].y;
+		snprintf(router_address_map[c].essid, sizeof(router_address_map[c].essid), "%s", routers[c].essid);
+		printf("captured router %d: %s\n", c, router_address_map[c].essid);
 		
 	}
-	fclose(router_list);///close the file
-	printf("end of router file io\n");
-	
-	/*///create test coordinates
-	sig_coor_map [0].signal_strength [0] = -68;
-	sig_coor_map [0].signal_strength [1] = -87;
-	strcpy(sig_coor_map [0].label , "lounge table");
-	
-	sig_coor_map [1].signal_strength [0] = -39;
-	sig_coor_map [1].signal_strength [1] = -84;
-	strcpy(sig_coor_map [1].label , "outside dads office");*/
 	
-	///get the coordinates from file
-	char coord_filename [100];
-	sprintf(coord_filename, "%s" , args[0]);
-	printf("\n\n\n%s\n",coord_filename);
-	FILE * coord_file_pointer = fopen(coord_filename,"r");
+	if (index_routers() < 0)	{
+		fprintf(stderr, "Can't index the routers : %s\n", strerror(errno));
+		if (catalogue)
+			iw_catalog_free(&catalog);
+		else
+			iw_map_close(&radio_map);
+		iw_journal_close(&journal);
+		return;
+	}
 	
-	///
-	//fscanf(router_list, "%d", &no_routers);///obtain no routers as 1st param
-	//printf("no routers %d\n", no_routers);
-	
-	coor_count = 0;
-	//TODO
-	while (coor_count < 56) {
-		char point_label [100];
-		fscanf(coord_file_pointer, "%s", point_label) ;///capture label
-		printf("captured point with label: %s\n", point_label);
-		///for each router, capture the mac and signal fingerprint
-		int router_index = 0;
-		for (router_index = 0 ; router_index < no_routers ; router_index++)
-		{
-			char mac [107];
-			int value = 0;
-			fscanf (coord_file_pointer, "%s %d", mac, &value);
-			printf("mac: %s - valu: %d\n",mac,value);
-			
-			///now find the router and align the value to the right mac in signal_strength
-			int i = 0;
-			for (i < 0 ; i < no_routers ; i++)
-			{
-				if (strcmp(router_address_map[i].mac , mac) == 0)	{
-					sig_coor_map [coor_count].signal_strength [i] = value;
-					strcpy(sig_coor_map [coor_count].label,point_label); 
-					printf("found mac %s at %d\n",mac,i);
-					break;
-				}
+	///a floor given makes a dense map sparse too
+	int sparse = catalogue || (radio_map.hdr->flags & IWMAP_F_SPARSE) || has_floor;
+	struct iw_knn knn;
+	iw_knn_init(&knn, k);
+	///the last fix, where the next search starts
+	int last_fix = -1;
+	double last_time = 0;
+	if (catalogue)	{
+		int s = 0;
+		for (s = 0 ; s < catalog.num_shards ; s++)	{
+			catalog.shards[s].sp.floor = floor;
+			printf("zone %s: %d points\n", catalog.shards[s].name, catalog.shards[s].sp.num_points);
+		}
+		printf("%d zones, searching %d per scan, floor %d dBm\n", catalog.num_shards, probe, floor);
+	}
+	else	{
+		///the fingerprints are used in place, straight from the mapping
+		iw_fpstore_from_map(&fingerprints, &radio_map);
+		printf("loaded %d points from %s\n", fingerprints.num_points, map_path);
+	}
+	if (sparse && !catalogue)	{
+		if (iw_fpsparse_from_map(&sparse_fingerprints, &radio_map) < 0)	{
+			fprintf(stderr, "Can't load the fingerprints of %s : %s\n", map_path, strerror(errno));
+			iw_map_close(&radio_map);
+			iw_registry_free(&router_registry);
+			iw_journal_close(&journal);
+			return;
+		}
+		sparse_fingerprints.floor = floor;
+		printf("%u heard cells, floor %d dBm\n", sparse_fingerprints.nnz, sparse_fingerprints.floor);
+	}
+	else if (!sparse)	{
+		///the searches only measure the routers kept, the map is projected on them
+		if (keep_routers != 0 && (radio_map.hdr->flags & IWMAP_F_STATS))
+			fprintf(stderr, "Spreads learnt in %s, keeping all the routers\n", map_path);
+		else if (keep_routers != 0)	{
+			struct iw_fpstore reduced;
+			int by_position = radio_map.hdr->flags & IWMAP_F_COORDS;
+			iw_select_rank(&router_selection, &fingerprints);
+			if ((keep_routers < 0 ? iw_select_auto(&router_selection, &fingerprints, by_position, IW_SELECT_TARGET_DEFAULT) : iw_select_keep(&router_selection, keep_routers)) < 0
+			    || iw_select_store(&router_selection, &fingerprints, &reduced) < 0)
+				fprintf(stderr, "Can't select the routers of %s, keeping them all : %s\n", map_path, strerror(errno));
+			else	{
+				double agree = keep_routers < 0 ? router_selection.agree : iw_select_check(&router_selection, &fingerprints, by_position);
+				///the store was borrowed from the map, nothing to free
+				iw_fpstore_free(&fingerprints);
+				fingerprints = reduced;
+				use_select = 1;
+				printf("kept %d of %d routers, %d held out points located %.0f%% as well as with all\n", router_selection.num_kept, router_selection.num_routers, IW_SELECT_HELD, 100.0 * agree);
+			}
+		}
+		if (iw_fpblock_from_store(&block_fingerprints, &fingerprints) < 0)	{
+			fprintf(stderr, "Can't load the fingerprints of %s : %s\n", map_path, strerror(errno));
+			iw_map_close(&radio_map);
+			iw_registry_free(&router_registry);
+			iw_journal_close(&journal);
+			return;
+		}
+		printf("searching with the %s kernel\n", iw_kernel_name());
+		///learnt with the spreads: the most likely points, not the nearest
+		if (radio_map.hdr->flags & IWMAP_F_STATS)	{
+			if (iw_gauss_build(&gauss_fingerprints, &fingerprints, IWMAP_FLOOR_DEFAULT) < 0)
+				fprintf(stderr, "Can't load the spreads of %s, nearest points : %s\n", map_path, strerror(errno));
+			else	{
+				use_gauss = 1;
+				printf("likelihood search, %d spread classes\n", IW_GAUSS_CLASSES);
+			}
+		}
+		///tracking: the scans come from about the last fix, search around it first
+		if (!use_gauss && threshold > 0 && (has_local || fingerprints.num_points >= IW_GRAPH_MIN_POINTS))	{
+			int by_position = radio_map.hdr->flags & IWMAP_F_COORDS;
+			if (iw_graph_build(&graph_fingerprints, &fingerprints, IW_GRAPH_DEGREE, by_position) < 0)
+				fprintf(stderr, "Can't link the points of %s, no local search : %s\n", map_path, strerror(errno));
+			else	{
+				use_graph = 1;
+				printf("local search, %d links per point by %s, up to %d dB per router\n", graph_fingerprints.degree, by_position ? "position" : "fingerprint", threshold);
+			}
+		}
+		///the filter needs the positions of the points, the floor it walks on
+		if (particles > 0 && !(radio_map.hdr->flags & IWMAP_F_COORDS))
+			fprintf(stderr, "No positions in %s, no particle filter\n", map_path);
+		else if (particles > 0)	{
+			if (iw_pf_init(&track_filter, &fingerprints, particles, IW_PF_SPEED_DEFAULT) < 0)
+				fprintf(stderr, "Can't set up the particle filter : %s\n", strerror(errno));
+			else	{
+				use_filter = 1;
+				printf("particle filter, %d particles at up to %.1f per second\n", track_filter.num_particles, track_filter.speed);
 			}
-			//strcpy(sig_coor_map[num_coords].mac , mac);
-			//router_address_map[c].xCo = xCo;
-			//router_address_map[c].yCo = yCo;
-			//strcpy(router_address_map[c].essid ,essid);
 		}
-		coor_count++;
+		///the Markov tracker walks the floor, or the links by fingerprint without it
+		hmm_reach = reach;
+		if (reach > 0)	{
+			if (build_hmm(&track_hmm) < 0)
+				fprintf(stderr, "Can't set up the Markov tracker : %s\n", strerror(errno));
+			else
+				use_hmm = 1;
+		}
+		if (use_hmm)
+			printf("Markov tracker, %d states, %d transitions\n", track_hmm.num_states, track_hmm.nnz);
+		///asked for: the candidates from the strongest routers, the others ruled out
+		if (!use_gauss && votes > 0)	{
+			if (iw_inv_build(&invert_fingerprints, &fingerprints) < 0)
+				fprintf(stderr, "Can't index the routers of %s, exact search : %s\n", map_path, strerror(errno));
+			else	{
+				use_invert = 1;
+				invert_fingerprints.votes = votes;
+				printf("strongest routers index, %d postings, %d of %d keys per candidate\n", invert_fingerprints.heads[invert_fingerprints.num_routers * IW_INV_BUCKETS], invert_fingerprints.votes, IW_INV_KEYS);
+			}
+		}
+		///asked for: coarse to fine, the nearest centroids then their members
+		if (!use_gauss && clusters > 0)	{
+			if (iw_cluster_build(&cluster_fingerprints, &fingerprints, 0) < 0)
+				fprintf(stderr, "Can't cluster %s, exact search : %s\n", map_path, strerror(errno));
+			else	{
+				use_cluster = 1;
+				cluster_fingerprints.probe = clusters < IW_CLUSTER_PROBE_MAX ? clusters : IW_CLUSTER_PROBE_MAX;
+				printf("%d clusters, searching %d per scan\n", cluster_fingerprints.num_clusters, cluster_fingerprints.probe);
+			}
+		}
+		///else the fastest exact search on this machine: the cores, the tree or neither
+		else if (!use_gauss)
+			choose_search(threads, knn.k);
+	}
+	///codebooks next to the map: approximate search (train them with iwmapc -q)
+	char pq_path [PATH_MAX];
+	if (!catalogue && !use_select && iw_pq_path(map_path, pq_path, sizeof(pq_path)) == 0)	{
+		if (iw_pq_load(&pq_fingerprints, pq_path, &fingerprints, &sparse_fingerprints) == 0)	{
+			use_pq = 1;
+			///unheard routers as in the exact matcher the codes stand in for
+			pq_fingerprints.floor = sparse ? floor : 0;
+			pq_fingerprints.rerank = rerank;
+			printf("approximate search, %d bytes per point, %d candidates\n", pq_fingerprints.sub_stride / 2, pq_fingerprints.rerank);
+		}
+		else if (errno != ENOENT)
+			fprintf(stderr, "Can't load the product codes %s, exact search : %s\n", pq_path, strerror(errno));
+	}
+	///a scan seen lately gets the result it had, without a search
+	if (!catalogue && quantum > 0)	{
+		if (iw_cache_init(&result_cache, IW_CACHE_ENTRIES, quantum) < 0)
+			fprintf(stderr, "Can't set up the cache of the results : %s\n", strerror(errno));
+		else	{
+			use_cache = 1;
+			printf("caching %d results, levels by %d dB\n", result_cache.num_entries, result_cache.quantum);
+		}
 	}
-	fclose(coord_file_pointer);///close the file
 	///
 	///init the window time variables
 	struct timeval startTime;
@@ -784,6 +1623,10 @@ void track (int		skfd,
 		num_aps = 0;
 		///setup the window position - the token method will fill the window
 		window.curPos = i;
+		///points learnt meanwhile
+		poll_journal(sparse);
+		///0 = not heard in this scan
+		memset(window.sliding_window[window.curPos].signal_strength, 0, sizeof(window.sliding_window[window.curPos].signal_strength));
 		
 		///do some actual work
 		/*
@@ -801,14 +1644,108 @@ void track (int		skfd,
 		window.sliding_window[window.curPos].time = curTimeUnit;
 		printf(": %d %d\n",curTimeUnit.tv_sec, curTimeUnit.tv_usec);
 		
+		///the scan as the searches see it, on the routers kept if the map was reduced
+		const int8_t * sample = window.sliding_window[window.curPos].signal_strength;
+		int8_t reduced [MAX_ROUTERS];
+		int sample_aps = num_aps;
+		int sample_routers = no_routers;
+		if (use_select)	{
+			int r = 0;
+			iw_select_row(&router_selection, sample, reduced);
+			sample = reduced;
+			sample_routers = router_selection.num_kept;
+			for (r = 0, sample_aps = 0 ; r < sample_routers ; r++)
+				sample_aps += sample[r] != 0;
+		}
+		
 		///now compare the data to the coordinate map: where is it?!
-		struct sig_coor_map_item * location;
-		if (num_aps == no_routers)	{
-			location = locate_signal (window.sliding_window[window.curPos]);
-			printf("location: %s\n", location->label);
+		int location = -1;
+		int cached = use_cache && sample_aps > 0 && iw_cache_lookup(&result_cache, sample, sample_routers, &knn);
+		if (cached)	{
+			///the same levels as lately, the same points: one lookup, no search
+			location = knn.nb[0].point;
+			printf("location: %s (cached, %lu hits %lu misses)\n", iw_fpstore_label(&fingerprints, location), result_cache.hits, result_cache.misses);
+			print_position(&fingerprints, radio_map.hdr->flags & IWMAP_F_COORDS, &knn);
+		}
+		else if (use_graph && last_fix >= 0 && sample_aps > 0
+		    && (location = locate_signal_local (&graph_fingerprints, &fingerprints, sample, penalty, last_fix, threshold, &knn)) >= 0)	{
+			///searched around the last fix only: the result is kept when its distance is under the threshold, else the full search below
+			printf("location: %s\n", iw_fpstore_label(&fingerprints, location));
+			print_position(&fingerprints, radio_map.hdr->flags & IWMAP_F_COORDS, &knn);
+		}
+		else if (use_invert && sample_aps > 0
+		    && (location = locate_signal_invert (&invert_fingerprints, &fingerprints, sample, penalty, &knn)) >= 0)	{
+			///the sample's strongest routers matched some points, the best of them
+			printf("location: %s\n", iw_fpstore_label(&fingerprints, location));
+			print_position(&fingerprints, radio_map.hdr->flags & IWMAP_F_COORDS, &knn);
+		}
+		else if (catalogue && sample_aps > 0)	{
+			///coarse to fine: pick the zones, then search their maps
+			int shard = -1;
+			location = locate_in_catalogue (sample, probe, &shard, &knn);
+			if (location >= 0)	{
+				const struct iw_shard * zone = &catalog.shards[shard];
+				printf("location: %s %s\n", zone->name, iw_fpstore_label(&zone->fps, location));
+				print_position(&zone->fps, zone->map.hdr->flags & IWMAP_F_COORDS, &knn);
+			}
+			else
+				printf("location: lack of signal\n");
+		}
+		else if (use_gauss && sample_aps > 0)	{
+			///a missed router is just at the floor, as likely as the point says
+			location = locate_signal_gauss (&gauss_fingerprints, sample, &knn);
+			printf("location: %s\n", iw_fpstore_label(&fingerprints, location));
+			print_position(&fingerprints, radio_map.hdr->flags & IWMAP_F_COORDS, &knn);
+		}
+		else if (use_pq && (sparse ? sample_aps > 0 : sample_aps == sample_routers))	{
+			location = locate_signal_pq (&pq_fingerprints, sample, &knn);
+			printf("location: %s\n", iw_fpstore_label(&fingerprints, location));
+			print_position(&fingerprints, radio_map.hdr->flags & IWMAP_F_COORDS, &knn);
+		}
+		else if (sparse && sample_aps > 0)	{
+			///no need to hear every router, the others are at the floor
+			location = locate_signal_sparse (&sparse_fingerprints, sample, &knn);
+			printf("location: %s\n", iw_fpstore_label(&fingerprints, location));
+			print_position(&fingerprints, radio_map.hdr->flags & IWMAP_F_COORDS, &knn);
+		}
+		else if (use_cluster && sample_aps == sample_routers)	{
+			location = locate_signal_cluster (&cluster_fingerprints, sample, &knn);
+			printf("location: %s\n", iw_fpstore_label(&fingerprints, location));
+			print_position(&fingerprints, radio_map.hdr->flags & IWMAP_F_COORDS, &knn);
+		}
+		else if (use_vptree && sample_aps == sample_routers)	{
+			location = locate_signal_vptree (&vptree_fingerprints, sample, &knn);
+			printf("location: %s\n", iw_fpstore_label(&fingerprints, location));
+			print_position(&fingerprints, radio_map.hdr->flags & IWMAP_F_COORDS, &knn);
+		}
+		else if (!sparse && sample_aps > 0)	{
+			///a router or two missed in a busy place: masked out, not thrown away
+			location = locate_signal (&block_fingerprints, &search_pool, sample, penalty, &knn);
+			printf("location: %s\n", iw_fpstore_label(&fingerprints, location));
+			print_position(&fingerprints, radio_map.hdr->flags & IWMAP_F_COORDS, &knn);
 		}
 		else
 			printf("location: lack of signal\n");
+		if (location >= 0 && use_cache && !cached)
+			iw_cache_store(&result_cache, sample, sample_routers, &knn);
+		if (location >= 0)
+			last_fix = location;
+		///the filter walks for the time since the last scan, then weighs this one
+		if (use_filter)	{
+			double now = curTimeUnit.tv_sec + curTimeUnit.tv_usec * 1e-6;
+			double x = 0, y = 0;
+			iw_pf_move(&track_filter, now - last_time);
+			last_time = now;
+			int measured = iw_pf_update(&track_filter, &fingerprints, sample, penalty, IW_PF_SIGMA_DEFAULT);
+			double spread = iw_pf_estimate(&track_filter, &x, &y);
+			printf("tracked: %.2f %.2f (spread %.2f, %d points measured)\n", x, y, spread, measured);
+		}
+		///and the Markov tracker, which doesn't jump across the floor on a bad scan
+		if (use_hmm)	{
+			int state = iw_hmm_update(&track_hmm, &fingerprints, sample, penalty, IW_HMM_SIGMA_DEFAULT, IW_HMM_THRESHOLD_DEFAULT);
+			if (state >= 0)
+				printf("tracked: %s (%d states measured, lost %d times)\n", iw_fpstore_label(&fingerprints, state), track_hmm.num_next, track_hmm.lost);
+		}
 	}
 	
 	
@@ -833,6 +1770,37 @@ void track (int		skfd,
 		fclose(fp[i++]);
 		printf("closed fp %d\n",i);
 	}
+	iw_journal_close(&journal);
+	iw_fpsparse_free(&sparse_fingerprints);
+	iw_fpblock_free(&block_fingerprints);
+	iw_vptree_free(&vptree_fingerprints);
+	use_vptree = 0;
+	iw_cluster_free(&cluster_fingerprints);
+	use_cluster = 0;
+	iw_inv_free(&invert_fingerprints);
+	use_invert = 0;
+	iw_pool_free(&search_pool);
+	iw_pq_free(&pq_fingerprints);
+	use_pq = 0;
+	iw_gauss_free(&gauss_fingerprints);
+	use_gauss = 0;
+	iw_graph_free(&graph_fingerprints);
+	use_graph = 0;
+	iw_pf_free(&track_filter);
+	use_filter = 0;
+	iw_hmm_free(&track_hmm);
+	use_hmm = 0;
+	use_select = 0;
+	if (use_cache)
+		printf("cache: %lu hits, %lu misses\n", result_cache.hits, result_cache.misses);
+	iw_cache_free(&result_cache);
+	use_cache = 0;
+	iw_fpstore_free(&fingerprints);
+	if (catalogue)
+		iw_catalog_free(&catalog);
+	else
+		iw_map_close(&radio_map);
+	iw_registry_free(&router_registry);
 	
 }
 
@@ -859,36 +1827,30 @@ switch(event->cmd)
 		
 		
 		gettimeofday(&startTime,NULL);		
-		struct router tmp;
-		iw_saether_ntop(&event->u.ap_addr, tmp.mac);
 		
 		printf("          Cell %02d - Address: %s	", state->ap_num,
-											tmp.mac);
+											iw_saether_ntop(&event->u.ap_addr, buffer));
 
 		///map routers to table
 		///1: check if router is part of the experiment, or just a stray
-		int i = 0;
-		
+		///(hashed on the raw BSSID, no string work per router)
+		int i = iw_registry_lookup(&router_registry, &event->u.ap_addr);
 		int recognised_address = 0;
-		for (i = 0 ; i < no_routers; i++ )
-		{
-			if (strcmp(router_address_map[i].mac, tmp.mac) == 0)
-			{///the router is part of experiemnt
-				printf("recognised: %s (num_aps = %d)\n",router_address_map[i].essid,num_aps);
-				recognised_address = 1;
-				///open the file pointer for this router
-				char out_filename [34];
-				sprintf(out_filename, "../output/output_for_router_%d.csv" , num_aps);
-				//if (fp[num_aps] == NULL)
-					fp[num_aps] = fopen(out_filename, "w");
-				///and write in the router details
-				fprintf(fp[num_aps], "%d,",1);//%s,", state->ap_num,iw_saether_ntop(&event->u.ap_addr, buffer));
-				num_aps ++;
-				
-				valid_quality_event = 1;///signal that the next quality event will be the capture of needed data
-				break;
-			}
+		if (i >= 0)
+		{///the router is part of experiemnt
+			printf("recognised: %s (num_aps = %d)\n",router_address_map[i].essid,num_aps);
+			recognised_address = 1;
+			cur_router = i;///the next quality event is for this column
+			///open the file pointer for this router
+			char out_filename [34];
+			sprintf(out_filename, "../output/output_for_router_%d.csv" , num_aps);
+			//if (fp[num_aps] == NULL)
+				fp[num_aps] = fopen(out_filename, "w");
+			///and write in the router details
+			fprintf(fp[num_aps], "%d,",1);//%s,", state->ap_num,iw_saether_ntop(&event->u.ap_addr, buffer));
+			num_aps ++;
 			
+			valid_quality_event = 1;///signal that the next quality event will be the capture of needed data
 		}
 		if (recognised_address == 0)
 			printf("	not ID'ed\n");///print new line if address not ID'ed
@@ -907,7 +1869,7 @@ switch(event->cmd)
 		
 		///location update
 		
-		window.sliding_window[window.curPos].router[num_aps -1] = event->u.qual;///ap_num was incremented just before here)
+		window.sliding_window[window.curPos].router[cur_router] = event->u.qual;///ap_num was incremented just before here)
 		///TODO window.sliding_window[window.curPos].data[num_aps] = event;///ap_num was incremented just before here)
 		
 		//window.sliding_window[window.curPos].router[num_aps].level
@@ -950,35 +1912,31 @@ learn_signal_event(struct stream_descr *	stream,	/* Stream of events */
 			
 			
 			gettimeofday(&startTime,NULL);		
-			struct router tmp;
-			iw_saether_ntop(&event->u.ap_addr, tmp.mac);
 			
 			printf("          Cell %02d - Address: %s	", state->ap_num,
-			tmp.mac);
+			iw_saether_ntop(&event->u.ap_addr, buffer));
 			
 			///map routers to table
 			///1: check if router is part of the experiment, or just a stray
-			int i = 0;			
+			///(hashed on the raw BSSID, no string work per router)
+			int i = iw_registry_lookup(&router_registry, &event->u.ap_addr);
 			int recognised_address = 0;
-			for (i = 0 ; i < no_routers; i++ )
-			{///for each router, capture the signal at this coordinate location
-				if (strcmp(router_address_map[i].mac, tmp.mac) == 0)
-				{///the router is part of experiemnt, continue
-					printf("recognised: %s (num_aps = %d)\n",router_address_map[i].essid,num_aps);
-					recognised_address = 1;
-					
-					///open the file pointer for this router
-					char out_filename [69];
-					sprintf(out_filename, "../output/output_for_test_%d.csv" , test_num);
-					
-					fp[num_aps] = fopen(out_filename, "w");
-					///and write in the router details
-					fprintf(fp[num_aps], "%d, %s,", state->ap_num,iw_saether_ntop(&event->u.ap_addr, buffer));
-					num_aps ++;
-					
-					valid_quality_event = 1;///signal that the next quality event will be the capture of needed data
-					break;
-				}
+			if (i >= 0)
+			{///the router is part of experiemnt, continue
+				printf("recognised: %s (num_aps = %d)\n",router_address_map[i].essid,num_aps);
+				recognised_address = 1;
+				cur_router = i;///the next quality event is for this column
+				
+				///open the file pointer for this router
+				char out_filename [69];
+				sprintf(out_filename, "../output/output_for_test_%d.csv" , test_num);
+				
+				fp[num_aps] = fopen(out_filename, "w");
+				///and write in the router details
+				fprintf(fp[num_aps], "%d, %s,", state->ap_num,iw_saether_ntop(&event->u.ap_addr, buffer));
+				num_aps ++;
+				
+				valid_quality_event = 1;///signal that the next quality event will be the capture of needed data
 			}
 	if (recognised_address == 0)
 		printf("	not ID'ed\n");///print new line if address not ID'ed
@@ -997,7 +1955,7 @@ learn_signal_event(struct stream_descr *	stream,	/* Stream of events */
 				
 				///location update
 				
-				window.sliding_window[window.curPos].router[num_aps -1] = event->u.qual;///ap_num was incremented just before here)
+				window.sliding_window[window.curPos].router[cur_router] = event->u.qual;///ap_num was incremented just before here)
 				///TODO window.sliding_window[window.curPos].data[num_aps] = event;///ap_num was incremented just before here)
 				
 				//window.sliding_window[window.curPos].router[num_aps].level
@@ -1035,66 +1993,60 @@ laern_function (struct stream_descr *	stream,	/* Stream of events */
 												
 												
 												gettimeofday(&startTime,NULL);		
-												struct router tmp;
-												iw_saether_ntop(&event->u.ap_addr, tmp.mac);
 												
 												printf("          Cell %02d - Address: %s	", state->ap_num,
-												tmp.mac);
+												iw_saether_ntop(&event->u.ap_addr, buffer));
 												
 												///map routers to table
 												///1: check if router is part of the experiment, or just a stray
-												int i = 0;
-												
+												///(hashed on the raw BSSID, no string work per router)
+												int i = iw_registry_lookup(&router_registry, &event->u.ap_addr);
 												int recognised_address = 0;
-												for (i = 0 ; i < no_routers; i++ )
+												if (i >= 0)
+												{///the router is part of experiemnt
+												printf("recognised: %s (num_aps = %d)\n",router_address_map[i].essid,num_aps);
+												recognised_address = 1;
+												cur_router = i;///the next quality event is for this column
+												///open the file pointer for this router
+												char out_filename [34];
+												sprintf(out_filename, "../output/output_for_router_%d.csv" , num_aps);
+												//if (fp[num_aps] == NULL)
+												fp[num_aps] = fopen(out_filename, "w");
+												///and write in the router details
+												fprintf(fp[num_aps], "%d,",1);//%s,", state->ap_num,iw_saether_ntop(&event->u.ap_addr, buffer));
+												num_aps ++;
+												
+												valid_quality_event = 1;///signal that the next quality event will be the capture of needed data
+											}
+									if (recognised_address == 0)
+										printf("	not ID'ed\n");///print new line if address not ID'ed
+										state->ap_num++;
+									break;
+										case IWEVQUAL:///quality event
+											///check if the signal event is from a router in the experiment
+											if (valid_quality_event == 1)
+											{	
+												gettimeofday(&startTime,NULL);
+												//printf ("\n\nin qual event%d %d\n",startTime.tv_sec,startTime.tv_usec);  
+												iw_print_stats(buffer, sizeof(buffer),&event->u.qual, iw_range, has_range);
+												printf("                    %s\n", buffer);
+												///file output
+												fprintf (fp[num_aps -1],"\n");
+												
+												///location update
+												
+												window.sliding_window[window.curPos].router[cur_router] = event->u.qual;///ap_num was incremented just before here)
+												///TODO window.sliding_window[window.curPos].data[num_aps] = event;///ap_num was incremented just before here)
+												
+												//window.sliding_window[window.curPos].router[num_aps].level
+												//printf ("updated sliding window[%d] router[%d] \n",window.curPos,num_aps);
+												//		printf ("updated sliding window[%d].r; outer[%d].level = %d\n",window.curPos,num_aps,window.sliding_window[window.curPos].router[num_aps].level);
+												
+												
+												if (num_aps  == no_routers  )
 												{
-													if (strcmp(router_address_map[i].mac, tmp.mac) == 0)
-													{///the router is part of experiemnt
-													printf("recognised: %s (num_aps = %d)\n",router_address_map[i].essid,num_aps);
-													recognised_address = 1;
-													///open the file pointer for this router
-													char out_filename [34];
-													sprintf(out_filename, "../output/output_for_router_%d.csv" , num_aps);
-													//if (fp[num_aps] == NULL)
-													fp[num_aps] = fopen(out_filename, "w");
-													///and write in the router details
-													fprintf(fp[num_aps], "%d,",1);//%s,", state->ap_num,iw_saether_ntop(&event->u.ap_addr, buffer));
-													num_aps ++;
-													
-													valid_quality_event = 1;///signal that the next quality event will be the capture of needed data
-													break;
+													//window.sliding_window[window.curPos].
 												}
-												
-										}
-										if (recognised_address == 0)
-											printf("	not ID'ed\n");///print new line if address not ID'ed
-											state->ap_num++;
-										break;
-											case IWEVQUAL:///quality event
-												///check if the signal event is from a router in the experiment
-												if (valid_quality_event == 1)
-												{	
-													gettimeofday(&startTime,NULL);
-													//printf ("\n\nin qual event%d %d\n",startTime.tv_sec,startTime.tv_usec);  
-													iw_print_stats(buffer, sizeof(buffer),&event->u.qual, iw_range, has_range);
-													printf("                    %s\n", buffer);
-													///file output
-													fprintf (fp[num_aps -1],"\n");
-													
-													///location update
-													
-													window.sliding_window[window.curPos].router[num_aps -1] = event->u.qual;///ap_num was incremented just before here)
-													///TODO window.sliding_window[window.curPos].data[num_aps] = event;///ap_num was incremented just before here)
-													
-													//window.sliding_window[window.curPos].router[num_aps].level
-													//printf ("updated sliding window[%d] router[%d] \n",window.curPos,num_aps);
-													//		printf ("updated sliding window[%d].r; outer[%d].level = %d\n",window.curPos,num_aps,window.sliding_window[window.curPos].router[num_aps].level);
-													
-													
-													if (num_aps  == no_routers  )
-													{
-														//window.sliding_window[window.curPos].
-													}
 													valid_quality_event = 0;
 												}
 												
@@ -2833,8 +3785,8 @@ static const struct iwlist_entry iwlist_cmds[] = {
   { "encryption",	print_keys_info,	0, NULL },
   { "keys",		print_keys_info,	0, NULL },
   { "power",		print_pm_info,		0, NULL },
-	{ "learn",		learn_map,		2, NULL },
-	{ "track",		track,	2, "[essid NNN] [last]" },
+	{ "learn",		learn_map,		4, "mapname label [x y]" },
+	{ "track",		track,	-1, "[-f floor] [-z zones] [-k k] [-c candidates] [-t threads] [-p penalty] [-l local] [-P particles] [-m reach] [-C clusters] [-v votes] [-r routers|auto] [-q cache] mapfile|catalogue testnum" },
 #ifndef WE_ESSENTIAL
   { "txpower",		print_txpower_info,	0, NULL },
   { "retry",		print_retry_info,	0, NULL },
@@ -2993,45 +3945,205 @@ main(int	argc,
   return 0;
 }
 
-double distance (double Pr, double Pt, double Gt, double Gr, double delta)
+/*
+ * Julz:
+ * distance to a router heard at Pr dBm, by the log-distance path loss model
+ * Pr = P0 - 10 n log10(d) (P0 the level at 1 unit, n the exponent), as fitted
+ * by iw_pathloss_fit
+ */
+double distance (double Pr, double P0, double n)
 {
-	return 1;//(1.0/2462000000.0)/()
+	return pow(10.0, (P0 - Pr) / (10.0 * n));///the model, solved for d
 }
 	
-struct sig_coor_map_item * locate_signal (struct location_time_stats input_signal)
+/*
+ * Julz:
+ * nearest points of the map to the sample, by the squared diff over all the
+ * routers: the knn->k best end up in knn, the nearest first (k = 1 is the
+ * plain 1stNN). The diffs are worked out by the vector kernel of the CPU
+ * over the blocked fingerprints, see iwkernel.c; every kernel gives the
+ * diffs of the plain loop, exactly.
+ * A router the sample missed is masked out: it costs penalty dB to the points
+ * that hear it, and the diff is scaled up to all the routers.
+ */
+int locate_signal (const struct iw_fpblock * fpb, struct iw_pool * pool, const int8_t * levels, int penalty, struct iw_knn * knn)
+{
+	///bounded heap of the k best: O(N log k), no sort of the whole map,
+	///one heap per thread of the pool, merged at the end
+	if (iw_fpblock_knn_masked(fpb, pool, levels, penalty, knn) == 0)
+		return -1;
+#ifdef DEBUG
+	///points are given up once they can't make it, the routers that tell them apart first
+	printf("best diff %d at %d (%.0f%% of the routers measured)\n", knn->nb[0].dist, knn->nb[0].point, 100.0 * knn->visited);
+#endif
+	///return result
+	return knn->nb[0].point;
+}
+
+/*
+ * Julz:
+ * locate_signal through the vantage point tree: the same neighbours as
+ * the brute force, but only the subtrees that may hold one are measured
+ */
+int locate_signal_vptree (const struct iw_vptree * tree, const int8_t * levels, struct iw_knn * knn)
+{
+	int visited = 0;
+	if (iw_vptree_knn(tree, levels, knn, &visited) == 0)
+		return -1;
+#ifdef DEBUG
+	printf("best diff %d at %d (%d of %d points measured)\n", knn->nb[0].dist, knn->nb[0].point, visited, tree->num_points);
+#endif
+	return knn->nb[0].point;
+}
+
+/*
+ * Julz:
+ * locate_signal through the clusters of the map: the query against the
+ * centroids first, then against the members of the cl->probe nearest
+ * clusters only (see iwcluster.c). Close to the exact search, not always
+ * the same (see iwlocbench -a)
+ */
+int locate_signal_cluster (const struct iw_cluster * cl, const int8_t * levels, struct iw_knn * knn)
+{
+	int visited = 0;
+	if (iw_cluster_knn(cl, levels, knn, &visited) == 0)
+		return -1;
+#ifdef DEBUG
+	printf("best diff %d at %d (%d of %d points measured in %d clusters)\n", knn->nb[0].dist, knn->nb[0].point, visited, cl->num_points, cl->probe);
+#endif
+	return knn->nb[0].point;
+}
+
+/*
+ * Julz:
+ * locate_signal through the strongest routers: only the points where the
+ * sample's loudest routers are among the loudest too are measured (see
+ * iwinvert.c), with the diffs of locate_signal. The number measured is
+ * printed in DEBUG builds, to tune the votes against the fixes. -1 if no
+ * point matched
+ */
+int locate_signal_invert (struct iw_invert * inv, const struct iw_fpstore * fps, const int8_t * levels, int penalty, struct iw_knn * knn)
+{
+	int candidates = 0;
+	if (iw_inv_knn(inv, fps, levels, penalty, knn, &candidates) == 0)	{
+#ifdef DEBUG
+		printf("no point shares the strongest routers, searching the whole map\n");
+#endif
+		return -1;
+	}
+#ifdef DEBUG
+	printf("best diff %d at %d (%d of %d points measured)\n", knn->nb[0].dist, knn->nb[0].point, candidates, fps->num_points);
+#endif
+	return knn->nb[0].point;
+}
+
+/*
+ * Julz:
+ * locate_signal for tracking: the scans come from about where the last fix
+ * was, so the neighbourhood graph is searched from there outward, best
+ * first (see iwgraph.c), a few tens of points whatever the size of the map.
+ * Same diffs as locate_signal. If the best found is still worse than
+ * threshold dB per router the tracker has moved away, or was wrong: -1,
+ * and the whole map is searched instead
+ */
+int locate_signal_local (struct iw_graph * graph, const struct iw_fpstore * fps, const int8_t * levels, int penalty, int last, int threshold, struct iw_knn * knn)
+{
+	int visited = 0;
+	if (iw_graph_knn(graph, fps, levels, penalty, last, knn, &visited) == 0)
+		return -1;
+	if (knn->nb[0].dist > fps->num_routers * threshold * threshold)	{
+#ifdef DEBUG
+		printf("best diff %d around %d too far, searching the whole map\n", knn->nb[0].dist, last);
+#endif
+		return -1;
+	}
+#ifdef DEBUG
+	printf("best diff %d at %d (%d of %d points measured around %d)\n", knn->nb[0].dist, knn->nb[0].point, visited, fps->num_points, last);
+#endif
+	return knn->nb[0].point;
+}
+
+/*
+ * Julz:
+ * locate_signal by likelihood: each point is the normal law of the levels
+ * it was learnt from, the knn->k points under which the sample is the most
+ * likely win. The costs come from tables, see iwgauss.c
+ */
+int locate_signal_gauss (const struct iw_gauss * gauss, const int8_t * levels, struct iw_knn * knn)
+{
+	if (iw_gauss_knn(gauss, levels, knn) == 0)
+		return -1;
+#ifdef DEBUG
+	printf("best cost %d at %d\n", knn->nb[0].dist, knn->nb[0].point);
+#endif
+	return knn->nb[0].point;
+}
+
+/*
+ * Julz:
+ * locate_signal through the product codes of the map: the pq->rerank best
+ * points by the codes are measured exactly, the knn->k best of them kept.
+ * Close to the exact search, not always the same (see iwlocbench -a)
+ */
+int locate_signal_pq (const struct iw_pq * pq, const int8_t * levels, struct iw_knn * knn)
+{
+	if (iw_pq_knn(pq, &fingerprints, &sparse_fingerprints, levels, knn) <= 0)
+		return -1;
+#ifdef DEBUG
+	printf("best diff %d at %d (%d candidates)\n", knn->nb[0].dist, knn->nb[0].point, pq->rerank);
+#endif
+	return knn->nb[0].point;
+}
+
+/*
+ * Julz:
+ * locate_signal over sparse fingerprints: only the cells a point hears
+ * are visited, so the cost follows the heard routers, not the registered
+ * ones. A router missing from either side counts as sp->floor dBm.
+ */
+int locate_signal_sparse (const struct iw_fpsparse * sp, const int8_t * levels, struct iw_knn * knn)
 {
+	///scatter the sample by router: the level to compare a point's cell
+	///with, and what that router already costs for a point not hearing it
+	int query [MAX_ROUTERS];
+	int unheard_cost [MAX_ROUTERS];
+	int empty_diff = 0; ///diff to a point that hears nothing
+	int j = 0;
+	for (j = 0 ; j < sp->num_routers ; j++)
+	{
+		int level = levels[j];
+		if (level != 0)	{///heard
+			query[j] = level;
+			unheard_cost[j] = (level - sp->floor)*(level - sp->floor);
+		}
+		else	{
+			query[j] = sp->floor;
+			unheard_cost[j] = 0;
+		}
+		empty_diff += unheard_cost[j];
+	}
 	
-	//coor_count = 4;
-	int total_diff [coor_count];
-	///compare the signals to the database:
-	 int i = 0;
-	for (i = 0 ; i < coor_count ; i++)
-	{///for every coord:
-		total_diff [i] = 0; ///init the diff figure
-		
-		
-			///for each router, check how different the signal readings are
-			int j = 0;
-			for (j = 0 ; j < no_routers ; j++)
-			{
-					///diff_2 = the square of the diff between located and coor signal strengths
-					int diff_2 = (input_signal.signal_strength[j] - sig_coor_map [i].signal_strength[j])*(input_signal.signal_strength[j] - sig_coor_map [i].signal_strength[j]);
-					total_diff [i] += diff_2;
-				
-			}
-		
-		printf("total diff for loc %d: %d\n", i ,total_diff[i]);
-		
-		
+	///then each heard cell of a point swaps the floor for its own level,
+	///and the point is offered to the k best so far
+	knn->count = 0;
+	int i = 0;
+	for (i = 0 ; i < sp->num_points ; i++)
+	{
+		int total_diff = empty_diff;
+		uint32_t k = 0;
+		for (k = sp->rowptr[i] ; k < sp->rowptr[i+1] ; k++)
+		{
+			int c = sp->cols[k];
+			int diff = query[c] - sp->vals[k];
+			total_diff += diff * diff - unheard_cost[c];
+		}
+		iw_knn_push(knn, i, total_diff);
 	}
-	///find the best coordinate
-	int best_record_index = 0;
-	 int k = 0 ;
-	for (k = 0 ; k < coor_count ; k++)
-	///NOTE this is 1stNN method.. could generalise to kNN
-		if (total_diff [k] <= total_diff [best_record_index])
-			best_record_index = k;
-	printf("come on here %d \n",best_record_index);
-	///return result
-	return &sig_coor_map[best_record_index];
+	iw_knn_sort(knn);
+	if (knn->count == 0)
+		return -1;
+#ifdef DEBUG
+	printf("best diff %d at %d\n", knn->nb[0].dist, knn->nb[0].point);
+#endif
+	return knn->nb[0].point;
 }
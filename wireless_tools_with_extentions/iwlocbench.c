@@ -0,0 +1,2031 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * iwlocbench : check the location searches against each other, and
+ * measure them, on a radio map or on a random one.
+ *
+ * Every distance kernel the CPU can run must give exactly the distances
+ * of the plain C one, then each is timed on the same queries, one by one,
+ * in a batch, with some routers missed, and unrolled for the width of
+ * the map. The approximate search is measured by its recall against
+ * the exact one, the search on a pool of threads by its scaling, the
+ * particle filter by its particles per second along a random walk, the
+ * hidden Markov tracker by the jumps of its fixes along another. The
+ * catalogue of zones must refuse the zones it couldn't search.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+#include <getopt.h>
+#include <limits.h>		/* PATH_MAX */
+#include <time.h>
+
+/************************ CONSTANTS & MACROS ************************/
+
+#define BENCH_POINTS_DEFAULT	15625	/* x 64 routers = 1M cells */
+#define BENCH_ROUTERS_DEFAULT	64
+#define BENCH_QUERIES_DEFAULT	200
+#define BENCH_K_DEFAULT		8
+#define BENCH_PACE		1.0	/* Walker of the trackers, per scan */
+#define BENCH_JUMP		3	/* Paces, a fix further than that jumped */
+#define BENCH_STAY		20	/* Scans of an asset before it is moved */
+#define BENCH_FEW_HEARD		2	/* Routers heard by the scans far away */
+
+/**************************** VARIABLES ****************************/
+
+static const char *	bench_kernels[] = { "scalar", "sse2", "avx2", "avx512" };
+
+/*************************** SUBROUTINES ***************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Monotonic time, in seconds
+ */
+static double
+bench_now(void)
+{
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Random number in [0, 1)
+ */
+static double
+bench_uniform(void)
+{
+  return(rand() / (RAND_MAX + 1.0));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Random radio map of a floor : points at random positions, routers
+ * spread one per 100 m^2, levels from a path loss model with 3 dB of
+ * noise. Maps of the same floor at random would be much harder to
+ * index, and nothing like the real ones.
+ */
+static int
+bench_random_store(struct iw_fpstore *	fps,
+		   int			num_points,
+		   int			num_routers)
+{
+  double	side = 10.0 * sqrt(num_routers);
+  double	rx[MAX_ROUTERS];
+  double	ry[MAX_ROUTERS];
+  int8_t	row[MAX_ROUTERS];
+  int		i;
+  int		r;
+
+  if((iw_fpstore_init(fps, num_routers) < 0)
+     || (iw_fpstore_reserve(fps, num_points) < 0))
+    return(-1);
+  for(r = 0; r < num_routers; r++)
+    {
+      rx[r] = side * bench_uniform();
+      ry[r] = side * bench_uniform();
+    }
+  for(i = 0; i < num_points; i++)
+    {
+      double	x = side * bench_uniform();
+      double	y = side * bench_uniform();
+
+      for(r = 0; r < num_routers; r++)
+	{
+	  double	d2 = (x - rx[r]) * (x - rx[r]) + (y - ry[r]) * (y - ry[r]);
+	  /* Sum of uniforms, about gaussian */
+	  double	noise = (bench_uniform() + bench_uniform() + bench_uniform()
+				 - 1.5) * 6.0;
+	  int		level = lrint(-35.0 - 15.0 * log10(fmax(d2, 1.0)) + noise);
+
+	  row[r] = (level < IWMAP_FLOOR_DEFAULT) ? 0 : iw_dbm_sat(level);
+	}
+      iw_fpstore_add(fps, row, x, y, "");
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Dense store of a radio map file
+ */
+static int
+bench_map_store(struct iw_fpstore *	fps,
+		const char *		path)
+{
+  struct iwmap		map;
+  struct iw_fpsparse	sp;
+  int8_t		row[MAX_ROUTERS];
+  uint32_t		k;
+  int			i;
+
+  if(iw_map_open(path, &map) < 0)
+    return(-1);
+  if((iw_fpsparse_from_map(&sp, &map) < 0)
+     || (iw_fpstore_init(fps, sp.num_routers) < 0)
+     || (iw_fpstore_reserve(fps, sp.num_points) < 0))
+    {
+      iw_map_close(&map);
+      return(-1);
+    }
+  for(i = 0; i < sp.num_points; i++)
+    {
+      memset(row, 0, sizeof(row));
+      for(k = sp.rowptr[i]; k < sp.rowptr[i + 1]; k++)
+	row[sp.cols[k]] = sp.vals[k];
+      iw_fpstore_add(fps, row, 0, 0, "");
+    }
+  iw_fpsparse_free(&sp);
+  iw_map_close(&map);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Queries : points of the map, with some noise
+ */
+static int8_t *
+bench_queries(const struct iw_fpstore *	fps,
+	      int			num_queries)
+{
+  int8_t *	queries = malloc((size_t) num_queries * MAX_ROUTERS);
+  int		q;
+  int		r;
+
+  if(queries == NULL)
+    return(NULL);
+  for(q = 0; q < num_queries; q++)
+    {
+      const int8_t *	row = iw_fpstore_row(fps, rand() % fps->num_points);
+      int8_t *		query = queries + (size_t) q * MAX_ROUTERS;
+
+      memset(query, 0, MAX_ROUTERS);
+      for(r = 0; r < fps->num_routers; r++)
+	if(row[r] != 0)
+	  query[r] = iw_dbm_sat(row[r] + rand() % 9 - 4);
+    }
+  return(queries);
+}
+
+/************************** DISTANCE KERNELS **************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Check every kernel against the plain C one, then time it
+ */
+static int
+bench_kernels_run(const struct iw_fpstore *	fps,
+		  const int8_t *		queries,
+		  int				num_queries)
+{
+  struct iw_fpblock	fpb;
+  int32_t *		ref;
+  int32_t *		dist;
+  int32_t		best;
+  size_t		len;
+  double		cells = (double) fps->num_points * fps->num_routers;
+  int			ret = 0;
+  unsigned int		k;
+  int			q;
+
+  if(iw_fpblock_from_store(&fpb, fps) < 0)
+    return(-1);
+  len = (size_t) ((fpb.num_points + IWMAP_BLOCK - 1) / IWMAP_BLOCK)
+    * IWMAP_BLOCK;
+  ref = malloc((size_t) num_queries * len * sizeof(int32_t));
+  dist = malloc(len * sizeof(int32_t));
+  if((ref == NULL) || (dist == NULL))
+    {
+      free(ref);
+      free(dist);
+      iw_fpblock_free(&fpb);
+      return(-1);
+    }
+
+  /* The reference distances */
+  iw_kernel_select("scalar");
+  for(q = 0; q < num_queries; q++)
+    iw_fpblock_dist(&fpb, queries + (size_t) q * MAX_ROUTERS,
+		    ref + (size_t) q * len);
+
+  printf("%d points x %d routers, %d queries\n",
+	 fps->num_points, fps->num_routers, num_queries);
+  for(k = 0; k < sizeof(bench_kernels) / sizeof(bench_kernels[0]); k++)
+    {
+      double	start;
+      double	elapsed;
+      int	mismatch = 0;
+      int	sink = 0;
+
+      if(iw_kernel_select(bench_kernels[k]) < 0)
+	{
+	  printf("    %-8s : not supported by this CPU\n", bench_kernels[k]);
+	  continue;
+	}
+      for(q = 0; q < num_queries; q++)
+	{
+	  iw_fpblock_dist(&fpb, queries + (size_t) q * MAX_ROUTERS, dist);
+	  if(memcmp(dist, ref + (size_t) q * len,
+		    fpb.num_points * sizeof(int32_t)))
+	    mismatch++;
+	}
+
+      start = bench_now();
+      for(q = 0; q < num_queries; q++)
+	sink += iw_fpblock_nearest(&fpb, queries + (size_t) q * MAX_ROUTERS,
+				   &best);
+      elapsed = (bench_now() - start) / num_queries;
+      printf("    %-8s : %s, %8.1f us per query, %6.2f Gcells/s%s\n",
+	     bench_kernels[k], mismatch ? "MISMATCH" : "exact",
+	     elapsed * 1e6, cells / elapsed * 1e-9, sink < 0 ? " ?" : "");
+      if(mismatch)
+	ret = -1;
+    }
+  iw_kernel_select(NULL);
+
+  free(ref);
+  free(dist);
+  iw_fpblock_free(&fpb);
+  return(ret);
+}
+
+/************************ NEAREST NEIGHBOURS ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Order of the neighbours, the best first, as iw_knn_sort() does
+ */
+static int
+bench_nb_cmp(const void *	a,
+	     const void *	b)
+{
+  if(iw_knn_worse(a, b))
+    return(1);
+  if(iw_knn_worse(b, a))
+    return(-1);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Check the bounded heap of iw_fpblock_knn() against a full sort of the
+ * distances, and time both
+ */
+static int
+bench_knn_run(const struct iw_fpstore *	fps,
+	      const int8_t *		queries,
+	      int			num_queries,
+	      int			k)
+{
+  struct iw_fpblock	fpb;
+  struct iw_knn		knn;
+  struct iw_neighbour *	all;
+  int32_t *		dist;
+  double		start;
+  double		t_heap;
+  double		t_sort = 0;
+  double		visited = 0;
+  int			mismatch = 0;
+  int			q;
+  int			i;
+
+  if(iw_fpblock_from_store(&fpb, fps) < 0)
+    return(-1);
+  all = malloc(fpb.num_points * sizeof(*all));
+  dist = malloc(((fpb.num_points + IWMAP_BLOCK - 1) / IWMAP_BLOCK)
+		* IWMAP_BLOCK * sizeof(int32_t));
+  if((all == NULL) || (dist == NULL))
+    {
+      free(all);
+      free(dist);
+      iw_fpblock_free(&fpb);
+      return(-1);
+    }
+  iw_knn_init(&knn, k);
+
+  start = bench_now();
+  for(q = 0; q < num_queries; q++)
+    iw_fpblock_knn(&fpb, queries + (size_t) q * MAX_ROUTERS, &knn);
+  t_heap = (bench_now() - start) / num_queries;
+
+  for(q = 0; q < num_queries; q++)
+    {
+      iw_fpblock_knn(&fpb, queries + (size_t) q * MAX_ROUTERS, &knn);
+      visited += knn.visited;
+      start = bench_now();
+      iw_fpblock_dist(&fpb, queries + (size_t) q * MAX_ROUTERS, dist);
+      for(i = 0; i < fpb.num_points; i++)
+	{
+	  all[i].point = i;
+	  all[i].dist = dist[i];
+	}
+      qsort(all, fpb.num_points, sizeof(*all), bench_nb_cmp);
+      t_sort += bench_now() - start;
+      if(memcmp(all, knn.nb, knn.count * sizeof(*all)))
+	mismatch++;
+    }
+  t_sort /= num_queries;
+
+  printf("    kNN k=%-2d : %s, %8.1f us per query (full sort %.1f us),"
+	 " %.1f %% of the routers\n", knn.k, mismatch ? "MISMATCH" : "exact",
+	 t_heap * 1e6, t_sort * 1e6, 100.0 * visited / num_queries);
+  free(all);
+  free(dist);
+  iw_fpblock_free(&fpb);
+  return(mismatch ? -1 : 0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Check the batches of every kernel against the queries one by one,
+ * and time both
+ */
+static int
+bench_batch_run(const struct iw_fpstore *	fps,
+		const int8_t *			queries,
+		int				num_queries,
+		int				k)
+{
+  struct iw_fpblock	fpb;
+  struct iw_knn *	ref;
+  struct iw_knn *	knn;
+  int			ret = 0;
+  unsigned int		j;
+  int			q;
+
+  if(iw_fpblock_from_store(&fpb, fps) < 0)
+    return(-1);
+  ref = malloc(num_queries * sizeof(*ref));
+  knn = malloc(num_queries * sizeof(*knn));
+  if((ref == NULL) || (knn == NULL))
+    {
+      free(ref);
+      free(knn);
+      iw_fpblock_free(&fpb);
+      return(-1);
+    }
+  for(q = 0; q < num_queries; q++)
+    {
+      iw_knn_init(&ref[q], k);
+      iw_knn_init(&knn[q], k);
+    }
+
+  printf("kNN k=%d of %d queries at once :\n", ref[0].k, num_queries);
+  for(j = 0; j < sizeof(bench_kernels) / sizeof(bench_kernels[0]); j++)
+    {
+      double	start;
+      double	t_single;
+      double	t_batch;
+      int	mismatch = 0;
+
+      if(iw_kernel_select(bench_kernels[j]) < 0)
+	continue;
+      start = bench_now();
+      for(q = 0; q < num_queries; q++)
+	iw_fpblock_knn(&fpb, queries + (size_t) q * MAX_ROUTERS, &ref[q]);
+      t_single = (bench_now() - start) / num_queries;
+      start = bench_now();
+      if(iw_fpblock_knn_batch(&fpb, queries, num_queries, MAX_ROUTERS,
+			      knn) < 0)
+	{
+	  ret = -1;
+	  break;
+	}
+      t_batch = (bench_now() - start) / num_queries;
+      for(q = 0; q < num_queries; q++)
+	if((knn[q].count != ref[q].count)
+	   || memcmp(knn[q].nb, ref[q].nb, ref[q].count * sizeof(ref[q].nb[0])))
+	  mismatch++;
+      printf("    %-8s : %s, %8.1f us per query (one by one %.1f us)\n",
+	     bench_kernels[j], mismatch ? "MISMATCH" : "exact",
+	     t_batch * 1e6, t_single * 1e6);
+      if(mismatch)
+	ret = -1;
+    }
+  iw_kernel_select(NULL);
+
+  free(ref);
+  free(knn);
+  iw_fpblock_free(&fpb);
+  return(ret);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Check the masked search of every kernel against a full sort of the
+ * distances of plain C, on the queries with one router heard in eight
+ * missed, or with only the first few heard (scans far from most of a
+ * big site, whose scaled distances saturate), and time it
+ */
+static int
+bench_masked_run(const struct iw_fpstore *	fps,
+		 const int8_t *			queries,
+		 int				num_queries,
+		 int				k,
+		 int				pen,
+		 int				few)
+{
+  struct iw_fpblock	fpb;
+  struct iw_knn		knn;
+  struct iw_knn *	ref;
+  struct iw_neighbour *	all;
+  int8_t *		partial;
+  int			ret = 0;
+  unsigned int		j;
+  int			q;
+  int			i;
+  int			r;
+
+  if(iw_fpblock_from_store(&fpb, fps) < 0)
+    return(-1);
+  ref = malloc(num_queries * sizeof(*ref));
+  all = malloc(fpb.num_points * sizeof(*all));
+  partial = malloc((size_t) num_queries * MAX_ROUTERS);
+  if((ref == NULL) || (all == NULL) || (partial == NULL))
+    {
+      free(ref);
+      free(all);
+      free(partial);
+      iw_fpblock_free(&fpb);
+      return(-1);
+    }
+  memcpy(partial, queries, (size_t) num_queries * MAX_ROUTERS);
+  for(q = 0; q < num_queries; q++)
+    {
+      int8_t *	query = partial + (size_t) q * MAX_ROUTERS;
+      int	heard = 0;
+
+      for(r = 0; r < fps->num_routers; r++)
+	{
+	  if(few ? (heard >= few) : (rand() % 8 == 0))
+	    query[r] = 0;
+	  heard += (query[r] != 0);
+	}
+      iw_knn_init(&ref[q], k);
+      if(heard == 0)
+	continue;
+      for(i = 0; i < fpb.num_points; i++)
+	{
+	  const int8_t *	row = iw_fpstore_row(fps, i);
+	  int32_t		d = 0;
+
+	  for(r = 0; r < fps->num_routers; r++)
+	    if(query[r] != 0)
+	      d += (row[r] - query[r]) * (row[r] - query[r]);
+	    else if(row[r] != 0)
+	      d += pen * pen;
+	  all[i].point = i;
+	  all[i].dist = d;
+	}
+      qsort(all, fpb.num_points, sizeof(*all), bench_nb_cmp);
+      ref[q].count = (fpb.num_points < k) ? fpb.num_points : k;
+      for(i = 0; i < ref[q].count; i++)
+	{
+	  int64_t	scaled = (int64_t) all[i].dist * fps->num_routers / heard;
+
+	  ref[q].nb[i] = all[i];
+	  ref[q].nb[i].dist = (scaled > INT32_MAX) ? INT32_MAX : scaled;
+	}
+    }
+  iw_knn_init(&knn, k);
+
+  if(few)
+    printf("kNN k=%d of scans hearing %d routers of %d, %d dB each missed :\n",
+	   knn.k, few, fps->num_routers, pen);
+  else
+    printf("kNN k=%d of scans missing 1 router in 8, %d dB each :\n",
+	   knn.k, pen);
+  for(j = 0; j < sizeof(bench_kernels) / sizeof(bench_kernels[0]); j++)
+    {
+      double	start;
+      double	t_full;
+      double	t_masked = 0;
+      int	mismatch = 0;
+
+      if(iw_kernel_select(bench_kernels[j]) < 0)
+	continue;
+      start = bench_now();
+      for(q = 0; q < num_queries; q++)
+	iw_fpblock_knn(&fpb, queries + (size_t) q * MAX_ROUTERS, &knn);
+      t_full = (bench_now() - start) / num_queries;
+      for(q = 0; q < num_queries; q++)
+	{
+	  start = bench_now();
+	  iw_fpblock_knn_masked(&fpb, NULL, partial + (size_t) q * MAX_ROUTERS,
+				pen, &knn);
+	  t_masked += bench_now() - start;
+	  if((knn.count != ref[q].count)
+	     || memcmp(knn.nb, ref[q].nb, knn.count * sizeof(knn.nb[0]))
+	     || ((knn.count > 0) && (knn.nb[0].dist < 0)))
+	    mismatch++;
+	}
+      t_masked /= num_queries;
+      printf("    %-8s : %s, %8.1f us per query (full scans %.1f us)\n",
+	     bench_kernels[j], mismatch ? "MISMATCH" : "exact",
+	     t_masked * 1e6, t_full * 1e6);
+      if(mismatch)
+	ret = -1;
+    }
+  iw_kernel_select(NULL);
+
+  free(ref);
+  free(all);
+  free(partial);
+  iw_fpblock_free(&fpb);
+  return(ret);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Check the kNN of every kernel unrolled for the width of the map
+ * against its kernel of any width, and time both
+ */
+static int
+bench_widths_run(const struct iw_fpstore *	fps,
+		 const int8_t *			queries,
+		 int				num_queries,
+		 int				k)
+{
+  struct iw_fpblock	fpb;
+  struct iw_knn *	ref;
+  struct iw_knn		knn;
+  int			ret = 0;
+  unsigned int		j;
+  int			q;
+
+  if(iw_fpblock_from_store(&fpb, fps) < 0)
+    return(-1);
+  ref = malloc(num_queries * sizeof(*ref));
+  if(ref == NULL)
+    {
+      iw_fpblock_free(&fpb);
+      return(-1);
+    }
+  iw_knn_init(&knn, k);
+  for(q = 0; q < num_queries; q++)
+    iw_knn_init(&ref[q], k);
+
+  printf("kNN k=%d, kernels of %d routers against those of any width :\n",
+	 knn.k, fps->num_routers);
+  for(j = 0; j < sizeof(bench_kernels) / sizeof(bench_kernels[0]); j++)
+    {
+      double	start;
+      double	t_any;
+      double	t_width;
+      int	mismatch = 0;
+
+      if(iw_kernel_select(bench_kernels[j]) < 0)
+	continue;
+      iw_kernel_widths(0);
+      start = bench_now();
+      for(q = 0; q < num_queries; q++)
+	iw_fpblock_knn(&fpb, queries + (size_t) q * MAX_ROUTERS, &ref[q]);
+      t_any = (bench_now() - start) / num_queries;
+      iw_kernel_widths(1);
+      start = bench_now();
+      for(q = 0; q < num_queries; q++)
+	iw_fpblock_knn(&fpb, queries + (size_t) q * MAX_ROUTERS, &knn);
+      t_width = (bench_now() - start) / num_queries;
+      for(q = 0; q < num_queries; q++)
+	{
+	  iw_fpblock_knn(&fpb, queries + (size_t) q * MAX_ROUTERS, &knn);
+	  if((knn.count != ref[q].count)
+	     || memcmp(knn.nb, ref[q].nb, knn.count * sizeof(knn.nb[0])))
+	    mismatch++;
+	}
+      printf("    %-8s : %s, %8.1f us per query (any width %.1f us)\n",
+	     bench_kernels[j], mismatch ? "MISMATCH" : "exact",
+	     t_width * 1e6, t_any * 1e6);
+      if(mismatch)
+	ret = -1;
+    }
+  iw_kernel_select(NULL);
+
+  free(ref);
+  iw_fpblock_free(&fpb);
+  return(ret);
+}
+
+/****************************** INDEX ******************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Check the tree against brute force, and time both. The times go in
+ * t_brute and t_tree (per query), and the share of the points the tree
+ * measured in visited.
+ */
+static int
+bench_index_compare(const struct iw_fpstore *	fps,
+		    const int8_t *		queries,
+		    int				num_queries,
+		    int				k,
+		    double *			t_brute,
+		    double *			t_tree,
+		    double *			visited)
+{
+  struct iw_fpblock	fpb;
+  struct iw_vptree	tree;
+  struct iw_knn		ref;
+  struct iw_knn		knn;
+  double		start;
+  long			count = 0;
+  int			mismatch = 0;
+  int			n;
+  int			q;
+
+  if(iw_fpblock_from_store(&fpb, fps) < 0)
+    return(-1);
+  if(iw_vptree_build(&tree, fps) < 0)
+    {
+      iw_fpblock_free(&fpb);
+      return(-1);
+    }
+  iw_knn_init(&ref, k);
+  iw_knn_init(&knn, k);
+
+  start = bench_now();
+  for(q = 0; q < num_queries; q++)
+    iw_fpblock_knn(&fpb, queries + (size_t) q * MAX_ROUTERS, &ref);
+  *t_brute = (bench_now() - start) / num_queries;
+
+  start = bench_now();
+  for(q = 0; q < num_queries; q++)
+    {
+      iw_vptree_knn(&tree, queries + (size_t) q * MAX_ROUTERS, &knn, &n);
+      count += n;
+    }
+  *t_tree = (bench_now() - start) / num_queries;
+  *visited = (double) count / num_queries / fps->num_points;
+
+  for(q = 0; q < num_queries; q++)
+    {
+      iw_fpblock_knn(&fpb, queries + (size_t) q * MAX_ROUTERS, &ref);
+      iw_vptree_knn(&tree, queries + (size_t) q * MAX_ROUTERS, &knn, NULL);
+      if((ref.count != knn.count)
+	 || memcmp(ref.nb, knn.nb, knn.count * sizeof(knn.nb[0])))
+	mismatch++;
+    }
+
+  iw_vptree_free(&tree);
+  iw_fpblock_free(&fpb);
+  return(mismatch);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * The tree on one map
+ */
+static int
+bench_index_run(const struct iw_fpstore *	fps,
+		const int8_t *			queries,
+		int				num_queries,
+		int				k)
+{
+  double	t_brute;
+  double	t_tree;
+  double	visited;
+  int		mismatch;
+
+  mismatch = bench_index_compare(fps, queries, num_queries, k,
+				 &t_brute, &t_tree, &visited);
+  if(mismatch < 0)
+    return(-1);
+  printf("    vptree   : %s, %8.1f us per query, %.1f %% of the points"
+	 " (brute force %.1f us)\n", mismatch ? "MISMATCH" : "exact",
+	 t_tree * 1e6, visited * 100, t_brute * 1e6);
+  return(mismatch ? -1 : 0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * The local search of the trackers, from a point linked to the one each
+ * query was taken at (the last fix, a step away), against the search of
+ * the whole map : how often it finds the same best, how often it would
+ * fall back, and how much it measures. Not exact, by design.
+ */
+static int
+bench_graph_run(const struct iw_fpstore *	fps,
+		int				num_queries,
+		int				k,
+		int				by_position)
+{
+  struct iw_fpblock	fpb;
+  struct iw_graph	graph;
+  struct iw_knn		ref;
+  struct iw_knn		knn;
+  int8_t		query[MAX_ROUTERS];
+  double		start;
+  double		t_build;
+  double		t_whole = 0;
+  double		t_local = 0;
+  long			count = 0;
+  int			limit = fps->num_routers * IW_GRAPH_THRESHOLD_DEFAULT
+				* IW_GRAPH_THRESHOLD_DEFAULT;
+  int			same = 0;
+  int			far = 0;
+  int			q;
+  int			r;
+
+  if(iw_fpblock_from_store(&fpb, fps) < 0)
+    return(-1);
+  start = bench_now();
+  if(iw_graph_build(&graph, fps, IW_GRAPH_DEGREE, by_position) < 0)
+    {
+      iw_fpblock_free(&fpb);
+      return(-1);
+    }
+  t_build = bench_now() - start;
+  iw_knn_init(&ref, k);
+  iw_knn_init(&knn, k);
+
+  for(q = 0; q < num_queries; q++)
+    {
+      int		p = rand() % fps->num_points;
+      const int8_t *	row = iw_fpstore_row(fps, p);
+      int		seed = graph.links[(size_t) p * graph.degree
+					   + rand() % graph.degree];
+      int		n;
+
+      memset(query, 0, sizeof(query));
+      for(r = 0; r < fps->num_routers; r++)
+	if(row[r] != 0)
+	  query[r] = iw_dbm_sat(row[r] + rand() % 9 - 4);
+
+      start = bench_now();
+      iw_fpblock_knn_masked(&fpb, NULL, query, IW_KNN_PENALTY_DEFAULT, &ref);
+      t_whole += bench_now() - start;
+      start = bench_now();
+      iw_graph_knn(&graph, fps, query, IW_KNN_PENALTY_DEFAULT,
+		   (seed >= 0) ? seed : p, &knn, &n);
+      t_local += bench_now() - start;
+      count += n;
+
+      if((knn.count > 0) && (ref.count > 0)
+	 && (knn.nb[0].point == ref.nb[0].point))
+	same++;
+      if((knn.count == 0) || (knn.nb[0].dist > limit))
+	far++;
+    }
+
+  printf("    %-11s : %5.1f %% same best, %4.1f %% over %d dB, %8.1f us"
+	 " per query, %.1f %% of the points (whole map %.1f us, built in"
+	 " %.0f ms)\n", by_position ? "by position" : "by finger",
+	 100.0 * same / num_queries, 100.0 * far / num_queries,
+	 IW_GRAPH_THRESHOLD_DEFAULT, t_local / num_queries * 1e6,
+	 100.0 * count / num_queries / fps->num_points,
+	 t_whole / num_queries * 1e6, t_build * 1e3);
+
+  iw_graph_free(&graph);
+  iw_fpblock_free(&fpb);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Find the size of map from which the tree beats brute force, for a
+ * few numbers of routers
+ */
+static int
+bench_crossover(int	max_points,
+		int	num_queries,
+		int	k)
+{
+  static const int	routers[] = { 4, 16, 64, 256 };
+  unsigned int		r;
+  int			ret = 0;
+
+  printf("kNN k=%d, %d queries, %s kernel\n", k, num_queries,
+	 iw_kernel_name());
+  for(r = 0; r < sizeof(routers) / sizeof(routers[0]); r++)
+    {
+      int	crossover = 0;
+      int	n;
+
+      printf("%d routers :\n", routers[r]);
+      for(n = 256; n <= max_points; n *= 4)
+	{
+	  struct iw_fpstore	fps;
+	  int8_t *		queries;
+	  double		t_brute;
+	  double		t_tree;
+	  double		visited;
+	  int			mismatch;
+
+	  if(bench_random_store(&fps, n, routers[r]) < 0)
+	    return(-1);
+	  queries = bench_queries(&fps, num_queries);
+	  if(queries == NULL)
+	    {
+	      iw_fpstore_free(&fps);
+	      return(-1);
+	    }
+	  mismatch = bench_index_compare(&fps, queries, num_queries, k,
+					 &t_brute, &t_tree, &visited);
+	  free(queries);
+	  iw_fpstore_free(&fps);
+	  if(mismatch < 0)
+	    return(-1);
+	  if(mismatch)
+	    ret = -1;
+	  if((crossover == 0) && (t_tree < t_brute))
+	    crossover = n;
+	  printf("    %7d points : brute %9.1f us, vptree %9.1f us (%5.1f %%)%s\n",
+		 n, t_brute * 1e6, t_tree * 1e6, visited * 100,
+		 mismatch ? " MISMATCH" : "");
+	}
+      if(crossover)
+	printf("    vptree faster from %d points\n", crossover);
+      else
+	printf("    brute force always faster\n");
+    }
+  return(ret);
+}
+
+/**************************** THREADS ****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Check the search on a pool of 1 to max_threads threads against the
+ * single thread one, and time it
+ */
+static int
+bench_pool_run(const struct iw_fpstore *	fps,
+	       const int8_t *			queries,
+	       int				num_queries,
+	       int				k,
+	       int				max_threads)
+{
+  struct iw_fpblock	fpb;
+  struct iw_knn *	ref;
+  struct iw_knn		knn;
+  double		t_single;
+  double		start;
+  int			threads;
+  int			ret = 0;
+  int			q;
+
+  if(iw_fpblock_from_store(&fpb, fps) < 0)
+    return(-1);
+  ref = malloc(num_queries * sizeof(*ref));
+  if(ref == NULL)
+    {
+      iw_fpblock_free(&fpb);
+      return(-1);
+    }
+  iw_knn_init(&knn, k);
+  start = bench_now();
+  for(q = 0; q < num_queries; q++)
+    {
+      iw_knn_init(&ref[q], k);
+      iw_fpblock_knn(&fpb, queries + (size_t) q * MAX_ROUTERS, &ref[q]);
+    }
+  t_single = (bench_now() - start) / num_queries;
+
+  printf("%d points x %d routers, kNN k=%d, %s kernel\n", fps->num_points,
+	 fps->num_routers, knn.k, iw_kernel_name());
+  printf("    %2d thread  : %8.1f us per query\n", 1, t_single * 1e6);
+  for(threads = 2; threads <= max_threads; threads *= 2)
+    {
+      struct iw_pool	pool;
+      double		elapsed;
+      int		mismatch = 0;
+      int		n;
+
+      /* Ends with max_threads, whatever it is */
+      if((threads < max_threads) && (2 * threads > max_threads))
+	threads = max_threads;
+      n = iw_pool_init(&pool, threads);
+      if(n < 0)
+	{
+	  ret = -1;
+	  break;
+	}
+      start = bench_now();
+      for(q = 0; q < num_queries; q++)
+	{
+	  iw_fpblock_knn_pool(&fpb, &pool, queries + (size_t) q * MAX_ROUTERS,
+			      &knn);
+	  if((knn.count != ref[q].count)
+	     || memcmp(knn.nb, ref[q].nb, knn.count * sizeof(knn.nb[0])))
+	    mismatch++;
+	}
+      elapsed = (bench_now() - start) / num_queries;
+      iw_pool_free(&pool);
+      printf("    %2d threads : %s, %8.1f us per query, x%.2f\n", n,
+	     mismatch ? "MISMATCH" : "exact", elapsed * 1e6,
+	     t_single / elapsed);
+      if(mismatch)
+	ret = -1;
+    }
+
+  free(ref);
+  iw_fpblock_free(&fpb);
+  return(ret);
+}
+
+/************************** PRODUCT CODES **************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Check that every kernel gives the neighbours of the plain C scan
+ */
+static int
+bench_pq_kernels(const struct iw_pq *		pq,
+		 const struct iw_fpstore *	fps,
+		 const int8_t *			queries,
+		 int				num_queries,
+		 int				k)
+{
+  struct iw_knn *	ref;
+  struct iw_knn		knn;
+  unsigned int		i;
+  int			q;
+
+  ref = malloc(num_queries * sizeof(*ref));
+  if(ref == NULL)
+    return(-1);
+  iw_kernel_select("scalar");
+  for(q = 0; q < num_queries; q++)
+    {
+      iw_knn_init(&ref[q], k);
+      iw_pq_knn(pq, fps, NULL, queries + (size_t) q * MAX_ROUTERS, &ref[q]);
+    }
+  for(i = 1; i < sizeof(bench_kernels) / sizeof(bench_kernels[0]); i++)
+    {
+      int	mismatch = 0;
+
+      if(iw_kernel_select(bench_kernels[i]) < 0)
+	continue;
+      iw_knn_init(&knn, k);
+      for(q = 0; q < num_queries; q++)
+	{
+	  iw_pq_knn(pq, fps, NULL, queries + (size_t) q * MAX_ROUTERS, &knn);
+	  if((knn.count != ref[q].count)
+	     || memcmp(knn.nb, ref[q].nb, knn.count * sizeof(knn.nb[0])))
+	    mismatch++;
+	}
+      printf("    %-8s : %s scan of the codes\n", bench_kernels[i],
+	     mismatch ? "MISMATCH," : "same");
+      if(mismatch)
+	{
+	  free(ref);
+	  return(-1);
+	}
+    }
+  iw_kernel_select(NULL);
+  free(ref);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Recall@k of the approximate search, by number of candidates : the
+ * share of the exact k nearest it finds
+ */
+static int
+bench_pq_run(const struct iw_fpstore *	fps,
+	     const int8_t *		queries,
+	     int			num_queries,
+	     int			k,
+	     int			sub_dim)
+{
+  struct iw_fpblock	fpb;
+  struct iw_pq		pq;
+  struct iw_knn *	exact;
+  struct iw_knn		knn;
+  double		t_exact;
+  double		start;
+  int			rerank;
+  int			q;
+
+  exact = malloc(num_queries * sizeof(*exact));
+  if((exact == NULL) || (iw_fpblock_from_store(&fpb, fps) < 0))
+    {
+      free(exact);
+      return(-1);
+    }
+  start = bench_now();
+  for(q = 0; q < num_queries; q++)
+    {
+      iw_knn_init(&exact[q], k);
+      iw_fpblock_knn(&fpb, queries + (size_t) q * MAX_ROUTERS, &exact[q]);
+    }
+  t_exact = (bench_now() - start) / num_queries;
+  iw_fpblock_free(&fpb);
+
+  start = bench_now();
+  if(iw_pq_train(&pq, fps, NULL, sub_dim) < 0)
+    {
+      free(exact);
+      return(-1);
+    }
+  printf("    codes    : %d bytes per point, trained in %.2f s\n",
+	 pq.sub_stride / 2, bench_now() - start);
+
+  /* The kernels must scan the same sums, hence find the same points */
+  if(bench_pq_kernels(&pq, fps, queries, num_queries, k) < 0)
+    {
+      iw_pq_free(&pq);
+      free(exact);
+      return(-1);
+    }
+
+  iw_knn_init(&knn, k);
+  for(rerank = knn.k; ; rerank *= 4)
+    {
+      long	found = 0;
+      long	wanted = 0;
+      double	t_pq;
+
+      if(rerank > fps->num_points)
+	rerank = fps->num_points;
+      if(rerank > IWPQ_RERANK_MAX)
+	rerank = IWPQ_RERANK_MAX;
+      pq.rerank = rerank;
+      start = bench_now();
+      for(q = 0; q < num_queries; q++)
+	{
+	  int	i;
+	  int	j;
+
+	  if(iw_pq_knn(&pq, fps, NULL, queries + (size_t) q * MAX_ROUTERS,
+		       &knn) < 0)
+	    {
+	      iw_pq_free(&pq);
+	      free(exact);
+	      return(-1);
+	    }
+	  /* Same point, or a tie with the distance of an exact one */
+	  for(i = 0; i < exact[q].count; i++)
+	    for(j = 0; j < knn.count; j++)
+	      if((knn.nb[j].point == exact[q].nb[i].point)
+		 || (knn.nb[j].dist == exact[q].nb[i].dist))
+		{
+		  found++;
+		  break;
+		}
+	  wanted += exact[q].count;
+	}
+      t_pq = (bench_now() - start) / num_queries;
+      printf("    %6d candidates : recall@%d %5.1f %%, %8.1f us per query"
+	     " (exact %.1f us)\n", rerank, knn.k, 100.0 * found / wanted,
+	     t_pq * 1e6, t_exact * 1e6);
+      if((rerank == fps->num_points) || (rerank == IWPQ_RERANK_MAX))
+	break;
+    }
+
+  iw_pq_free(&pq);
+  free(exact);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Recall and time of the clusters, by number of clusters searched
+ */
+static int
+bench_cluster_run(const struct iw_fpstore *	fps,
+		  const int8_t *		queries,
+		  int				num_queries,
+		  int				k)
+{
+  struct iw_fpblock	fpb;
+  struct iw_cluster	cl;
+  struct iw_knn *	exact;
+  struct iw_knn		knn;
+  double		t_exact;
+  double		start;
+  int			probe;
+  int			q;
+
+  exact = malloc(num_queries * sizeof(*exact));
+  if((exact == NULL) || (iw_fpblock_from_store(&fpb, fps) < 0))
+    {
+      free(exact);
+      return(-1);
+    }
+  start = bench_now();
+  for(q = 0; q < num_queries; q++)
+    {
+      iw_knn_init(&exact[q], k);
+      iw_fpblock_knn(&fpb, queries + (size_t) q * MAX_ROUTERS, &exact[q]);
+    }
+  t_exact = (bench_now() - start) / num_queries;
+  iw_fpblock_free(&fpb);
+
+  start = bench_now();
+  if(iw_cluster_build(&cl, fps, 0) < 0)
+    {
+      free(exact);
+      return(-1);
+    }
+  printf("    clusters : %d, built in %.2f s\n", cl.num_clusters,
+	 bench_now() - start);
+
+  iw_knn_init(&knn, k);
+  for(probe = 1; ; probe *= 2)
+    {
+      long	found = 0;
+      long	wanted = 0;
+      long	count = 0;
+      double	t_cl;
+      int	n;
+
+      if(probe > cl.num_clusters)
+	probe = cl.num_clusters;
+      if(probe > IW_CLUSTER_PROBE_MAX)
+	probe = IW_CLUSTER_PROBE_MAX;
+      cl.probe = probe;
+      start = bench_now();
+      for(q = 0; q < num_queries; q++)
+	{
+	  int	i;
+	  int	j;
+
+	  iw_cluster_knn(&cl, queries + (size_t) q * MAX_ROUTERS, &knn, &n);
+	  count += n;
+	  /* Same point, or a tie with the distance of an exact one */
+	  for(i = 0; i < exact[q].count; i++)
+	    for(j = 0; j < knn.count; j++)
+	      if((knn.nb[j].point == exact[q].nb[i].point)
+		 || (knn.nb[j].dist == exact[q].nb[i].dist))
+		{
+		  found++;
+		  break;
+		}
+	  wanted += exact[q].count;
+	}
+      t_cl = (bench_now() - start) / num_queries;
+      printf("    %6d clusters : recall@%d %5.1f %%, %8.1f us per query,"
+	     " %.1f %% of the points (exact %.1f us)\n", probe, knn.k,
+	     100.0 * found / wanted, t_cl * 1e6,
+	     100.0 * count / num_queries / fps->num_points, t_exact * 1e6);
+      if((probe == cl.num_clusters) || (probe == IW_CLUSTER_PROBE_MAX))
+	break;
+    }
+
+  iw_cluster_free(&cl);
+  free(exact);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Recall of the strongest routers index against the size of its
+ * candidates, by votes a candidate needs
+ */
+static int
+bench_invert_run(const struct iw_fpstore *	fps,
+		 const int8_t *			queries,
+		 int				num_queries,
+		 int				k)
+{
+  struct iw_fpblock	fpb;
+  struct iw_invert	inv;
+  struct iw_knn *	exact;
+  struct iw_knn		knn;
+  double		t_exact;
+  double		start;
+  int			votes;
+  int			q;
+
+  exact = malloc(num_queries * sizeof(*exact));
+  if((exact == NULL) || (iw_fpblock_from_store(&fpb, fps) < 0))
+    {
+      free(exact);
+      return(-1);
+    }
+  start = bench_now();
+  for(q = 0; q < num_queries; q++)
+    {
+      iw_knn_init(&exact[q], k);
+      iw_fpblock_knn_masked(&fpb, NULL, queries + (size_t) q * MAX_ROUTERS,
+			    IW_KNN_PENALTY_DEFAULT, &exact[q]);
+    }
+  t_exact = (bench_now() - start) / num_queries;
+  iw_fpblock_free(&fpb);
+
+  start = bench_now();
+  if(iw_inv_build(&inv, fps) < 0)
+    {
+      free(exact);
+      return(-1);
+    }
+  printf("    routers  : %d postings, built in %.2f s\n",
+	 inv.heads[inv.num_routers * IW_INV_BUCKETS], bench_now() - start);
+
+  iw_knn_init(&knn, k);
+  for(votes = IW_INV_KEYS; votes >= 1; votes--)
+    {
+      long	found = 0;
+      long	wanted = 0;
+      long	count = 0;
+      int	least = fps->num_points;
+      int	most = 0;
+      double	t_inv;
+      int	n;
+
+      inv.votes = votes;
+      start = bench_now();
+      for(q = 0; q < num_queries; q++)
+	{
+	  int	i;
+	  int	j;
+
+	  iw_inv_knn(&inv, fps, queries + (size_t) q * MAX_ROUTERS,
+		     IW_KNN_PENALTY_DEFAULT, &knn, &n);
+	  count += n;
+	  if(n < least)
+	    least = n;
+	  if(n > most)
+	    most = n;
+	  /* Same point, or a tie with the distance of an exact one */
+	  for(i = 0; i < exact[q].count; i++)
+	    for(j = 0; j < knn.count; j++)
+	      if((knn.nb[j].point == exact[q].nb[i].point)
+		 || (knn.nb[j].dist == exact[q].nb[i].dist))
+		{
+		  found++;
+		  break;
+		}
+	  wanted += exact[q].count;
+	}
+      t_inv = (bench_now() - start) / num_queries;
+      printf("    %d of %d keys : recall@%d %5.1f %%, %8.1f us per query,"
+	     " %ld candidates (%d to %d) (exact %.1f us)\n", votes,
+	     IW_INV_KEYS, knn.k, 100.0 * found / wanted, t_inv * 1e6,
+	     count / num_queries, least, most, t_exact * 1e6);
+    }
+
+  iw_inv_free(&inv);
+  free(exact);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * The routers kept by a selection : how well the held out points are
+ * located, and the time of a search
+ */
+static int
+bench_select_one(const struct iw_select *	sel,
+		 const struct iw_fpstore *	fps,
+		 int				by_position,
+		 const int8_t *			queries,
+		 int				num_queries,
+		 int				k)
+{
+  struct iw_fpstore	reduced;
+  struct iw_fpblock	fpb;
+  struct iw_knn		knn;
+  int8_t		row[MAX_ROUTERS];
+  double		agree;
+  double		start;
+  double		t_knn;
+  int			q;
+
+  agree = iw_select_check(sel, fps, by_position);
+  if((agree < 0) || (iw_select_store(sel, fps, &reduced) < 0))
+    return(-1);
+  if(iw_fpblock_from_store(&fpb, &reduced) < 0)
+    {
+      iw_fpstore_free(&reduced);
+      return(-1);
+    }
+  iw_knn_init(&knn, k);
+  start = bench_now();
+  for(q = 0; q < num_queries; q++)
+    {
+      iw_select_row(sel, queries + (size_t) q * MAX_ROUTERS, row);
+      iw_fpblock_knn(&fpb, row, &knn);
+    }
+  t_knn = (bench_now() - start) / num_queries;
+  printf("    %4d routers : located %5.1f %% as well, %8.1f us per query\n",
+	 sel->num_kept, 100 * agree, t_knn * 1e6);
+  iw_fpblock_free(&fpb);
+  iw_fpstore_free(&reduced);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Routers kept against the points found and the time of a search, from
+ * all of them down by halves, then as chosen against the held out points
+ */
+static int
+bench_select_run(const struct iw_fpstore *	fps,
+		 const int8_t *			queries,
+		 int				num_queries,
+		 int				k)
+{
+  struct iw_select	sel;
+  double		start;
+  int			by_position = 0;
+  int			kept;
+  int			r;
+
+  /* Maps from a file come without their positions */
+  for(r = 0; r < fps->num_points; r++)
+    by_position |= (fps->x[r] != 0) || (fps->y[r] != 0);
+  iw_select_rank(&sel, fps);
+  printf("routers by variance :");
+  for(r = 0; (r < sel.num_routers) && (r < 8); r++)
+    printf(" %d (%.0f dB^2)", sel.rank[r], sel.var[r]);
+  printf("%s\n", (sel.num_routers > 8) ? " ..." : "");
+
+  for(kept = sel.num_routers; kept >= 1; kept /= 2)
+    {
+      iw_select_keep(&sel, kept);
+      if(bench_select_one(&sel, fps, by_position, queries, num_queries, k) < 0)
+	return(-1);
+    }
+
+  start = bench_now();
+  if(iw_select_auto(&sel, fps, by_position, IW_SELECT_TARGET_DEFAULT) < 0)
+    return(-1);
+  printf("  chosen to locate the held out points %.0f %% as well, by %s,"
+	 " in %.2f s :\n", 100 * IW_SELECT_TARGET_DEFAULT,
+	 by_position ? "position" : "fingerprint", bench_now() - start);
+  return(bench_select_one(&sel, fps, by_position, queries, num_queries, k));
+}
+
+/****************************** CACHE ******************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Load a catalogue of the zones given, all with the map zone.map of dir.
+ * Return 0 if it loads, -1 if it is refused.
+ */
+static int
+bench_catalog_load(const char *	dir,
+		   const char *	zones[],
+		   int		num_zones)
+{
+  struct iw_catalog	cat;
+  char			path[PATH_MAX];
+  FILE *		file;
+  int			z;
+
+  snprintf(path, sizeof(path), "%s/site.cat", dir);
+  file = fopen(path, "w");
+  if(file == NULL)
+    return(-1);
+  for(z = 0; z < num_zones; z++)
+    fprintf(file, "%s zone.map\n", zones[z]);
+  fclose(file);
+  z = iw_catalog_load(&cat, path);
+  if(z == 0)
+    iw_catalog_free(&cat);
+  unlink(path);
+  return(z);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Check that a catalogue refuses a zone inside a zone that has a map,
+ * in either order, as the inner one would never be searched
+ */
+static int
+bench_catalog_run(const struct iw_fpstore *	fps)
+{
+  static const char *	nested[] = { "site/a", "site/a/b" };
+  static const char *	reversed[] = { "site/a/b", "site/a" };
+  static const char *	siblings[] = { "site/a/b", "site/a/c" };
+  struct iwmap_router	routers[MAX_ROUTERS];
+  struct iwmap		map;
+  char			dir[] = "/tmp/iwlocbench-XXXXXX";
+  char			path[PATH_MAX];
+  int			ret = 0;
+  int			r;
+
+  memset(routers, 0, sizeof(routers));
+  for(r = 0; r < fps->num_routers; r++)
+    {
+      /* Locally administered, all different */
+      routers[r].bssid[0] = 0x02;
+      routers[r].bssid[4] = r >> 8;
+      routers[r].bssid[5] = r;
+    }
+  if(mkdtemp(dir) == NULL)
+    return(-1);
+  snprintf(path, sizeof(path), "%s/zone.map", dir);
+  if(iw_map_build(&map, fps, routers, 0) < 0)
+    {
+      rmdir(dir);
+      return(-1);
+    }
+  r = iw_map_save(&map, path);
+  iw_map_close(&map);
+  if(r < 0)
+    {
+      rmdir(dir);
+      return(-1);
+    }
+
+  printf("catalogue of zones :\n");
+  /* Refused and reported, errors expected */
+  if((bench_catalog_load(dir, nested, 2) == 0)
+     || (bench_catalog_load(dir, reversed, 2) == 0))
+    {
+      printf("    nested zones : ACCEPTED\n");
+      ret = -1;
+    }
+  else
+    printf("    nested zones : refused, either order\n");
+  if(bench_catalog_load(dir, siblings, 2) < 0)
+    {
+      printf("    sibling zones : REFUSED\n");
+      ret = -1;
+    }
+  else
+    printf("    sibling zones : loaded\n");
+
+  unlink(path);
+  rmdir(dir);
+  return(ret);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Assets that don't move : each is scanned BENCH_STAY times where it
+ * lies, a router now and then a dB off (as in output.txt), then it is
+ * moved to another point. The matcher behind the cache against the
+ * matcher alone, and the same points.
+ */
+static int
+bench_cache_run(const struct iw_fpstore *	fps,
+		int				num_scans,
+		int				k,
+		int				quantum)
+{
+  struct iw_fpblock	fpb;
+  struct iw_cache	cache;
+  struct iw_knn		ref;
+  struct iw_knn		knn;
+  int8_t		base[MAX_ROUTERS];
+  int8_t		query[MAX_ROUTERS];
+  double		t_cache = 0;
+  double		t_search = 0;
+  int			wrong = 0;
+  int			s;
+  int			r;
+
+  if(iw_fpblock_from_store(&fpb, fps) < 0)
+    return(-1);
+  if(iw_cache_init(&cache, IW_CACHE_ENTRIES, quantum) < 0)
+    {
+      iw_fpblock_free(&fpb);
+      return(-1);
+    }
+  iw_knn_init(&ref, k);
+  iw_knn_init(&knn, k);
+
+  for(s = 0; s < num_scans; s++)
+    {
+      double	start;
+
+      if((s % BENCH_STAY) == 0)
+	{
+	  const int8_t *	row = iw_fpstore_row(fps, rand() % fps->num_points);
+
+	  memset(base, 0, sizeof(base));
+	  for(r = 0; r < fps->num_routers; r++)
+	    if(row[r] != 0)
+	      base[r] = iw_dbm_sat(row[r] + rand() % 9 - 4);
+	}
+      memcpy(query, base, sizeof(query));
+      r = rand() % (4 * fps->num_routers);
+      if((r < fps->num_routers) && (query[r] != 0))
+	query[r] = iw_dbm_sat(query[r] + ((rand() & 1) ? 1 : -1));
+
+      start = bench_now();
+      iw_fpblock_knn_masked(&fpb, NULL, query, IW_KNN_PENALTY_DEFAULT, &ref);
+      t_search += bench_now() - start;
+
+      start = bench_now();
+      if(!iw_cache_lookup(&cache, query, fps->num_routers, &knn))
+	{
+	  iw_fpblock_knn_masked(&fpb, NULL, query, IW_KNN_PENALTY_DEFAULT,
+				&knn);
+	  iw_cache_store(&cache, query, fps->num_routers, &knn);
+	}
+      t_cache += bench_now() - start;
+      if(knn.nb[0].point != ref.nb[0].point)
+	wrong++;
+    }
+
+  printf("cache by %d dB, %d scans, %d per asset : %lu hits %lu misses,"
+	 " %8.2f us per scan (search %.2f us), %.1f %% other points\n",
+	 cache.quantum, num_scans, BENCH_STAY, cache.hits, cache.misses,
+	 t_cache / num_scans * 1e6, t_search / num_scans * 1e6,
+	 100.0 * wrong / num_scans);
+  iw_cache_free(&cache);
+  iw_fpblock_free(&fpb);
+  return(0);
+}
+
+/****************************** TRACKERS ******************************/
+
+/*
+ * Someone walking across the floor of the map, scanning as they go
+ */
+struct bench_walker
+{
+  double	x;
+  double	y;
+  double	heading;
+  double	minx;
+  double	maxx;
+  double	miny;
+  double	maxy;
+};
+
+/*------------------------------------------------------------------*/
+/*
+ * Start a walk anywhere on the floor of the map
+ */
+static void
+bench_walker_init(struct bench_walker *		walker,
+		  const struct iw_fpstore *	fps)
+{
+  int	i;
+
+  walker->minx = walker->maxx = fps->x[0];
+  walker->miny = walker->maxy = fps->y[0];
+  for(i = 1; i < fps->num_points; i++)
+    {
+      walker->minx = fmin(walker->minx, fps->x[i]);
+      walker->maxx = fmax(walker->maxx, fps->x[i]);
+      walker->miny = fmin(walker->miny, fps->y[i]);
+      walker->maxy = fmax(walker->maxy, fps->y[i]);
+    }
+  walker->x = walker->minx + (walker->maxx - walker->minx) * bench_uniform();
+  walker->y = walker->miny + (walker->maxy - walker->miny) * bench_uniform();
+  walker->heading = 2 * M_PI * bench_uniform();
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * One step of BENCH_PACE : the walker turns a little, and bounces off
+ * the walls. The scan is the point nearest to the walker, up to noise
+ * dB off, and missing one router in missed (if not 0).
+ */
+static void
+bench_walker_step(struct bench_walker *		walker,
+		  const struct iw_fpstore *	fps,
+		  int				noise,
+		  int				missed,
+		  int8_t *			query)
+{
+  const int8_t *	row;
+  double		best = INFINITY;
+  int			nearest = 0;
+  int			i;
+  int			r;
+
+  walker->heading += (bench_uniform() - 0.5) * M_PI / 2;
+  walker->x += BENCH_PACE * cos(walker->heading);
+  walker->y += BENCH_PACE * sin(walker->heading);
+  if((walker->x < walker->minx) || (walker->x > walker->maxx)
+     || (walker->y < walker->miny) || (walker->y > walker->maxy))
+    {
+      walker->heading += M_PI;
+      walker->x = fmin(fmax(walker->x, walker->minx), walker->maxx);
+      walker->y = fmin(fmax(walker->y, walker->miny), walker->maxy);
+    }
+  for(i = 0; i < fps->num_points; i++)
+    {
+      double	d2 = ((fps->x[i] - walker->x) * (fps->x[i] - walker->x)
+		      + (fps->y[i] - walker->y) * (fps->y[i] - walker->y));
+
+      if(d2 < best)
+	{
+	  best = d2;
+	  nearest = i;
+	}
+    }
+  row = iw_fpstore_row(fps, nearest);
+  memset(query, 0, MAX_ROUTERS);
+  for(r = 0; r < fps->num_routers; r++)
+    if((row[r] != 0) && ((missed == 0) || (rand() % missed != 0)))
+      query[r] = iw_dbm_sat(row[r] + rand() % (2 * noise + 1) - noise);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Track a random walk across the floor of the map with the particle
+ * filter, one scan per second at a steady pace (the filter allows for
+ * up to IW_PF_SPEED_DEFAULT). Time the filter, and compare its error
+ * with that of the nearest point of each scan (once the cloud has
+ * settled).
+ */
+static int
+bench_pf_run(const struct iw_fpstore *	fps,
+	     int			num_scans,
+	     int			num_particles)
+{
+  struct bench_walker	walker;
+  struct iw_fpblock	fpb;
+  struct iw_knn		knn;
+  struct iw_pf		pf;
+  int8_t		query[MAX_ROUTERS];
+  double		t_filter = 0;
+  double		e_filter = 0;
+  double		e_nearest = 0;
+  int			settle = num_scans / 10;
+  int			s;
+
+  if(iw_fpblock_from_store(&fpb, fps) < 0)
+    return(-1);
+  if(iw_pf_init(&pf, fps, num_particles, IW_PF_SPEED_DEFAULT) < 0)
+    {
+      iw_fpblock_free(&fpb);
+      return(-1);
+    }
+  iw_knn_init(&knn, 1);
+  bench_walker_init(&walker, fps);
+
+  for(s = 0; s < num_scans; s++)
+    {
+      double	start;
+      double	px;
+      double	py;
+
+      bench_walker_step(&walker, fps, 4, 0, query);
+      start = bench_now();
+      iw_pf_move(&pf, 1.0);
+      iw_pf_update(&pf, fps, query, IW_KNN_PENALTY_DEFAULT,
+		   IW_PF_SIGMA_DEFAULT);
+      iw_pf_estimate(&pf, &px, &py);
+      t_filter += bench_now() - start;
+
+      iw_fpblock_knn(&fpb, query, &knn);
+      if(s >= settle)
+	{
+	  e_filter += hypot(px - walker.x, py - walker.y);
+	  e_nearest += hypot(fps->x[knn.nb[0].point] - walker.x,
+			     fps->y[knn.nb[0].point] - walker.y);
+	}
+    }
+
+  printf("particle filter, %d particles, %d scans at %.1f per scan :\n"
+	 "    %8.1f us per scan, %.1f M particles/s, error %.2f"
+	 " (nearest point %.2f)\n", pf.num_particles, num_scans, BENCH_PACE,
+	 t_filter / num_scans * 1e6,
+	 (double) pf.num_particles * num_scans / t_filter * 1e-6,
+	 e_filter / (num_scans - settle), e_nearest / (num_scans - settle));
+
+  iw_pf_free(&pf);
+  iw_fpblock_free(&fpb);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Track a random walk with the hidden Markov tracker, on scans with
+ * more noise and a router in eight missed. Time it, and count the fixes
+ * that jump more than BENCH_JUMP paces from the last, for it and for
+ * the nearest point of each scan.
+ */
+static int
+bench_hmm_run(const struct iw_fpstore *	fps,
+	      int			num_scans)
+{
+  struct bench_walker	walker;
+  struct iw_fpblock	fpb;
+  struct iw_hmm		hmm;
+  struct iw_knn		knn;
+  int8_t		query[MAX_ROUTERS];
+  double		start;
+  double		t_build;
+  double		t_hmm = 0;
+  double		e_hmm = 0;
+  double		e_nearest = 0;
+  long			states = 0;
+  int			j_hmm = 0;
+  int			j_nearest = 0;
+  int			last_hmm = -1;
+  int			last_nearest = -1;
+  int			s;
+
+  if(iw_fpblock_from_store(&fpb, fps) < 0)
+    return(-1);
+  start = bench_now();
+  if(iw_hmm_build(&hmm, fps, IW_HMM_REACH) < 0)
+    {
+      iw_fpblock_free(&fpb);
+      return(-1);
+    }
+  t_build = bench_now() - start;
+  iw_knn_init(&knn, 1);
+  bench_walker_init(&walker, fps);
+
+  for(s = 0; s < num_scans; s++)
+    {
+      int	state;
+      int	nearest;
+
+      bench_walker_step(&walker, fps, 8, 8, query);
+      start = bench_now();
+      state = iw_hmm_update(&hmm, fps, query, IW_KNN_PENALTY_DEFAULT,
+			    IW_HMM_SIGMA_DEFAULT, IW_HMM_THRESHOLD_DEFAULT);
+      /* The first, lost, scan measures the whole map */
+      if(s > 0)
+	t_hmm += bench_now() - start;
+      states += hmm.num_next;
+      iw_fpblock_knn_masked(&fpb, NULL, query, IW_KNN_PENALTY_DEFAULT, &knn);
+      nearest = knn.nb[0].point;
+      if(state < 0)
+	continue;
+
+      e_hmm += hypot(fps->x[state] - walker.x, fps->y[state] - walker.y);
+      e_nearest += hypot(fps->x[nearest] - walker.x,
+			 fps->y[nearest] - walker.y);
+      if((last_hmm >= 0)
+	 && (hypot(fps->x[state] - fps->x[last_hmm],
+		   fps->y[state] - fps->y[last_hmm]) > BENCH_JUMP * BENCH_PACE))
+	j_hmm++;
+      if((last_nearest >= 0)
+	 && (hypot(fps->x[nearest] - fps->x[last_nearest],
+		   fps->y[nearest] - fps->y[last_nearest])
+	     > BENCH_JUMP * BENCH_PACE))
+	j_nearest++;
+      last_hmm = state;
+      last_nearest = nearest;
+    }
+
+  printf("hidden Markov tracker, %d states, %d transitions, built in %.0f ms,"
+	 " %d scans :\n"
+	 "    %8.1f us per scan, %.0f states per scan, lost %d times,"
+	 " error %.2f, %d jumps (nearest point %.2f, %d jumps)\n",
+	 hmm.num_states, hmm.nnz, t_build * 1e3, num_scans,
+	 t_hmm / (num_scans - 1) * 1e6, (double) states / num_scans,
+	 hmm.lost, e_hmm / num_scans, j_hmm, e_nearest / num_scans, j_nearest);
+
+  iw_hmm_free(&hmm);
+  iw_fpblock_free(&fpb);
+  return(0);
+}
+
+/******************************* MAIN ********************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Display help
+ */
+static void
+iw_usage(int	status)
+{
+  fputs("Usage: iwlocbench [-n points] [-r routers] [-q queries] [-k k]"
+	" [-s seed] [binarymap]\n"
+	"       iwlocbench -x [-n max points] [-q queries] [-k k]\n"
+	"       iwlocbench -a [-d routers] [-n points] [-r routers] [-q queries]"
+	" [-k k] [binarymap]\n"
+	"       iwlocbench -t threads [-n points] [-r routers] [-q queries]"
+	" [-k k] [binarymap]\n"
+	"       iwlocbench -p particles [-n points] [-r routers] [-q scans]"
+	" [binarymap]\n"
+	"       iwlocbench -m [-n points] [-r routers] [-q scans] [binarymap]\n"
+	"       iwlocbench -f [-n points] [-r routers] [-q queries] [-k k]"
+	" [binarymap]\n"
+	"       iwlocbench -c quantum [-n points] [-r routers] [-q scans]"
+	" [-k k] [binarymap]\n",
+	status ? stderr : stdout);
+  exit(status);
+}
+
+static const struct option long_opts[] = {
+  { "approximate", no_argument, NULL, 'a' },
+  { "cache", required_argument, NULL, 'c' },
+  { "code-routers", required_argument, NULL, 'd' },
+  { "features", no_argument, NULL, 'f' },
+  { "help", no_argument, NULL, 'h' },
+  { "markov", no_argument, NULL, 'm' },
+  { "neighbours", required_argument, NULL, 'k' },
+  { "points", required_argument, NULL, 'n' },
+  { "particles", required_argument, NULL, 'p' },
+  { "queries", required_argument, NULL, 'q' },
+  { "routers", required_argument, NULL, 'r' },
+  { "seed", required_argument, NULL, 's' },
+  { "threads", required_argument, NULL, 't' },
+  { "crossover", no_argument, NULL, 'x' },
+  { NULL, 0, NULL, 0 }
+};
+
+/*------------------------------------------------------------------*/
+/*
+ * The main !
+ */
+int
+main(int	argc,
+     char **	argv)
+{
+  struct iw_fpstore	fps;
+  int8_t *		queries;
+  int			num_points = BENCH_POINTS_DEFAULT;
+  int			num_routers = BENCH_ROUTERS_DEFAULT;
+  int			num_queries = BENCH_QUERIES_DEFAULT;
+  int			k = BENCH_K_DEFAULT;
+  int			crossover = 0;
+  int			approximate = 0;
+  int			sub_dim = IWPQ_SUB_DIM_DEFAULT;
+  int			threads = 0;
+  int			particles = 0;
+  int			markov = 0;
+  int			features = 0;
+  int			quantum = 0;
+  int			ret;
+  int			opt;
+
+  /* Check command line arguments */
+  while((opt = getopt_long(argc, argv, "ac:d:fhk:mn:p:q:r:s:t:x", long_opts, NULL)) > 0)
+    {
+      switch(opt)
+	{
+	case 'a':
+	  /* Recall of the product codes */
+	  approximate = 1;
+	  break;
+
+	case 'c':
+	  /* Cache of the results, levels by that many dB */
+	  quantum = atoi(optarg);
+	  if(quantum < 1)
+	    quantum = 1;
+	  break;
+
+	case 'd':
+	  sub_dim = atoi(optarg);
+	  break;
+
+	case 'f':
+	  /* Routers kept, by variance */
+	  features = 1;
+	  break;
+
+	case 'h':
+	  iw_usage(0);
+	  break;
+
+	case 'k':
+	  k = atoi(optarg);
+	  break;
+
+	case 'm':
+	  /* Hidden Markov tracker along a walk */
+	  markov = 1;
+	  break;
+
+	case 'n':
+	  num_points = atoi(optarg);
+	  break;
+
+	case 'p':
+	  /* Particle filter along a walk */
+	  particles = atoi(optarg);
+	  break;
+
+	case 'q':
+	  num_queries = atoi(optarg);
+	  break;
+
+	case 'r':
+	  num_routers = atoi(optarg);
+	  break;
+
+	case 's':
+	  srand(atoi(optarg));
+	  break;
+
+	case 't':
+	  /* Scaling on a pool, up to that many threads */
+	  threads = atoi(optarg);
+	  if(threads < 1)
+	    threads = sysconf(_SC_NPROCESSORS_ONLN);
+	  break;
+
+	case 'x':
+	  /* Tree against brute force, by size of map */
+	  crossover = 1;
+	  break;
+
+	default:
+	  iw_usage(1);
+	  break;
+	}
+    }
+  if((num_points < 1) || (num_queries < 1)
+     || (num_routers < 1) || (num_routers > MAX_ROUTERS))
+    iw_usage(1);
+
+  if(crossover)
+    {
+      if(optind != argc)
+	iw_usage(1);
+      return(bench_crossover(num_points, num_queries, k) < 0);
+    }
+
+  if(optind + 1 == argc)
+    ret = bench_map_store(&fps, argv[optind]);
+  else if(optind == argc)
+    ret = bench_random_store(&fps, num_points, num_routers);
+  else
+    iw_usage(1);
+  if((ret < 0) || (fps.num_points == 0))
+    {
+      fprintf(stderr, "iwlocbench: no radio map : %s\n",
+	      ret < 0 ? strerror(errno) : "no points");
+      return(1);
+    }
+
+  queries = bench_queries(&fps, num_queries);
+  if(queries == NULL)
+    {
+      fprintf(stderr, "iwlocbench: %s\n", strerror(ENOMEM));
+      iw_fpstore_free(&fps);
+      return(1);
+    }
+  if((particles > 0) || markov)
+    {
+      ret = (particles > 0) ? bench_pf_run(&fps, num_queries, particles)
+			    : bench_hmm_run(&fps, num_queries);
+      if(ret < 0)
+	fprintf(stderr, "iwlocbench: %s\n", strerror(errno));
+      free(queries);
+      iw_fpstore_free(&fps);
+      return(ret < 0);
+    }
+  if(quantum > 0)
+    {
+      ret = bench_cache_run(&fps, num_queries, k, quantum);
+      if(ret < 0)
+	fprintf(stderr, "iwlocbench: %s\n", strerror(errno));
+      free(queries);
+      iw_fpstore_free(&fps);
+      return(ret < 0);
+    }
+  if(features)
+    {
+      ret = bench_select_run(&fps, queries, num_queries, k);
+      if(ret < 0)
+	fprintf(stderr, "iwlocbench: %s\n", strerror(errno));
+      free(queries);
+      iw_fpstore_free(&fps);
+      return(ret < 0);
+    }
+  if(threads > 0)
+    {
+      ret = bench_pool_run(&fps, queries, num_queries, k, threads);
+      if(ret < 0)
+	fprintf(stderr, "iwlocbench: %s\n", strerror(errno));
+      free(queries);
+      iw_fpstore_free(&fps);
+      return(ret < 0);
+    }
+  if(approximate)
+    {
+      ret = bench_pq_run(&fps, queries, num_queries, k, sub_dim);
+      if((ret == 0)
+	 && (bench_cluster_run(&fps, queries, num_queries, k) < 0))
+	ret = -1;
+      if((ret == 0)
+	 && (bench_invert_run(&fps, queries, num_queries, k) < 0))
+	ret = -1;
+      if(ret < 0)
+	fprintf(stderr, "iwlocbench: %s\n", strerror(errno));
+      free(queries);
+      iw_fpstore_free(&fps);
+      return(ret < 0);
+    }
+  ret = bench_kernels_run(&fps, queries, num_queries);
+  if(bench_knn_run(&fps, queries, num_queries, k) < 0)
+    ret = -1;
+  if(bench_batch_run(&fps, queries, num_queries, k) < 0)
+    ret = -1;
+  if(bench_masked_run(&fps, queries, num_queries, k,
+		      IW_KNN_PENALTY_DEFAULT, 0) < 0)
+    ret = -1;
+  /* Too few heard for the distances of a big map to fit, they saturate */
+  if(bench_masked_run(&fps, queries, num_queries, k,
+		      IW_KNN_PENALTY_MAX, BENCH_FEW_HEARD) < 0)
+    ret = -1;
+  if(bench_widths_run(&fps, queries, num_queries, k) < 0)
+    ret = -1;
+  if(bench_index_run(&fps, queries, num_queries, k) < 0)
+    ret = -1;
+  printf("local search k=%d from a neighbour of the point, %d links :\n",
+	 k, IW_GRAPH_DEGREE);
+  if((bench_graph_run(&fps, num_queries, k, 1) < 0)
+     || (bench_graph_run(&fps, num_queries, k, 0) < 0))
+    ret = -1;
+  if(bench_catalog_run(&fps) < 0)
+    ret = -1;
+  free(queries);
+  iw_fpstore_free(&fps);
+  return(ret < 0);
+}
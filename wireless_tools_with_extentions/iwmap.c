@@ -0,0 +1,1443 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Radio map files : compilation of the text maps written by
+ * "iwlist learn", and loading of the binary maps used by "iwlist track".
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+#include <limits.h>		/* PATH_MAX */
+#include <sys/mman.h>		/* mmap */
+#include <sys/stat.h>		/* fstat */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Longest token of a text map, as a scanf() width */
+#define IWMAP_TOKEN_MAX		128
+#define IWMAP_TOKEN_FMT		"%127s"
+
+/****************************** TYPES ******************************/
+
+/*
+ * Position of a point, as read from input/actual_coordinates.txt
+ */
+struct iwmap_coord
+{
+  char		label[IWMAP_LABEL_LEN];
+  double	x;
+  double	y;
+};
+
+/************************* IMAGE SUBROUTINES *************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Compute the layout of a map of the given size
+ * (nnz only matters for sparse maps)
+ */
+static void
+iw_map_layout(struct iwmap_header *	hdr,
+	      int			num_routers,
+	      int			num_points,
+	      uint64_t			nnz,
+	      uint32_t			flags)
+{
+  uint64_t	off;
+
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, IWMAP_MAGIC, IWMAP_MAGIC_LEN);
+  hdr->version = IWMAP_VERSION;
+  hdr->header_len = sizeof(*hdr);
+  hdr->flags = flags;
+  hdr->num_routers = num_routers;
+  hdr->num_points = num_points;
+  hdr->row_stride = IWMAP_ROUNDUP(num_routers, IWMAP_ROW_ALIGN);
+  hdr->label_len = IWMAP_LABEL_LEN;
+
+  off = IWMAP_ROUNDUP(sizeof(*hdr), IWMAP_ALIGN);
+  hdr->routers_off = off;
+  off += (uint64_t) num_routers * sizeof(struct iwmap_router);
+  off = IWMAP_ROUNDUP(off, IWMAP_ALIGN);
+  hdr->matrix_off = off;
+  if(!(flags & IWMAP_F_SPARSE))
+    off += (uint64_t) num_points * hdr->row_stride * sizeof(int8_t);
+  off = IWMAP_ROUNDUP(off, IWMAP_ALIGN);
+  hdr->x_off = off;
+  off += (uint64_t) num_points * sizeof(double);
+  off = IWMAP_ROUNDUP(off, IWMAP_ALIGN);
+  hdr->y_off = off;
+  off += (uint64_t) num_points * sizeof(double);
+  off = IWMAP_ROUNDUP(off, IWMAP_ALIGN);
+  hdr->labels_off = off;
+  off += (uint64_t) num_points * hdr->label_len;
+  off = IWMAP_ROUNDUP(off, IWMAP_ALIGN);
+
+  /* Empty CSR sections for dense maps */
+  if(!(flags & IWMAP_F_SPARSE))
+    nnz = 0;
+  hdr->nnz = nnz;
+  hdr->rowptr_off = off;
+  if(flags & IWMAP_F_SPARSE)
+    off += (uint64_t) (num_points + 1) * sizeof(uint32_t);
+  off = IWMAP_ROUNDUP(off, IWMAP_ALIGN);
+  hdr->cols_off = off;
+  off += nnz * sizeof(uint16_t);
+  off = IWMAP_ROUNDUP(off, IWMAP_ALIGN);
+  hdr->vals_off = off;
+  off += nnz * sizeof(int8_t);
+  off = IWMAP_ROUNDUP(off, IWMAP_ALIGN);
+
+  /* Stats of the cells, dense maps only */
+  hdr->stats_off = off;
+  if((flags & IWMAP_F_STATS) && !(flags & IWMAP_F_SPARSE))
+    off += (uint64_t) num_points * hdr->row_stride * sizeof(struct iwmap_stat);
+  hdr->file_len = off;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Check that a section of the image fits in the file
+ */
+static int
+iw_map_section_ok(const struct iwmap_header *	hdr,
+		  uint64_t			off,
+		  uint64_t			count,
+		  uint64_t			size)
+{
+  /* count and size both come from 32 bit fields, can't overflow */
+  return((off <= hdr->file_len)
+	 && ((off % sizeof(double)) == 0)
+	 && (count * size <= hdr->file_len - off));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Make sure the header describes a sane image of the given length,
+ * so that we never read outside of the mapping.
+ */
+static int
+iw_map_check(const struct iwmap_header *	hdr,
+	     size_t				len)
+{
+  int	sparse = (hdr->flags & IWMAP_F_SPARSE) != 0;
+  int	stats = (hdr->flags & IWMAP_F_STATS) && !sparse;
+
+  if((len < sizeof(*hdr))
+     || (memcmp(hdr->magic, IWMAP_MAGIC, IWMAP_MAGIC_LEN) != 0))
+    {
+      errno = EINVAL;
+      return(-1);
+    }
+  if(hdr->version != IWMAP_VERSION)
+    {
+      errno = ENOTSUP;
+      return(-1);
+    }
+  if((hdr->header_len < sizeof(*hdr))
+     || (hdr->file_len > len)
+     || (hdr->row_stride < hdr->num_routers)
+     || (hdr->label_len != IWMAP_LABEL_LEN)
+     || !iw_map_section_ok(hdr, hdr->routers_off, hdr->num_routers,
+			   sizeof(struct iwmap_router))
+     || !iw_map_section_ok(hdr, hdr->matrix_off,
+			   sparse ? 0 :
+			   (uint64_t) hdr->num_points * hdr->row_stride,
+			   sizeof(int8_t))
+     || !iw_map_section_ok(hdr, hdr->x_off, hdr->num_points,
+			   sizeof(double))
+     || !iw_map_section_ok(hdr, hdr->y_off, hdr->num_points,
+			   sizeof(double))
+     || !iw_map_section_ok(hdr, hdr->labels_off, hdr->num_points,
+			   hdr->label_len)
+     /* Keep nnz small enough for the products below */
+     || (hdr->nnz > hdr->file_len)
+     || (sparse
+	 && !iw_map_section_ok(hdr, hdr->rowptr_off,
+			       (uint64_t) hdr->num_points + 1, sizeof(uint32_t)))
+     || !iw_map_section_ok(hdr, hdr->cols_off, hdr->nnz, sizeof(uint16_t))
+     || !iw_map_section_ok(hdr, hdr->vals_off, hdr->nnz, sizeof(int8_t))
+     || !iw_map_section_ok(hdr, hdr->stats_off,
+			   stats ?
+			   (uint64_t) hdr->num_points * hdr->row_stride : 0,
+			   sizeof(struct iwmap_stat)))
+    {
+      errno = EINVAL;
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Point the header and router table of the map into its image
+ */
+static void
+iw_map_bind(struct iwmap *	map)
+{
+  const char *	base = (const char *) map->image;
+
+  map->hdr = (const struct iwmap_header *) base;
+  map->routers = (const struct iwmap_router *) (base + map->hdr->routers_off);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Count the heard (non zero) cells of a store
+ */
+static uint64_t
+iw_fpstore_count_heard(const struct iw_fpstore *	fps)
+{
+  uint64_t	nnz = 0;
+  int		i;
+  int		j;
+
+  for(i = 0; i < fps->num_points; i++)
+    {
+      const int8_t *	row = iw_fpstore_row(fps, i);
+
+      for(j = 0; j < fps->num_routers; j++)
+	nnz += (row[j] != 0);
+    }
+  return(nnz);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Write the heard cells of a store in compressed sparse row form
+ */
+static void
+iw_fpstore_to_csr(const struct iw_fpstore *	fps,
+		  uint32_t *			rowptr,
+		  uint16_t *			cols,
+		  int8_t *			vals)
+{
+  uint32_t	k = 0;
+  int		i;
+  int		j;
+
+  for(i = 0; i < fps->num_points; i++)
+    {
+      const int8_t *	row = iw_fpstore_row(fps, i);
+
+      rowptr[i] = k;
+      for(j = 0; j < fps->num_routers; j++)
+	if(row[j] != 0)
+	  {
+	    cols[k] = j;
+	    vals[k] = row[j];
+	    k++;
+	  }
+    }
+  rowptr[fps->num_points] = k;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Build the image of a map from a fingerprint store and its router
+ * table (one entry per column of the store).
+ * With IWMAP_F_SPARSE, only the heard cells are written. IWMAP_F_STATS
+ * is dropped if the store has no stats, or if the map is sparse.
+ */
+int
+iw_map_build(struct iwmap *			map,
+	     const struct iw_fpstore *		fps,
+	     const struct iwmap_router *	routers,
+	     uint32_t				flags)
+{
+  struct iwmap_header	hdr;
+  char *		image;
+  size_t		n = fps->num_points;
+  uint64_t		nnz = 0;
+
+  memset(map, 0, sizeof(*map));
+  if((fps->stats == NULL) || (flags & IWMAP_F_SPARSE))
+    flags &= ~IWMAP_F_STATS;
+  if(flags & IWMAP_F_SPARSE)
+    {
+      nnz = iw_fpstore_count_heard(fps);
+      /* Row pointers are 32 bits */
+      if(nnz > UINT32_MAX)
+	{
+	  errno = E2BIG;
+	  return(-1);
+	}
+    }
+  iw_map_layout(&hdr, fps->num_routers, fps->num_points, nnz, flags);
+  /* The store and the file use the same row padding */
+  if(hdr.row_stride != (uint32_t) fps->stride)
+    {
+      errno = EINVAL;
+      return(-1);
+    }
+
+  image = calloc(1, hdr.file_len);
+  if(image == NULL)
+    return(-1);
+  memcpy(image, &hdr, sizeof(hdr));
+  memcpy(image + hdr.routers_off, routers,
+	 fps->num_routers * sizeof(struct iwmap_router));
+  if(n > 0)
+    {
+      if(flags & IWMAP_F_SPARSE)
+	iw_fpstore_to_csr(fps, (uint32_t *) (image + hdr.rowptr_off),
+			  (uint16_t *) (image + hdr.cols_off),
+			  (int8_t *) (image + hdr.vals_off));
+      else
+	memcpy(image + hdr.matrix_off, fps->rss,
+	       n * fps->stride * sizeof(int8_t));
+      if(flags & IWMAP_F_STATS)
+	memcpy(image + hdr.stats_off, fps->stats,
+	       n * fps->stride * sizeof(struct iwmap_stat));
+      memcpy(image + hdr.x_off, fps->x, n * sizeof(double));
+      memcpy(image + hdr.y_off, fps->y, n * sizeof(double));
+      memcpy(image + hdr.labels_off, fps->labels, n * IWMAP_LABEL_LEN);
+    }
+
+  map->image = image;
+  map->len = hdr.file_len;
+  map->mapped = 0;
+  iw_map_bind(map);
+  return(0);
+}
+
+/************************ FINGERPRINT STORE ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Reallocate the arrays of a store for the given number of rows and
+ * cells per row. Used for growth, and to take a private copy of the
+ * arrays borrowed from a map.
+ */
+static int
+iw_fpstore_realloc(struct iw_fpstore *	fps,
+		   int			capacity,
+		   int			stride)
+{
+  void *	rss = NULL;
+  struct iwmap_stat *	stats = NULL;
+  double *	x;
+  double *	y;
+  char *	labels;
+  int		i;
+
+  /* Rows are cache line aligned for the matcher */
+  if(!fps->sparse
+     && (posix_memalign(&rss, IWMAP_ALIGN,
+			IWMAP_ROUNDUP((size_t) capacity * stride * sizeof(int8_t),
+				      IWMAP_ALIGN)) != 0))
+    {
+      errno = ENOMEM;
+      return(-1);
+    }
+  /* Stats only if there were some, all unknown */
+  if(fps->stats != NULL)
+    stats = calloc((size_t) capacity * stride, sizeof(struct iwmap_stat));
+  x = malloc(capacity * sizeof(double));
+  y = malloc(capacity * sizeof(double));
+  labels = calloc(capacity, IWMAP_LABEL_LEN);
+  if((x == NULL) || (y == NULL) || (labels == NULL)
+     || ((fps->stats != NULL) && (stats == NULL)))
+    {
+      free(rss);
+      free(stats);
+      free(x);
+      free(y);
+      free(labels);
+      errno = ENOMEM;
+      return(-1);
+    }
+
+  /* Copy the existing points, new cells read as 0 (not heard) */
+  if(rss != NULL)
+    {
+      memset(rss, 0, (size_t) capacity * stride * sizeof(int8_t));
+      for(i = 0; (fps->rss != NULL) && (i < fps->num_points); i++)
+	memcpy((int8_t *) rss + (size_t) i * stride, iw_fpstore_row(fps, i),
+	       fps->num_routers * sizeof(int8_t));
+    }
+  for(i = 0; (stats != NULL) && (i < fps->num_points); i++)
+    memcpy(stats + (size_t) i * stride, iw_fpstore_stats(fps, i),
+	   fps->num_routers * sizeof(struct iwmap_stat));
+  if(fps->num_points > 0)
+    {
+      memcpy(x, fps->x, fps->num_points * sizeof(double));
+      memcpy(y, fps->y, fps->num_points * sizeof(double));
+      memcpy(labels, fps->labels, (size_t) fps->num_points * IWMAP_LABEL_LEN);
+    }
+
+  /* Don't free what we borrowed */
+  if(fps->capacity > 0)
+    {
+      free(fps->rss);
+      free(fps->stats);
+      free(fps->x);
+      free(fps->y);
+      free(fps->labels);
+    }
+  fps->rss = rss;
+  fps->stats = stats;
+  fps->x = x;
+  fps->y = y;
+  fps->labels = labels;
+  fps->capacity = capacity;
+  fps->stride = stride;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Create an empty store for the given number of routers
+ */
+int
+iw_fpstore_init(struct iw_fpstore *	fps,
+		int			num_routers)
+{
+  memset(fps, 0, sizeof(*fps));
+  fps->num_routers = num_routers;
+  return(iw_fpstore_realloc(fps, 16,
+			    IWMAP_ROUNDUP(num_routers, IWMAP_ROW_ALIGN)));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Use the arrays of a loaded map as a (borrowed) store.
+ * Sparse maps have no matrix, rss is then NULL (see iw_fpsparse).
+ */
+int
+iw_fpstore_from_map(struct iw_fpstore *		fps,
+		    const struct iwmap *	map)
+{
+  const char *	base = (const char *) map->image;
+
+  memset(fps, 0, sizeof(*fps));
+  fps->num_points = map->hdr->num_points;
+  fps->num_routers = map->hdr->num_routers;
+  fps->stride = map->hdr->row_stride;
+  /* capacity == 0 : read only, see iw_fpstore_realloc() */
+  fps->sparse = (map->hdr->flags & IWMAP_F_SPARSE) != 0;
+  if(!fps->sparse)
+    fps->rss = (int8_t *) (uintptr_t) (base + map->hdr->matrix_off);
+  if(!fps->sparse && (map->hdr->flags & IWMAP_F_STATS))
+    fps->stats = (struct iwmap_stat *) (uintptr_t) (base
+						    + map->hdr->stats_off);
+  fps->x = (double *) (uintptr_t) (base + map->hdr->x_off);
+  fps->y = (double *) (uintptr_t) (base + map->hdr->y_off);
+  fps->labels = (char *) (uintptr_t) (base + map->hdr->labels_off);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Make room for at least num_points points
+ */
+int
+iw_fpstore_reserve(struct iw_fpstore *	fps,
+		   int			num_points)
+{
+  int	capacity = fps->capacity ? fps->capacity : 16;
+
+  if(num_points <= fps->capacity)
+    return(0);
+  while(capacity < num_points)
+    capacity *= 2;
+  return(iw_fpstore_realloc(fps, capacity, fps->stride));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Change the number of routers (columns) of the store.
+ * New columns of existing points read as 0 (not heard).
+ */
+int
+iw_fpstore_set_routers(struct iw_fpstore *	fps,
+		       int			num_routers)
+{
+  int	stride = IWMAP_ROUNDUP(num_routers, IWMAP_ROW_ALIGN);
+  int	i;
+
+  /* No cells to move around */
+  if(fps->sparse)
+    {
+      fps->num_routers = num_routers;
+      fps->stride = stride;
+      return(0);
+    }
+
+  if((stride != fps->stride) || (fps->capacity == 0))
+    {
+      int	old = fps->num_routers;
+      int	capacity = fps->capacity;
+
+      /* Borrowed stores have no capacity, but points all the same */
+      if(capacity < fps->num_points)
+	capacity = fps->num_points;
+      if(capacity < 16)
+	capacity = 16;
+      /* Only copy the columns that survive */
+      if(num_routers < old)
+	fps->num_routers = num_routers;
+      if(iw_fpstore_realloc(fps, capacity, stride) < 0)
+	{
+	  fps->num_routers = old;
+	  return(-1);
+	}
+    }
+  else
+    /* Same stride, clear the cells we drop or reuse */
+    for(i = 0; i < fps->num_points; i++)
+      {
+	memset(fps->rss + (size_t) i * stride + num_routers, 0,
+	       (stride - num_routers) * sizeof(int8_t));
+	if(fps->stats != NULL)
+	  memset(fps->stats + (size_t) i * stride + num_routers, 0,
+		 (stride - num_routers) * sizeof(struct iwmap_stat));
+      }
+  fps->num_routers = num_routers;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append a point to the store, rss has one value per router (it is
+ * ignored by sparse stores). Return the index of the new point.
+ */
+int
+iw_fpstore_add(struct iw_fpstore *	fps,
+	       const int8_t *		rss,
+	       double			x,
+	       double			y,
+	       const char *		label)
+{
+  int	point = fps->num_points;
+  char *	dst;
+
+  if(iw_fpstore_reserve(fps, point + 1) < 0)
+    return(-1);
+
+  if(!fps->sparse)
+    memcpy(fps->rss + (size_t) point * fps->stride, rss,
+	   fps->num_routers * sizeof(int8_t));
+  /* Until iw_fpstore_set_stats() */
+  if(fps->stats != NULL)
+    memset(fps->stats + (size_t) point * fps->stride, 0,
+	   fps->stride * sizeof(struct iwmap_stat));
+  fps->x[point] = x;
+  fps->y[point] = y;
+  dst = fps->labels + (size_t) point * IWMAP_LABEL_LEN;
+  memset(dst, 0, IWMAP_LABEL_LEN);
+  strncpy(dst, label, IWMAP_LABEL_LEN - 1);
+  fps->num_points++;
+  return(point);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Set the stats of the cells of a point (one per router). The first
+ * stats of a store make room for those of every point, the points
+ * learnt without them have unknown spreads.
+ */
+int
+iw_fpstore_set_stats(struct iw_fpstore *		fps,
+		     int			point,
+		     const struct iwmap_stat *	stats)
+{
+  if(fps->sparse || (point < 0) || (point >= fps->num_points))
+    {
+      errno = EINVAL;
+      return(-1);
+    }
+  /* Copy what we borrowed first */
+  if((fps->capacity == 0)
+     && (iw_fpstore_realloc(fps, fps->num_points, fps->stride) < 0))
+    return(-1);
+  if(fps->stats == NULL)
+    {
+      fps->stats = calloc((size_t) fps->capacity * fps->stride,
+			  sizeof(struct iwmap_stat));
+      if(fps->stats == NULL)
+	{
+	  errno = ENOMEM;
+	  return(-1);
+	}
+    }
+  memcpy(fps->stats + (size_t) point * fps->stride, stats,
+	 fps->num_routers * sizeof(struct iwmap_stat));
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Stats of a cell from the mean and variance of its levels, in dBm and
+ * dB^2 (a mean of 0 : never heard)
+ */
+void
+iw_stat_set(struct iwmap_stat *	stat,
+	    double		mean,
+	    double		var)
+{
+  double	sigma = sqrt(var > 0 ? var : 0) / IWMAP_SIGMA_UNIT;
+
+  stat->mean = (mean < 0) ? iw_dbm_sat(lrint(mean)) : 0;
+  /* 0 is unknown, steady levels get the smallest spread */
+  stat->sigma = (sigma > 255) ? 255 : (sigma < 1) ? 1 : lrint(sigma);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Variance of the levels of a router over the points of a (dense) store,
+ * unheard at 0 as the distance sees them : the mean squared diff of two
+ * points at that router is twice this.
+ */
+double
+iw_fpstore_var(const struct iw_fpstore *	fps,
+	       int				router)
+{
+  double	sum = 0;
+  double	sum2 = 0;
+  int		i;
+
+  if(fps->num_points == 0)
+    return(0);
+  for(i = 0; i < fps->num_points; i++)
+    {
+      int	level = iw_fpstore_row(fps, i)[router];
+
+      sum += level;
+      sum2 += (double) level * level;
+    }
+  return(sum2 / fps->num_points
+	 - (sum / fps->num_points) * (sum / fps->num_points));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release a store (borrowed arrays belong to the map)
+ */
+void
+iw_fpstore_free(struct iw_fpstore *	fps)
+{
+  if(fps->capacity > 0)
+    {
+      free(fps->rss);
+      free(fps->stats);
+      free(fps->x);
+      free(fps->y);
+      free(fps->labels);
+    }
+  memset(fps, 0, sizeof(*fps));
+}
+
+/************************ SPARSE FINGERPRINTS ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Build the sparse form of a (dense) store
+ */
+int
+iw_fpsparse_from_store(struct iw_fpsparse *		sp,
+		       const struct iw_fpstore *	fps)
+{
+  uint64_t	nnz = iw_fpstore_count_heard(fps);
+  uint32_t *	rowptr;
+  uint16_t *	cols;
+  int8_t *	vals;
+
+  memset(sp, 0, sizeof(*sp));
+  if(nnz > UINT32_MAX)
+    {
+      errno = E2BIG;
+      return(-1);
+    }
+  rowptr = malloc((fps->num_points + 1) * sizeof(uint32_t));
+  /* Never ask malloc() for nothing, NULL would look like a failure */
+  cols = malloc((nnz + 1) * sizeof(uint16_t));
+  vals = malloc(nnz + 1);
+  if((rowptr == NULL) || (cols == NULL) || (vals == NULL))
+    {
+      free(rowptr);
+      free(cols);
+      free(vals);
+      errno = ENOMEM;
+      return(-1);
+    }
+  iw_fpstore_to_csr(fps, rowptr, cols, vals);
+
+  sp->num_points = fps->num_points;
+  sp->num_routers = fps->num_routers;
+  sp->owned = 1;
+  sp->floor = IWMAP_FLOOR_DEFAULT;
+  sp->nnz = nnz;
+  sp->max_points = fps->num_points;
+  sp->max_cells = nnz + 1;
+  sp->rowptr = rowptr;
+  sp->cols = cols;
+  sp->vals = vals;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Get the sparse fingerprints of a loaded map. The CSR sections of a
+ * sparse map are used in place, a dense map is converted.
+ */
+int
+iw_fpsparse_from_map(struct iw_fpsparse *	sp,
+		     const struct iwmap *	map)
+{
+  const struct iwmap_header *	hdr = map->hdr;
+  const char *			base = (const char *) map->image;
+  uint32_t			i;
+
+  if(!(hdr->flags & IWMAP_F_SPARSE))
+    {
+      struct iw_fpstore	fps;
+
+      iw_fpstore_from_map(&fps, map);
+      return(iw_fpsparse_from_store(sp, &fps));
+    }
+
+  memset(sp, 0, sizeof(*sp));
+  sp->num_points = hdr->num_points;
+  sp->num_routers = hdr->num_routers;
+  sp->floor = IWMAP_FLOOR_DEFAULT;
+  sp->nnz = hdr->nnz;
+  /* owned == 0 : read only, see iw_fpsparse_add() */
+  sp->rowptr = (uint32_t *) (uintptr_t) (base + hdr->rowptr_off);
+  sp->cols = (uint16_t *) (uintptr_t) (base + hdr->cols_off);
+  sp->vals = (int8_t *) (uintptr_t) (base + hdr->vals_off);
+
+  /* iw_map_check() only checked the sections, the matcher also trusts
+   * their content to stay within the arrays */
+  if((hdr->nnz > UINT32_MAX) || (sp->rowptr[0] != 0)
+     || (sp->rowptr[sp->num_points] != sp->nnz))
+    goto bad;
+  for(i = 0; i < (uint32_t) sp->num_points; i++)
+    if(sp->rowptr[i] > sp->rowptr[i + 1])
+      goto bad;
+  for(i = 0; i < sp->nnz; i++)
+    if(sp->cols[i] >= sp->num_routers)
+      goto bad;
+  return(0);
+
+ bad:
+  memset(sp, 0, sizeof(*sp));
+  errno = EINVAL;
+  return(-1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append a point to sparse fingerprints, row has one value per router
+ * and 0 for the unheard ones. Return the index of the new point.
+ */
+int
+iw_fpsparse_add(struct iw_fpsparse *	sp,
+		const int8_t *		row)
+{
+  uint32_t	heard = 0;
+  uint32_t	max_points = sp->max_points;
+  uint32_t	max_cells = sp->max_cells;
+  int		j;
+
+  for(j = 0; j < sp->num_routers; j++)
+    heard += (row[j] != 0);
+
+  /* Grow geometrically, and take a copy of borrowed arrays */
+  if(!sp->owned)
+    max_points = max_cells = 0;
+  if((uint32_t) sp->num_points + 1 > max_points)
+    max_points = 2 * sp->num_points + 16;
+  if(sp->nnz + heard > max_cells)
+    max_cells = 2 * (sp->nnz + heard) + 16;
+  if((max_points != sp->max_points) || (max_cells != sp->max_cells)
+     || !sp->owned)
+    {
+      uint32_t *	rowptr = malloc((max_points + 1) * sizeof(uint32_t));
+      uint16_t *	cols = malloc(max_cells * sizeof(uint16_t));
+      int8_t *		vals = malloc(max_cells);
+
+      if((rowptr == NULL) || (cols == NULL) || (vals == NULL))
+	{
+	  free(rowptr);
+	  free(cols);
+	  free(vals);
+	  errno = ENOMEM;
+	  return(-1);
+	}
+      memcpy(rowptr, sp->rowptr, (sp->num_points + 1) * sizeof(uint32_t));
+      memcpy(cols, sp->cols, sp->nnz * sizeof(uint16_t));
+      memcpy(vals, sp->vals, sp->nnz);
+      if(sp->owned)
+	{
+	  free(sp->rowptr);
+	  free(sp->cols);
+	  free(sp->vals);
+	}
+      sp->rowptr = rowptr;
+      sp->cols = cols;
+      sp->vals = vals;
+      sp->max_points = max_points;
+      sp->max_cells = max_cells;
+      sp->owned = 1;
+    }
+
+  for(j = 0; j < sp->num_routers; j++)
+    if(row[j] != 0)
+      {
+	sp->cols[sp->nnz] = j;
+	sp->vals[sp->nnz] = row[j];
+	sp->nnz++;
+      }
+  sp->rowptr[++sp->num_points] = sp->nnz;
+  return(sp->num_points - 1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release sparse fingerprints (borrowed arrays belong to the map)
+ */
+void
+iw_fpsparse_free(struct iw_fpsparse *	sp)
+{
+  if(sp->owned)
+    {
+      free(sp->rowptr);
+      free(sp->cols);
+      free(sp->vals);
+    }
+  memset(sp, 0, sizeof(*sp));
+}
+
+/************************ PATH LOSS MODEL ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Fit a log-distance path loss model for each router, by least squares
+ * over the points that hear it (x and y give the position of each point
+ * of sp). With p0 = level at 1 unit and t = -10 * log10(d), the model
+ * is a straight line, level = p0 + n * t.
+ * When the points don't say much about the slope (all at the same
+ * distance, or a slope that doesn't make sense, which is typical of
+ * routers whose position is unknown), the exponent is clamped and only
+ * p0 is fitted.
+ * Return the number of routers that could be fitted.
+ */
+int
+iw_pathloss_fit(const struct iw_fpsparse *	sp,
+		const double *			x,
+		const double *			y,
+		const struct iwmap_router *	routers,
+		struct iw_pathloss *		models)
+{
+  double *	sums;
+  int		fitted = 0;
+  uint32_t	k;
+  int		i;
+  int		r;
+
+  /* Per router : count, sum t, sum t^2, sum level, sum t * level */
+  sums = calloc((size_t) sp->num_routers * 5, sizeof(double));
+  if(sums == NULL)
+    {
+      errno = ENOMEM;
+      return(-1);
+    }
+
+  for(i = 0; i < sp->num_points; i++)
+    for(k = sp->rowptr[i]; k < sp->rowptr[i + 1]; k++)
+      {
+	double *	s = sums + (size_t) sp->cols[k] * 5;
+	double		dx = x[i] - routers[sp->cols[k]].x;
+	double		dy = y[i] - routers[sp->cols[k]].y;
+	double		d2 = dx * dx + dy * dy;
+	double		t;
+
+	if(d2 < IWMAP_PL_DMIN * IWMAP_PL_DMIN)
+	  d2 = IWMAP_PL_DMIN * IWMAP_PL_DMIN;
+	t = -5.0 * log10(d2);
+	s[0] += 1.0;
+	s[1] += t;
+	s[2] += t * t;
+	s[3] += sp->vals[k];
+	s[4] += t * sp->vals[k];
+      }
+
+  for(r = 0; r < sp->num_routers; r++)
+    {
+      const double *	s = sums + (size_t) r * 5;
+      double		det = s[0] * s[2] - s[1] * s[1];
+      double		n = IWMAP_PL_N_DEFAULT;
+
+      models[r].points = (int) s[0];
+      if(s[0] == 0)
+	{
+	  models[r].p0 = 0;
+	  models[r].n = n;
+	  continue;
+	}
+      /* Slope, unless the distances are all (nearly) the same */
+      if(det > 1e-9 * s[0] * s[0])
+	n = (s[0] * s[4] - s[1] * s[3]) / det;
+      if(n < IWMAP_PL_N_MIN)
+	n = IWMAP_PL_N_MIN;
+      if(n > IWMAP_PL_N_MAX)
+	n = IWMAP_PL_N_MAX;
+      /* Best intercept for that slope */
+      models[r].n = n;
+      models[r].p0 = (s[3] - n * s[1]) / s[0];
+      fitted++;
+    }
+
+  free(sums);
+  return(fitted);
+}
+
+/************************ BSSID REGISTRY ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * BSSID as a 48 bit integer
+ */
+static uint64_t
+iw_bssid_key(const unsigned char *	bssid)
+{
+  return(((uint64_t) bssid[0] << 40) | ((uint64_t) bssid[1] << 32)
+	 | ((uint64_t) bssid[2] << 24) | ((uint64_t) bssid[3] << 16)
+	 | ((uint64_t) bssid[4] << 8) | (uint64_t) bssid[5]);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Insert a key in the table, which must have a free slot
+ */
+static void
+iw_registry_insert(struct iw_bssid_registry *	reg,
+		   uint64_t			key,
+		   int				value)
+{
+  unsigned int	i;
+
+  for(i = (key * 0x9E3779B97F4A7C15ULL) >> reg->shift;
+      reg->keys[i] != 0;
+      i = (i + 1) & reg->mask)
+    if(reg->keys[i] == key)
+      {
+	reg->values[i] = value;
+	return;
+      }
+  reg->keys[i] = key;
+  reg->values[i] = value;
+  reg->count++;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Resize the table to 2^bits slots and rehash everything
+ */
+static int
+iw_registry_resize(struct iw_bssid_registry *	reg,
+		   unsigned int			bits)
+{
+  struct iw_bssid_registry	old = *reg;
+  unsigned int			size = 1U << bits;
+  unsigned int			i;
+
+  reg->keys = calloc(size, sizeof(uint64_t));
+  reg->values = malloc(size * sizeof(int));
+  if((reg->keys == NULL) || (reg->values == NULL))
+    {
+      free(reg->keys);
+      free(reg->values);
+      *reg = old;
+      errno = ENOMEM;
+      return(-1);
+    }
+  reg->mask = size - 1;
+  reg->shift = 64 - bits;
+  reg->count = 0;
+
+  if(old.keys != NULL)
+    {
+      for(i = 0; i <= old.mask; i++)
+	if(old.keys[i] != 0)
+	  iw_registry_insert(reg, old.keys[i], old.values[i]);
+      free(old.keys);
+      free(old.values);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Create an empty registry, sized for about hint routers
+ */
+int
+iw_registry_init(struct iw_bssid_registry *	reg,
+		 int				hint)
+{
+  unsigned int	bits = 4;
+
+  memset(reg, 0, sizeof(*reg));
+  /* Keep the load factor under one half */
+  while((bits < 30) && ((1U << bits) < 2U * hint))
+    bits++;
+  return(iw_registry_resize(reg, bits));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Register (or re-register) a BSSID
+ */
+int
+iw_registry_add(struct iw_bssid_registry *	reg,
+		const unsigned char *		bssid,
+		int				value)
+{
+  if((reg->keys == NULL) && (iw_registry_init(reg, 0) < 0))
+    return(-1);
+  if((2U * (reg->count + 1) > reg->mask + 1)
+     && (iw_registry_resize(reg, 65 - reg->shift) < 0))
+    return(-1);
+  iw_registry_insert(reg, iw_bssid_key(bssid) | IW_BSSID_USED, value);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Find the value registered for a BSSID, -1 if unknown
+ */
+int
+iw_registry_find(const struct iw_bssid_registry *	reg,
+		 const unsigned char *			bssid)
+{
+  uint64_t	key = iw_bssid_key(bssid) | IW_BSSID_USED;
+  unsigned int	i;
+
+  if(reg->keys == NULL)
+    return(-1);
+  /* Fibonacci hashing, the table is never full */
+  for(i = (key * 0x9E3779B97F4A7C15ULL) >> reg->shift;
+      reg->keys[i] != 0;
+      i = (i + 1) & reg->mask)
+    if(reg->keys[i] == key)
+      return(reg->values[i]);
+  return(-1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release a registry
+ */
+void
+iw_registry_free(struct iw_bssid_registry *	reg)
+{
+  free(reg->keys);
+  free(reg->values);
+  memset(reg, 0, sizeof(*reg));
+}
+
+/************************ LOADING SUBROUTINES ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Map a compiled radio map in memory.
+ * Pages are only read when the matcher touches them, so this is
+ * constant time whatever the size of the map.
+ */
+int
+iw_map_open(const char *	path,
+	    struct iwmap *	map)
+{
+  struct stat	st;
+  void *	image;
+  int		fd;
+  int		err;
+
+  memset(map, 0, sizeof(*map));
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return(-1);
+  if(fstat(fd, &st) < 0)
+    {
+      err = errno;
+      close(fd);
+      errno = err;
+      return(-1);
+    }
+  if(st.st_size < (off_t) sizeof(struct iwmap_header))
+    {
+      close(fd);
+      errno = EINVAL;
+      return(-1);
+    }
+
+  image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  /* The mapping holds its own reference on the file */
+  close(fd);
+  if(image == MAP_FAILED)
+    return(-1);
+
+  if(iw_map_check((const struct iwmap_header *) image, st.st_size) < 0)
+    {
+      err = errno;
+      munmap(image, st.st_size);
+      errno = err;
+      return(-1);
+    }
+
+  /* We will scan the whole matrix anyway, start reading it now */
+  madvise(image, st.st_size, MADV_WILLNEED);
+
+  map->image = image;
+  map->len = st.st_size;
+  map->mapped = 1;
+  iw_map_bind(map);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release a map, whether mapped or compiled
+ */
+void
+iw_map_close(struct iwmap *	map)
+{
+  if(map->image != NULL)
+    {
+      if(map->mapped)
+	munmap(map->image, map->len);
+      else
+	free(map->image);
+    }
+  memset(map, 0, sizeof(*map));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Write a map to disk.
+ * The new file is renamed over the old one, so that a tracker which
+ * has the old map mapped keeps a consistent view of it.
+ */
+int
+iw_map_save(const struct iwmap *	map,
+	    const char *		path)
+{
+  char		tmp[PATH_MAX];
+  FILE *	f;
+  int		err;
+
+  if(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+    {
+      errno = ENAMETOOLONG;
+      return(-1);
+    }
+
+  f = fopen(tmp, "wb");
+  if(f == NULL)
+    return(-1);
+  if(fwrite(map->image, 1, map->len, f) != map->len)
+    {
+      err = errno;
+      fclose(f);
+      unlink(tmp);
+      errno = err;
+      return(-1);
+    }
+  if((fclose(f) != 0) || (rename(tmp, path) < 0))
+    {
+      err = errno;
+      unlink(tmp);
+      errno = err;
+      return(-1);
+    }
+  return(0);
+}
+
+/********************** TEXT MAP SUBROUTINES ***********************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Read the router list (input/inputrouters.txt) : the number of
+ * routers, then one "mac x y essid" line per router.
+ * Return the number of routers.
+ */
+static int
+iw_map_read_routers(FILE *			f,
+		    struct iwmap_router *	routers,
+		    int				max)
+{
+  char	mac[IWMAP_TOKEN_MAX];
+  char	essid[IWMAP_TOKEN_MAX];
+  int	num;
+  int	x, y;
+  int	i;
+
+  if((fscanf(f, "%d", &num) != 1) || (num < 0))
+    {
+      errno = EINVAL;
+      return(-1);
+    }
+  if(num > max)
+    {
+      errno = E2BIG;
+      return(-1);
+    }
+
+  for(i = 0; i < num; i++)
+    {
+      if((fscanf(f, IWMAP_TOKEN_FMT " %d %d " IWMAP_TOKEN_FMT,
+		 mac, &x, &y, essid) != 4)
+	 || (iw_ether_aton(mac, (struct ether_addr *) routers[i].bssid)
+	     != ETH_ALEN))
+	{
+	  errno = EINVAL;
+	  return(-1);
+	}
+      strncpy(routers[i].essid, essid, IWMAP_ESSID_LEN - 1);
+      routers[i].x = x;
+      routers[i].y = y;
+    }
+  return(num);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Compare two coordinates by label, for qsort() and bsearch()
+ */
+static int
+iw_map_coord_cmp(const void *	a,
+		 const void *	b)
+{
+  return(strcmp(((const struct iwmap_coord *) a)->label,
+		((const struct iwmap_coord *) b)->label));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Read the position of the points (input/actual_coordinates.txt) :
+ * one "label x y" line per point. The result is sorted by label.
+ * Return the number of points.
+ */
+static int
+iw_map_read_coords(FILE *		f,
+		   struct iwmap_coord **	pcoords)
+{
+  struct iwmap_coord *	coords = NULL;
+  struct iwmap_coord	coord;
+  int			num = 0;
+  int			max = 0;
+
+  memset(&coord, 0, sizeof(coord));
+  while(fscanf(f, "%39s %lf %lf", coord.label, &coord.x, &coord.y) == 3)
+    {
+      if(num == max)
+	{
+	  struct iwmap_coord *	newcoords;
+
+	  max = max ? max * 2 : 64;
+	  newcoords = realloc(coords, max * sizeof(*coords));
+	  if(newcoords == NULL)
+	    {
+	      free(coords);
+	      return(-1);
+	    }
+	  coords = newcoords;
+	}
+      coords[num++] = coord;
+    }
+
+  if(num > 0)
+    qsort(coords, num, sizeof(*coords), iw_map_coord_cmp);
+  *pcoords = coords;
+  return(num);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Position of a point by label, from the coordinates file
+ * (input/actual_coordinates.txt, see iw_map_read_coords()).
+ * Return 0, or -1 with errno ENOENT if the point is not in the file.
+ */
+int
+iw_map_find_coords(FILE *	coords_file,
+		   const char *	label,
+		   double *	x,
+		   double *	y)
+{
+  struct iwmap_coord *	coords = NULL;
+  struct iwmap_coord *	coord;
+  struct iwmap_coord	key;
+  int			num;
+
+  num = iw_map_read_coords(coords_file, &coords);
+  if(num < 0)
+    return(-1);
+  memset(&key, 0, sizeof(key));
+  strncpy(key.label, label, IWMAP_LABEL_LEN - 1);
+  coord = (num > 0) ? bsearch(&key, coords, num, sizeof(*coords),
+			      iw_map_coord_cmp) : NULL;
+  if(coord == NULL)
+    {
+      free(coords);
+      errno = ENOENT;
+      return(-1);
+    }
+  *x = coord->x;
+  *y = coord->y;
+  free(coords);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Compile a text map, as written by learn_map(), into a binary map.
+ * The text map is a sequence of points, each made of a label followed
+ * by "mac value" lines. The lines of the points learnt with their
+ * spreads go on with the mean and variance of the level, in dBm and
+ * dB^2 : "mac value mean variance", and the map then keeps them
+ * (IWMAP_F_STATS).
+ * The optional router list fixes the order of the columns (routers
+ * found in the map but not in the list are added at the end), and the
+ * optional coordinates give the position of each point by label.
+ */
+int
+iw_map_compile_text(FILE *		text,
+		    FILE *		routers_file,
+		    FILE *		coords_file,
+		    struct iwmap *	map)
+{
+  struct iwmap_router		routers[MAX_ROUTERS];
+  struct iw_bssid_registry	reg;
+  struct iw_fpstore		fps;
+  struct iwmap_coord *		coords = NULL;
+  int				num_routers = 0;
+  int				num_coords = 0;
+  char				tok[IWMAP_TOKEN_MAX];
+  char				label[IWMAP_LABEL_LEN];
+  int8_t			row[MAX_ROUTERS];
+  struct iwmap_stat		stats[MAX_ROUTERS];
+  char				rest[IWMAP_TOKEN_MAX];
+  unsigned char			bssid[ETH_ALEN];
+  uint32_t			flags = 0;
+  int				have_point = 0;
+  int				have_stats = 0;
+  double			mean;
+  double			var;
+  int				value;
+  int				col;
+  int				ret = -1;
+
+  memset(map, 0, sizeof(*map));
+  memset(routers, 0, sizeof(routers));
+  memset(&fps, 0, sizeof(fps));
+  if(iw_registry_init(&reg, MAX_ROUTERS) < 0)
+    return(-1);
+
+  if(routers_file != NULL)
+    {
+      num_routers = iw_map_read_routers(routers_file, routers, MAX_ROUTERS);
+      if(num_routers < 0)
+	goto out;
+      for(col = 0; col < num_routers; col++)
+	if(iw_registry_add(&reg, routers[col].bssid, col) < 0)
+	  goto out;
+    }
+  if(coords_file != NULL)
+    {
+      num_coords = iw_map_read_coords(coords_file, &coords);
+      if(num_coords < 0)
+	goto out;
+    }
+  if(iw_fpstore_init(&fps, num_routers) < 0)
+    goto out;
+
+  /* One point per label, the point is stored when the next one starts */
+  while(1)
+    {
+      int	eof = (fscanf(text, IWMAP_TOKEN_FMT, tok) != 1);
+
+      if(eof || (iw_ether_aton(tok, (struct ether_addr *) bssid) != ETH_ALEN))
+	{
+	  if(have_point)
+	    {
+	      struct iwmap_coord	key;
+	      struct iwmap_coord *	coord = NULL;
+
+	      if(num_coords > 0)
+		{
+		  memset(&key, 0, sizeof(key));
+		  strcpy(key.label, label);
+		  coord = bsearch(&key, coords, num_coords, sizeof(*coords),
+				  iw_map_coord_cmp);
+		  if(coord == NULL)
+		    fprintf(stderr, "Radio map : no coordinates for point %s\n",
+			    label);
+		}
+	      col = iw_fpstore_add(&fps, row, coord ? coord->x : 0.0,
+				   coord ? coord->y : 0.0, label);
+	      if((col < 0)
+		 || (have_stats && (iw_fpstore_set_stats(&fps, col, stats) < 0)))
+		goto out;
+	      if(have_stats)
+		flags |= IWMAP_F_STATS;
+	    }
+	  if(eof)
+	    break;
+
+	  /* Not a MAC address, so the label of a new point */
+	  memset(label, 0, sizeof(label));
+	  strncpy(label, tok, IWMAP_LABEL_LEN - 1);
+	  memset(row, 0, sizeof(row));
+	  memset(stats, 0, sizeof(stats));
+	  have_point = 1;
+	  have_stats = 0;
+	  continue;
+	}
+
+      if(!have_point || (fscanf(text, "%d", &value) != 1))
+	{
+	  fprintf(stderr, "Radio map : stray entry for %s\n", tok);
+	  errno = EINVAL;
+	  goto out;
+	}
+      col = iw_registry_find(&reg, bssid);
+      if(col < 0)
+	{
+	  /* New router, add a column */
+	  if(num_routers >= MAX_ROUTERS)
+	    {
+	      errno = E2BIG;
+	      goto out;
+	    }
+	  col = num_routers++;
+	  memcpy(routers[col].bssid, bssid, ETH_ALEN);
+	  if((iw_registry_add(&reg, bssid, col) < 0)
+	     || (iw_fpstore_set_routers(&fps, num_routers) < 0))
+	    goto out;
+	}
+      row[col] = iw_dbm_sat(value);
+
+      /* The stats, if any, on the rest of the line */
+      if((fgets(rest, sizeof(rest), text) != NULL)
+	 && (sscanf(rest, "%lf %lf", &mean, &var) == 2))
+	{
+	  iw_stat_set(&stats[col], mean, var);
+	  have_stats = 1;
+	}
+    }
+
+  if(coords_file != NULL)
+    flags |= IWMAP_F_COORDS;
+  ret = iw_map_build(map, &fps, routers, flags);
+
+ out:
+  free(coords);
+  iw_fpstore_free(&fps);
+  iw_registry_free(&reg);
+  return(ret);
+}
@@ -0,0 +1,1368 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Radio map (signal fingerprint database) used by "iwlist track".
+ *
+ * Maps are surveyed with "iwlist learn", which appends points to a
+ * text map in input/coordinate_maps/. Re-parsing that text on every
+ * run does not scale, so iwmapc compiles it into the binary format
+ * described here, and track() simply mmap()s the result.
+ *
+ * This file is released under the GPL license.
+ */
+
+#ifndef IWMAP_H
+#define IWMAP_H
+
+/***************************** INCLUDES *****************************/
+
+#include "iwlib.h"		/* Julz's extensions, MAX_ROUTERS... */
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Identification of a binary map. The CR/LF pair catches files that
+ * went through a text mode transfer. */
+#define IWMAP_MAGIC		"IWRMAP\r\n"
+#define IWMAP_MAGIC_LEN		8
+/* Version of the binary layout, bump it on any incompatible change */
+#define IWMAP_VERSION		5
+
+/* Each section of the file starts on a cache line */
+#define IWMAP_ALIGN		64
+/* Round up to a multiple of a power of two */
+#define IWMAP_ROUNDUP(x, a)	(((uint64_t) (x) + (a) - 1) & ~((uint64_t) (a) - 1))
+/* Fingerprint rows are padded to a multiple of this many cells (one
+ * 128 bit vector of int8_t dBm values) */
+#define IWMAP_ROW_ALIGN		16
+
+#define IWMAP_ESSID_LEN		32
+#define IWMAP_LABEL_LEN		40
+
+/* Header flags */
+#define IWMAP_F_COORDS		0x0001	/* x and y sections are valid */
+#define IWMAP_F_SPARSE		0x0002	/* CSR sections replace the matrix */
+#define IWMAP_F_STATS		0x0004	/* Mean and spread of each cell */
+
+/* Unit of the spreads (standard deviations) of the cells, in dB */
+#define IWMAP_SIGMA_UNIT	0.25
+
+/* Signal assumed by the sparse matcher for the routers a point (or the
+ * live sample) does not hear, in dBm. Can be changed per run. */
+#define IWMAP_FLOOR_DEFAULT	-100
+
+/* Journal of the points learnt since the map was compiled, kept next
+ * to the map and merged into it once it reaches IWMAP_JOURNAL_COMPACT */
+#define IWMAP_JOURNAL_SUFFIX	".journal"
+#define IWMAP_JOURNAL_COMPACT	(64 * 1024)
+#define IWMAP_JREC_MAGIC	0x4A504D49	/* "IMPJ" */
+/* Record flags */
+#define IWMAP_JREC_F_STATS	0x0001	/* Stats of the cells after the cells */
+
+/* Catalogue of maps : longest building/floor/zone name, most shards
+ * searched per query, and the default */
+#define IWCAT_NAME_LEN		64
+#define IWCAT_PROBE_MAX		16
+#define IWCAT_PROBE_DEFAULT	2
+/* Words of a bitmap with one bit per router */
+#define IWCAT_WORDS		((MAX_ROUTERS + 63) / 64)
+
+/* Points per block of the blocked fingerprints (struct iw_fpblock) :
+ * one 512 bit vector of int16_t holds a pair of routers of the block */
+#define IWMAP_BLOCK		16
+/* Size of a query packed by pairs of routers */
+#define IWMAP_QPAIRS		((MAX_ROUTERS + 1) / 2)
+
+/* Most neighbours of a kNN search, and the default. The position is
+ * weighted by 1 / (diff + IW_KNN_EPS), diff in dB. */
+#define IW_KNN_MAX		64
+#define IW_KNN_DEFAULT		1
+#define IW_KNN_EPS		1.0
+/* What a router the scan missed costs a point that hears it, in dB
+ * (masked search of the partial scans), and the most it can be */
+#define IW_KNN_PENALTY_DEFAULT	20
+#define IW_KNN_PENALTY_MAX	255
+
+/* Maps smaller than this are searched by brute force, the kernels beat
+ * the tree there (see iwlocbench -x) */
+#define IW_VPTREE_MIN_POINTS	4096
+
+/* Clusters of the fingerprints (iwcluster.c) : points and rounds of the
+ * k-means, and the clusters a search measures the members of, by
+ * default and at most */
+#define IW_CLUSTER_TRAIN_MAX	16384
+#define IW_CLUSTER_ROUNDS	10
+#define IW_CLUSTER_PROBE_DEFAULT	4
+#define IW_CLUSTER_PROBE_MAX	IW_KNN_MAX
+
+/* Inverted index of the strongest routers (iwinvert.c) : routers each
+ * point is posted under, rank buckets they go by (see iw_inv_bucket),
+ * the strongest routers of a query looked up, and the default votes a
+ * candidate needs, one per key it shares */
+#define IW_INV_DEPTH		6
+#define IW_INV_BUCKETS		3
+#define IW_INV_KEYS		3
+#define IW_INV_VOTES_DEFAULT	2
+
+/* Selection of the routers of a map (iwselect.c) : points held out to
+ * choose how many to keep, and how well they must be located with the
+ * routers kept, as a share of how well with all of them */
+#define IW_SELECT_HELD		256
+#define IW_SELECT_TARGET_DEFAULT	0.95
+
+/* Cache of the results of the matcher (iwcache.c) : scans kept */
+#define IW_CACHE_ENTRIES	64
+
+/* Neighbourhood graph of the trackers (iwgraph.c) : links per point,
+ * and the most, best points a search keeps exploring from, the default
+ * worst fix of a local search before the whole map is searched, in dB
+ * per router (RMS), and maps smaller than this are searched whole, it
+ * costs next to nothing there */
+#define IW_GRAPH_DEGREE		8
+#define IW_GRAPH_DEGREE_MAX	32
+#define IW_GRAPH_EF		16
+#define IW_GRAPH_THRESHOLD_DEFAULT	8
+#define IW_GRAPH_MIN_POINTS	4096
+
+/* Particle filter of the trackers (iwparticle.c) : lanes of its
+ * vectors (one SSE2 register of floats), default particles, walking
+ * speed in map units per second, and spread of the levels in dB per
+ * router for the likelihood of a scan */
+#define IW_PF_LANES		4
+#define IW_PF_PARTICLES_DEFAULT	10000
+#define IW_PF_SPEED_DEFAULT	1.5
+#define IW_PF_SIGMA_DEFAULT	6.0
+
+/* Hidden Markov tracker (iwhmm.c) : the most it walks between two
+ * scans, in map units (metres), or its links per point for the maps
+ * without positions, the probability of staying at the same point from
+ * a scan to the next,
+ * states dropped below this share of the most likely one, spread of
+ * the levels in dB per router for the likelihood of a scan, and the
+ * default worst diff of the most likely state, in dB per router (RMS),
+ * before the tracker is lost */
+#define IW_HMM_REACH		2.0
+#define IW_HMM_DEGREE		24
+#define IW_HMM_STAY		0.5f
+#define IW_HMM_BEAM		1e-4f
+#define IW_HMM_SIGMA_DEFAULT	6.0
+#define IW_HMM_THRESHOLD_DEFAULT	12
+
+/* Threads of the search pool (iwpool.c), and the queries it is timed
+ * on against the caller alone, when the map is loaded : it only pays off
+ * with enough cores and points (see iwlocbench -t) */
+#define IW_POOL_MAX_THREADS	64
+#define IW_POOL_PROBES		32
+
+/* Product quantizer (approximate search) : codebooks file kept next to
+ * the map, routers per sub-quantizer, centroids of each (4 bit codes,
+ * see iwkernel.c), points per block of codes and sub-quantizers padded
+ * to a multiple of 4 (one AVX-512 vector), points and rounds of the
+ * k-means training, and candidates of the scan of the codes measured
+ * exactly (more is a better recall) */
+#define IWPQ_MAGIC		"IWPQCB\r\n"
+#define IWPQ_VERSION		1
+#define IWPQ_SUFFIX		".pq"
+#define IWPQ_SUB_DIM_DEFAULT	2
+#define IWPQ_SUB_DIM_MAX	32
+#define IWPQ_CENTROIDS		16
+#define IWPQ_BLOCK		32
+#define IWPQ_SUB_ALIGN		4
+#define IWPQ_TRAIN_MAX		16384
+#define IWPQ_ROUNDS		10
+#define IWPQ_RERANK_DEFAULT	64
+#define IWPQ_RERANK_MAX		65536
+
+/* Gaussian likelihood matcher : spread classes of the tables, from
+ * IW_GAUSS_SIGMA_MIN dB up by IW_GAUSS_STEPS per octave, the spread of
+ * the cells learnt without one, the cost of a cell in IW_GAUSS_SCALE
+ * per nat and capped at IW_GAUSS_CUTOFF standard deviations (a router
+ * way off is an outlier, not proof), and the span of the differences
+ * a table covers, -255 to 255 dB */
+#define IW_GAUSS_CLASSES	16
+#define IW_GAUSS_SIGMA_MIN	1.0
+#define IW_GAUSS_STEPS		4
+#define IW_GAUSS_SIGMA_DEFAULT	4.0
+#define IW_GAUSS_SCALE		16.0
+#define IW_GAUSS_CUTOFF		4.0
+#define IW_GAUSS_HALF		255
+#define IW_GAUSS_SPAN		(2 * IW_GAUSS_HALF + 1)
+
+/* Log-distance path loss model : distances are in map units (metres)
+ * and clamped to IWMAP_PL_DMIN, fitted exponents are kept within the
+ * physical range and default to free space */
+#define IWMAP_PL_DMIN		0.1
+#define IWMAP_PL_N_DEFAULT	2.0
+#define IWMAP_PL_N_MIN		1.5
+#define IWMAP_PL_N_MAX		6.0
+
+/* Marks a used slot of the BSSID registry (BSSIDs are only 48 bits) */
+#define IW_BSSID_USED		(1ULL << 63)
+
+/****************************** TYPES ******************************/
+
+/*
+ * Header of a binary map. All integers are in host byte order and all
+ * offsets are counted from the start of the file.
+ *
+ * Layout :
+ *	header | router table | fingerprint matrix | x | y | labels
+ *	       | CSR row pointers | CSR columns | CSR values | cell stats
+ *
+ * The fingerprint matrix has one row per surveyed point and one column
+ * per router of the router table, each row being padded to row_stride
+ * cells so that rows are fixed size and aligned. The sections after the
+ * router table are exactly the arrays of struct iw_fpstore, so a mapped
+ * map is used in place.
+ * Sparse maps (IWMAP_F_SPARSE) have an empty matrix and store only the
+ * heard (non zero) cells, in compressed sparse row form, which are the
+ * arrays of struct iw_fpsparse. Dense maps have empty CSR sections.
+ * Dense maps learnt with their spreads (IWMAP_F_STATS) keep the mean
+ * and spread of each cell of the matrix, laid out as the matrix, for
+ * the likelihood matcher. The others have an empty section.
+ */
+struct iwmap_header
+{
+  char		magic[IWMAP_MAGIC_LEN];
+  uint32_t	version;
+  uint32_t	header_len;	/* sizeof(struct iwmap_header) */
+  uint32_t	flags;
+  uint32_t	num_routers;	/* Columns of the matrix */
+  uint32_t	num_points;	/* Rows of the matrix */
+  uint32_t	row_stride;	/* Cells per row, >= num_routers */
+  uint32_t	label_len;	/* Bytes per label, including '\0' */
+  uint32_t	reserved;
+  uint64_t	routers_off;	/* num_routers struct iwmap_router */
+  uint64_t	matrix_off;	/* num_points * row_stride int8_t (dBm) */
+  uint64_t	x_off;		/* num_points double */
+  uint64_t	y_off;		/* num_points double */
+  uint64_t	labels_off;	/* num_points * label_len char */
+  uint64_t	nnz;		/* Cells of the CSR sections */
+  uint64_t	rowptr_off;	/* num_points + 1 uint32_t */
+  uint64_t	cols_off;	/* nnz uint16_t */
+  uint64_t	vals_off;	/* nnz int8_t (dBm) */
+  uint64_t	stats_off;	/* num_points * row_stride struct iwmap_stat */
+  uint64_t	file_len;
+};
+
+/*
+ * One entry of the router table, i.e. one column of the matrix.
+ */
+struct iwmap_router
+{
+  unsigned char	bssid[8];	/* ETH_ALEN significant, rest is padding */
+  char		essid[IWMAP_ESSID_LEN];
+  int32_t	x;		/* Position, as in inputrouters.txt */
+  int32_t	y;
+};
+
+/*
+ * Mean and spread of one cell, over the samples of the point that heard
+ * the router. The fingerprint itself holds the most frequent level.
+ */
+struct iwmap_stat
+{
+  int8_t	mean;		/* dBm, 0 if never heard */
+  uint8_t	sigma;		/* In IWMAP_SIGMA_UNIT, 0 if unknown */
+};
+
+/*
+ * A radio map file in memory, either mapped or freshly built.
+ * When mapped, the image is read only.
+ */
+struct iwmap
+{
+  const struct iwmap_header *	hdr;
+  const struct iwmap_router *	routers;
+  void *			image;		/* Whole file image */
+  size_t			len;		/* Size of the image */
+  int				mapped;		/* Image comes from mmap() */
+};
+
+/*
+ * Fingerprint store : the radio map as a structure of arrays.
+ * One contiguous row major dBm matrix, separate x and y arrays and a
+ * label table, so that the matcher only streams through the matrix.
+ * The store either owns its arrays, which then grow as points are
+ * added, or borrows them from a mapped map (capacity is 0), in which
+ * case they are read only and copied on the first addition.
+ * The store of a sparse map has no matrix (the cells are in a struct
+ * iw_fpsparse), it only keeps the coordinates and labels.
+ * Points learnt with their spreads also have the stats of their cells,
+ * laid out as rss (see IWMAP_F_STATS).
+ */
+struct iw_fpstore
+{
+  int		num_points;	/* Rows in use */
+  int		num_routers;	/* Columns in use */
+  int		stride;		/* Cells per row, multiple of IWMAP_ROW_ALIGN */
+  int		capacity;	/* Rows allocated, 0 if borrowed */
+  int		sparse;		/* No matrix, rss is NULL */
+  int8_t *	rss;		/* num_points x stride, dBm */
+  struct iwmap_stat *	stats;	/* The same, NULL if not learnt */
+  double *	x;		/* Position of each point */
+  double *	y;
+  char *	labels;		/* IWMAP_LABEL_LEN bytes per point */
+};
+
+/*
+ * Sparse fingerprints : compressed sparse row form of the matrix, only
+ * keeping the routers each point hears. On large sites a point hears a
+ * few tens of the hundreds of routers, so memory and matching time
+ * follow the heard routers instead of the registered ones.
+ * The arrays are either owned, and grow as points are added, or
+ * borrowed from a mapped map, and copied on the first addition.
+ */
+struct iw_fpsparse
+{
+  int		num_points;
+  int		num_routers;
+  int		owned;		/* Arrays were allocated by us */
+  int		floor;		/* dBm for unheard routers */
+  uint32_t	nnz;		/* Stored cells */
+  uint32_t	max_points;	/* Rows allocated (if owned) */
+  uint32_t	max_cells;	/* Cells allocated (if owned) */
+  uint32_t *	rowptr;		/* Cells of point i : rowptr[i]..[i+1] */
+  uint16_t *	cols;		/* Router of each cell, increasing */
+  int8_t *	vals;		/* dBm of each cell */
+};
+
+/*
+ * Blocked fingerprints, the layout of the distance kernels. Points go by
+ * blocks of IWMAP_BLOCK, and within a block routers go by pairs, the two
+ * levels of each point side by side :
+ *	block 0 : pair 0 : p0r0 p0r1 p1r0 p1r1 ... p15r0 p15r1
+ *		  pair 1 : p0r2 p0r3 p1r2 p1r3 ...
+ *	block 1 : ...
+ * So a vector covers many points at once, and one multiply-add of the
+ * widened differences gives each point the squares of a pair of routers.
+ * Cells of missing routers and points are 0. The squared norm of each
+ * point is kept for the batches, which go by the dot products.
+ * Built from a store, the routers are laid out by decreasing variance,
+ * so that a search can give up far points early ; queries are packed
+ * in the same order (iw_fpblock_query()).
+ */
+struct iw_fpblock
+{
+  int		num_points;
+  int		num_routers;
+  int		pairs;		/* Router pairs, (num_routers + 1) / 2 */
+  int		max_blocks;	/* Blocks allocated */
+  int8_t *	cells;		/* pairs * 2 * IWMAP_BLOCK per block, dBm */
+  int32_t *	norms;		/* Sum of the squares of each point */
+  int *		order;		/* Router of each column, NULL : as is */
+};
+
+/*
+ * Result of a k nearest neighbours search. While searching, nb is a
+ * max-heap on the distance (the worst neighbour on top), so a point
+ * only costs a compare unless it beats that one. iw_knn_sort() then
+ * puts the best first.
+ */
+struct iw_neighbour
+{
+  int		point;
+  int32_t	dist;		/* Squared diff, dB^2 */
+};
+
+struct iw_knn
+{
+  int			k;
+  int			count;	/* Neighbours found, up to k */
+  double		visited;	/* Share of the cells measured, for
+					 * the searches of the blocks */
+  struct iw_neighbour	nb[IW_KNN_MAX];
+};
+
+/*
+ * Node of a vantage point tree. The points of an inner node are split
+ * by their distance to the vantage point : the nearer half goes to
+ * child[0], the rest to child[1], and each child keeps the range of
+ * those distances, so that a search can skip the children the triangle
+ * inequality rules out. Leaves hold up to IWMAP_BLOCK points, one block
+ * of the blocked fingerprints of the tree.
+ */
+struct iw_vpnode
+{
+  int		point;		/* Vantage point, -1 for a leaf */
+  int		child[2];	/* Subtrees, or (leaf) its block */
+  double	lo[2];		/* Distance of the points of each subtree */
+  double	hi[2];		/*   to the vantage point, in dB */
+};
+
+/*
+ * Vantage point tree over the fingerprints of a map, an exact index for
+ * the nearest neighbours (the distance is the euclidean one, the square
+ * root of the diff of locate_signal()). Points added after the build go
+ * to a tail that is searched by brute force.
+ */
+struct iw_vptree
+{
+  int			num_points;	/* Indexed + tail */
+  int			num_routers;
+  int			num_nodes;
+  int			max_nodes;
+  struct iw_vpnode *	nodes;		/* nodes[0] is the root */
+  int8_t *		vrows;		/* Vantage fingerprint of each node */
+  struct iw_fpblock	leaves;		/* Points of the leaves, then the tail */
+  int *			perm;		/* Point of each slot of leaves, or -1 */
+  int			tail;		/* First slot of the tail */
+};
+
+/*
+ * Clusters of the fingerprints of a map, by k-means : the centroids,
+ * rounded, and the members of each cluster one after the other, from a
+ * block of their own (the last one padded). A search measures the
+ * centroids, then the members of the probe nearest clusters, so it may
+ * miss a neighbour. Points added after the build go to a tail that is
+ * searched by brute force.
+ */
+struct iw_cluster
+{
+  int			num_points;	/* Clustered + tail */
+  int			num_routers;
+  int			num_clusters;
+  int			probe;		/* Clusters searched per query */
+  struct iw_fpblock	centroids;	/* Mean of each cluster, dBm */
+  struct iw_fpblock	members;	/* Points by cluster, then the tail */
+  int *			start;		/* First slot of each cluster, and
+					 * the end of the last one */
+  int *			perm;		/* Point of each slot, or -1 */
+  int			tail;		/* First slot of the tail */
+};
+
+/*
+ * Inverted index of the strongest routers of the points of a map : the
+ * points are posted under (router, rank bucket), one list per pair, the
+ * lists one after the other (CSR). The marks, votes and candidates are
+ * the scratch of a search.
+ */
+struct iw_invert
+{
+  int		num_points;	/* Indexed, the rest is the tail */
+  int		num_routers;
+  int		votes;		/* Least keys a candidate shares */
+  int *		heads;		/* Postings of list l : heads[l]..[l+1] */
+  int *		postings;	/* Points */
+  uint32_t *	seen;		/* Per point, the last search that met it */
+  uint32_t	search;		/* Current search */
+  uint8_t *	count;		/* Per point, its votes this search */
+  int *		cands;		/* The points met this search */
+};
+
+/*
+ * Routers of a map kept for the searches : all of them ranked by the
+ * variance of their levels over the points, the most telling first, and
+ * those kept, by increasing router (the columns of the projection).
+ */
+struct iw_select
+{
+  int		num_routers;		/* Of the map */
+  int		num_kept;
+  int		rank[MAX_ROUTERS];	/* Routers, by decreasing variance */
+  double	var[MAX_ROUTERS];	/* Their variance, dB^2 */
+  int		routers[MAX_ROUTERS];	/* Kept, by increasing router */
+  double	agree;			/* How well the held out points are
+					 * located (iw_select_auto()) */
+};
+
+/*
+ * Result of the matcher for a scan, in the cache. The entries are chained
+ * by bucket of their hash, and from the most to the least recently used.
+ */
+struct iw_centry
+{
+  uint64_t	hash;		/* Of the quantized scan */
+  int		num_routers;	/* Of the scan */
+  int		chain;		/* Next entry of the bucket, or -1 */
+  int		newer;		/* Order of use, -1 at the ends */
+  int		older;
+  struct iw_knn	knn;		/* The result */
+};
+
+/*
+ * Cache of the last results of the matcher, by quantized scan, the least
+ * recently used result goes first (see iwcache.c)
+ */
+struct iw_cache
+{
+  int			num_entries;
+  int			used;		/* Entries holding a result */
+  int			quantum;	/* Levels by classes of that many dB */
+  int			num_buckets;	/* Power of 2 */
+  int *			buckets;	/* First entry of each, or -1 */
+  struct iw_centry *	entries;
+  int8_t *		keys;		/* Quantized scan of each entry,
+					 * MAX_ROUTERS apart */
+  int			newest;
+  int			oldest;
+  unsigned long		hits;
+  unsigned long		misses;
+};
+
+/*
+ * Thread pool of the searches. The threads live as long as the pool and
+ * wait for the jobs, each runs its shard of every job.
+ */
+struct iw_pool;
+
+struct iw_pool_thread
+{
+  struct iw_pool *	pool;
+  pthread_t		thread;
+  int			shard;
+};
+
+struct iw_pool
+{
+  int			num_threads;	/* Running, and the caller */
+  pthread_mutex_t	lock;
+  pthread_cond_t	wake;		/* A job, or the stop */
+  unsigned int		gen;		/* Jobs so far */
+  int			stop;
+  int			pending;	/* Shards of the job not done yet */
+  void			(*job)(void *	arg,
+				       int	shard,
+				       int	num_shards);
+  void *		arg;
+  struct iw_pool_thread	threads[IW_POOL_MAX_THREADS];	/* 0 is the caller */
+};
+
+/*
+ * Neighbourhood graph of the points of a map : each point is linked to
+ * the degree points nearest to it, on the floor or by fingerprint, -1
+ * past its last link. A tracker searches it from its last fix outward,
+ * see iwgraph.c. The marks and the frontier of the search are kept
+ * here, so one search at a time. Points added to the store after the
+ * build are its tail, measured by brute force.
+ */
+struct iw_graph
+{
+  int		num_points;	/* Linked points */
+  int		degree;		/* Links per point */
+  int *		links;		/* num_points x degree */
+  uint32_t *	seen;		/* Per point, the last search that saw it */
+  uint32_t	search;		/* Current search */
+  int		frontier_len;
+  struct iw_neighbour *	frontier;	/* Heap of the points to explore */
+};
+
+/*
+ * Particle filter of a tracker, over a map with positions : the
+ * particles are arrays of floats (x, y, w), aligned for the vectors,
+ * num_particles a multiple of IW_PF_LANES. The floor is a grid of
+ * cols x rows cells of 1 / inv_cell map units, each knowing its nearest
+ * point of the map, and the likelihood of a scan is worked out per
+ * point, for the points under the cloud, see iwparticle.c.
+ */
+struct iw_pf
+{
+  int		num_particles;
+  int		num_points;	/* Of the map */
+  float		speed;		/* Map units per second, at most */
+  float		minx;		/* Floor */
+  float		maxx;
+  float		miny;
+  float		maxy;
+  float		inv_cell;	/* Cells per map unit */
+  int		cols;
+  int		rows;
+  int *		grid;		/* Nearest point of each cell */
+  float *	x;		/* Particles */
+  float *	y;
+  float *	w;		/* Weights, sum to 1 */
+  float *	nx;		/* Resampled particles */
+  float *	ny;
+  int *		point;		/* Point of the map under each particle */
+  int *		ends;		/* Copies of each particle, resampling */
+  float *	lik;		/* Per point, its likelihood this scan */
+  uint32_t *	seen;		/* Per point, the last scan that measured it */
+  uint32_t	scan;		/* Current scan */
+  int *		touched;	/* Points measured this scan */
+  uint32_t	rng[IW_PF_LANES];	/* Generator of each lane */
+};
+
+/*
+ * Hidden Markov tracker over the points of a map : the transitions are
+ * a sparse matrix (CSR, rows sum to 1, the state itself included), the
+ * filtered probabilities are only kept for the states of the beam
+ * (alpha[active[i]]), see iwhmm.c.
+ */
+struct iw_hmm
+{
+  int		num_states;
+  int		nnz;		/* Transitions */
+  int *		rowptr;		/* num_states + 1 */
+  int *		cols;		/* State reached */
+  float *	probs;		/* Its probability */
+  float *	alpha;		/* Per state, its probability */
+  float *	next;		/* The same, being updated */
+  float *	dist;		/* Per state, its diff this scan */
+  int *		active;		/* The states of the beam */
+  int		num_active;
+  int *		next_active;	/* The states reached this scan */
+  int		num_next;
+  uint32_t *	seen;		/* Per state, the last scan that reached it */
+  uint32_t	scan;		/* Current scan */
+  int		lost;		/* Times the whole map was measured again */
+};
+
+/*
+ * Gaussian likelihood of the fingerprints : each cell is the normal law
+ * of its mean and spread, and a query costs each point the negative log
+ * likelihood of its levels. The law only depends on the difference to
+ * the mean and on the spread, so the spreads are rounded to classes and
+ * each class has the table of the costs of every difference : a cell is
+ * an offset into the tables, and scoring a point is one lookup and one
+ * add per router. Unheard routers, on either side, are at floor dBm.
+ */
+struct iw_gauss
+{
+  int		num_points;
+  int		num_routers;
+  int		max_points;	/* Cells allocated, in points */
+  int		floor;
+  uint16_t *	cells;		/* Per point and router, the entry of a
+				 * query at 0 dBm in the tables */
+  uint16_t	table[IW_GAUSS_CLASSES * IW_GAUSS_SPAN];	/* Costs */
+};
+
+/*
+ * Header of a codebooks file (IWPQ_SUFFIX). Sections are aligned on
+ * IWMAP_ALIGN, like those of the map.
+ */
+struct iwpq_header
+{
+  char		magic[IWMAP_MAGIC_LEN];
+  uint32_t	version;
+  uint32_t	header_len;	/* sizeof(struct iwpq_header) */
+  uint32_t	num_routers;	/* Of the map */
+  uint32_t	num_points;	/* Coded points */
+  uint32_t	sub_dim;	/* Routers per sub-quantizer */
+  uint32_t	num_sub;	/* Sub-quantizers, bytes per code */
+  uint32_t	num_centroids;	/* Per sub-quantizer */
+  int32_t	floor;		/* dBm of the unheard routers, when coded */
+  uint64_t	centroids_off;	/* num_sub * num_centroids * sub_dim float */
+  uint64_t	codes_off;	/* Blocks of codes, see struct iw_pq */
+  uint64_t	file_len;
+};
+
+/*
+ * Product quantizer of the fingerprints of a map. Unheard routers (0)
+ * count as floor dBm, both in the codes and in the exact measure of the
+ * candidates : 0 gives the diff of locate_signal(), the floor of the
+ * sparse map that of locate_signal_sparse().
+ * Codes go by blocks of IWPQ_BLOCK points, 16 bytes per sub-quantizer :
+ * byte i holds the code of point i in its low nibble, of i + 16 in the
+ * high one.
+ */
+struct iw_pq
+{
+  int		num_routers;
+  int		num_points;
+  int		max_points;	/* Codes allocated */
+  int		sub_dim;
+  int		num_sub;
+  int		sub_stride;	/* num_sub rounded up to IWPQ_SUB_ALIGN */
+  int		num_centroids;
+  int		floor;
+  int		rerank;		/* Candidates measured exactly */
+  float *	centroids;
+  uint8_t *	codes;
+};
+
+/*
+ * One record of the journal : a learnt point, followed by num_cells
+ * struct iwmap_jcell, then (IWMAP_JREC_F_STATS) by the num_cells struct
+ * iwmap_stat of the same cells. Routers are given by BSSID, the learner
+ * and the map may not agree on columns.
+ */
+struct iwmap_jrec
+{
+  uint32_t	magic;		/* IWMAP_JREC_MAGIC */
+  uint16_t	num_cells;	/* Heard routers */
+  uint16_t	flags;		/* IWMAP_JREC_F_* */
+  double	x;		/* Position of the point */
+  double	y;
+  char		label[IWMAP_LABEL_LEN];
+};
+
+struct iwmap_jcell
+{
+  unsigned char	bssid[ETH_ALEN];
+  int8_t	level;		/* dBm */
+  uint8_t	reserved;
+};
+
+/*
+ * Reader of a journal, which follows it across compactions.
+ */
+struct iw_journal
+{
+  char *	path;
+  int		fd;		/* -1 if the journal doesn't exist (yet) */
+  off_t		pos;		/* Start of the next record */
+};
+
+/*
+ * Log-distance path loss model of one router :
+ *	level(d) = p0 - 10 * n * log10(d)
+ * with d the distance to the router, p0 the level at 1 unit.
+ */
+struct iw_pathloss
+{
+  double	p0;		/* dBm at distance 1 */
+  double	n;		/* Path loss exponent */
+  int		points;		/* Points the fit is based on, 0 : never heard */
+};
+
+/*
+ * Registry of the routers of the experiment, indexed by BSSID.
+ * Open addressing hash table (linear probing) keyed on the BSSID as
+ * a 48 bit integer, so that scan events are matched straight from the
+ * raw sockaddr, without formatting or comparing strings.
+ */
+struct iw_bssid_registry
+{
+  uint64_t *	keys;		/* BSSID | IW_BSSID_USED, 0 if free */
+  int *		values;		/* Column of the router */
+  unsigned int	mask;		/* Number of slots - 1 */
+  unsigned int	shift;		/* 64 - log2(number of slots) */
+  int		count;		/* Used slots */
+};
+
+/*
+ * One map (shard) of a catalogue, the radio map of one zone
+ */
+struct iw_shard
+{
+  char			name[IWCAT_NAME_LEN];	/* building/floor/zone */
+  struct iwmap		map;
+  struct iw_fpstore	fps;			/* Labels and positions */
+  struct iw_fpsparse	sp;			/* Fingerprints */
+  int16_t		global[MAX_ROUTERS];	/* Column in the catalogue */
+};
+
+/*
+ * Node of the building / floor / zone tree. Zones (leaves) have a shard.
+ */
+struct iw_cat_node
+{
+  char		name[IWCAT_NAME_LEN];	/* This level only, "lounge" */
+  int		parent;			/* -1 for the root */
+  int		child;			/* First child, -1 if none */
+  int		sibling;		/* Next child of the parent, or -1 */
+  int		shard;			/* Zones only, -1 otherwise */
+  uint64_t	bssids[IWCAT_WORDS];	/* Routers known below, by column */
+  int8_t	centroid[MAX_ROUTERS];	/* Mean level below, 0 if unheard */
+};
+
+/*
+ * A catalogue of maps. Routers are numbered across all the shards.
+ */
+struct iw_catalog
+{
+  int				num_shards;
+  int				max_shards;
+  struct iw_shard *		shards;
+  int				num_nodes;
+  int				max_nodes;
+  struct iw_cat_node *		nodes;		/* nodes[0] is the root */
+  int				num_routers;
+  struct iwmap_router		routers[MAX_ROUTERS];
+  struct iw_bssid_registry	reg;		/* BSSID -> column */
+};
+
+/**************************** PROTOTYPES ****************************/
+
+/* ----------------------- RADIO MAP FILES ------------------------ */
+int
+	iw_map_open(const char *	path,
+		    struct iwmap *	map);
+int
+	iw_map_compile_text(FILE *		text,
+			    FILE *		routers,
+			    FILE *		coords,
+			    struct iwmap *	map);
+int
+	iw_map_find_coords(FILE *	coords,
+			   const char *	label,
+			   double *	x,
+			   double *	y);
+int
+	iw_map_build(struct iwmap *			map,
+		     const struct iw_fpstore *		fps,
+		     const struct iwmap_router *	routers,
+		     uint32_t				flags);
+int
+	iw_map_save(const struct iwmap *	map,
+		    const char *		path);
+void
+	iw_map_close(struct iwmap *	map);
+
+/* ---------------------- FINGERPRINT STORE ----------------------- */
+int
+	iw_fpstore_init(struct iw_fpstore *	fps,
+			int			num_routers);
+int
+	iw_fpstore_from_map(struct iw_fpstore *		fps,
+			    const struct iwmap *	map);
+int
+	iw_fpstore_reserve(struct iw_fpstore *	fps,
+			   int			num_points);
+int
+	iw_fpstore_set_routers(struct iw_fpstore *	fps,
+			       int			num_routers);
+int
+	iw_fpstore_add(struct iw_fpstore *	fps,
+		       const int8_t *		rss,
+		       double			x,
+		       double			y,
+		       const char *		label);
+int
+	iw_fpstore_set_stats(struct iw_fpstore *		fps,
+			     int			point,
+			     const struct iwmap_stat *	stats);
+void
+	iw_stat_set(struct iwmap_stat *	stat,
+		    double		mean,
+		    double		var);
+double
+	iw_fpstore_var(const struct iw_fpstore *	fps,
+		       int				router);
+void
+	iw_fpstore_free(struct iw_fpstore *	fps);
+int
+	iw_fpsparse_from_store(struct iw_fpsparse *		sp,
+			       const struct iw_fpstore *	fps);
+int
+	iw_fpsparse_from_map(struct iw_fpsparse *	sp,
+			     const struct iwmap *	map);
+int
+	iw_fpsparse_add(struct iw_fpsparse *	sp,
+			const int8_t *		row);
+void
+	iw_fpsparse_free(struct iw_fpsparse *	sp);
+
+/* ----------------------- DISTANCE KERNELS ----------------------- */
+void
+	iw_fpblock_init(struct iw_fpblock *	fpb,
+			int			num_routers);
+int
+	iw_fpblock_from_store(struct iw_fpblock *		fpb,
+			      const struct iw_fpstore *		fps);
+int
+	iw_fpblock_add(struct iw_fpblock *	fpb,
+		       const int8_t *		row);
+void
+	iw_fpblock_free(struct iw_fpblock *	fpb);
+void
+	iw_fpblock_query(const struct iw_fpblock *	fpb,
+			 const int8_t *			query,
+			 int32_t *			qpairs);
+void
+	iw_fpblock_dist_blocks(const struct iw_fpblock *	fpb,
+			       const int32_t *			qpairs,
+			       int				first_block,
+			       int				num_blocks,
+			       int32_t *			dist);
+void
+	iw_fpblock_dist(const struct iw_fpblock *	fpb,
+			const int8_t *			query,
+			int32_t *			dist);
+int
+	iw_fpblock_nearest(const struct iw_fpblock *	fpb,
+			   const int8_t *		query,
+			   int32_t *			best_dist);
+int
+	iw_fpblock_knn(const struct iw_fpblock *	fpb,
+		       const int8_t *			query,
+		       struct iw_knn *			knn);
+int
+	iw_fpblock_knn_pool(const struct iw_fpblock *	fpb,
+			    struct iw_pool *		pool,
+			    const int8_t *		query,
+			    struct iw_knn *		knn);
+int
+	iw_fpblock_knn_masked(const struct iw_fpblock *	fpb,
+			      struct iw_pool *		pool,
+			      const int8_t *		query,
+			      int			penalty,
+			      struct iw_knn *		knn);
+int
+	iw_fpblock_knn_batch(const struct iw_fpblock *	fpb,
+			     const int8_t *		queries,
+			     int			num_queries,
+			     size_t			stride,
+			     struct iw_knn *		knn);
+int32_t
+	iw_dist_masked(const int8_t *	row,
+		       const int8_t *	query,
+		       int		num_routers,
+		       int		penalty);
+int32_t
+	iw_dist_scale(int32_t	dist,
+		      int	num_routers,
+		      int	heard);
+void
+	iw_knn_init(struct iw_knn *	knn,
+		    int			k);
+void
+	iw_knn_push(struct iw_knn *	knn,
+		    int			point,
+		    int32_t		dist);
+void
+	iw_knn_sort(struct iw_knn *	knn);
+int
+	iw_knn_position(const struct iw_knn *	knn,
+			const double *		x,
+			const double *		y,
+			double *		px,
+			double *		py);
+int
+	iw_kernel_select(const char *	name);
+int
+	iw_kernel_widths(int	enable);
+const char *
+	iw_kernel_name(void);
+void
+	iw_kernel_scan(const uint8_t *	codes,
+		       int		num_sub,
+		       int		num_blocks,
+		       const uint8_t *	tables,
+		       uint16_t		limit,
+		       uint16_t *	sums,
+		       uint32_t *	masks);
+
+/* ------------------------- THREAD POOL -------------------------- */
+int
+	iw_pool_init(struct iw_pool *	pool,
+		     int		num_threads);
+void
+	iw_pool_run(struct iw_pool *	pool,
+		    void		(*job)(void *	arg,
+					       int	shard,
+					       int	num_shards),
+		    void *		arg);
+void
+	iw_pool_free(struct iw_pool *	pool);
+double
+	iw_pool_probe(const struct iw_fpstore *	fps,
+		      int			k,
+		      int			(*search)(void *		arg,
+							  const int8_t *	query,
+							  struct iw_knn *	knn),
+		      void *			arg);
+
+/* ------------------------ VANTAGE POINTS ------------------------ */
+int
+	iw_vptree_build(struct iw_vptree *		tree,
+			const struct iw_fpstore *	fps);
+int
+	iw_vptree_add(struct iw_vptree *	tree,
+		      const int8_t *		row);
+int
+	iw_vptree_knn(const struct iw_vptree *	tree,
+		      const int8_t *		query,
+		      struct iw_knn *		knn,
+		      int *			visited);
+void
+	iw_vptree_free(struct iw_vptree *	tree);
+
+/* --------------------------- CLUSTERS --------------------------- */
+int
+	iw_cluster_build(struct iw_cluster *		cl,
+			 const struct iw_fpstore *	fps,
+			 int				num_clusters);
+int
+	iw_cluster_add(struct iw_cluster *	cl,
+		       const int8_t *		row);
+int
+	iw_cluster_knn(const struct iw_cluster *	cl,
+		       const int8_t *			query,
+		       struct iw_knn *			knn,
+		       int *				visited);
+void
+	iw_cluster_free(struct iw_cluster *	cl);
+
+/* ------------------------ INVERTED INDEX ------------------------ */
+int
+	iw_inv_build(struct iw_invert *		inv,
+		     const struct iw_fpstore *	fps);
+int
+	iw_inv_knn(struct iw_invert *		inv,
+		   const struct iw_fpstore *	fps,
+		   const int8_t *		query,
+		   int				penalty,
+		   struct iw_knn *		knn,
+		   int *			candidates);
+void
+	iw_inv_free(struct iw_invert *	inv);
+
+/* ---------------------- ROUTER SELECTION ------------------------ */
+void
+	iw_select_rank(struct iw_select *		sel,
+		       const struct iw_fpstore *	fps);
+int
+	iw_select_keep(struct iw_select *	sel,
+		       int			num_kept);
+void
+	iw_select_row(const struct iw_select *	sel,
+		      const int8_t *		in,
+		      int8_t *			out);
+int
+	iw_select_store(const struct iw_select *	sel,
+			const struct iw_fpstore *	src,
+			struct iw_fpstore *		dst);
+int
+	iw_select_auto(struct iw_select *		sel,
+		       const struct iw_fpstore *	fps,
+		       int				by_position,
+		       double				target);
+double
+	iw_select_check(const struct iw_select *	sel,
+			const struct iw_fpstore *	fps,
+			int				by_position);
+
+/* ------------------------- RESULT CACHE ------------------------- */
+int
+	iw_cache_init(struct iw_cache *	cache,
+		      int		num_entries,
+		      int		quantum);
+void
+	iw_cache_clear(struct iw_cache *	cache);
+int
+	iw_cache_lookup(struct iw_cache *	cache,
+			const int8_t *		query,
+			int			num_routers,
+			struct iw_knn *		knn);
+void
+	iw_cache_store(struct iw_cache *	cache,
+		       const int8_t *		query,
+		       int			num_routers,
+		       const struct iw_knn *	knn);
+void
+	iw_cache_free(struct iw_cache *	cache);
+
+/* ------------------------ NEIGHBOUR GRAPH ----------------------- */
+int
+	iw_graph_build(struct iw_graph *		graph,
+		       const struct iw_fpstore *	fps,
+		       int				degree,
+		       int				by_position);
+int
+	iw_graph_knn(struct iw_graph *		graph,
+		     const struct iw_fpstore *	fps,
+		     const int8_t *		query,
+		     int			penalty,
+		     int			seed,
+		     struct iw_knn *		knn,
+		     int *			visited);
+void
+	iw_graph_free(struct iw_graph *	graph);
+
+/* ----------------------- PARTICLE FILTER ------------------------ */
+int
+	iw_pf_init(struct iw_pf *		pf,
+		   const struct iw_fpstore *	fps,
+		   int				num_particles,
+		   float			speed);
+int
+	iw_pf_remap(struct iw_pf *		pf,
+		    const struct iw_fpstore *	fps);
+void
+	iw_pf_spread(struct iw_pf *	pf);
+void
+	iw_pf_move(struct iw_pf *	pf,
+		   double		dt);
+int
+	iw_pf_update(struct iw_pf *			pf,
+		     const struct iw_fpstore *	fps,
+		     const int8_t *		query,
+		     int			penalty,
+		     double			sigma);
+double
+	iw_pf_estimate(const struct iw_pf *	pf,
+		       double *			px,
+		       double *			py);
+void
+	iw_pf_free(struct iw_pf *	pf);
+
+/* ------------------------ MARKOV TRACKER ------------------------ */
+int
+	iw_hmm_build(struct iw_hmm *		hmm,
+		     const struct iw_fpstore *	fps,
+		     double			reach);
+int
+	iw_hmm_build_graph(struct iw_hmm *		hmm,
+			   const struct iw_graph *	graph);
+void
+	iw_hmm_resume(struct iw_hmm *		hmm,
+		      const struct iw_hmm *	old);
+int
+	iw_hmm_update(struct iw_hmm *			hmm,
+		      const struct iw_fpstore *		fps,
+		      const int8_t *			query,
+		      int				penalty,
+		      double				sigma,
+		      int				threshold);
+void
+	iw_hmm_free(struct iw_hmm *	hmm);
+
+/* ------------------------- LIKELIHOOD --------------------------- */
+int
+	iw_gauss_build(struct iw_gauss *		gauss,
+		       const struct iw_fpstore *	fps,
+		       int				floor);
+int
+	iw_gauss_add(struct iw_gauss *		gauss,
+		     const int8_t *		row,
+		     const struct iwmap_stat *	stats);
+int
+	iw_gauss_knn(const struct iw_gauss *	gauss,
+		     const int8_t *		query,
+		     struct iw_knn *		knn);
+void
+	iw_gauss_free(struct iw_gauss *	gauss);
+
+/* ------------------------ PRODUCT CODES ------------------------- */
+int
+	iw_pq_path(const char *	map_path,
+		   char *	buf,
+		   int		buflen);
+int
+	iw_pq_train(struct iw_pq *		pq,
+		    const struct iw_fpstore *	fps,
+		    const struct iw_fpsparse *	sp,
+		    int				sub_dim);
+int
+	iw_pq_add(struct iw_pq *	pq,
+		  const int8_t *	row);
+int
+	iw_pq_knn(const struct iw_pq *		pq,
+		  const struct iw_fpstore *	fps,
+		  const struct iw_fpsparse *	sp,
+		  const int8_t *		query,
+		  struct iw_knn *		knn);
+int
+	iw_pq_save(const struct iw_pq *	pq,
+		   const char *		path);
+int
+	iw_pq_load(struct iw_pq *		pq,
+		   const char *			path,
+		   const struct iw_fpstore *	fps,
+		   const struct iw_fpsparse *	sp);
+void
+	iw_pq_free(struct iw_pq *	pq);
+
+/* --------------------------- JOURNAL ---------------------------- */
+int
+	iw_journal_path(const char *	map_path,
+			char *		buf,
+			int		buflen);
+int
+	iw_journal_append(const char *			path,
+			  const struct iwmap_jrec *	rec,
+			  const struct iwmap_jcell *	cells,
+			  const struct iwmap_stat *	stats);
+int
+	iw_journal_open(struct iw_journal *	journal,
+			const char *		path);
+int
+	iw_journal_next(struct iw_journal *	journal,
+			struct iwmap_jrec *	rec,
+			struct iwmap_jcell *	cells,
+			struct iwmap_stat *	stats);
+void
+	iw_journal_close(struct iw_journal *	journal);
+int
+	iw_journal_row(struct iw_bssid_registry *	reg,
+		       struct iwmap_router *		routers,
+		       int *				num_routers,
+		       int				max_routers,
+		       const struct iwmap_jrec *	rec,
+		       const struct iwmap_jcell *	cells,
+		       const struct iwmap_stat *	stats,
+		       int8_t *				row,
+		       struct iwmap_stat *		stats_row);
+int
+	iw_map_compact(const char *	map_path);
+
+/* -------------------------- CATALOGUE --------------------------- */
+int
+	iw_catalog_load(struct iw_catalog *	cat,
+			const char *		path);
+void
+	iw_catalog_free(struct iw_catalog *	cat);
+int
+	iw_catalog_select(const struct iw_catalog *	cat,
+			  const int8_t *		sample,
+			  int				probe,
+			  int *				shards);
+
+/* ---------------------- PATH LOSS MODEL ------------------------- */
+int
+	iw_pathloss_fit(const struct iw_fpsparse *	sp,
+			const double *			x,
+			const double *			y,
+			const struct iwmap_router *	routers,
+			struct iw_pathloss *		models);
+
+/* ----------------------- BSSID REGISTRY ------------------------- */
+int
+	iw_registry_init(struct iw_bssid_registry *	reg,
+			 int				hint);
+int
+	iw_registry_add(struct iw_bssid_registry *	reg,
+			const unsigned char *		bssid,
+			int				value);
+int
+	iw_registry_find(const struct iw_bssid_registry *	reg,
+			 const unsigned char *			bssid);
+void
+	iw_registry_free(struct iw_bssid_registry *	reg);
+
+/* -------------------------- LOCATION ---------------------------- */
+///the localising function, returns the index of the best map point for
+///the sample levels (dBm by router, 0 not heard) and leaves the knn->k
+///best in knn, the best first
+///(on the threads of pool if not NULL, routers missed by the sample cost
+///penalty dB to the points hearing them)
+int
+	locate_signal(const struct iw_fpblock *		fpb,
+		      struct iw_pool *			pool,
+		      const int8_t *			levels,
+		      int				penalty,
+		      struct iw_knn *			knn);
+///the same, through the vantage point tree of the map
+int
+	locate_signal_vptree(const struct iw_vptree *		tree,
+			     const int8_t *			levels,
+			     struct iw_knn *			knn);
+///the same, approximately, among the members of the nearest clusters
+int
+	locate_signal_cluster(const struct iw_cluster *		cl,
+			      const int8_t *			levels,
+			      struct iw_knn *			knn);
+///the same, among the points whose strongest routers are those of the
+///sample, -1 if there are none (then the whole map has to be searched)
+int
+	locate_signal_invert(struct iw_invert *		inv,
+			     const struct iw_fpstore *	fps,
+			     const int8_t *		levels,
+			     int			penalty,
+			     struct iw_knn *		knn);
+///the same, searched from the last fix outward over the neighbourhood
+///graph of the map, -1 if the best found is worse than threshold dB per
+///router (then the whole map has to be searched)
+int
+	locate_signal_local(struct iw_graph *		graph,
+			    const struct iw_fpstore *	fps,
+			    const int8_t *		levels,
+			    int				penalty,
+			    int				last,
+			    int				threshold,
+			    struct iw_knn *		knn);
+///the most likely points, from the spreads the map was learnt with
+int
+	locate_signal_gauss(const struct iw_gauss *		gauss,
+			    const int8_t *			levels,
+			    struct iw_knn *			knn);
+///the same, approximately, through the product codes of the map
+int
+	locate_signal_pq(const struct iw_pq *		pq,
+			 const int8_t *			levels,
+			 struct iw_knn *		knn);
+///the same, over sparse fingerprints (unheard routers are at sp->floor)
+int
+	locate_signal_sparse(const struct iw_fpsparse *		sp,
+			     const int8_t *			levels,
+			     struct iw_knn *			knn);
+
+/************************* INLINE FUNTIONS *************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Fingerprint of one point of the store
+ */
+static inline const int8_t *
+iw_fpstore_row(const struct iw_fpstore *	fps,
+	       int				point)
+{
+  return(fps->rss + (size_t) point * fps->stride);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Stats of the cells of one point of the store, NULL if not learnt
+ */
+static inline const struct iwmap_stat *
+iw_fpstore_stats(const struct iw_fpstore *	fps,
+		 int				point)
+{
+  if(fps->stats == NULL)
+    return(NULL);
+  return(fps->stats + (size_t) point * fps->stride);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Label of one point of the store
+ */
+static inline const char *
+iw_fpstore_label(const struct iw_fpstore *	fps,
+		 int				point)
+{
+  return(fps->labels + (size_t) point * IWMAP_LABEL_LEN);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Is neighbour a worse than neighbour b ? Further, or as far but earlier
+ * in the map (the last of equals wins, as in locate_signal()).
+ */
+__attribute__((always_inline))
+static inline int
+iw_knn_worse(const struct iw_neighbour *	a,
+	     const struct iw_neighbour *	b)
+{
+  return((a->dist > b->dist) || ((a->dist == b->dist) && (a->point < b->point)));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Level predicted by a path loss model at a squared distance d2 from
+ * the router, in dBm
+ */
+static inline double
+iw_pathloss_level(const struct iw_pathloss *	model,
+		  double			d2)
+{
+  if(d2 < IWMAP_PL_DMIN * IWMAP_PL_DMIN)
+    d2 = IWMAP_PL_DMIN * IWMAP_PL_DMIN;
+  /* 10 * log10(d) == 5 * log10(d^2), no square root */
+  return(model->p0 - 5.0 * model->n * log10(d2));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Find the value registered for the address of a scan event
+ */
+static inline int
+iw_registry_lookup(const struct iw_bssid_registry *	reg,
+		   const struct sockaddr *		sap)
+{
+  return(iw_registry_find(reg, (const unsigned char *) sap->sa_data));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* IWMAP_H */
@@ -0,0 +1,546 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * iwmapc : compile the text radio maps written by "iwlist learn" into
+ * the binary format loaded by "iwlist track", dump a binary map, merge
+ * the journal of learnt points into it, train the product codes of its
+ * approximate search, or locate recorded scans on it.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+#include <getopt.h>
+#include <limits.h>		/* PATH_MAX */
+#include <time.h>
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Recorded scans located at once, see locate_scans() */
+#define IWMAPC_BATCH		4096
+
+/************************** MAP COMPILING **************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Open an optional input file
+ */
+static int
+open_input(const char *	path,
+	   FILE **	pf)
+{
+  *pf = NULL;
+  if(path == NULL)
+    return(0);
+  *pf = fopen(path, "r");
+  if(*pf == NULL)
+    {
+      fprintf(stderr, "iwmapc: can't open %s : %s\n", path, strerror(errno));
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Compile one text map
+ */
+static int
+compile_map(const char *	text_path,
+	    const char *	routers_path,
+	    const char *	coords_path,
+	    const char *	out_path,
+	    int			sparse)
+{
+  struct iwmap	map;
+  FILE *	text = NULL;
+  FILE *	routers = NULL;
+  FILE *	coords = NULL;
+  int		ret = -1;
+
+  if((open_input(text_path, &text) < 0)
+     || (open_input(routers_path, &routers) < 0)
+     || (open_input(coords_path, &coords) < 0))
+    goto out;
+
+  if(iw_map_compile_text(text, routers, coords, &map) < 0)
+    {
+      fprintf(stderr, "iwmapc: can't compile %s : %s\n",
+	      text_path, strerror(errno));
+      goto out;
+    }
+
+  /* Rebuild the image with only the heard cells */
+  if(sparse)
+    {
+      struct iwmap		dense = map;
+      struct iw_fpstore		fps;
+      int			err;
+
+      iw_fpstore_from_map(&fps, &dense);
+      err = iw_map_build(&map, &fps, dense.routers,
+			 dense.hdr->flags | IWMAP_F_SPARSE);
+      iw_map_close(&dense);
+      if(err < 0)
+	{
+	  fprintf(stderr, "iwmapc: can't compress %s : %s\n",
+		  text_path, strerror(errno));
+	  goto out;
+	}
+    }
+
+  if(iw_map_save(&map, out_path) < 0)
+    fprintf(stderr, "iwmapc: can't write %s : %s\n",
+	    out_path, strerror(errno));
+  else
+    {
+      printf("%s : %d points, %d routers", out_path,
+	     map.hdr->num_points, map.hdr->num_routers);
+      if(map.hdr->flags & IWMAP_F_SPARSE)
+	printf(", %llu heard cells", (unsigned long long) map.hdr->nnz);
+      if(map.hdr->flags & IWMAP_F_STATS)
+	printf(", with the spreads");
+      printf("\n");
+      ret = 0;
+    }
+  iw_map_close(&map);
+
+ out:
+  if(text)
+    fclose(text);
+  if(routers)
+    fclose(routers);
+  if(coords)
+    fclose(coords);
+  return(ret);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Display the content of a binary map
+ */
+static int
+dump_map(const char *	path)
+{
+  struct iwmap		map;
+  struct iw_fpstore	fps;
+  struct iw_fpsparse	sp;
+  char			buf[20];
+  int			sparse;
+  int			i;
+  int			j;
+
+  if(iw_map_open(path, &map) < 0)
+    {
+      fprintf(stderr, "iwmapc: can't load %s : %s\n", path, strerror(errno));
+      return(-1);
+    }
+  iw_fpstore_from_map(&fps, &map);
+  sparse = (map.hdr->flags & IWMAP_F_SPARSE) != 0;
+  if(sparse && (iw_fpsparse_from_map(&sp, &map) < 0))
+    {
+      fprintf(stderr, "iwmapc: corrupted map %s\n", path);
+      iw_map_close(&map);
+      return(-1);
+    }
+
+  printf("%s : version %d, %d points, %d routers%s%s\n", path,
+	 map.hdr->version, map.hdr->num_points, map.hdr->num_routers,
+	 sparse ? " (sparse)" : "",
+	 (map.hdr->flags & IWMAP_F_STATS) ? " (with the spreads)" : "");
+  for(i = 0; i < (int) map.hdr->num_routers; i++)
+    {
+      iw_ether_ntop((const struct ether_addr *) map.routers[i].bssid, buf);
+      printf("    Router %02d : %s  %-16s (%d, %d)\n", i, buf,
+	     map.routers[i].essid, map.routers[i].x, map.routers[i].y);
+    }
+
+  for(i = 0; i < fps.num_points; i++)
+    {
+      printf("    %-12s", iw_fpstore_label(&fps, i));
+      if(map.hdr->flags & IWMAP_F_COORDS)
+	printf(" (%g, %g)", fps.x[i], fps.y[i]);
+      if(sparse)
+	/* Only the heard routers, as router:level */
+	for(j = sp.rowptr[i]; j < (int) sp.rowptr[i + 1]; j++)
+	  printf(" %d:%d", sp.cols[j], sp.vals[j]);
+      else
+	{
+	  const int8_t *	row = iw_fpstore_row(&fps, i);
+
+	  for(j = 0; j < fps.num_routers; j++)
+	    printf(" %4d", row[j]);
+	}
+      printf("\n");
+    }
+
+  if(sparse)
+    iw_fpsparse_free(&sp);
+  iw_fpstore_free(&fps);
+  iw_map_close(&map);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Merge the journal of a map into it right now
+ */
+static int
+compact_map(const char *	path)
+{
+  int	merged = iw_map_compact(path);
+
+  if(merged < 0)
+    {
+      fprintf(stderr, "iwmapc: can't merge the journal of %s : %s\n",
+	      path, strerror(errno));
+      return(-1);
+    }
+  printf("%s : merged %d learnt points\n", path, merged);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Train the product quantizer of a map and save it next to the map
+ */
+static int
+train_codes(const char *	path,
+	    int			sub_dim)
+{
+  struct iwmap		map;
+  struct iw_fpstore	fps;
+  struct iw_fpsparse	sp;
+  struct iw_pq		pq;
+  char			pq_path[PATH_MAX];
+  int			sparse;
+  int			ret = -1;
+
+  if(iw_pq_path(path, pq_path, sizeof(pq_path)) < 0)
+    {
+      fprintf(stderr, "iwmapc: %s : %s\n", path, strerror(errno));
+      return(-1);
+    }
+  if(iw_map_open(path, &map) < 0)
+    {
+      fprintf(stderr, "iwmapc: can't load %s : %s\n", path, strerror(errno));
+      return(-1);
+    }
+  iw_fpstore_from_map(&fps, &map);
+  sparse = (map.hdr->flags & IWMAP_F_SPARSE) != 0;
+  if(sparse)
+    {
+      if(iw_fpsparse_from_map(&sp, &map) < 0)
+	{
+	  fprintf(stderr, "iwmapc: corrupted map %s\n", path);
+	  iw_map_close(&map);
+	  return(-1);
+	}
+      sp.floor = IWMAP_FLOOR_DEFAULT;
+    }
+
+  if(iw_pq_train(&pq, &fps, sparse ? &sp : NULL, sub_dim) < 0)
+    fprintf(stderr, "iwmapc: can't train the codes of %s : %s\n",
+	    path, strerror(errno));
+  else
+    {
+      if(iw_pq_save(&pq, pq_path) < 0)
+	fprintf(stderr, "iwmapc: can't write %s : %s\n",
+		pq_path, strerror(errno));
+      else
+	{
+	  printf("%s : %d points coded on %d bytes, %d centroids of %d routers\n",
+		 pq_path, pq.num_points, pq.sub_stride / 2, pq.num_centroids,
+		 pq.sub_dim);
+	  ret = 0;
+	}
+      iw_pq_free(&pq);
+    }
+
+  if(sparse)
+    iw_fpsparse_free(&sp);
+  iw_fpstore_free(&fps);
+  iw_map_close(&map);
+  return(ret);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Locate a batch of recorded scans, and print where they were found
+ */
+static void
+locate_batch(const struct iw_fpblock *	fpb,
+	     const struct iw_fpstore *	fps,
+	     int			coords,
+	     const struct iwmap_jrec *	recs,
+	     const int8_t *		rows,
+	     int			num_scans,
+	     struct iw_knn *		knn,
+	     double *			error)
+{
+  double	x;
+  double	y;
+  int		i;
+
+  iw_fpblock_knn_batch(fpb, rows, num_scans, MAX_ROUTERS, knn);
+  for(i = 0; i < num_scans; i++)
+    {
+      if(knn[i].count == 0)
+	continue;
+      printf("    %-12s : %-12s diff %d", recs[i].label,
+	     iw_fpstore_label(fps, knn[i].nb[0].point), knn[i].nb[0].dist);
+      if(coords && (iw_knn_position(&knn[i], fps->x, fps->y, &x, &y) == 0))
+	{
+	  double	d = hypot(x - recs[i].x, y - recs[i].y);
+
+	  printf(" at (%g, %g), %.2f away", x, y, d);
+	  *error += d;
+	}
+      printf("\n");
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Locate again every scan of a recording (a journal, as written by
+ * "iwlist learn") on a map, by batches, to measure the map offline.
+ * Routers the map doesn't know are ignored.
+ */
+static int
+locate_scans(const char *	scans_path,
+	     const char *	path,
+	     int		k)
+{
+  struct iwmap		map;
+  struct iw_fpstore	fps;
+  struct iw_fpblock	fpb;
+  struct iw_bssid_registry	reg;
+  struct iw_journal	journal;
+  struct iwmap_jrec *	recs = NULL;
+  struct iwmap_jcell	cells[MAX_ROUTERS];
+  struct iw_knn *	knn = NULL;
+  int8_t *		rows = NULL;
+  struct timespec	start;
+  struct timespec	end;
+  double		error = 0;
+  int			coords;
+  int			num_scans = 0;
+  int			total = 0;
+  int			ret = -1;
+  int			r;
+  int			i;
+
+  if(iw_map_open(path, &map) < 0)
+    {
+      fprintf(stderr, "iwmapc: can't load %s : %s\n", path, strerror(errno));
+      return(-1);
+    }
+  if(map.hdr->flags & IWMAP_F_SPARSE)
+    {
+      fprintf(stderr, "iwmapc: %s : %s\n", path, strerror(ENOTSUP));
+      iw_map_close(&map);
+      return(-1);
+    }
+  coords = (map.hdr->flags & IWMAP_F_COORDS) != 0;
+  iw_fpstore_from_map(&fps, &map);
+  memset(&fpb, 0, sizeof(fpb));
+  memset(&reg, 0, sizeof(reg));
+  if((iw_journal_open(&journal, scans_path) < 0)
+     || (journal.fd < 0))
+    {
+      fprintf(stderr, "iwmapc: can't open %s : %s\n",
+	      scans_path, strerror(errno));
+      goto out;
+    }
+  recs = malloc(IWMAPC_BATCH * sizeof(*recs));
+  rows = malloc((size_t) IWMAPC_BATCH * MAX_ROUTERS);
+  knn = malloc(IWMAPC_BATCH * sizeof(*knn));
+  if((recs == NULL) || (rows == NULL) || (knn == NULL)
+     || (iw_registry_init(&reg, map.hdr->num_routers) < 0)
+     || (iw_fpblock_from_store(&fpb, &fps) < 0))
+    goto fail;
+  for(i = 0; i < (int) map.hdr->num_routers; i++)
+    if(iw_registry_add(&reg, map.routers[i].bssid, i) < 0)
+      goto fail;
+  for(i = 0; i < IWMAPC_BATCH; i++)
+    iw_knn_init(&knn[i], k);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while((r = iw_journal_next(&journal, &recs[num_scans], cells, NULL)) > 0)
+    {
+      int8_t *	row = rows + (size_t) num_scans * MAX_ROUTERS;
+
+      memset(row, 0, MAX_ROUTERS);
+      for(i = 0; i < recs[num_scans].num_cells; i++)
+	{
+	  int	col = iw_registry_find(&reg, cells[i].bssid);
+
+	  if(col >= 0)
+	    row[col] = cells[i].level;
+	}
+      if(++num_scans == IWMAPC_BATCH)
+	{
+	  locate_batch(&fpb, &fps, coords, recs, rows, num_scans, knn, &error);
+	  total += num_scans;
+	  num_scans = 0;
+	}
+    }
+  if(r < 0)
+    goto fail;
+  locate_batch(&fpb, &fps, coords, recs, rows, num_scans, knn, &error);
+  total += num_scans;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf("%s : %d scans located in %.3f s", scans_path, total,
+	 (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+  if(coords && (total > 0))
+    printf(", %.2f away on average", error / total);
+  printf("\n");
+  ret = 0;
+  goto out;
+
+ fail:
+  fprintf(stderr, "iwmapc: can't locate the scans of %s : %s\n",
+	  scans_path, strerror(errno));
+ out:
+  iw_journal_close(&journal);
+  iw_registry_free(&reg);
+  iw_fpblock_free(&fpb);
+  free(knn);
+  free(rows);
+  free(recs);
+  iw_fpstore_free(&fps);
+  iw_map_close(&map);
+  return(ret);
+}
+
+/******************************* MAIN ********************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Display help
+ */
+static void
+iw_usage(int	status)
+{
+  fputs("Usage: iwmapc [-s] [-r routers] [-c coordinates] textmap binarymap\n"
+	"       iwmapc -l binarymap\n"
+	"       iwmapc -j binarymap\n"
+	"       iwmapc -q [-d routers] binarymap\n"
+	"       iwmapc -e scans [-k k] binarymap\n",
+	status ? stderr : stdout);
+  exit(status);
+}
+
+static const struct option long_opts[] = {
+  { "coordinates", required_argument, NULL, 'c' },
+  { "codes", no_argument, NULL, 'q' },
+  { "code-routers", required_argument, NULL, 'd' },
+  { "help", no_argument, NULL, 'h' },
+  { "journal", no_argument, NULL, 'j' },
+  { "locate", required_argument, NULL, 'e' },
+  { "neighbours", required_argument, NULL, 'k' },
+  { "list", no_argument, NULL, 'l' },
+  { "routers", required_argument, NULL, 'r' },
+  { "sparse", no_argument, NULL, 's' },
+  { NULL, 0, NULL, 0 }
+};
+
+/*------------------------------------------------------------------*/
+/*
+ * The main !
+ */
+int
+main(int	argc,
+     char **	argv)
+{
+  const char *	routers_path = NULL;
+  const char *	coords_path = NULL;
+  const char *	scans_path = NULL;
+  int		list = 0;
+  int		journal = 0;
+  int		sparse = 0;
+  int		codes = 0;
+  int		sub_dim = IWPQ_SUB_DIM_DEFAULT;
+  int		k = IW_KNN_DEFAULT;
+  int		opt;
+
+  /* Check command line arguments */
+  while((opt = getopt_long(argc, argv, "c:d:e:hjk:lqr:s", long_opts, NULL)) > 0)
+    {
+      switch(opt)
+	{
+	case 'c':
+	  /* Position of each point, by label */
+	  coords_path = optarg;
+	  break;
+
+	case 'd':
+	  /* Routers per byte of the codes : fewer, better recall */
+	  sub_dim = atoi(optarg);
+	  break;
+
+	case 'e':
+	  /* Recorded scans to locate */
+	  scans_path = optarg;
+	  break;
+
+	case 'h':
+	  iw_usage(0);
+	  break;
+
+	case 'j':
+	  /* Merge the learnt points now, rather than wait for learn */
+	  journal = 1;
+	  break;
+
+	case 'k':
+	  k = atoi(optarg);
+	  break;
+
+	case 'l':
+	  /* User wants to see a compiled map */
+	  list = 1;
+	  break;
+
+	case 'q':
+	  /* Product codes, for the approximate search of big maps */
+	  codes = 1;
+	  break;
+
+	case 'r':
+	  /* Router list, fixes the order of the columns */
+	  routers_path = optarg;
+	  break;
+
+	case 's':
+	  /* Large site, keep only the heard cells */
+	  sparse = 1;
+	  break;
+
+	default:
+	  iw_usage(1);
+	  break;
+	}
+    }
+
+  if(list || journal || codes || scans_path)
+    {
+      if(optind + 1 != argc)
+	iw_usage(1);
+      if(scans_path)
+	return(locate_scans(scans_path, argv[optind], k) < 0);
+      if(codes)
+	return(train_codes(argv[optind], sub_dim) < 0);
+      if(journal)
+	return(compact_map(argv[optind]) < 0);
+      return(dump_map(argv[optind]) < 0);
+    }
+
+  if(optind + 2 != argc)
+    iw_usage(1);
+  return(compile_map(argv[optind], routers_path, coords_path,
+		     argv[optind + 1], sparse) < 0);
+}
@@ -57,6 +57,21 @@ extern int
 
 /* We need the library */
 #include "iwlib.c"
+#include "iwmap.c"
+#include "iwjournal.c"
+#include "iwcatalog.c"
+#include "iwkernel.c"
+#include "iwindex.c"
+#include "iwpq.c"
+#include "iwcluster.c"
+#include "iwinvert.c"
+#include "iwselect.c"
+#include "iwpool.c"
+#include "iwgauss.c"
+#include "iwgraph.c"
+#include "iwparticle.c"
+#include "iwhmm.c"
+#include "iwcache.c"
 
 /* Get iwconfig in there. Mandatory. */
 #define main(args...) main_iwconfig(args)
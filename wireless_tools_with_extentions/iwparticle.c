@@ -0,0 +1,571 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Particle filter : the tracker is a cloud of particles on the floor,
+ * each a guess of where it is, with a weight. Between two scans they
+ * walk, at most at the walking speed, in any direction. A scan weights
+ * each particle by the likelihood of the scan at the point of the
+ * radio map nearest to it, and the cloud is resampled once most of the
+ * weight is on a few particles. The position is the mean of the cloud.
+ *
+ * The particles are arrays of x, y and w (structure of arrays), walked
+ * IW_PF_LANES at a time with the vectors of gcc : the moves, the random
+ * numbers (one generator per lane), the weights and their sums have no
+ * branch. Only what depends on the map is looked up one particle at a
+ * time : the floor is a grid whose cells know their nearest point of
+ * the map, and the likelihood of a point is worked out once per scan,
+ * for the points under the cloud only.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Cells of the grid of the floor per point of the map */
+#define IW_PF_GRID_CELLS	4
+
+/* The cloud is resampled once its effective size, 1 / sum(w^2), falls
+ * below this share of the particles */
+#define IW_PF_RESAMPLE		0.5f
+
+/* One vector of lanes : gcc makes one SSE2 register of it */
+typedef float		iw_pf_vf __attribute__((vector_size(IW_PF_LANES * sizeof(float))));
+typedef int32_t		iw_pf_vi __attribute__((vector_size(IW_PF_LANES * sizeof(int32_t))));
+typedef uint32_t	iw_pf_vu __attribute__((vector_size(IW_PF_LANES * sizeof(uint32_t))));
+
+/* Lane by lane v < lo ? lo : (v > hi ? hi : v), with masks */
+#define IW_PF_CLAMP(v, lo, hi)						\
+  do {									\
+    iw_pf_vi	_m = (v) < (lo);					\
+    (v) = (iw_pf_vf) ((_m & (iw_pf_vi) (lo)) | (~_m & (iw_pf_vi) (v)));	\
+    _m = (v) > (hi);							\
+    (v) = (iw_pf_vf) ((_m & (iw_pf_vi) (hi)) | (~_m & (iw_pf_vi) (v)));	\
+  } while(0)
+
+/**************************** SUBROUTINES ****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Next random numbers of the lanes, uniform in [0, 1) (xorshift32)
+ */
+__attribute__((always_inline))
+static inline iw_pf_vf
+iw_pf_uniform(iw_pf_vu *	state)
+{
+  iw_pf_vu	s = *state;
+
+  s ^= s << 13;
+  s ^= s >> 17;
+  s ^= s << 5;
+  *state = s;
+  return(__builtin_convertvector((iw_pf_vi) (s >> 8), iw_pf_vf)
+	 * (1.0f / 16777216.0f));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Squared distance of a point of the map to the centre of a cell
+ */
+static float
+iw_pf_cell_d2(const struct iw_pf *		pf,
+	      const struct iw_fpstore *	fps,
+	      int			point,
+	      int			cell)
+{
+  float	dx = (float) fps->x[point] - pf->minx
+	     - ((cell % pf->cols) + 0.5f) / pf->inv_cell;
+  float	dy = (float) fps->y[point] - pf->miny
+	     - ((cell / pf->cols) + 0.5f) / pf->inv_cell;
+
+  return(dx * dx + dy * dy);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Let a cell take the nearest point of a neighbour, if nearer than its
+ * own
+ */
+static void
+iw_pf_cell_offer(struct iw_pf *			pf,
+		 const struct iw_fpstore *	fps,
+		 int				cell,
+		 int				x,
+		 int				y)
+{
+  int	point;
+
+  if((x < 0) || (x >= pf->cols) || (y < 0) || (y >= pf->rows))
+    return;
+  point = pf->grid[y * pf->cols + x];
+  if((point >= 0)
+     && ((pf->grid[cell] < 0)
+	 || (iw_pf_cell_d2(pf, fps, point, cell)
+	     < iw_pf_cell_d2(pf, fps, pf->grid[cell], cell))))
+    pf->grid[cell] = point;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Grid of the floor, each cell with its nearest point of the map. The
+ * points go to their cells, then two sweeps of the grid, down and up,
+ * hand them to the cells around (distance transform, close enough to
+ * the true nearest for the likelihoods).
+ */
+static int
+iw_pf_grid(struct iw_pf *		pf,
+	   const struct iw_fpstore *	fps)
+{
+  float		width;
+  float		height;
+  float		cell;
+  int		i;
+  int		x;
+  int		y;
+
+  pf->minx = pf->maxx = fps->x[0];
+  pf->miny = pf->maxy = fps->y[0];
+  for(i = 1; i < fps->num_points; i++)
+    {
+      pf->minx = fminf(pf->minx, fps->x[i]);
+      pf->maxx = fmaxf(pf->maxx, fps->x[i]);
+      pf->miny = fminf(pf->miny, fps->y[i]);
+      pf->maxy = fmaxf(pf->maxy, fps->y[i]);
+    }
+  width = pf->maxx - pf->minx;
+  height = pf->maxy - pf->miny;
+  cell = sqrtf(width * height / (IW_PF_GRID_CELLS * fps->num_points));
+  if(!(cell > 0))
+    cell = fmaxf(width, height) / (IW_PF_GRID_CELLS * fps->num_points);
+  if(!(cell > 0))
+    cell = 1.0f;
+  pf->inv_cell = 1.0f / cell;
+  /* As the particles will find their cells, so that they stay in */
+  pf->cols = (int) (width * pf->inv_cell) + 1;
+  pf->rows = (int) (height * pf->inv_cell) + 1;
+
+  pf->grid = malloc((size_t) pf->cols * pf->rows * sizeof(int));
+  if(pf->grid == NULL)
+    {
+      errno = ENOMEM;
+      return(-1);
+    }
+  for(i = 0; i < pf->cols * pf->rows; i++)
+    pf->grid[i] = -1;
+  for(i = 0; i < fps->num_points; i++)
+    {
+      /* In float, as the particles */
+      int	c = ((int) (((float) fps->y[i] - pf->miny) * pf->inv_cell)
+		     * pf->cols
+		     + (int) (((float) fps->x[i] - pf->minx) * pf->inv_cell));
+
+      if((pf->grid[c] < 0)
+	 || (iw_pf_cell_d2(pf, fps, i, c) < iw_pf_cell_d2(pf, fps, pf->grid[c], c)))
+	pf->grid[c] = i;
+    }
+  for(y = 0; y < pf->rows; y++)
+    for(x = 0; x < pf->cols; x++)
+      {
+	int	c = y * pf->cols + x;
+
+	iw_pf_cell_offer(pf, fps, c, x - 1, y);
+	iw_pf_cell_offer(pf, fps, c, x - 1, y - 1);
+	iw_pf_cell_offer(pf, fps, c, x, y - 1);
+	iw_pf_cell_offer(pf, fps, c, x + 1, y - 1);
+      }
+  for(y = pf->rows - 1; y >= 0; y--)
+    for(x = pf->cols - 1; x >= 0; x--)
+      {
+	int	c = y * pf->cols + x;
+
+	iw_pf_cell_offer(pf, fps, c, x + 1, y);
+	iw_pf_cell_offer(pf, fps, c, x + 1, y + 1);
+	iw_pf_cell_offer(pf, fps, c, x, y + 1);
+	iw_pf_cell_offer(pf, fps, c, x - 1, y + 1);
+      }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Systematic resampling : one random offset, then particle j goes where
+ * (offset + j) / N falls in the sums of the weights. Particle i is
+ * copied from ends[i - 1] to ends[i], the ends come in one pass of the
+ * vectors over the sums.
+ */
+static void
+iw_pf_resample(struct iw_pf *	pf)
+{
+  iw_pf_vu	rng;
+  float		offset;
+  float		sum = 0;
+  float *	swap;
+  int		n = pf->num_particles;
+  int		i;
+  int		j;
+
+  memcpy(&rng, pf->rng, sizeof(rng));
+  offset = iw_pf_uniform(&rng)[0];
+  memcpy(pf->rng, &rng, sizeof(rng));
+
+  /* The sums, in place of the weights */
+  for(i = 0; i < n; i++)
+    {
+      sum += pf->w[i];
+      pf->w[i] = sum;
+    }
+  for(i = 0; i < n; i += IW_PF_LANES)
+    {
+      iw_pf_vf	cum = *(iw_pf_vf *) (pf->w + i) * (n / sum) - offset + 1.0f;
+      iw_pf_vf	lo = { 0 };
+      iw_pf_vf	hi = lo + (float) n;
+
+      IW_PF_CLAMP(cum, lo, hi);
+      *(iw_pf_vi *) (pf->ends + i) = __builtin_convertvector(cum, iw_pf_vi);
+    }
+  /* Whatever the rounding, every particle is drawn */
+  pf->ends[n - 1] = n;
+
+  for(i = 0, j = 0; i < n; i++)
+    for(; j < pf->ends[i]; j++)
+      {
+	pf->nx[j] = pf->x[i];
+	pf->ny[j] = pf->y[i];
+      }
+  swap = pf->x;
+  pf->x = pf->nx;
+  pf->nx = swap;
+  swap = pf->y;
+  pf->y = pf->ny;
+  pf->ny = swap;
+  for(i = 0; i < n; i++)
+    pf->w[i] = 1.0f / n;
+}
+
+/***************************** FILTER *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Filter of num_particles particles (rounded up to IW_PF_LANES) over
+ * the points of a (dense) store with positions, walking at most speed
+ * map units per second. The particles are spread over the floor.
+ * Return 0, or -1.
+ */
+int
+iw_pf_init(struct iw_pf *		pf,
+	   const struct iw_fpstore *	fps,
+	   int				num_particles,
+	   float			speed)
+{
+  size_t	len;
+  int		ret;
+  int		l;
+
+  memset(pf, 0, sizeof(*pf));
+  if((fps->rss == NULL) || (fps->x == NULL) || (fps->y == NULL))
+    {
+      errno = ENOTSUP;
+      return(-1);
+    }
+  if((num_particles < 1) || (fps->num_points == 0))
+    {
+      errno = EINVAL;
+      return(-1);
+    }
+  pf->num_particles = (int) IWMAP_ROUNDUP(num_particles, IW_PF_LANES);
+  pf->num_points = fps->num_points;
+  pf->speed = speed;
+  for(l = 0; l < IW_PF_LANES; l++)
+    pf->rng[l] = 2463534242u + 97 * l;
+
+  len = IWMAP_ROUNDUP(pf->num_particles * sizeof(float), IWMAP_ALIGN);
+  ret = (posix_memalign((void **) &pf->x, IWMAP_ALIGN, len)
+	 | posix_memalign((void **) &pf->y, IWMAP_ALIGN, len)
+	 | posix_memalign((void **) &pf->w, IWMAP_ALIGN, len)
+	 | posix_memalign((void **) &pf->nx, IWMAP_ALIGN, len)
+	 | posix_memalign((void **) &pf->ny, IWMAP_ALIGN, len)
+	 | posix_memalign((void **) &pf->point, IWMAP_ALIGN, len)
+	 | posix_memalign((void **) &pf->ends, IWMAP_ALIGN, len));
+  pf->lik = malloc(pf->num_points * sizeof(float));
+  pf->seen = calloc(pf->num_points, sizeof(uint32_t));
+  pf->touched = malloc(pf->num_points * sizeof(int));
+  if(ret || (pf->lik == NULL) || (pf->seen == NULL) || (pf->touched == NULL))
+    {
+      iw_pf_free(pf);
+      errno = ENOMEM;
+      return(-1);
+    }
+  if(iw_pf_grid(pf, fps) < 0)
+    {
+      iw_pf_free(pf);
+      errno = ENOMEM;
+      return(-1);
+    }
+  iw_pf_spread(pf);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * The store got new points (learnt while tracking) : the grid and the
+ * arrays per point are made again over all of them, the particles stay
+ * where they are, with their weights. The floor only grows, so they
+ * stay on it.
+ * Return 0, or -1 (the filter is unchanged).
+ */
+int
+iw_pf_remap(struct iw_pf *		pf,
+	    const struct iw_fpstore *	fps)
+{
+  struct iw_pf	remap;
+  size_t	len = pf->num_particles * sizeof(float);
+
+  if(iw_pf_init(&remap, fps, pf->num_particles, pf->speed) < 0)
+    return(-1);
+  memcpy(remap.x, pf->x, len);
+  memcpy(remap.y, pf->y, len);
+  memcpy(remap.w, pf->w, len);
+  memcpy(remap.rng, pf->rng, sizeof(remap.rng));
+  iw_pf_free(pf);
+  *pf = remap;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Spread the particles evenly over the floor, all the same weight (the
+ * tracker is lost)
+ */
+void
+iw_pf_spread(struct iw_pf *	pf)
+{
+  iw_pf_vu	rng;
+  int		i;
+
+  memcpy(&rng, pf->rng, sizeof(rng));
+  for(i = 0; i < pf->num_particles; i += IW_PF_LANES)
+    {
+      *(iw_pf_vf *) (pf->x + i) = pf->minx + iw_pf_uniform(&rng)
+				  * (pf->maxx - pf->minx);
+      *(iw_pf_vf *) (pf->y + i) = pf->miny + iw_pf_uniform(&rng)
+				  * (pf->maxy - pf->miny);
+      *(iw_pf_vf *) (pf->w + i) = (iw_pf_vf) { 0 }
+				  + 1.0f / pf->num_particles;
+    }
+  memcpy(pf->rng, &rng, sizeof(rng));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Walk the particles for dt seconds : each moves up to speed * dt along
+ * each axis, uniformly (a square, not a circle : no sin nor cos, and
+ * the walker going straight along a wall is still followed), and stays
+ * on the floor
+ */
+void
+iw_pf_move(struct iw_pf *	pf,
+	   double		dt)
+{
+  iw_pf_vu	rng;
+  iw_pf_vf	minx = (iw_pf_vf) { 0 } + pf->minx;
+  iw_pf_vf	maxx = (iw_pf_vf) { 0 } + pf->maxx;
+  iw_pf_vf	miny = (iw_pf_vf) { 0 } + pf->miny;
+  iw_pf_vf	maxy = (iw_pf_vf) { 0 } + pf->maxy;
+  float		side = (float) (2 * pf->speed * dt);
+  int		i;
+
+  memcpy(&rng, pf->rng, sizeof(rng));
+  for(i = 0; i < pf->num_particles; i += IW_PF_LANES)
+    {
+      iw_pf_vf	x = *(iw_pf_vf *) (pf->x + i);
+      iw_pf_vf	y = *(iw_pf_vf *) (pf->y + i);
+
+      x += (iw_pf_uniform(&rng) - 0.5f) * side;
+      y += (iw_pf_uniform(&rng) - 0.5f) * side;
+      IW_PF_CLAMP(x, minx, maxx);
+      IW_PF_CLAMP(y, miny, maxy);
+      *(iw_pf_vf *) (pf->x + i) = x;
+      *(iw_pf_vf *) (pf->y + i) = y;
+    }
+  memcpy(pf->rng, &rng, sizeof(rng));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Weight the particles by the likelihood of a scan, at the point of
+ * the map nearest to each : a normal law of sigma dB per router, on the
+ * distances of iw_fpblock_knn_masked() (a router the scan missed costs
+ * penalty dB to the points hearing it). The cloud is resampled if the
+ * weight is on too few particles, and spread again if it is on none.
+ * Return the number of points of the map measured, 0 if the scan heard
+ * none of the routers (the weights stay).
+ */
+int
+iw_pf_update(struct iw_pf *			pf,
+	     const struct iw_fpstore *	fps,
+	     const int8_t *		query,
+	     int			penalty,
+	     double			sigma)
+{
+  iw_pf_vf	sums = { 0 };
+  iw_pf_vf	squares = { 0 };
+  float		scale = (float) (1.0 / (2.0 * sigma * sigma));
+  float		best = INFINITY;
+  float		sum;
+  float		ess;
+  int		n = fps->num_routers;
+  int		heard = 0;
+  int		touched = 0;
+  int		i;
+  int		l;
+
+  if(penalty < 0)
+    penalty = 0;
+  if(penalty > IW_KNN_PENALTY_MAX)
+    penalty = IW_KNN_PENALTY_MAX;
+  for(l = 0; l < n; l++)
+    heard += (query[l] != 0);
+  if(heard == 0)
+    return(0);
+
+  /* A new mark for this scan, clear them all once in 2^32 */
+  if(++pf->scan == 0)
+    {
+      memset(pf->seen, 0, pf->num_points * sizeof(uint32_t));
+      pf->scan = 1;
+    }
+
+  /* The cells of the particles, then the points under them, measured
+   * once */
+  for(i = 0; i < pf->num_particles; i += IW_PF_LANES)
+    {
+      iw_pf_vf	x = *(iw_pf_vf *) (pf->x + i);
+      iw_pf_vf	y = *(iw_pf_vf *) (pf->y + i);
+      iw_pf_vi	cx = __builtin_convertvector((x - pf->minx) * pf->inv_cell,
+					     iw_pf_vi);
+      iw_pf_vi	cy = __builtin_convertvector((y - pf->miny) * pf->inv_cell,
+					     iw_pf_vi);
+
+      *(iw_pf_vi *) (pf->point + i) = cy * pf->cols + cx;
+    }
+  for(i = 0; i < pf->num_particles; i++)
+    {
+      int	point = pf->grid[pf->point[i]];
+
+      pf->point[i] = point;
+      if(pf->seen[point] == pf->scan)
+	continue;
+      pf->seen[point] = pf->scan;
+      pf->touched[touched++] = point;
+      /* Scaled to all the routers, as iw_fpblock_knn_masked() */
+      pf->lik[point] = ((float) iw_dist_masked(iw_fpstore_row(fps, point),
+					       query, n, penalty)
+			* n / heard);
+      best = fminf(best, pf->lik[point]);
+    }
+  /* Relative to the best point, so that one at least is 1 */
+  for(i = 0; i < touched; i++)
+    pf->lik[pf->touched[i]] = expf((best - pf->lik[pf->touched[i]]) * scale);
+
+  for(i = 0; i < pf->num_particles; i += IW_PF_LANES)
+    {
+      iw_pf_vf	lik;
+      iw_pf_vf	w;
+
+      for(l = 0; l < IW_PF_LANES; l++)
+	lik[l] = pf->lik[pf->point[i + l]];
+      w = *(iw_pf_vf *) (pf->w + i) * lik;
+      *(iw_pf_vf *) (pf->w + i) = w;
+      sums += w;
+    }
+  sum = 0;
+  for(l = 0; l < IW_PF_LANES; l++)
+    sum += sums[l];
+  if(!(sum > 0))
+    {
+      /* No particle is anywhere near, lost */
+      iw_pf_spread(pf);
+      return(touched);
+    }
+
+  for(i = 0; i < pf->num_particles; i += IW_PF_LANES)
+    {
+      iw_pf_vf	w = *(iw_pf_vf *) (pf->w + i) * (1.0f / sum);
+
+      *(iw_pf_vf *) (pf->w + i) = w;
+      squares += w * w;
+    }
+  ess = 0;
+  for(l = 0; l < IW_PF_LANES; l++)
+    ess += squares[l];
+  if(1.0f / ess < IW_PF_RESAMPLE * pf->num_particles)
+    iw_pf_resample(pf);
+  return(touched);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Position of the tracker, the mean of the cloud.
+ * Return the spread of the cloud around it (RMS distance).
+ */
+double
+iw_pf_estimate(const struct iw_pf *	pf,
+	       double *			px,
+	       double *			py)
+{
+  iw_pf_vf	sx = { 0 };
+  iw_pf_vf	sy = { 0 };
+  iw_pf_vf	sxx = { 0 };
+  iw_pf_vf	syy = { 0 };
+  double	mx = 0;
+  double	my = 0;
+  double	var = 0;
+  int		i;
+  int		l;
+
+  for(i = 0; i < pf->num_particles; i += IW_PF_LANES)
+    {
+      iw_pf_vf	w = *(const iw_pf_vf *) (pf->w + i);
+      iw_pf_vf	x = *(const iw_pf_vf *) (pf->x + i) - pf->minx;
+      iw_pf_vf	y = *(const iw_pf_vf *) (pf->y + i) - pf->miny;
+
+      sx += w * x;
+      sy += w * y;
+      sxx += w * x * x;
+      syy += w * y * y;
+    }
+  for(l = 0; l < IW_PF_LANES; l++)
+    {
+      mx += sx[l];
+      my += sy[l];
+      var += sxx[l] + syy[l];
+    }
+  var -= mx * mx + my * my;
+  *px = pf->minx + mx;
+  *py = pf->miny + my;
+  return((var > 0) ? sqrt(var) : 0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release a filter
+ */
+void
+iw_pf_free(struct iw_pf *	pf)
+{
+  free(pf->x);
+  free(pf->y);
+  free(pf->w);
+  free(pf->nx);
+  free(pf->ny);
+  free(pf->point);
+  free(pf->ends);
+  free(pf->grid);
+  free(pf->lik);
+  free(pf->seen);
+  free(pf->touched);
+  memset(pf, 0, sizeof(*pf));
+}
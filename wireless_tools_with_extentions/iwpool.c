@@ -0,0 +1,220 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Thread pool of the searches : the threads are started once, with the
+ * map, and wait for the jobs of the queries. A job is split in shards,
+ * one per thread, the caller taking the first one itself, and it is
+ * over when every shard is done. Starting threads for each query would
+ * cost more than the search of most maps.
+ *
+ * Between two jobs a thread spins a little before it sleeps, queries
+ * come in bursts (the samples of a window, or a recording being played)
+ * and waking a sleeping thread takes longer than the shard of a small
+ * map.
+ *
+ * Whether the pool pays off depends on the cores, their caches and the
+ * size and width of the map, so it is not guessed : the searches are
+ * timed on a few points of the map when it is loaded, and the fastest
+ * is kept (see iw_pool_probe()).
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+#include <sched.h>
+#include <time.h>
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Polls of the next job before going to sleep */
+#define IW_POOL_SPIN		(1 << 16)
+
+/**************************** WORKERS ****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Wait for a job after the one numbered seen.
+ * Return 0 if there is one, -1 if the pool is stopping.
+ */
+static int
+iw_pool_wait(struct iw_pool *	pool,
+	     unsigned int	seen)
+{
+  int	spin;
+
+  for(spin = 0; spin < IW_POOL_SPIN; spin++)
+    if(__atomic_load_n(&pool->gen, __ATOMIC_ACQUIRE) != seen)
+      return(pool->stop ? -1 : 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while(pool->gen == seen)
+    pthread_cond_wait(&pool->wake, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+  return(pool->stop ? -1 : 0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Thread of the pool : run its shard of each job
+ */
+static void *
+iw_pool_worker(void *	arg)
+{
+  struct iw_pool_thread *	self = arg;
+  struct iw_pool *		pool = self->pool;
+  unsigned int			seen = 0;
+
+  while(iw_pool_wait(pool, seen) == 0)
+    {
+      seen = pool->gen;
+      pool->job(pool->arg, self->shard, pool->num_threads);
+      __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELEASE);
+    }
+  return(NULL);
+}
+
+/****************************** POOL ******************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Start a pool of num_threads threads, the caller of iw_pool_run()
+ * being one of them. 0 is one per CPU. If the system refuses some, the
+ * pool makes do with those it got.
+ * Return the number of threads, or -1.
+ */
+int
+iw_pool_init(struct iw_pool *	pool,
+	     int		num_threads)
+{
+  int	i;
+
+  memset(pool, 0, sizeof(*pool));
+  if(num_threads < 1)
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(num_threads < 1)
+    num_threads = 1;
+  if(num_threads > IW_POOL_MAX_THREADS)
+    num_threads = IW_POOL_MAX_THREADS;
+  if((pthread_mutex_init(&pool->lock, NULL) != 0)
+     || (pthread_cond_init(&pool->wake, NULL) != 0))
+    {
+      errno = ENOMEM;
+      return(-1);
+    }
+  pool->num_threads = 1;
+  for(i = 1; i < num_threads; i++)
+    {
+      pool->threads[i].pool = pool;
+      pool->threads[i].shard = i;
+      if(pthread_create(&pool->threads[i].thread, NULL, iw_pool_worker,
+			&pool->threads[i]) != 0)
+	break;
+      pool->num_threads++;
+    }
+  return(pool->num_threads);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Run a job : job(arg, shard, num_shards) for every shard, at once on
+ * the threads of the pool, and return once they are all done. Shards
+ * only write their own results, the caller reads them all after this.
+ * A pool runs one job at a time.
+ */
+void
+iw_pool_run(struct iw_pool *	pool,
+	    void		(*job)(void *	arg,
+				       int	shard,
+				       int	num_shards),
+	    void *		arg)
+{
+  if(pool->num_threads > 1)
+    {
+      pool->job = job;
+      pool->arg = arg;
+      pool->pending = pool->num_threads - 1;
+      pthread_mutex_lock(&pool->lock);
+      __atomic_add_fetch(&pool->gen, 1, __ATOMIC_RELEASE);
+      pthread_cond_broadcast(&pool->wake);
+      pthread_mutex_unlock(&pool->lock);
+    }
+
+  job(arg, 0, pool->num_threads);
+
+  /* The others are on their way, it won't be long */
+  while(__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0)
+    sched_yield();
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Stop the threads and release the pool
+ */
+void
+iw_pool_free(struct iw_pool *	pool)
+{
+  int	i;
+
+  if(pool->num_threads == 0)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  __atomic_add_fetch(&pool->gen, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for(i = 1; i < pool->num_threads; i++)
+    pthread_join(pool->threads[i].thread, NULL);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  memset(pool, 0, sizeof(*pool));
+}
+
+/*************************** CALIBRATION ***************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Monotonic time, in seconds
+ */
+static double
+iw_pool_now(void)
+{
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Time a search of a map, search(arg, query, knn), on IW_POOL_PROBES of
+ * its own points spread over it : once to warm the caches (and the
+ * threads), then timed.
+ * Return the time of a query, in seconds, or -1 if the store is empty.
+ */
+double
+iw_pool_probe(const struct iw_fpstore *	fps,
+	      int			k,
+	      int			(*search)(void *		arg,
+						  const int8_t *	query,
+						  struct iw_knn *	knn),
+	      void *			arg)
+{
+  struct iw_knn	knn;
+  double	start = 0;
+  int		round;
+  int		i;
+
+  if(fps->num_points == 0)
+    return(-1);
+  iw_knn_init(&knn, k);
+  for(round = 0; round < 2; round++)
+    {
+      start = iw_pool_now();
+      for(i = 0; i < IW_POOL_PROBES; i++)
+	search(arg, iw_fpstore_row(fps, (int) ((int64_t) i * fps->num_points
+					       / IW_POOL_PROBES)), &knn);
+    }
+  return((iw_pool_now() - start) / IW_POOL_PROBES);
+}
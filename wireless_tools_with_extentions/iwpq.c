@@ -0,0 +1,800 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Product quantizer : approximate nearest neighbours, for the maps too
+ * big for an exact search. The routers are cut in groups of sub_dim,
+ * and each group of a fingerprint is coded by the nearest of (up to)
+ * IWPQ_CENTROIDS centroids learnt by k-means, on 4 bits.
+ *
+ * A query first works out its distance to every centroid of every
+ * group (the asymmetric distance tables, the query is not coded), then
+ * the distance to a point is a sum of num_sub lookups. Tables of 16
+ * bytes stay in vector registers, and the kernels (iwkernel.c) look up
+ * a whole block of points per byte shuffle. The best candidates of that
+ * scan are measured exactly, and give the neighbours : the more
+ * candidates, the better the recall.
+ *
+ * The codebooks and the codes are trained by "iwmapc -q" and saved
+ * next to the map (IWPQ_SUFFIX).
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+#include <float.h>		/* FLT_MAX */
+#include <limits.h>		/* PATH_MAX */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Blocks per call of the scan kernel, the sums of a chunk stay in L1
+ * while we pick the candidates */
+#define IWPQ_CHUNK		64
+
+/****************************** TYPES ******************************/
+
+/*
+ * A candidate of the scan of the codes
+ */
+struct iw_pqcand
+{
+  int32_t	dist;
+  int		point;
+};
+
+/**************************** SUBROUTINES ****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Bytes of the codes of a block
+ */
+static inline size_t
+iw_pq_block_len(const struct iw_pq *	pq)
+{
+  return((size_t) 16 * pq->sub_stride);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Fingerprint of a point, unheard routers at floor dBm. The rows come
+ * from the store, or from the sparse map when the store has none.
+ */
+static void
+iw_pq_row(const struct iw_pq *		pq,
+	  const struct iw_fpstore *	fps,
+	  const struct iw_fpsparse *	sp,
+	  int				point,
+	  int8_t *			row)
+{
+  uint32_t	j;
+  int		r;
+
+  if(fps->rss != NULL)
+    memcpy(row, iw_fpstore_row(fps, point), pq->num_routers);
+  else
+    {
+      memset(row, 0, pq->num_routers);
+      for(j = sp->rowptr[point]; j < sp->rowptr[point + 1]; j++)
+	row[sp->cols[j]] = sp->vals[j];
+    }
+  for(r = 0; r < pq->num_routers; r++)
+    if(row[r] == 0)
+      row[r] = pq->floor;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Group m of a fingerprint, padded with 0 past the last router
+ */
+static void
+iw_pq_group(const struct iw_pq *	pq,
+	    const int8_t *		row,
+	    int				m,
+	    float *			v)
+{
+  int	d;
+
+  for(d = 0; d < pq->sub_dim; d++)
+    {
+      int	r = m * pq->sub_dim + d;
+
+      v[d] = (r < pq->num_routers) ? row[r] : 0.0f;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Nearest of n centroids of dim values to v
+ */
+static int
+iw_pq_nearest(const float *	centroids,
+	      int		n,
+	      int		dim,
+	      const float *	v)
+{
+  float		best = FLT_MAX;
+  int		which = 0;
+  int		c;
+  int		d;
+
+  for(c = 0; c < n; c++)
+    {
+      const float *	cent = centroids + (size_t) c * dim;
+      float		sum = 0.0f;
+
+      for(d = 0; d < dim; d++)
+	sum += (v[d] - cent[d]) * (v[d] - cent[d]);
+      if(sum < best)
+	{
+	  best = sum;
+	  which = c;
+	}
+    }
+  return(which);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Code a fingerprint (unheard routers already at the floor) as point
+ * number point
+ */
+static void
+iw_pq_encode(struct iw_pq *	pq,
+	     const int8_t *	row,
+	     int		point)
+{
+  uint8_t *	codes = pq->codes + (point / IWPQ_BLOCK) * iw_pq_block_len(pq);
+  int		i = point % IWPQ_BLOCK;
+  float		v[IWPQ_SUB_DIM_MAX];
+  int		m;
+
+  for(m = 0; m < pq->num_sub; m++)
+    {
+      uint8_t *	byte = codes + 16 * m + (i & 15);
+      int	c;
+
+      iw_pq_group(pq, row, m, v);
+      c = iw_pq_nearest(pq->centroids
+			+ (size_t) m * pq->num_centroids * pq->sub_dim,
+			pq->num_centroids, pq->sub_dim, v);
+      if(i < 16)
+	*byte = (*byte & 0xF0) | c;
+      else
+	*byte = (*byte & 0x0F) | (c << 4);
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Exact diff of the query (unheard routers already at the floor) to a
+ * point of the map
+ */
+static int32_t
+iw_pq_exact(const struct iw_pq *	pq,
+	    const struct iw_fpstore *	fps,
+	    const struct iw_fpsparse *	sp,
+	    const int8_t *		levels,
+	    int				point)
+{
+  int8_t		buf[MAX_ROUTERS];
+  const int8_t *	row = buf;
+  int32_t		dist = 0;
+  int			r;
+
+  /* Rows of a dense map are good as they are */
+  if((fps->rss != NULL) && (pq->floor == 0))
+    row = iw_fpstore_row(fps, point);
+  else
+    iw_pq_row(pq, fps, sp, point, buf);
+  for(r = 0; r < pq->num_routers; r++)
+    dist += (levels[r] - row[r]) * (levels[r] - row[r]);
+  return(dist);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Make room for the codes of at least num_points points, new codes are 0
+ */
+static int
+iw_pq_reserve(struct iw_pq *	pq,
+	      int		num_points)
+{
+  uint8_t *	codes;
+  int		max_points = pq->max_points ? pq->max_points : 4 * IWPQ_BLOCK;
+
+  if(num_points <= pq->max_points)
+    return(0);
+  while(max_points < num_points)
+    max_points *= 2;
+  codes = realloc(pq->codes, max_points / IWPQ_BLOCK * iw_pq_block_len(pq));
+  if(codes == NULL)
+    {
+      errno = ENOMEM;
+      return(-1);
+    }
+  memset(codes + pq->max_points / IWPQ_BLOCK * iw_pq_block_len(pq), 0,
+	 (max_points - pq->max_points) / IWPQ_BLOCK * iw_pq_block_len(pq));
+  pq->codes = codes;
+  pq->max_points = max_points;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Code the points of the map from pq->num_points on
+ */
+static int
+iw_pq_encode_map(struct iw_pq *			pq,
+		 const struct iw_fpstore *	fps,
+		 const struct iw_fpsparse *	sp)
+{
+  int8_t	row[MAX_ROUTERS];
+  int		i;
+
+  if(iw_pq_reserve(pq, fps->num_points) < 0)
+    return(-1);
+  for(i = pq->num_points; i < fps->num_points; i++)
+    {
+      iw_pq_row(pq, fps, sp, i, row);
+      iw_pq_encode(pq, row, i);
+    }
+  pq->num_points = fps->num_points;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Learn the centroids of group m by k-means over the sample (rows of
+ * width num_routers)
+ */
+static int
+iw_pq_kmeans(struct iw_pq *	pq,
+	     const int8_t *	sample,
+	     int		num_sample,
+	     int		m)
+{
+  float *	cents = pq->centroids + (size_t) m * pq->num_centroids * pq->sub_dim;
+  int		k = pq->num_centroids;
+  int		dim = pq->sub_dim;
+  double *	sums;
+  int *		counts;
+  int *		assign;
+  float		v[IWPQ_SUB_DIM_MAX];
+  unsigned int	seed = m + 1;
+  int		round;
+  int		i;
+  int		c;
+  int		d;
+
+  sums = malloc((size_t) k * dim * sizeof(double));
+  counts = malloc(k * sizeof(int));
+  assign = malloc(num_sample * sizeof(int));
+  if((sums == NULL) || (counts == NULL) || (assign == NULL))
+    {
+      free(sums);
+      free(counts);
+      free(assign);
+      errno = ENOMEM;
+      return(-1);
+    }
+
+  /* Start from points spread over the sample */
+  for(c = 0; c < k; c++)
+    iw_pq_group(pq, sample + (size_t) (c * (num_sample / k)) * pq->num_routers,
+		m, cents + c * dim);
+  for(i = 0; i < num_sample; i++)
+    assign[i] = -1;
+
+  for(round = 0; round < IWPQ_ROUNDS; round++)
+    {
+      int	moved = 0;
+
+      memset(sums, 0, (size_t) k * dim * sizeof(double));
+      memset(counts, 0, k * sizeof(int));
+      for(i = 0; i < num_sample; i++)
+	{
+	  iw_pq_group(pq, sample + (size_t) i * pq->num_routers, m, v);
+	  c = iw_pq_nearest(cents, k, dim, v);
+	  if(c != assign[i])
+	    {
+	      assign[i] = c;
+	      moved++;
+	    }
+	  counts[c]++;
+	  for(d = 0; d < dim; d++)
+	    sums[c * dim + d] += v[d];
+	}
+      if(moved == 0)
+	break;
+
+      for(c = 0; c < k; c++)
+	{
+	  if(counts[c] == 0)
+	    {
+	      /* Lost its points, give it another one at random */
+	      seed = seed * 1103515245 + 12345;
+	      iw_pq_group(pq, sample + (size_t) ((seed >> 8) % num_sample)
+			  * pq->num_routers, m, cents + c * dim);
+	      continue;
+	    }
+	  for(d = 0; d < dim; d++)
+	    cents[c * dim + d] = sums[c * dim + d] / counts[c];
+	}
+    }
+
+  free(sums);
+  free(counts);
+  free(assign);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Common part of training and loading
+ */
+static void
+iw_pq_setup(struct iw_pq *	pq,
+	    int			num_routers,
+	    int			sub_dim,
+	    int			num_centroids,
+	    int			level)
+{
+  memset(pq, 0, sizeof(*pq));
+  pq->num_routers = num_routers;
+  pq->sub_dim = sub_dim;
+  pq->num_sub = (num_routers + sub_dim - 1) / sub_dim;
+  pq->sub_stride = IWMAP_ROUNDUP(pq->num_sub, IWPQ_SUB_ALIGN);
+  pq->num_centroids = num_centroids;
+  pq->floor = level;
+  pq->rerank = IWPQ_RERANK_DEFAULT;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Distance tables of a query, scaled to uint8_t so that the sum over
+ * every sub-quantizer fits in uint16_t. Each table is offset by its
+ * smallest entry, which doesn't change the order of the sums.
+ */
+static void
+iw_pq_tables(const struct iw_pq *	pq,
+	     const int8_t *		levels,
+	     uint8_t *			tables)
+{
+  float		dist[IWPQ_CENTROIDS * ((MAX_ROUTERS + IWPQ_SUB_ALIGN - 1)
+				       / IWPQ_SUB_ALIGN * IWPQ_SUB_ALIGN)];
+  float		top = 255.0f;
+  float		range = 0.0f;
+  float		scale;
+  float		v[IWPQ_SUB_DIM_MAX];
+  int		m;
+  int		c;
+  int		d;
+
+  for(m = 0; m < pq->num_sub; m++)
+    {
+      const float *	cents = pq->centroids
+				+ (size_t) m * pq->num_centroids * pq->sub_dim;
+      float *		table = dist + m * IWPQ_CENTROIDS;
+      float		lo = FLT_MAX;
+      float		hi = 0.0f;
+
+      iw_pq_group(pq, levels, m, v);
+      for(c = 0; c < pq->num_centroids; c++)
+	{
+	  float	sum = 0.0f;
+
+	  for(d = 0; d < pq->sub_dim; d++)
+	    sum += (v[d] - cents[c * pq->sub_dim + d])
+		   * (v[d] - cents[c * pq->sub_dim + d]);
+	  table[c] = sum;
+	  if(sum < lo)
+	    lo = sum;
+	  if(sum > hi)
+	    hi = sum;
+	}
+      for(c = 0; c < pq->num_centroids; c++)
+	table[c] -= lo;
+      if(hi - lo > range)
+	range = hi - lo;
+    }
+
+  if(top * pq->sub_stride > 65535.0f)
+    top = 65535 / pq->sub_stride;
+  scale = (range > 0.0f) ? top / range : 0.0f;
+  memset(tables, 0, 16 * pq->sub_stride);
+  for(m = 0; m < pq->num_sub; m++)
+    for(c = 0; c < IWPQ_CENTROIDS; c++)
+      tables[16 * m + c] = (c < pq->num_centroids)
+			   ? lrintf(dist[m * IWPQ_CENTROIDS + c] * scale) : 255;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Offer a candidate to the max heap of the scan. Return the new count.
+ */
+static inline int
+iw_pq_cand_push(struct iw_pqcand *	heap,
+		int			count,
+		int			size,
+		int			point,
+		int32_t			sum)
+{
+  int	p;
+  int	c;
+
+  if(count < size)
+    {
+      for(p = count++; p > 0; p = (p - 1) / 2)
+	{
+	  if(heap[(p - 1) / 2].dist >= sum)
+	    break;
+	  heap[p] = heap[(p - 1) / 2];
+	}
+    }
+  else
+    {
+      for(p = 0; (c = 2 * p + 1) < size; p = c)
+	{
+	  if((c + 1 < size) && (heap[c + 1].dist > heap[c].dist))
+	    c++;
+	  if(heap[c].dist <= sum)
+	    break;
+	  heap[p] = heap[c];
+	}
+    }
+  heap[p].dist = sum;
+  heap[p].point = point;
+  return(count);
+}
+
+/************************* PRODUCT CODES *************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Name of the codebooks of a map
+ */
+int
+iw_pq_path(const char *	map_path,
+	   char *	buf,
+	   int		buflen)
+{
+  if(snprintf(buf, buflen, "%s%s", map_path, IWPQ_SUFFIX) >= buflen)
+    {
+      errno = ENAMETOOLONG;
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Learn the codebooks of a map, and code its points. The rows come from
+ * the store, or for a sparse map (no rows in the store) from sp, and
+ * then the unheard routers are at sp->floor.
+ */
+int
+iw_pq_train(struct iw_pq *		pq,
+	    const struct iw_fpstore *	fps,
+	    const struct iw_fpsparse *	sp,
+	    int				sub_dim)
+{
+  int8_t *	sample;
+  int		num_sample;
+  int		err;
+  int		i;
+  int		m;
+
+  if((sub_dim < 1) || (sub_dim > IWPQ_SUB_DIM_MAX) || (fps->num_points == 0)
+     || (fps->num_routers == 0) || ((fps->rss == NULL) && (sp == NULL)))
+    {
+      errno = EINVAL;
+      return(-1);
+    }
+  iw_pq_setup(pq, fps->num_routers, sub_dim,
+	      (fps->num_points < IWPQ_CENTROIDS) ? fps->num_points : IWPQ_CENTROIDS,
+	      (fps->rss == NULL) ? sp->floor : 0);
+
+  /* Points spread over the map, they come by survey order */
+  num_sample = (fps->num_points < IWPQ_TRAIN_MAX) ? fps->num_points : IWPQ_TRAIN_MAX;
+  sample = malloc((size_t) num_sample * pq->num_routers);
+  pq->centroids = malloc((size_t) pq->num_sub * pq->num_centroids
+			 * pq->sub_dim * sizeof(float));
+  if((sample == NULL) || (pq->centroids == NULL))
+    {
+      free(sample);
+      iw_pq_free(pq);
+      errno = ENOMEM;
+      return(-1);
+    }
+  for(i = 0; i < num_sample; i++)
+    iw_pq_row(pq, fps, sp, (int) ((int64_t) i * fps->num_points / num_sample),
+	      sample + (size_t) i * pq->num_routers);
+
+  for(m = 0; m < pq->num_sub; m++)
+    if(iw_pq_kmeans(pq, sample, num_sample, m) < 0)
+      break;
+  free(sample);
+  if((m < pq->num_sub) || (iw_pq_encode_map(pq, fps, sp) < 0))
+    {
+      err = errno;
+      iw_pq_free(pq);
+      errno = err;
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Code a point added to the map (learnt), with the codebooks as they
+ * are. The row has 0 for the unheard routers.
+ * Return its number.
+ */
+int
+iw_pq_add(struct iw_pq *	pq,
+	  const int8_t *	row)
+{
+  int8_t	levels[MAX_ROUTERS];
+  int		r;
+
+  if(iw_pq_reserve(pq, pq->num_points + 1) < 0)
+    return(-1);
+  for(r = 0; r < pq->num_routers; r++)
+    levels[r] = row[r] ? row[r] : pq->floor;
+  iw_pq_encode(pq, levels, pq->num_points);
+  return(pq->num_points++);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Approximate k nearest points to the query, sorted (see iw_knn_sort()).
+ * The codes give pq->rerank candidates, which are measured exactly on
+ * the rows of the map (as in iw_pq_train()).
+ * Return the number found, or -1.
+ */
+int
+iw_pq_knn(const struct iw_pq *		pq,
+	  const struct iw_fpstore *	fps,
+	  const struct iw_fpsparse *	sp,
+	  const int8_t *		query,
+	  struct iw_knn *		knn)
+{
+  int8_t		levels[MAX_ROUTERS];
+  uint8_t		tables[16 * ((MAX_ROUTERS + IWPQ_SUB_ALIGN - 1)
+				     / IWPQ_SUB_ALIGN * IWPQ_SUB_ALIGN)];
+  uint16_t		sums[IWPQ_CHUNK * IWPQ_BLOCK];
+  uint32_t		masks[IWPQ_CHUNK];
+  struct iw_pqcand *	heap;
+  int			num_blocks = (pq->num_points + IWPQ_BLOCK - 1) / IWPQ_BLOCK;
+  int			rerank = pq->rerank;
+  int			count = 0;
+  int32_t		bound = INT32_MAX;
+  int			b;
+  int			i;
+
+  knn->count = 0;
+  if(rerank < knn->k)
+    rerank = knn->k;
+  if(rerank > IWPQ_RERANK_MAX)
+    rerank = IWPQ_RERANK_MAX;
+  heap = malloc(rerank * sizeof(struct iw_pqcand));
+  if(heap == NULL)
+    {
+      errno = ENOMEM;
+      return(-1);
+    }
+
+  for(i = 0; i < pq->num_routers; i++)
+    levels[i] = query[i] ? query[i] : pq->floor;
+  iw_pq_tables(pq, levels, tables);
+
+  /* Scan of the codes by chunks, the best candidates in a max heap.
+   * Once it is full, very few points make it : the kernel flags those
+   * under the bound of the start of the chunk, the bound only goes down
+   * so they are checked again. */
+  for(b = 0; (b < num_blocks) && (bound > 0); b += IWPQ_CHUNK)
+    {
+      int	n = (num_blocks - b < IWPQ_CHUNK) ? num_blocks - b : IWPQ_CHUNK;
+      int	j;
+
+      iw_kernel_scan(pq->codes + b * iw_pq_block_len(pq), pq->sub_stride, n,
+		     tables, (bound > 65535) ? 65535 : bound - 1, sums, masks);
+      for(j = 0; j < n; j++)
+	{
+	  uint32_t	mask;
+
+	  for(mask = masks[j]; mask != 0; mask &= mask - 1)
+	    {
+	      int	k = j * IWPQ_BLOCK + __builtin_ctz(mask);
+
+	      /* Padding of the last block */
+	      if(b * IWPQ_BLOCK + k >= pq->num_points)
+		break;
+	      if(sums[k] >= bound)
+		continue;
+	      count = iw_pq_cand_push(heap, count, rerank, b * IWPQ_BLOCK + k,
+				      sums[k]);
+	      if(count == rerank)
+		bound = heap[0].dist;
+	    }
+	}
+    }
+
+  /* The candidates, measured exactly */
+  for(i = 0; i < count; i++)
+    {
+      int32_t	dist = iw_pq_exact(pq, fps, sp, levels, heap[i].point);
+
+      if((knn->count < knn->k) || (dist <= knn->nb[0].dist))
+	iw_knn_push(knn, heap[i].point, dist);
+    }
+  free(heap);
+  iw_knn_sort(knn);
+  return(knn->count);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Write the codebooks to disk, with the same care as iw_map_save()
+ */
+int
+iw_pq_save(const struct iw_pq *	pq,
+	   const char *		path)
+{
+  static const char	zeros[IWMAP_ALIGN];
+  struct iwpq_header	hdr;
+  char			tmp[PATH_MAX];
+  size_t		centroids_len;
+  size_t		codes_len;
+  FILE *		f;
+  int			err;
+
+  if(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+    {
+      errno = ENAMETOOLONG;
+      return(-1);
+    }
+
+  centroids_len = (size_t) pq->num_sub * pq->num_centroids * pq->sub_dim
+		  * sizeof(float);
+  codes_len = (pq->num_points + IWPQ_BLOCK - 1) / IWPQ_BLOCK
+	      * iw_pq_block_len(pq);
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, IWPQ_MAGIC, IWMAP_MAGIC_LEN);
+  hdr.version = IWPQ_VERSION;
+  hdr.header_len = sizeof(hdr);
+  hdr.num_routers = pq->num_routers;
+  hdr.num_points = pq->num_points;
+  hdr.sub_dim = pq->sub_dim;
+  hdr.num_sub = pq->num_sub;
+  hdr.num_centroids = pq->num_centroids;
+  hdr.floor = pq->floor;
+  hdr.centroids_off = IWMAP_ROUNDUP(sizeof(hdr), IWMAP_ALIGN);
+  hdr.codes_off = IWMAP_ROUNDUP(hdr.centroids_off + centroids_len, IWMAP_ALIGN);
+  hdr.file_len = hdr.codes_off + codes_len;
+
+  f = fopen(tmp, "wb");
+  if(f == NULL)
+    return(-1);
+  if((fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+     || (fwrite(zeros, 1, hdr.centroids_off - sizeof(hdr), f)
+	 != hdr.centroids_off - sizeof(hdr))
+     || (fwrite(pq->centroids, 1, centroids_len, f) != centroids_len)
+     || (fwrite(zeros, 1, hdr.codes_off - hdr.centroids_off - centroids_len, f)
+	 != hdr.codes_off - hdr.centroids_off - centroids_len)
+     || (fwrite(pq->codes, 1, codes_len, f) != codes_len))
+    {
+      err = errno;
+      fclose(f);
+      unlink(tmp);
+      errno = err;
+      return(-1);
+    }
+  if((fclose(f) != 0) || (rename(tmp, path) < 0))
+    {
+      err = errno;
+      unlink(tmp);
+      errno = err;
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Load the codebooks of a map. Points merged into the map since they
+ * were saved get coded, but codebooks of other routers are stale
+ * (ESTALE) and must be trained again.
+ */
+int
+iw_pq_load(struct iw_pq *		pq,
+	   const char *			path,
+	   const struct iw_fpstore *	fps,
+	   const struct iw_fpsparse *	sp)
+{
+  struct iwpq_header	hdr;
+  size_t		centroids_len;
+  size_t		codes_len;
+  FILE *		f;
+  int			err;
+
+  memset(pq, 0, sizeof(*pq));
+  f = fopen(path, "rb");
+  if(f == NULL)
+    return(-1);
+  if(fread(&hdr, sizeof(hdr), 1, f) != 1)
+    {
+      fclose(f);
+      errno = EINVAL;
+      return(-1);
+    }
+  if(memcmp(hdr.magic, IWPQ_MAGIC, IWMAP_MAGIC_LEN)
+     || (hdr.version != IWPQ_VERSION) || (hdr.header_len != sizeof(hdr))
+     || (hdr.sub_dim < 1) || (hdr.sub_dim > IWPQ_SUB_DIM_MAX)
+     || (hdr.num_routers > MAX_ROUTERS)
+     || (hdr.num_sub != (hdr.num_routers + hdr.sub_dim - 1) / hdr.sub_dim)
+     || (hdr.num_centroids < 1) || (hdr.num_centroids > IWPQ_CENTROIDS))
+    {
+      fclose(f);
+      errno = EINVAL;
+      return(-1);
+    }
+  if(((int) hdr.num_routers != fps->num_routers)
+     || ((int) hdr.num_points > fps->num_points)
+     || ((fps->rss == NULL) && (sp == NULL)))
+    {
+      fclose(f);
+      errno = ESTALE;
+      return(-1);
+    }
+
+  iw_pq_setup(pq, hdr.num_routers, hdr.sub_dim, hdr.num_centroids, hdr.floor);
+  centroids_len = (size_t) pq->num_sub * pq->num_centroids * pq->sub_dim
+		  * sizeof(float);
+  codes_len = (hdr.num_points + IWPQ_BLOCK - 1) / IWPQ_BLOCK
+	      * iw_pq_block_len(pq);
+  pq->centroids = malloc(centroids_len);
+  if((pq->centroids == NULL) || (iw_pq_reserve(pq, fps->num_points) < 0))
+    {
+      fclose(f);
+      iw_pq_free(pq);
+      errno = ENOMEM;
+      return(-1);
+    }
+  if((hdr.codes_off < hdr.centroids_off + centroids_len)
+     || (hdr.file_len != hdr.codes_off + codes_len)
+     || (fseek(f, hdr.centroids_off, SEEK_SET) < 0)
+     || (fread(pq->centroids, 1, centroids_len, f) != centroids_len)
+     || (fseek(f, hdr.codes_off, SEEK_SET) < 0)
+     || (fread(pq->codes, 1, codes_len, f) != codes_len))
+    {
+      fclose(f);
+      iw_pq_free(pq);
+      errno = EINVAL;
+      return(-1);
+    }
+  fclose(f);
+
+  pq->num_points = hdr.num_points;
+  if(iw_pq_encode_map(pq, fps, sp) < 0)
+    {
+      err = errno;
+      iw_pq_free(pq);
+      errno = err;
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release a quantizer
+ */
+void
+iw_pq_free(struct iw_pq *	pq)
+{
+  free(pq->centroids);
+  free(pq->codes);
+  memset(pq, 0, sizeof(*pq));
+}
@@ -0,0 +1,327 @@
+/*
+ *	Wireless Tools - location tracking extensions
+ *
+ * Selection of the routers of a radio map, when it is loaded. Sites
+ * register dozens of routers, many heard about the same everywhere :
+ * they add to the diffs of every point alike, and tell nothing about
+ * where a scan was taken. The routers are ranked by the variance of
+ * their levels over the points (the mean squared diff two points get
+ * from a router is twice its variance), the top ones are kept, and the
+ * fingerprints and the scans are projected on those. Every search then
+ * measures that many routers, not all of them.
+ *
+ * How many to keep can be given, or chosen against held out points :
+ * points of the map, each located among the others with the routers
+ * kept, must be about as near to where they are (on the floor, or by
+ * fingerprint for the maps without positions) as with all of them.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include "iwmap.h"		/* Header */
+
+/****************************** TYPES ******************************/
+
+/*
+ * Variance of a router, for the ranking
+ */
+struct iw_selvar
+{
+  double	var;
+  int		router;
+};
+
+/***************************** RANKING *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Order of the variances of the routers, the largest first
+ */
+static int
+iw_select_cmp(const void *	a,
+	      const void *	b)
+{
+  const struct iw_selvar *	va = a;
+  const struct iw_selvar *	vb = b;
+
+  if(va->var != vb->var)
+    return((va->var < vb->var) ? 1 : -1);
+  return(va->router - vb->router);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Rank the routers of a (dense) store, and keep them all
+ */
+void
+iw_select_rank(struct iw_select *		sel,
+	       const struct iw_fpstore *	fps)
+{
+  struct iw_selvar	vars[MAX_ROUTERS];
+  int			r;
+
+  memset(sel, 0, sizeof(*sel));
+  sel->num_routers = fps->num_routers;
+  for(r = 0; r < fps->num_routers; r++)
+    {
+      vars[r].var = iw_fpstore_var(fps, r);
+      vars[r].router = r;
+    }
+  qsort(vars, fps->num_routers, sizeof(vars[0]), iw_select_cmp);
+  for(r = 0; r < fps->num_routers; r++)
+    {
+      sel->rank[r] = vars[r].router;
+      sel->var[r] = vars[r].var;
+    }
+  iw_select_keep(sel, fps->num_routers);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Keep the num_kept first routers of the ranking. They are projected in
+ * the order of the map, by increasing router.
+ * Return the number kept.
+ */
+int
+iw_select_keep(struct iw_select *	sel,
+	       int			num_kept)
+{
+  uint8_t	keep[MAX_ROUTERS];
+  int		r;
+
+  if(num_kept > sel->num_routers)
+    num_kept = sel->num_routers;
+  if(num_kept < 1)
+    num_kept = (sel->num_routers > 0) ? 1 : 0;
+  memset(keep, 0, sizeof(keep));
+  for(r = 0; r < num_kept; r++)
+    keep[sel->rank[r]] = 1;
+  sel->num_kept = 0;
+  for(r = 0; r < sel->num_routers; r++)
+    if(keep[r])
+      sel->routers[sel->num_kept++] = r;
+  return(sel->num_kept);
+}
+
+/**************************** PROJECTION ****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Project a fingerprint or a scan on the routers kept. out may be in :
+ * the routers kept come in increasing order.
+ */
+void
+iw_select_row(const struct iw_select *	sel,
+	      const int8_t *		in,
+	      int8_t *			out)
+{
+  int	r;
+
+  for(r = 0; r < sel->num_kept; r++)
+    out[r] = in[sel->routers[r]];
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Build the store of the points of src on the routers kept, the same
+ * points in the same order
+ */
+int
+iw_select_store(const struct iw_select *	sel,
+		const struct iw_fpstore *	src,
+		struct iw_fpstore *		dst)
+{
+  int8_t	row[MAX_ROUTERS];
+  int		i;
+
+  if((iw_fpstore_init(dst, sel->num_kept) < 0)
+     || (iw_fpstore_reserve(dst, src->num_points) < 0))
+    {
+      iw_fpstore_free(dst);
+      return(-1);
+    }
+  for(i = 0; i < src->num_points; i++)
+    {
+      iw_select_row(sel, iw_fpstore_row(src, i), row);
+      /* Room was made for them all */
+      iw_fpstore_add(dst, row, src->x[i], src->y[i],
+		     iw_fpstore_label(src, i));
+    }
+  return(0);
+}
+
+/************************** HELD OUT POINTS **************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Squared distance between two fingerprints over all the routers
+ */
+static int32_t
+iw_select_dist2(const int8_t *	a,
+		const int8_t *	b,
+		int		num_routers)
+{
+  int32_t	sum = 0;
+  int		r;
+
+  for(r = 0; r < num_routers; r++)
+    sum += (a[r] - b[r]) * (a[r] - b[r]);
+  return(sum);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * How far off a held out point is located at point p : on the floor for
+ * the maps with positions, else in dB over all the routers
+ */
+static double
+iw_select_miss(const struct iw_fpstore *	fps,
+	       int				by_position,
+	       int				held,
+	       int				p)
+{
+  if(p < 0)
+    return(0);
+  if(by_position)
+    return(hypot(fps->x[held] - fps->x[p], fps->y[held] - fps->y[p]));
+  return(sqrt((double) iw_select_dist2(iw_fpstore_row(fps, held),
+				       iw_fpstore_row(fps, p),
+				       fps->num_routers)));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Mean miss of the held out points of a store (every num_points /
+ * IW_SELECT_HELD th point), each located at its nearest point among the
+ * others, with the routers kept only (sel NULL : all of them)
+ */
+static double
+iw_select_error(const struct iw_select *	sel,
+		const struct iw_fpstore *	fps,
+		int				by_position)
+{
+  struct iw_fpblock	fpb;
+  struct iw_knn		knn;
+  int8_t		row[MAX_ROUTERS];
+  double		sum = 0;
+  int			num_held;
+  int			h;
+  int			i;
+
+  if(sel == NULL)
+    {
+      if(iw_fpblock_from_store(&fpb, fps) < 0)
+	return(-1);
+    }
+  else
+    {
+      iw_fpblock_init(&fpb, sel->num_kept);
+      for(i = 0; i < fps->num_points; i++)
+	{
+	  iw_select_row(sel, iw_fpstore_row(fps, i), row);
+	  if(iw_fpblock_add(&fpb, row) < 0)
+	    {
+	      iw_fpblock_free(&fpb);
+	      return(-1);
+	    }
+	}
+    }
+
+  num_held = (fps->num_points - 1 < IW_SELECT_HELD)
+    ? fps->num_points - 1 : IW_SELECT_HELD;
+  iw_knn_init(&knn, 2);
+  for(h = 0; h < num_held; h++)
+    {
+      int		held = (int) ((int64_t) h * fps->num_points / num_held);
+      const int8_t *	query = iw_fpstore_row(fps, held);
+      int		p = -1;
+
+      if(sel != NULL)
+	{
+	  iw_select_row(sel, query, row);
+	  query = row;
+	}
+      /* Its nearest but itself */
+      iw_fpblock_knn(&fpb, query, &knn);
+      for(i = 0; (i < knn.count) && (p < 0); i++)
+	if(knn.nb[i].point != held)
+	  p = knn.nb[i].point;
+      sum += iw_select_miss(fps, by_position, held, p);
+    }
+  iw_fpblock_free(&fpb);
+  return(sum / num_held);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Keep the fewest routers of the ranking (see iw_select_rank()) with
+ * which the held out points are located at least target as well as with
+ * all of them (their mean miss over it). By halves, the more routers the
+ * better, about. The share reached is left in sel->agree.
+ * Return the number kept, or -1.
+ */
+int
+iw_select_auto(struct iw_select *		sel,
+	       const struct iw_fpstore *	fps,
+	       int				by_position,
+	       double				target)
+{
+  double	all;
+  int		lo = 1;
+  int		hi = sel->num_routers;
+
+  iw_select_keep(sel, sel->num_routers);
+  sel->agree = 1.0;
+  if((fps->num_points < 2) || (sel->num_routers < 2))
+    return(sel->num_kept);
+  all = iw_select_error(NULL, fps, by_position);
+  if(all < 0)
+    return(-1);
+
+  /* hi always makes it (all of them do) */
+  while(lo < hi)
+    {
+      int	mid = (lo + hi) / 2;
+      double	miss;
+
+      iw_select_keep(sel, mid);
+      miss = iw_select_error(sel, fps, by_position);
+      if(miss < 0)
+	return(-1);
+      if(miss * target <= all)
+	{
+	  hi = mid;
+	  sel->agree = (miss > 0) ? all / miss : 1.0;
+	}
+      else
+	lo = mid + 1;
+    }
+  iw_select_keep(sel, hi);
+  if(hi == sel->num_routers)
+    sel->agree = 1.0;
+  return(sel->num_kept);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * How well the held out points are located with the routers kept, as a
+ * share of how well with all of them (their mean miss over it), or -1
+ */
+double
+iw_select_check(const struct iw_select *	sel,
+		const struct iw_fpstore *	fps,
+		int				by_position)
+{
+  double	all;
+  double	miss;
+
+  if(fps->num_points < 2)
+    return(1.0);
+  all = iw_select_error(NULL, fps, by_position);
+  miss = iw_select_error(sel, fps, by_position);
+  if((all < 0) || (miss < 0))
+    return(-1);
+  return((miss > 0) ? all / miss : 1.0);
+}